@@ -183,10 +183,19 @@ const char *PacketParser::header_type2string(int val){
 
 
 
-#define MAX_HEADERS_IN_PACKET 32
 pkt_type_t *PacketParser::parse_packet(const u8 *pkt, size_t pktlen, bool eth_included){
-  if(PKTPARSERDEBUG)printf("%s(%p, %lu)\n", __func__, pkt, (long unsigned)pktlen);
   static pkt_type_t this_packet[MAX_HEADERS_IN_PACKET+1]; /* Packet structure array   */
+  PacketParser::parse_packet(pkt, pktlen, eth_included, this_packet);
+  return this_packet;
+} /* End of parse_packet() */
+
+
+/* Reentrant version of parse_packet(). The type and length of each header is
+ * stored in the supplied "this_packet" array, which must have room for
+ * MAX_HEADERS_IN_PACKET+1 elements. The element that follows the last header
+ * has zero length. Returns the number of headers found. */
+int PacketParser::parse_packet(const u8 *pkt, size_t pktlen, bool eth_included, pkt_type_t *this_packet){
+  if(PKTPARSERDEBUG)printf("%s(%p, %lu)\n", __func__, pkt, (long unsigned)pktlen);
   u8 current_header=0;             /* Current array position of "this_packet" */
   const u8 *curr_pkt=pkt;          /* Pointer to current part of the packet   */
   size_t curr_pktlen=pktlen;       /* Remaining packet length                 */
@@ -210,7 +219,7 @@ pkt_type_t *PacketParser::parse_packet(const u8 *pkt, size_t pktlen, bool eth_in
   HopByHopHeader ext_hopt;
   RoutingHeader ext_routing;
   ARPHeader arp;
-  memset(this_packet, 0, sizeof(this_packet));
+  memset(this_packet, 0, sizeof(pkt_type_t)*(MAX_HEADERS_IN_PACKET+1));
 
   /* Decide which layer we have to start from */
   if( eth_included ){
@@ -664,8 +673,8 @@ pkt_type_t *PacketParser::parse_packet(const u8 *pkt, size_t pktlen, bool eth_in
     }
   }
 
-  return this_packet;
-} /* End of parse_received_packet() */
+  return current_header;
+} /* End of parse_packet() */
 
 
 /* TODO: remove */
@@ -757,7 +766,17 @@ PacketElement *PacketParser::split(const u8 *pkt, size_t pktlen){
 
 
 PacketElement *PacketParser::split(const u8 *pkt, size_t pktlen, bool eth_included){
-  pkt_type_t *packetheaders=NULL;
+  pkt_type_t packetheaders[MAX_HEADERS_IN_PACKET+1];
+
+  /* Analyze the packet. This returns a list of header types and lengths */
+  PacketParser::parse_packet(pkt, pktlen, eth_included, packetheaders);
+  return PacketParser::build_chain(pkt, packetheaders);
+} /* End of split() */
+
+
+/* Builds a chain of PacketElements from the list of headers obtained from
+ * parse_packet(). Every header is stored in its own PacketHeader object. */
+PacketElement *PacketParser::build_chain(const u8 *pkt, const pkt_type_t *packetheaders){
   const u8 *curr_pkt=pkt;
   PacketElement *first=NULL;
   PacketElement *last=NULL;
@@ -775,10 +794,6 @@ PacketElement *PacketParser::split(const u8 *pkt, size_t pktlen, bool eth_includ
   ARPHeader *arp=NULL;
   RawData *raw=NULL;
 
-  /* Analyze the packet. This returns a list of header types and lengths */
-  if((packetheaders=PacketParser::parse_packet(pkt, pktlen, eth_included))==NULL)
-    return NULL;
-
   /* Store each header in its own PacketHeader object type */
   for(int i=0; packetheaders[i].length!=0; i++){
 
@@ -931,7 +946,7 @@ PacketElement *PacketParser::split(const u8 *pkt, size_t pktlen, bool eth_includ
     curr_pkt+=packetheaders[i].length;
   }
   return first;
-} /* End of split() */
+} /* End of build_chain() */
 
 
 /* This method frees a chain of PacketElement objects. Note that objects in
@@ -1855,3 +1870,198 @@ PacketElement *PacketParser::find_transport_layer(PacketElement *chain){
   }
   return NULL;
 } /* End of find_transport_layer() */
+
+
+/* Parses the supplied packet into a packet_view_t. Nothing is copied or
+ * allocated: the view just records the type, length and offset of each
+ * header, so it can be used on every captured packet to decide whether the
+ * packet is interesting before paying for a chain of PacketElements. Note
+ * that the view points into "pkt", so the buffer must not be released or
+ * modified while the view is in use. Returns OP_SUCCESS if at least one
+ * header was found and OP_FAILURE otherwise. */
+int PacketParser::parse_view(const u8 *pkt, size_t pktlen, bool eth_included, packet_view_t *view){
+  u32 offset=0;
+  int i=0;
+
+  if(view==NULL)
+    return OP_FAILURE;
+  view->pkt=pkt;
+  view->pktlen=pktlen;
+  view->eth_included=eth_included;
+  view->count=0;
+  view->net=-1;
+  view->chain=NULL;
+  if(pkt==NULL || pktlen==0){
+    memset(view->hdr, 0, sizeof(view->hdr));
+    return OP_FAILURE;
+  }
+
+  /* Find the headers and compute where each one starts */
+  view->count=PacketParser::parse_packet(pkt, pktlen, eth_included, view->hdr);
+  for(i=0; i<view->count; i++){
+    view->offset[i]=offset;
+    offset+=view->hdr[i].length;
+  }
+  view->offset[i]=offset;
+
+  /* The network layer is whatever comes after the link layer */
+  i=(view->count>0 && view->hdr[0].type==HEADER_TYPE_ETHERNET) ? 1 : 0;
+  if(i<view->count){
+    switch(view->hdr[i].type){
+      case HEADER_TYPE_IPv4:
+      case HEADER_TYPE_IPv6:
+      case HEADER_TYPE_ARP:
+        view->net=i;
+      break;
+    }
+  }
+  return (view->count>0) ? OP_SUCCESS : OP_FAILURE;
+} /* End of parse_view() */
+
+
+/* Returns a pointer to the beginning of the header at position "idx" of the
+ * view, or NULL if there is no such header. */
+const u8 *PacketParser::view_header(const packet_view_t *view, int idx){
+  if(view==NULL || idx<0 || idx>=view->count)
+    return NULL;
+  return view->pkt+view->offset[idx];
+} /* End of view_header() */
+
+
+/* Same as find_transport_layer() but for packet views. The search starts at
+ * the header in position "first", so the headers of the datagram included in
+ * an ICMP error can be inspected too. Returns the position of the header or
+ * -1 if no transport layer header is found. */
+int PacketParser::find_transport_layer(const packet_view_t *view, int first){
+  if(view==NULL || first<0)
+    return -1;
+  for(int i=first; i<view->count; i++){
+    switch(view->hdr[i].type){
+      /* If we have a link or a network layer header, skip it. */
+      case HEADER_TYPE_IPv6_HOPOPT:
+      case HEADER_TYPE_IPv4:
+      case HEADER_TYPE_IPv6:
+      case HEADER_TYPE_IPv6_ROUTE:
+      case HEADER_TYPE_IPv6_FRAG:
+      case HEADER_TYPE_IPv6_NONXT:
+      case HEADER_TYPE_IPv6_OPTS:
+      case HEADER_TYPE_ETHERNET:
+      case HEADER_TYPE_IPv6_MOBILE:
+      break;
+
+      /* If we found the transport layer, return it. */
+      case HEADER_TYPE_TCP:
+      case HEADER_TYPE_UDP:
+      case HEADER_TYPE_ICMPv4:
+      case HEADER_TYPE_ICMPv6:
+      case HEADER_TYPE_SCTP:
+      case HEADER_TYPE_ARP:
+        return i;
+      break;
+
+      /* Otherwise, the packet contains headers we don't understand */
+      default:
+        return -1;
+      break;
+    }
+  }
+  return -1;
+} /* End of find_transport_layer() */
+
+
+/* Same as is_response() but the received packet is supplied as a view. TCP
+ * and UDP responses, which is what most probes get, are matched directly on
+ * the captured bytes. Anything else (ARP, ICMP messages and ICMP errors that
+ * quote the probe) needs a closer look, so the chain of the received packet
+ * is built and passed to the general version of this method. The chain stays
+ * in the view until free_view() is called. Like the general version, ICMP
+ * errors are matched on the datagram they quote, so they may come from any
+ * host. Responses to probes sent to a multicast address may come from any
+ * host too, as long as they are destined to us. */
+bool PacketParser::is_response(PacketElement *sent, packet_view_t *rcvd){
+  PacketElement *sent_layer4=NULL;
+  const u8 *sent_src=NULL, *sent_dst=NULL;
+  const u8 *rcvd_ip=NULL, *rcvd_layer4=NULL;
+  u16 addrlen=0, sport=0, dport=0;
+  bool multicast=false;
+  int l4=-1;
+
+  if(sent==NULL || rcvd==NULL || rcvd->net<0)
+    return false;
+  if(sent->protocol_id()==HEADER_TYPE_ETHERNET)
+    if( (sent=sent->getNextElement())==NULL)
+      return false;
+
+  /* Make sure both packets have the same network layer */
+  if((int)rcvd->hdr[rcvd->net].type!=sent->protocol_id())
+    return false;
+  if(sent->protocol_id()!=HEADER_TYPE_IPv4 && sent->protocol_id()!=HEADER_TYPE_IPv6)
+    return PacketParser::is_response(sent, PacketParser::view_chain(rcvd));
+
+  /* Skip layers until we find ICMP or a transport protocol */
+  for(sent_layer4=sent->getNextElement(); sent_layer4!=NULL; sent_layer4=sent_layer4->getNextElement()){
+    if(sent_layer4->protocol_id()==HEADER_TYPE_UDP    || sent_layer4->protocol_id()==HEADER_TYPE_TCP ||
+       sent_layer4->protocol_id()==HEADER_TYPE_ICMPv4 || sent_layer4->protocol_id()==HEADER_TYPE_ICMPv6 )
+      break;
+  }
+  if(sent_layer4==NULL || (l4=PacketParser::find_transport_layer(rcvd, rcvd->net+1))<0)
+    return false;
+  if((sent_layer4->protocol_id()!=HEADER_TYPE_TCP && sent_layer4->protocol_id()!=HEADER_TYPE_UDP) ||
+     sent_layer4->protocol_id()!=(int)rcvd->hdr[l4].type)
+    return PacketParser::is_response(sent, PacketParser::view_chain(rcvd));
+
+  /* Ensure the packet comes from the host we sent the probe to (unless it
+   * was sent to a multicast group) and that it is destined to us. */
+  rcvd_ip=PacketParser::view_header(rcvd, rcvd->net);
+  if(sent->protocol_id()==HEADER_TYPE_IPv4){
+    sent_src=((IPv4Header *)sent)->getSourceAddress();
+    sent_dst=((IPv4Header *)sent)->getDestinationAddress();
+    addrlen=4;
+    rcvd_ip+=12;
+    multicast=((sent_dst[0] & 0xF0)==0xE0);
+  }else{
+    sent_src=((IPv6Header *)sent)->getSourceAddress();
+    sent_dst=((IPv6Header *)sent)->getDestinationAddress();
+    addrlen=16;
+    rcvd_ip+=8;
+    multicast=(sent_dst[0]==0xFF);
+  }
+  if( !multicast && memcmp(rcvd_ip, sent_dst, addrlen)!=0 )
+    return false;
+  if( memcmp(rcvd_ip+addrlen, sent_src, addrlen)!=0 )
+    return false;
+
+  /* Both are TCP or both UDP: probe source port must equal response target
+   * port and probe target port must equal response source port. */
+  rcvd_layer4=PacketParser::view_header(rcvd, l4);
+  sport=(rcvd_layer4[0] << 8) | rcvd_layer4[1];
+  dport=(rcvd_layer4[2] << 8) | rcvd_layer4[3];
+  if( ((TransportLayerElement *)sent_layer4)->getSourcePort() != dport )
+    return false;
+  if( ((TransportLayerElement *)sent_layer4)->getDestinationPort() != sport )
+    return false;
+  return true;
+} /* End of is_response() */
+
+
+/* Returns the chain of PacketElements of the packet in the view, building it
+ * the first time it is requested. The chain belongs to the view and must be
+ * released with free_view(). */
+PacketElement *PacketParser::view_chain(packet_view_t *view){
+  if(view==NULL)
+    return NULL;
+  if(view->chain==NULL && view->count>0)
+    view->chain=PacketParser::build_chain(view->pkt, view->hdr);
+  return view->chain;
+} /* End of view_chain() */
+
+
+/* Frees the chain of PacketElements built for the view, if any. The view
+ * itself can still be used afterwards. */
+int PacketParser::free_view(packet_view_t *view){
+  if(view!=NULL && view->chain!=NULL){
+    PacketParser::freePacketChain(view->chain);
+    view->chain=NULL;
+  }
+  return OP_SUCCESS;
+} /* End of free_view() */
@@ -168,10 +168,30 @@ typedef struct packet_type{
 }pkt_type_t;
 
 
+#define MAX_HEADERS_IN_PACKET 32
+
+/* Zero-copy view of a parsed packet. It holds the type, length and offset of
+ * each header in the caller's buffer, so it can be kept on the stack and
+ * filled for every captured packet without allocating anything. The chain of
+ * PacketElements is only built if it is actually needed. */
+typedef struct packet_view{
+    const u8 *pkt;                           /* Packet buffer (not owned)  */
+    size_t pktlen;                           /* Length of the packet       */
+    bool eth_included;                       /* Starts with Ethernet?      */
+    int count;                               /* Number of headers          */
+    int net;                                 /* Network header, or -1      */
+    pkt_type_t hdr[MAX_HEADERS_IN_PACKET+1]; /* Type and length of headers */
+    u32 offset[MAX_HEADERS_IN_PACKET+1];     /* Where each header starts   */
+    PacketElement *chain;                    /* Built by view_chain()      */
+}packet_view_t;
+
+
 class PacketParser {
 
     private:
-    
+
+    static PacketElement *build_chain(const u8 *pkt, const pkt_type_t *packetheaders);
+
     public:
 
     /* Misc */
@@ -181,6 +201,7 @@ class PacketParser {
 
     static const char *header_type2string(int val);
     static pkt_type_t *parse_packet(const u8 *pkt, size_t pktlen, bool eth_included);
+    static int parse_packet(const u8 *pkt, size_t pktlen, bool eth_included, pkt_type_t *this_packet);
     static int dummy_print_packet_type(const u8 *pkt, size_t pktlen, bool eth_included); /* TODO: remove */
     static int dummy_print_packet(const u8 *pkt, size_t pktlen, bool eth_included); /* TODO: remove */
     static int payload_offset(const u8 *pkt, size_t pktlen, bool link_included);
@@ -191,6 +212,14 @@ class PacketParser {
     static bool is_response(PacketElement *sent, PacketElement *rcvd);
     static PacketElement *find_transport_layer(PacketElement *chain);
 
+    /* Packet views */
+    static int parse_view(const u8 *pkt, size_t pktlen, bool eth_included, packet_view_t *view);
+    static const u8 *view_header(const packet_view_t *view, int idx);
+    static int find_transport_layer(const packet_view_t *view, int first);
+    static bool is_response(PacketElement *sent, packet_view_t *rcvd);
+    static PacketElement *view_chain(packet_view_t *view);
+    static int free_view(packet_view_t *view);
+
 }; /* End of class PacketParser */
 
 #endif /* __PACKETPARSER_H__ */
@@ -172,6 +172,7 @@
 #endif
 #ifdef HAVE_LINUX_RTNETLINK_H
 #include <linux/rtnetlink.h>
+#include <linux/fib_rules.h>
 #endif
 
 #ifndef NETINET_IN_SYSTM_H  /* This guarding is needed for at least some versions of OpenBSD */
@@ -197,6 +198,23 @@
 #include <sys/resource.h>
 #endif
 
+#ifdef LINUX
+#include <sys/mman.h>
+#include <linux/if_packet.h>
+#endif
+
+/* SSE2 is part of the x86-64 baseline, so it is used whenever the compiler
+ * targets it. AVX2 is not, so its code is compiled separately and only used
+ * if the CPU we run on supports it. */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CKSUM_SSE2 1
+#include <emmintrin.h>
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define CKSUM_AVX2 1
+#include <immintrin.h>
+#endif
+#endif
+
 #define NBASE_MAX_ERR_STR_LEN 1024  /* Max length of an error message */
 
 /** Print fatal error messages to stderr and then exits. A newline
@@ -543,7 +561,9 @@ int ip_is_reserved(struct in_addr *ip)
    false.  If the command is MACCACHE_SET, the function adds an entry
    with the given ip (ss) and mac address.  An existing entry for the
    IP ss will be overwritten with the new MAC address.  true is always
-   returned for the set command. */
+   returned for the set command. The entries are kept sorted by address
+   so lookups are a binary search, even after the whole system neighbor
+   table has been loaded (see mac_cache_load_neighbors()). */
 #define MACCACHE_GET 1
 #define MACCACHE_SET 2
 static int do_mac_cache(int command, const struct sockaddr_storage *ss, u8 *mac) {
@@ -554,17 +574,29 @@ static int do_mac_cache(int command, const struct sockaddr_storage *ss, u8 *mac)
   static struct MacCache *Cache = NULL;
   static int MacCapacity = 0;
   static int MacCacheSz = 0;
-  int i;
-
-  if (command == MACCACHE_GET) {
-    for (i = 0; i < MacCacheSz; i++) {
-      if (sockaddr_storage_cmp(&Cache[i].ip, ss) == 0) {
-        memcpy(mac, Cache[i].mac, 6);
-        return 1;
-      }
+  int lo, hi, mid, rc;
+
+  /* Find the entry, or the position where it should be inserted */
+  lo = 0;
+  hi = MacCacheSz;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    rc = sockaddr_storage_cmp(&Cache[mid].ip, ss);
+    if (rc == 0) {
+      if (command == MACCACHE_GET)
+        memcpy(mac, Cache[mid].mac, 6);
+      else
+        memcpy(Cache[mid].mac, mac, 6);
+      return 1;
+    } else if (rc < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
     }
-    return 0;
   }
+  if (command == MACCACHE_GET)
+    return 0;
+
   assert(command == MACCACHE_SET);
   if (MacCacheSz == MacCapacity) {
     if (MacCapacity == 0)
@@ -574,17 +606,10 @@ static int do_mac_cache(int command, const struct sockaddr_storage *ss, u8 *mac)
     Cache = (struct MacCache *) safe_realloc(Cache, MacCapacity * sizeof(struct MacCache));
   }
 
-  /* Ensure that it isn't already there ... */
-  for (i = 0; i < MacCacheSz; i++) {
-    if (sockaddr_storage_cmp(&Cache[i].ip, ss) == 0) {
-      memcpy(Cache[i].mac, mac, 6);
-      return 1;
-    }
-  }
-
-  /* Add it to the end of the list */
-  memcpy(&Cache[i].ip, ss, sizeof(struct sockaddr_storage));
-  memcpy(Cache[i].mac, mac, 6);
+  /* Insert it, keeping the list sorted */
+  memmove(&Cache[lo + 1], &Cache[lo], (MacCacheSz - lo) * sizeof(struct MacCache));
+  memcpy(&Cache[lo].ip, ss, sizeof(struct sockaddr_storage));
+  memcpy(Cache[lo].mac, mac, 6);
   MacCacheSz++;
   return 1;
 }
@@ -607,15 +632,177 @@ int mac_cache_set(const struct sockaddr_storage *ss, u8 *mac){
     return do_mac_cache(MACCACHE_SET, ss, mac);
 }
 
-/* Standard BSD internet checksum routine. Uses libdnet helper functions. */
+/* Adds the supplied buffer to a 64-bit one's complement accumulator, 32 bits
+ * at a time. Since 2^16 = 1 (mod 2^16 - 1), summing 32-bit words and folding
+ * at the end gives the same result as summing 16-bit words. */
+static u64 cksum_add_scalar(const u8 *p, size_t len, u64 sum) {
+  u32 w32;
+  u16 w16;
+
+  while (len >= 4) {
+    memcpy(&w32, p, 4);
+    sum += w32;
+    p += 4;
+    len -= 4;
+  }
+  if (len >= 2) {
+    memcpy(&w16, p, 2);
+    sum += w16;
+    p += 2;
+    len -= 2;
+  }
+  if (len > 0) {
+    /* Pad the odd byte with a zero, as if it was the first byte of a word. */
+    w16 = 0;
+    memcpy(&w16, p, 1);
+    sum += w16;
+  }
+  return sum;
+}
+
+#ifdef CKSUM_SSE2
+/* Same as cksum_add_scalar(), 16 bytes at a time. Each 32-bit word is widened
+ * to 64 bits so the accumulators can't overflow. */
+static u64 cksum_add_sse2(const u8 *p, size_t len, u64 sum) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i acc = zero;
+  __m128i v;
+  u64 lanes[2];
+
+  while (len >= 16) {
+    v = _mm_loadu_si128((const __m128i *) p);
+    acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+    acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+    p += 16;
+    len -= 16;
+  }
+  _mm_storeu_si128((__m128i *) lanes, acc);
+  sum += lanes[0];
+  sum += lanes[1];
+  return cksum_add_scalar(p, len, sum);
+}
+#endif
+
+#ifdef CKSUM_AVX2
+/* Same as cksum_add_sse2(), 32 bytes at a time. */
+__attribute__((target("avx2")))
+static u64 cksum_add_avx2(const u8 *p, size_t len, u64 sum) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i acc = zero;
+  __m256i v;
+  u64 lanes[4];
+
+  while (len >= 32) {
+    v = _mm256_loadu_si256((const __m256i *) p);
+    acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, zero));
+    acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, zero));
+    p += 32;
+    len -= 32;
+  }
+  _mm256_storeu_si256((__m256i *) lanes, acc);
+  sum += lanes[0];
+  sum += lanes[1];
+  sum += lanes[2];
+  sum += lanes[3];
+  return cksum_add_sse2(p, len, sum);
+}
+
+static int cpu_has_avx2(void) {
+  static int has_avx2 = -1;
+
+  if (has_avx2 < 0) {
+    __builtin_cpu_init();
+    has_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+  }
+  return has_avx2;
+}
+#endif
+
+/* Returns the one's complement sum of the supplied buffer, added to "sum"
+ * (which may be the result of a previous call). The result is folded to 16
+ * bits but not complemented, so several calls can be chained and finished
+ * with ip_cksum_carry(). Words are summed in host byte order (RFC 1071,
+ * section 2(B)), so every buffer but the last should have an even length. */
+u32 in_cksum_add(const void *buf, size_t len, u32 sum) {
+  const u8 *p = (const u8 *) buf;
+  u64 acc = sum;
+
+  /* Short buffers, like most protocol headers, are not worth the setup. */
+#ifdef CKSUM_AVX2
+  if (len >= 128 && cpu_has_avx2())
+    acc = cksum_add_avx2(p, len, acc);
+  else
+#endif
+#ifdef CKSUM_SSE2
+  if (len >= 64)
+    acc = cksum_add_sse2(p, len, acc);
+  else
+#endif
+    acc = cksum_add_scalar(p, len, acc);
+
+  /* Fold the 64-bit accumulator down to 16 bits */
+  acc = (acc >> 32) + (acc & 0xFFFFFFFF);
+  acc = (acc >> 32) + (acc & 0xFFFFFFFF);
+  acc = (acc >> 16) + (acc & 0xFFFF);
+  acc = (acc >> 16) + (acc & 0xFFFF);
+  return (u32) acc;
+}
+
+/* Standard BSD internet checksum routine. */
 unsigned short in_cksum(u16 *ptr,int nbytes) {
-  int sum;
+  u32 sum;
 
-   sum = ip_cksum_add(ptr, nbytes, 0);
+  sum = in_cksum_add(ptr, nbytes, 0);
 
   return ip_cksum_carry(sum);
+}
 
-  return 0;
+/* Incremental checksum update, as described in RFC 1624 (eqn. 3):
+ * HC' = ~(~HC + ~m + m'). "sum" is the checksum as currently stored in the
+ * packet and "oldval"/"newval" are the old and new contents of one of the
+ * 16-bit words it covers, all of them in network byte order. Returns the new
+ * checksum, also in network byte order. */
+u16 in_cksum_update16(u16 sum, u16 oldval, u16 newval) {
+  u32 acc;
+
+  acc = (u16) ~sum;
+  acc += (u16) ~oldval;
+  acc += newval;
+  acc = (acc >> 16) + (acc & 0xFFFF);
+  acc += acc >> 16;
+  return (u16) ~acc;
+}
+
+/* Same as in_cksum_update16() for a 32-bit field, like an IPv4 address or a
+ * TCP sequence number. */
+u16 in_cksum_update32(u16 sum, u32 oldval, u32 newval) {
+  sum = in_cksum_update16(sum, (u16) (oldval >> 16), (u16) (newval >> 16));
+  return in_cksum_update16(sum, (u16) (oldval & 0xFFFF), (u16) (newval & 0xFFFF));
+}
+
+/* Updates checksum "sum" after the "len" bytes at "oldbuf" are replaced by
+ * the ones at "newbuf". Both buffers must start at the same, even, offset
+ * of the data the checksum covers. Only the words that actually differ are
+ * taken into account, so this is cheap when just a few fields changed. */
+u16 in_cksum_update(u16 sum, const void *oldbuf, const void *newbuf, size_t len) {
+  const u8 *a = (const u8 *) oldbuf;
+  const u8 *b = (const u8 *) newbuf;
+  u16 wa, wb;
+  size_t i;
+
+  for (i = 0; i + 1 < len; i += 2) {
+    memcpy(&wa, a + i, 2);
+    memcpy(&wb, b + i, 2);
+    if (wa != wb)
+      sum = in_cksum_update16(sum, wa, wb);
+  }
+  if (i < len && a[i] != b[i]) {
+    wa = wb = 0;
+    memcpy(&wa, a + i, 1);
+    memcpy(&wb, b + i, 1);
+    sum = in_cksum_update16(sum, wa, wb);
+  }
+  return sum;
 }
 
 
@@ -829,7 +1016,7 @@ unsigned short ipv4_pseudoheader_cksum(const struct in_addr *src,
     u8 proto;
     u16 length;
   } hdr;
-  int sum;
+  u32 sum;
 
   hdr.src = *src;
   hdr.dst = *dst;
@@ -838,9 +1025,9 @@ unsigned short ipv4_pseudoheader_cksum(const struct in_addr *src,
   hdr.length = htons(len);
 
   /* Get the ones'-complement sum of the pseudo-header. */
-  sum = ip_cksum_add(&hdr, sizeof(hdr), 0);
+  sum = in_cksum_add(&hdr, sizeof(hdr), 0);
   /* Add it to the sum of the packet. */
-  sum = ip_cksum_add(hstart, len, sum);
+  sum = in_cksum_add(hstart, len, sum);
 
   /* Fold in the carry, take the complement, and return. */
   sum = ip_cksum_carry(sum);
@@ -865,7 +1052,7 @@ u16 ipv6_pseudoheader_cksum(const struct in6_addr *src,
     u8 z0, z1, z2;
     u8 nxt;
   } hdr;
-  int sum;
+  u32 sum;
 
   hdr.src = *src;
   hdr.dst = *dst;
@@ -873,8 +1060,8 @@ u16 ipv6_pseudoheader_cksum(const struct in6_addr *src,
   hdr.length = htonl(len);
   hdr.nxt = nxt;
 
-  sum = ip_cksum_add(&hdr, sizeof(hdr), 0);
-  sum = ip_cksum_add(hstart, len, sum);
+  sum = in_cksum_add(&hdr, sizeof(hdr), 0);
+  sum = in_cksum_add(hstart, len, sum);
   sum = ip_cksum_carry(sum);
   /* RFC 2460: "Unlike IPv4, when UDP packets are originated by an IPv6 node,
      the UDP checksum is not optional.  That is, whenever originating a UDP
@@ -3262,6 +3449,290 @@ static int route_dst_netlink(const struct sockaddr_storage *dst,
   }
 }
 
+/* Sends a netlink dump request of the given type and family and calls
+   callback() for every message of the reply. hdrlen is the size of the
+   family-specific header that follows the nlmsghdr (struct rtmsg, ndmsg,
+   etc.); all of them start with the address family. Returns 0 if the whole
+   dump was read and -1 on error. */
+static int netlink_dump(int type, int family, size_t hdrlen,
+                        void (*callback)(struct nlmsghdr *, void *), void *arg) {
+  struct sockaddr_nl snl;
+  unsigned char req[NLMSG_SPACE(64)];
+  struct nlmsghdr *nlmsg;
+  unsigned char buf[16384];
+  int fd, n;
+
+  assert(hdrlen <= 64);
+  fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+  if (fd == -1)
+    return -1;
+
+  memset(&snl, 0, sizeof(snl));
+  snl.nl_family = AF_NETLINK;
+
+  memset(req, 0, sizeof(req));
+  nlmsg = (struct nlmsghdr *) req;
+  nlmsg->nlmsg_len = NLMSG_LENGTH(hdrlen);
+  nlmsg->nlmsg_type = type;
+  nlmsg->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  nlmsg->nlmsg_seq = 1;
+  *(unsigned char *) NLMSG_DATA(nlmsg) = family;
+
+  if (sendto(fd, req, nlmsg->nlmsg_len, 0, (struct sockaddr *) &snl, sizeof(snl)) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  for (;;) {
+    n = recv(fd, buf, sizeof(buf), 0);
+    if (n <= 0)
+      break;
+    for (nlmsg = (struct nlmsghdr *) buf; NLMSG_OK(nlmsg, (unsigned int) n); nlmsg = NLMSG_NEXT(nlmsg, n)) {
+      if (nlmsg->nlmsg_type == NLMSG_DONE) {
+        close(fd);
+        return 0;
+      }
+      if (nlmsg->nlmsg_type == NLMSG_ERROR)
+        goto bail;
+      callback(nlmsg, arg);
+    }
+  }
+
+bail:
+  close(fd);
+  return -1;
+}
+
+/* A snapshot of the routing tables, so route_dst() doesn't have to ask the
+   kernel once per destination. The routes of the local, main and default
+   tables are stored in one binary trie per address family and table, which
+   gives the longest prefix match in as many steps as the address has bits.
+   Tables are searched in the order the default policy rules use; if the
+   system has any other rule, the snapshot of that family is not used.
+
+   The trie only tells which route the kernel would use. The details
+   (interface, source address and gateway) are obtained by asking the kernel
+   about the first destination that hits each route, and reused for every
+   other destination that hits the same one. */
+#define SNAPSHOT_TABLES 3
+
+struct route_trie_node {
+  struct route_trie_node *child[2];
+  int route; /* Index in route_snapshot.routes or -1 */
+};
+
+struct snapshot_route {
+  unsigned int metric;
+  unsigned char type;
+  int rc;                /* route_dst_netlink() result, -1 if not asked yet */
+  struct route_nfo rnfo; /* Result for the first destination we asked about */
+};
+
+static struct {
+  int initialized;
+  int usable[2];         /* IPv4, IPv6 */
+  struct route_trie_node *root[2][SNAPSHOT_TABLES];
+  struct snapshot_route *routes;
+  int numroutes;
+  int capacity;
+} route_snapshot;
+
+static int snapshot_family_index(int af) {
+  return (af == AF_INET6) ? 1 : 0;
+}
+
+/* Maps the local, main and default tables to their position in the
+   default rule list. Returns -1 for any other table. */
+static int snapshot_table_index(unsigned int table) {
+  if (table == RT_TABLE_LOCAL)
+    return 0;
+  else if (table == RT_TABLE_MAIN)
+    return 1;
+  else if (table == RT_TABLE_DEFAULT)
+    return 2;
+  return -1;
+}
+
+/* netlink_dump() callback that checks that the policy rules are the default
+   ones: plain lookups in the local, main or default tables. */
+static void snapshot_check_rule(struct nlmsghdr *nlmsg, void *arg) {
+  struct fib_rule_hdr *frh;
+  struct rtattr *rtattr;
+  unsigned int table;
+  unsigned int len;
+  int i;
+
+  if (nlmsg->nlmsg_type != RTM_NEWRULE)
+    return;
+  frh = (struct fib_rule_hdr *) NLMSG_DATA(nlmsg);
+  if (frh->family != AF_INET && frh->family != AF_INET6)
+    return;
+  i = snapshot_family_index(frh->family);
+  table = frh->table;
+  len = NLMSG_PAYLOAD(nlmsg, sizeof(*frh));
+  for (rtattr = (struct rtattr *) ((char *) frh + NLMSG_ALIGN(sizeof(*frh))); RTA_OK(rtattr, len); rtattr = RTA_NEXT(rtattr, len)) {
+    if (rtattr->rta_type == FRA_TABLE)
+      table = *(unsigned int *) RTA_DATA(rtattr);
+    /* The kernel reports these as -1 when they are not in use */
+    else if (rtattr->rta_type == FRA_SUPPRESS_PREFIXLEN || rtattr->rta_type == FRA_SUPPRESS_IFGROUP) {
+      if (*(int *) RTA_DATA(rtattr) != -1)
+        route_snapshot.usable[i] = 0;
+    }
+    /* Anything but the priority and the protocol (21, FRA_PROTOCOL, which
+       older headers don't define) is a selector we don't handle. */
+    else if (rtattr->rta_type != FRA_PRIORITY && rtattr->rta_type != 21)
+      route_snapshot.usable[i] = 0;
+  }
+  if (frh->action != FR_ACT_TO_TBL || frh->src_len != 0 || frh->dst_len != 0 ||
+      frh->tos != 0 || snapshot_table_index(table) == -1)
+    route_snapshot.usable[i] = 0;
+}
+
+/* netlink_dump() callback that adds a route to the snapshot. */
+static void snapshot_add_route(struct nlmsghdr *nlmsg, void *arg) {
+  struct rtmsg *rtmsg;
+  struct rtattr *rtattr;
+  struct route_trie_node **node;
+  struct snapshot_route *route;
+  const unsigned char *dst = NULL;
+  unsigned int table, metric = 0;
+  unsigned int len;
+  int f, t, bit;
+
+  if (nlmsg->nlmsg_type != RTM_NEWROUTE)
+    return;
+  rtmsg = (struct rtmsg *) NLMSG_DATA(nlmsg);
+  if (rtmsg->rtm_family != AF_INET && rtmsg->rtm_family != AF_INET6)
+    return;
+  if (rtmsg->rtm_flags & RTM_F_CLONED)
+    return;
+  table = rtmsg->rtm_table;
+  len = RTM_PAYLOAD(nlmsg);
+  for (rtattr = RTM_RTA(rtmsg); RTA_OK(rtattr, len); rtattr = RTA_NEXT(rtattr, len)) {
+    if (rtattr->rta_type == RTA_DST)
+      dst = (const unsigned char *) RTA_DATA(rtattr);
+    else if (rtattr->rta_type == RTA_TABLE)
+      table = *(unsigned int *) RTA_DATA(rtattr);
+    else if (rtattr->rta_type == RTA_PRIORITY)
+      metric = *(unsigned int *) RTA_DATA(rtattr);
+  }
+  if ((t = snapshot_table_index(table)) == -1)
+    return;
+  if (dst == NULL && rtmsg->rtm_dst_len != 0)
+    return;
+  f = snapshot_family_index(rtmsg->rtm_family);
+
+  /* Walk down the trie, creating the nodes we need */
+  node = &route_snapshot.root[f][t];
+  for (bit = 0; ; bit++) {
+    if (*node == NULL) {
+      *node = (struct route_trie_node *) safe_zalloc(sizeof(struct route_trie_node));
+      (*node)->route = -1;
+    }
+    if (bit == rtmsg->rtm_dst_len)
+      break;
+    node = &(*node)->child[(dst[bit / 8] >> (7 - bit % 8)) & 1];
+  }
+
+  /* Several routes for the same prefix: the kernel uses the lowest metric */
+  if ((*node)->route != -1 && route_snapshot.routes[(*node)->route].metric <= metric)
+    return;
+  if (route_snapshot.numroutes == route_snapshot.capacity) {
+    route_snapshot.capacity = (route_snapshot.capacity == 0) ? 64 : route_snapshot.capacity * 2;
+    route_snapshot.routes = (struct snapshot_route *) safe_realloc(route_snapshot.routes,
+      route_snapshot.capacity * sizeof(struct snapshot_route));
+  }
+  route = &route_snapshot.routes[route_snapshot.numroutes];
+  route->metric = metric;
+  route->type = rtmsg->rtm_type;
+  route->rc = -1;
+  (*node)->route = route_snapshot.numroutes++;
+}
+
+/* Reads the policy rules and the routing tables. Called once. */
+static void init_route_snapshot(void) {
+  route_snapshot.initialized = 1;
+  route_snapshot.usable[0] = route_snapshot.usable[1] = 1;
+  if (netlink_dump(RTM_GETRULE, AF_UNSPEC, sizeof(struct fib_rule_hdr), snapshot_check_rule, NULL) == -1 ||
+      netlink_dump(RTM_GETROUTE, AF_UNSPEC, sizeof(struct rtmsg), snapshot_add_route, NULL) == -1) {
+    route_snapshot.usable[0] = route_snapshot.usable[1] = 0;
+  }
+}
+
+/* Returns the index of the route the kernel would use for dst, or -1 if
+   there isn't one in the snapshot. */
+static int snapshot_lookup(int f, const unsigned char *addr, int bits) {
+  struct route_trie_node *node;
+  int t, bit, best;
+
+  for (t = 0; t < SNAPSHOT_TABLES; t++) {
+    best = -1;
+    node = route_snapshot.root[f][t];
+    for (bit = 0; node != NULL; bit++) {
+      if (node->route != -1)
+        best = node->route;
+      if (bit == bits)
+        break;
+      node = node->child[(addr[bit / 8] >> (7 - bit % 8)) & 1];
+    }
+    /* "throw" routes make the lookup continue in the next table */
+    if (best != -1 && route_snapshot.routes[best].type != RTN_THROW)
+      return best;
+  }
+  return -1;
+}
+
+/* Does route_dst() through the routing snapshot. Returns -1 if the snapshot
+   can't answer for dst, in which case the kernel has to be asked. Only
+   plain unicast destinations are handled: the kernel treats multicast,
+   broadcast and scoped addresses specially, and a specific device or
+   source address changes the lookup. */
+static int route_dst_snapshot(const struct sockaddr_storage *dst,
+                              struct route_nfo *rnfo, const char *device,
+                              const struct sockaddr_storage *spoofss) {
+  struct snapshot_route *route;
+  const unsigned char *addr;
+  int f, i, bits;
+
+  if ((device != NULL && device[0] != '\0') || spoofss != NULL)
+    return -1;
+  if (dst->ss_family == AF_INET) {
+    addr = (const unsigned char *) &((const struct sockaddr_in *) dst)->sin_addr.s_addr;
+    if ((addr[0] & 0xF0) == 0xE0 || addr[0] == 0 || memcmp(addr, "\xFF\xFF\xFF\xFF", 4) == 0)
+      return -1;
+    bits = 32;
+  } else if (dst->ss_family == AF_INET6) {
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) dst;
+    addr = sin6->sin6_addr.s6_addr;
+    if (sin6->sin6_scope_id != 0 || addr[0] == 0xFF || (addr[0] == 0xFE && (addr[1] & 0xC0) == 0x80) ||
+        memcmp(addr, IP6_ADDR_UNSPEC, IP6_ADDR_LEN) == 0)
+      return -1;
+    bits = 128;
+  } else {
+    return -1;
+  }
+
+  if (!route_snapshot.initialized)
+    init_route_snapshot();
+  f = snapshot_family_index(dst->ss_family);
+  if (!route_snapshot.usable[f] || (i = snapshot_lookup(f, addr, bits)) == -1)
+    return -1;
+
+  route = &route_snapshot.routes[i];
+  if (route->rc == -1) {
+    memset(&route->rnfo, 0, sizeof(route->rnfo));
+    route->rc = route_dst_netlink(dst, &route->rnfo, NULL, NULL);
+  }
+  if (route->rc == 1) {
+    *rnfo = route->rnfo;
+    /* Same rule as route_dst_netlink(): a gateway that is the destination
+       itself doesn't make it indirect. */
+    rnfo->direct_connect = (rnfo->nexthop.ss_family == AF_UNSPEC ||
+                            sockaddr_storage_equal(dst, &rnfo->nexthop));
+  }
+  return route->rc;
+}
+
 #else
 
 static struct interface_info *find_loopback_iface(struct interface_info *ifaces,
@@ -3494,12 +3965,95 @@ static int route_dst_generic(const struct sockaddr_storage *dst,
 int route_dst(const struct sockaddr_storage *dst, struct route_nfo *rnfo,
               const char *device, const struct sockaddr_storage *spoofss) {
 #ifdef HAVE_LINUX_RTNETLINK_H
+  int rc;
+
+  if ((rc = route_dst_snapshot(dst, rnfo, device, spoofss)) != -1)
+    return rc;
   return route_dst_netlink(dst, rnfo, device, spoofss);
 #else
   return route_dst_generic(dst, rnfo, device, spoofss);
 #endif
 }
 
+#ifdef HAVE_LINUX_RTNETLINK_H
+#ifndef NDA_RTA
+#define NDA_RTA(r) ((struct rtattr *) (((char *) (r)) + NLMSG_ALIGN(sizeof(struct ndmsg))))
+#endif
+
+/* netlink_dump() callback that copies a neighbor table entry into the MAC
+   cache. */
+static void load_neighbor_netlink(struct nlmsghdr *nlmsg, void *arg) {
+  struct ndmsg *ndmsg;
+  struct rtattr *rtattr;
+  struct sockaddr_storage ss;
+  const void *dst = NULL;
+  const u8 *lladdr = NULL;
+  unsigned int len;
+  int *count = (int *) arg;
+
+  if (nlmsg->nlmsg_type != RTM_NEWNEIGH)
+    return;
+  ndmsg = (struct ndmsg *) NLMSG_DATA(nlmsg);
+  /* Incomplete and failed entries don't have a usable link-layer
+     address. Stale ones do, and the kernel still uses them. */
+  if (!(ndmsg->ndm_state & (NUD_REACHABLE | NUD_STALE | NUD_DELAY | NUD_PROBE | NUD_PERMANENT)))
+    return;
+  if (ndmsg->ndm_family != AF_INET && ndmsg->ndm_family != AF_INET6)
+    return;
+  len = NLMSG_PAYLOAD(nlmsg, sizeof(*ndmsg));
+  for (rtattr = NDA_RTA(ndmsg); RTA_OK(rtattr, len); rtattr = RTA_NEXT(rtattr, len)) {
+    if (rtattr->rta_type == NDA_DST)
+      dst = RTA_DATA(rtattr);
+    else if (rtattr->rta_type == NDA_LLADDR && RTA_PAYLOAD(rtattr) == 6)
+      lladdr = (const u8 *) RTA_DATA(rtattr);
+  }
+  if (dst == NULL || lladdr == NULL)
+    return;
+  memset(&ss, 0, sizeof(ss));
+  set_sockaddr(&ss, ndmsg->ndm_family, (void *) dst);
+  mac_cache_set(&ss, (u8 *) lladdr);
+  (*count)++;
+}
+#endif
+
+/* arp_loop() callback for mac_cache_load_neighbors() */
+static int load_neighbors_arp(const struct arp_entry *entry, void *arg) {
+  struct sockaddr_storage ss;
+  int *count = (int *) arg;
+
+  if (entry->arp_ha.addr_type != ADDR_TYPE_ETH)
+    return 0;
+  memset(&ss, 0, sizeof(ss));
+  if (addr_ntos(&entry->arp_pa, (struct sockaddr *) &ss) == 0) {
+    mac_cache_set(&ss, (u8 *) entry->arp_ha.addr_eth.data);
+    (*count)++;
+  }
+  return 0;
+}
+
+/* Copies the entries of the system's neighbor table (the ARP cache and,
+ * where we know how to read it, the IPv6 Neighbor Discovery cache) into
+ * the MAC cache in a single pass, so callers that need to resolve many
+ * addresses don't have to query the system once per address. Returns the
+ * number of entries loaded, or -1 if the table could not be read. */
+int mac_cache_load_neighbors(void) {
+  int count = 0;
+  arp_t *a;
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+  /* A single RTM_GETNEIGH dump returns both the ARP and the IPv6 Neighbor
+     Discovery entries. See rtnetlink(7). */
+  if (netlink_dump(RTM_GETNEIGH, AF_UNSPEC, sizeof(struct ndmsg), load_neighbor_netlink, &count) == 0)
+    return count;
+  count = 0;
+#endif
+  if ((a = arp_open()) == NULL)
+    return -1;
+  arp_loop(a, load_neighbors_arp, &count);
+  arp_close(a);
+  return count;
+}
+
 /* Wrapper for system function sendto(), which retries a few times when
  * the call fails. It also prints informational messages about the
  * errors encountered. It returns the number of bytes sent or -1 in
@@ -3947,6 +4501,268 @@ int send_ipv6_packet_eth_or_sd(int sd, const struct eth_nfo *eth,
 }
 
 
+#ifdef LINUX
+/* Hands "count" already prepared messages to the kernel using as few
+   sendmmsg() calls as possible. When the kernel refuses a message, that
+   message is sent again through Sendto() (which retries on transient errors
+   and reports the problem) and the batch continues with the next one.
+   If "results" is not NULL, results[i] tells whether msgs[i] was sent.
+   Returns the number of messages that were sent. */
+static int sendmmsg_all(int sd, struct mmsghdr *msgs, int count, bool *results) {
+  int i = 0, j, res, sent = 0;
+
+  while (i < count) {
+    res = sendmmsg(sd, msgs + i, count - i, 0);
+    if (res > 0) {
+      if (results != NULL) {
+        for (j = i; j < i + res; j++)
+          results[j] = true;
+      }
+      i += res;
+      sent += res;
+      continue;
+    }
+    /* msgs[i] could not be sent. Let Sendto() deal with it. */
+    res = Sendto("sendmmsg_all", sd, (const unsigned char *) msgs[i].msg_hdr.msg_iov->iov_base,
+                 msgs[i].msg_hdr.msg_iov->iov_len, 0,
+                 (struct sockaddr *) msgs[i].msg_hdr.msg_name,
+                 msgs[i].msg_hdr.msg_namelen);
+    if (res != -1)
+      sent++;
+    if (results != NULL)
+      results[i] = (res != -1);
+    i++;
+  }
+  return sent;
+}
+#endif
+
+
+/* Sends a batch of IPv4 packets over a raw socket. See netutil.h. */
+int send_ip_packets_sd(int sd, const struct sockaddr_in *dsts,
+  u8 * const *packets, const unsigned int *packetlens, int count,
+  bool *results) {
+#ifdef LINUX
+  struct mmsghdr msgs[MAX_SENDMMSG_BATCH];
+  struct iovec iovs[MAX_SENDMMSG_BATCH];
+  struct sockaddr_in socks[MAX_SENDMMSG_BATCH];
+  const struct ip *ip;
+  const struct tcp_hdr *tcp;
+  const struct udp_hdr *udp;
+  int i, n, done, sent = 0;
+
+  assert(sd >= 0);
+  for (done = 0; done < count; done += n) {
+    n = MIN(count - done, MAX_SENDMMSG_BATCH);
+    memset(msgs, 0, n * sizeof(struct mmsghdr));
+    for (i = 0; i < n; i++) {
+      /* Same port trick as in send_ip_packet_sd() */
+      socks[i] = dsts[done + i];
+      ip = (const struct ip *) packets[done + i];
+      if (packetlens[done + i] >= 20) {
+        if (ip->ip_p == IPPROTO_TCP
+            && packetlens[done + i] >= (unsigned int) ip->ip_hl * 4 + 20) {
+          tcp = (const struct tcp_hdr *) ((const u8 *) ip + ip->ip_hl * 4);
+          socks[i].sin_port = tcp->th_dport;
+        } else if (ip->ip_p == IPPROTO_UDP
+                   && packetlens[done + i] >= (unsigned int) ip->ip_hl * 4 + 8) {
+          udp = (const struct udp_hdr *) ((const u8 *) ip + ip->ip_hl * 4);
+          socks[i].sin_port = udp->uh_dport;
+        }
+      }
+      iovs[i].iov_base = packets[done + i];
+      iovs[i].iov_len = packetlens[done + i];
+      msgs[i].msg_hdr.msg_name = &socks[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    sent += sendmmsg_all(sd, msgs, n, results != NULL ? results + done : NULL);
+  }
+  return sent;
+#else
+  int i, sent = 0;
+
+  int res;
+
+  for (i = 0; i < count; i++) {
+    res = send_ip_packet_sd(sd, &dsts[i], packets[i], packetlens[i]);
+    if (res != -1)
+      sent++;
+    if (results != NULL)
+      results[i] = (res != -1);
+  }
+  return sent;
+#endif
+}
+
+
+/* Sends a batch of IPv6 packets over a raw socket. See netutil.h. */
+int send_ipv6_packets_sd(int sd, const struct sockaddr_in6 *dsts,
+  u8 * const *packets, const unsigned int *packetlens, int count,
+  bool *results) {
+  int i, res, sent = 0;
+#if defined(LINUX) && HAVE_IPV6_IPPROTO_RAW
+  struct mmsghdr msgs[MAX_SENDMMSG_BATCH];
+  struct iovec iovs[MAX_SENDMMSG_BATCH];
+  int n, done;
+
+  if (sd != -1) {
+    for (done = 0; done < count; done += n) {
+      n = MIN(count - done, MAX_SENDMMSG_BATCH);
+      memset(msgs, 0, n * sizeof(struct mmsghdr));
+      for (i = 0; i < n; i++) {
+        iovs[i].iov_base = packets[done + i];
+        iovs[i].iov_len = packetlens[done + i];
+        msgs[i].msg_hdr.msg_name = (void *) &dsts[done + i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+      }
+      sent += sendmmsg_all(sd, msgs, n, results != NULL ? results + done : NULL);
+    }
+    return sent;
+  }
+#endif
+  for (i = 0; i < count; i++) {
+    res = send_ipv6_packet_eth_or_sd(-1, NULL, &dsts[i], packets[i], packetlens[i]);
+    if (res != -1)
+      sent++;
+    if (results != NULL)
+      results[i] = (res != -1);
+  }
+  return sent;
+}
+
+
+/* Size of each slot in the Ethernet transmission ring. Two slots fit in a
+   regular 4K page and every slot has room for a full 1500-byte frame plus
+   the tpacket2_hdr that precedes it. */
+#define ETH_TXRING_FRAME_SIZE 2048
+
+struct eth_txring {
+  int sd;                  /* PF_PACKET socket the ring is attached to */
+  u8 *ring;                /* Memory mapped ring                       */
+  size_t ringlen;          /* Length of the mapping                    */
+  unsigned int frame_nr;   /* Number of slots in the ring              */
+  unsigned int head;       /* Next slot to be filled                   */
+  unsigned int queued;     /* Slots filled since the last flush        */
+};
+
+struct eth_txring *eth_txring_open(const char *device, unsigned int frames) {
+#ifdef LINUX
+  struct eth_txring *r;
+  struct tpacket_req req;
+  struct sockaddr_ll sll;
+  int version = TPACKET_V2;
+  unsigned int per_block;
+
+  if (device == NULL || *device == '\0' || frames == 0)
+    return NULL;
+
+  r = (struct eth_txring *) safe_zalloc(sizeof(struct eth_txring));
+  r->ring = (u8 *) MAP_FAILED;
+  if ((r->sd = socket(PF_PACKET, SOCK_RAW, 0)) == -1)
+    goto fail;
+  if (setsockopt(r->sd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1)
+    goto fail;
+
+  /* The ring is made of page-sized blocks, each holding a whole number of
+     slots. Round the number of slots up so every block is full. */
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = MAX(getpagesize(), ETH_TXRING_FRAME_SIZE);
+  req.tp_frame_size = ETH_TXRING_FRAME_SIZE;
+  per_block = req.tp_block_size / req.tp_frame_size;
+  req.tp_block_nr = (frames + per_block - 1) / per_block;
+  req.tp_frame_nr = req.tp_block_nr * per_block;
+  if (setsockopt(r->sd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) == -1)
+    goto fail;
+
+  r->frame_nr = req.tp_frame_nr;
+  r->ringlen = (size_t) req.tp_block_size * req.tp_block_nr;
+  r->ring = (u8 *) mmap(NULL, r->ringlen, PROT_READ | PROT_WRITE, MAP_SHARED, r->sd, 0);
+  if (r->ring == MAP_FAILED)
+    goto fail;
+
+  memset(&sll, 0, sizeof(sll));
+  sll.sll_family = AF_PACKET;
+  sll.sll_protocol = 0;
+  if ((sll.sll_ifindex = if_nametoindex(device)) == 0)
+    goto fail;
+  if (bind(r->sd, (struct sockaddr *) &sll, sizeof(sll)) == -1)
+    goto fail;
+
+  return r;
+
+fail:
+  if (r->ring != MAP_FAILED)
+    munmap(r->ring, r->ringlen);
+  if (r->sd != -1)
+    close(r->sd);
+  free(r);
+  return NULL;
+#else
+  return NULL;
+#endif
+}
+
+int eth_txring_add(struct eth_txring *ring, const u8 *frame, unsigned int framelen) {
+#ifdef LINUX
+  struct tpacket2_hdr *hdr;
+  unsigned int off = TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+
+  assert(ring != NULL);
+  if (framelen > ETH_TXRING_FRAME_SIZE - off)
+    return -1;
+  hdr = (struct tpacket2_hdr *) (ring->ring + (size_t) ring->head * ETH_TXRING_FRAME_SIZE);
+  /* If the slot is still owned by the kernel, the ring is full. A blocking
+     flush waits until the kernel has transmitted every pending frame. */
+  if (hdr->tp_status != TP_STATUS_AVAILABLE) {
+    if (eth_txring_flush(ring) == -1 || hdr->tp_status != TP_STATUS_AVAILABLE)
+      return -1;
+  }
+  memcpy((u8 *) hdr + off, frame, framelen);
+  hdr->tp_len = framelen;
+  hdr->tp_status = TP_STATUS_SEND_REQUEST;
+  ring->head = (ring->head + 1) % ring->frame_nr;
+  ring->queued++;
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+int eth_txring_flush(struct eth_txring *ring) {
+#ifdef LINUX
+  int queued;
+
+  assert(ring != NULL);
+  if (ring->queued == 0)
+    return 0;
+  queued = ring->queued;
+  ring->queued = 0;
+  if (send(ring->sd, NULL, 0, 0) == -1) {
+    netutil_error("%s: send() on TX ring failed: %s", __func__, strerror(socket_errno()));
+    return -1;
+  }
+  return queued;
+#else
+  return -1;
+#endif
+}
+
+void eth_txring_close(struct eth_txring *ring) {
+#ifdef LINUX
+  if (ring == NULL)
+    return;
+  eth_txring_flush(ring);
+  munmap(ring->ring, ring->ringlen);
+  close(ring->sd);
+  free(ring);
+#endif
+}
+
+
 
 #ifdef WIN32
 /* Convert a dnet interface name into the long pcap style.  This also caches the
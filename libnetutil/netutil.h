@@ -241,6 +241,11 @@ int ip_is_reserved(struct in_addr *ip);
 int mac_cache_get(const struct sockaddr_storage *ss, u8 *mac);
 int mac_cache_set(const struct sockaddr_storage *ss, u8 *mac);
 
+/* Copies the system's neighbor table (ARP and, where supported, IPv6
+ * Neighbor Discovery entries) into the MAC cache. Returns the number of
+ * entries loaded or -1 if the table could not be read. */
+int mac_cache_load_neighbors(void);
+
 const void *ip_get_data(const void *packet, unsigned int *len,
   struct abstract_ip_hdr *hdr);
 const void *ip_get_data_any(const void *packet, unsigned int *len,
@@ -255,9 +260,22 @@ const void *ipv6_get_data_any(const struct ip6_hdr *ip6, unsigned int *len, u8 *
 const void *icmp_get_data(const struct icmp_hdr *icmp, unsigned int *len);
 const void *icmpv6_get_data(const struct icmpv6_hdr *icmpv6, unsigned int *len);
 
+/* Returns the one's complement sum of the supplied buffer, added to "sum"
+   (which may be the result of a previous call). The result is folded to 16
+   bits but not complemented; finish it with ip_cksum_carry(). Large buffers
+   are summed with SSE2 or AVX2 instructions when available. */
+u32 in_cksum_add(const void *buf, size_t len, u32 sum);
+
 /* Standard BSD internet checksum routine. */
 unsigned short in_cksum(u16 *ptr, int nbytes);
 
+/* Incremental checksum updates (RFC 1624). They return the checksum that
+   results from replacing a 16-bit word, a 32-bit word or a whole buffer of
+   the covered data. All values are in network byte order. */
+u16 in_cksum_update16(u16 sum, u16 oldval, u16 newval);
+u16 in_cksum_update32(u16 sum, u32 oldval, u32 newval);
+u16 in_cksum_update(u16 sum, const void *oldbuf, const void *newbuf, size_t len);
+
 /* Calculate the Internet checksum of some given data concatentated with the
    IPv4 pseudo-header. See RFC 1071 and TCP/IP Illustrated sections 3.2, 11.3,
    and 17.3. */
@@ -501,6 +519,53 @@ int send_ip_packet_eth_or_sd(int sd, const struct eth_nfo *eth,
 int send_ipv6_packet_eth_or_sd(int sd, const struct eth_nfo *eth,
   const struct sockaddr_in6 *dst, const u8 *packet, unsigned int packetlen);
 
+/* Maximum number of packets handed to the kernel in a single sendmmsg()
+ * call by send_ip_packets_sd() and send_ipv6_packets_sd(). Larger batches
+ * are split into several calls. */
+#define MAX_SENDMMSG_BATCH 128
+
+/* Sends "count" pre-built IPv4 packets through the raw socket "sd".
+ * packets[i] (of length packetlens[i]) is sent to dsts[i]. On Linux the
+ * whole batch is handed to the kernel with sendmmsg(), so it costs a few
+ * system calls instead of one per packet. Packets the kernel refuses are
+ * retried one by one through send_ip_packet_sd(). On other platforms every
+ * packet goes through send_ip_packet_sd(). If "results" is not NULL,
+ * results[i] is set to whether packets[i] was sent. Returns the number of
+ * packets that were sent successfully. */
+int send_ip_packets_sd(int sd, const struct sockaddr_in *dsts,
+  u8 * const *packets, const unsigned int *packetlens, int count,
+  bool *results);
+
+/* IPv6 counterpart of send_ip_packets_sd(). "sd" must be an AF_INET6
+ * IPPROTO_RAW socket. Batching is only possible on platforms where such
+ * sockets take the full IPv6 header (HAVE_IPV6_IPPROTO_RAW on Linux). In
+ * any other case, or if "sd" is -1, the packets are sent one by one through
+ * send_ipv6_packet_eth_or_sd(). Returns the number of packets sent. */
+int send_ipv6_packets_sd(int sd, const struct sockaddr_in6 *dsts,
+  u8 * const *packets, const unsigned int *packetlens, int count,
+  bool *results);
+
+/* Ethernet transmission ring (PACKET_MMAP TX_RING on Linux). Frames are
+ * copied into a ring buffer shared with the kernel with eth_txring_add()
+ * and transmitted all together when eth_txring_flush() is called, so a
+ * whole batch of frames costs a single system call. eth_txring_open()
+ * returns NULL if the ring could not be set up (or if the platform does
+ * not support it); callers should then fall back to eth_send(). */
+struct eth_txring;
+struct eth_txring *eth_txring_open(const char *device, unsigned int frames);
+
+/* Queues a frame in the ring. If the ring is full, queued frames are flushed
+ * first. Returns 0 on success and -1 if the frame could not be queued (e.g.
+ * because it does not fit in a ring slot). */
+int eth_txring_add(struct eth_txring *ring, const u8 *frame, unsigned int framelen);
+
+/* Transmits every frame queued since the last flush. Returns the number of
+ * frames handed to the kernel or -1 on error. */
+int eth_txring_flush(struct eth_txring *ring);
+
+/* Flushes any pending frames, unmaps the ring and closes the socket. */
+void eth_txring_close(struct eth_txring *ring);
+
 /* Create and send all fragments of a pre-built IPv4 packet.
  * Minimal MTU for IPv4 is 68 and maximal IPv4 header size is 60
  * which gives us a right to cut TCP header after 8th byte */
@@ -241,9 +241,20 @@ void nrand_init(nrand_h *r) {
   nrand_get(r, seed, 256); nrand_get(r, seed, 256);
 }
 
+/* Each thread gets its own generator state, so programs that ask for random
+ * numbers from several threads at once (like nping --threads) don't share an
+ * unsynchronized one. */
+#if defined(_MSC_VER)
+#define NRAND_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+#define NRAND_THREAD_LOCAL __thread
+#else
+#define NRAND_THREAD_LOCAL
+#endif
+
 int get_random_bytes(void *buf, int numbytes) {
-  static nrand_h state;
-  static int state_init = 0;
+  static NRAND_THREAD_LOCAL nrand_h state;
+  static NRAND_THREAD_LOCAL int state_init = 0;
 
   /* Initialize if we need to */
   if (!state_init) {
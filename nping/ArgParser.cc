@@ -301,6 +301,10 @@ int ArgParser::parseArguments(int argc, char *argv[]) {
   /* Timing and performance */
   {"delay", required_argument, 0, 0},
   {"rate", required_argument, 0, 0},
+  {"batch", required_argument, 0, 0},
+  {"inflight", required_argument, 0, 0},
+  {"threads", required_argument, 0, 0},
+  {"precompile", no_argument, 0, 0},
 
   /* Misc */
   {"help", no_argument, 0, 'h'},
@@ -324,6 +328,10 @@ int ArgParser::parseArguments(int argc, char *argv[]) {
   {"reduce-verbosity", optional_argument, 0, 'q'},
   {"debug", no_argument, 0, 0},
   {"quiet", no_argument, 0, 0},
+  {"output-jsonl", required_argument, 0, 0},
+  {"output-binary", required_argument, 0, 0},
+  {"stats-every", required_argument, 0, 0},
+  {"stats-socket", required_argument, 0, 0},
   {0, 0, 0, 0}
   };
 
@@ -1273,13 +1281,30 @@ int ArgParser::parseArguments(int argc, char *argv[]) {
             if(aux32==0){
                 nping_fatal(QT_3,"Invalid rate supplied. Rate can never be zero.");
             }else{
-                /* Compute delay from rate: delay= 1000ms/rate*/
-                aux32 = 1000 / aux32;
-                o.setDelay(aux32);
+                /* The rate scheduler works with microsecond resolution, so
+                 * we store the rate itself. We still compute the delay in
+                 * msecs (delay= 1000ms/rate) for the code that needs it. */
+                o.setDelay(1000 / aux32);
+                o.setRate(aux32);
             }
         }else{
             nping_fatal(QT_3,"Invalid rate supplied. Rate must be a valid, positive integer");
         }
+    /* Tx batch size */
+    } else if (optcmp(long_options[option_index].name, "batch") == 0 ){
+        if (parse_u32(optarg, &aux32)!=OP_SUCCESS || o.setTxBatch(aux32)!=OP_SUCCESS)
+            nping_fatal(QT_3,"Invalid batch size supplied. Value must be 1<=N<=%d", MAX_TX_BATCH);
+    /* Number of probes per host kept for response matching */
+    } else if (optcmp(long_options[option_index].name, "inflight") == 0 ){
+        if (parse_u32(optarg, &aux32)!=OP_SUCCESS || o.setInflight(aux32)!=OP_SUCCESS)
+            nping_fatal(QT_3,"Invalid number of in-flight probes supplied. Value must be 1<=N<=%d", MAX_INFLIGHT_PROBES);
+    /* Number of threads that transmit probes */
+    } else if (optcmp(long_options[option_index].name, "threads") == 0 ){
+        if (parse_u32(optarg, &aux32)!=OP_SUCCESS || o.setThreads(aux32)!=OP_SUCCESS)
+            nping_fatal(QT_3,"Invalid number of threads supplied. Value must be 0<=N<=%d", MAX_SENDER_THREADS);
+    /* Build probes from precompiled templates */
+    } else if (optcmp(long_options[option_index].name, "precompile") == 0 ){
+        o.setPrecompile(true);
 
 /* MISC OPTIONS **************************************************************/
     /* Use a bad checksum for protocols above the network layer */
@@ -1323,6 +1348,25 @@ int ArgParser::parseArguments(int argc, char *argv[]) {
     }else if (optcmp(long_options[option_index].name, "debug") == 0 ){
             o.setVerbosity(4);
             o.setDebugging(9);
+    /* Structured output */
+    }else if (optcmp(long_options[option_index].name, "output-jsonl") == 0 ||
+              optcmp(long_options[option_index].name, "output-binary") == 0 ){
+        if(o.issetStructuredOutput())
+            nping_fatal(QT_3, "Only one of --output-jsonl and --output-binary may be specified.");
+        o.setStructuredOutput(optarg, optcmp(long_options[option_index].name, "output-jsonl")==0 ? OUTPUT_FORMAT_JSONL : OUTPUT_FORMAT_BINARY);
+    /* Live statistics */
+    }else if (optcmp(long_options[option_index].name, "stats-every") == 0 ){
+#ifdef WIN32
+        nping_fatal(QT_3, "Option --stats-every is not supported on Windows.");
+#endif
+        if ( (l= tval2msecs(optarg)) <= 0 || o.setStatsInterval(l)!=OP_SUCCESS)
+            nping_fatal(QT_3,"Invalid interval supplied. Interval must be a valid, positive integer or floating point number.");
+    }else if (optcmp(long_options[option_index].name, "stats-socket") == 0 ){
+#ifdef WIN32
+        nping_fatal(QT_3, "Option --stats-socket is not supported on Windows.");
+#endif
+        if(o.setStatsSocket(optarg)!=OP_SUCCESS)
+            nping_fatal(QT_3,"Invalid socket path supplied.");
     }
 
     /* Copy and paste these to add more options. */
@@ -1652,6 +1696,10 @@ void ArgParser::printUsage(void){
 "  's' (seconds), 'm' (minutes), or 'h' (hours) to the value (e.g. 30m, 0.25h).\n"
 "  --delay <time>                   : Adjust delay between probes.\n"
 "  --rate  <rate>                   : Send num packets per second.\n"
+"  --batch <n>                      : Send packets in batches of up to n.\n"
+"  --inflight <n>                   : Remember last n probes per target.\n"
+"  --threads <n>                    : Send probes from n parallel threads.\n"
+"  --precompile                     : Reuse precompiled packet templates.\n"
 "MISC:\n"
 "  -h, --help                       : Display help information.\n"
 "  -V, --version                    : Display current version number. \n"
@@ -0,0 +1,533 @@
+/***************************************************************************
+ * BPFGenerator.cc -- The BPFGenerator class builds the BPF programs that  *
+ * the kernel uses to drop captured packets that can't be responses to our *
+ * probes.                                                                 *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2014 Insecure.Com LLC. Nmap is    *
+ * also a registered trademark of Insecure.Com LLC.  This program is free  *
+ * software; you may redistribute and/or modify it under the terms of the  *
+ * GNU General Public License as published by the Free Software            *
+ * Foundation; Version 2 ("GPL"), BUT ONLY WITH ALL OF THE CLARIFICATIONS  *
+ * AND EXCEPTIONS DESCRIBED HEREIN.  This guarantees your right to use,    *
+ * modify, and redistribute this software under certain conditions.  If    *
+ * you wish to embed Nmap technology into proprietary software, we sell    *
+ * alternative licenses (contact sales@nmap.com).  Dozens of software      *
+ * vendors already license Nmap technology such as host discovery, port    *
+ * scanning, OS detection, version detection, and the Nmap Scripting       *
+ * Engine.                                                                 *
+ *                                                                         *
+ * Note that the GPL places important restrictions on "derivative works",  *
+ * yet it does not provide a detailed definition of that term.  To avoid   *
+ * misunderstandings, we interpret that term as broadly as copyright law   *
+ * allows.  For example, we consider an application to constitute a        *
+ * derivative work for the purpose of this license if it does any of the   *
+ * following with any software or content covered by this license          *
+ * ("Covered Software"):                                                   *
+ *                                                                         *
+ * o Integrates source code from Covered Software.                         *
+ *                                                                         *
+ * o Reads or includes copyrighted data files, such as Nmap's nmap-os-db   *
+ * or nmap-service-probes.                                                 *
+ *                                                                         *
+ * o Is designed specifically to execute Covered Software and parse the    *
+ * results (as opposed to typical shell or execution-menu apps, which will *
+ * execute anything you tell them to).                                     *
+ *                                                                         *
+ * o Includes Covered Software in a proprietary executable installer.  The *
+ * installers produced by InstallShield are an example of this.  Including *
+ * Nmap with other software in compressed or archival form does not        *
+ * trigger this provision, provided appropriate open source decompression  *
+ * or de-archiving software is widely available for no charge.  For the    *
+ * purposes of this license, an installer is considered to include Covered *
+ * Software even if it actually retrieves a copy of Covered Software from  *
+ * another source during runtime (such as by downloading it from the       *
+ * Internet).                                                              *
+ *                                                                         *
+ * o Links (statically or dynamically) to a library which does any of the  *
+ * above.                                                                  *
+ *                                                                         *
+ * o Executes a helper program, module, or script to do any of the above.  *
+ *                                                                         *
+ * This list is not exclusive, but is meant to clarify our interpretation  *
+ * of derived works with some common examples.  Other people may interpret *
+ * the plain GPL differently, so we consider this a special exception to   *
+ * the GPL that we apply to Covered Software.  Works which meet any of     *
+ * these conditions must conform to all of the terms of this license,      *
+ * particularly including the GPL Section 3 requirements of providing      *
+ * source code and allowing free redistribution of the work as a whole.    *
+ *                                                                         *
+ * As another special exception to the GPL terms, Insecure.Com LLC grants  *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two.                                  *
+ *                                                                         *
+ * Any redistribution of Covered Software, including any derived works,    *
+ * must obey and carry forward all of the terms of this license, including *
+ * obeying all GPL rules and restrictions.  For example, source code of    *
+ * the whole work must be provided and free redistribution must be         *
+ * allowed.  All GPL references to "this License", are to be treated as    *
+ * including the terms and conditions of this license text as well.        *
+ *                                                                         *
+ * Because this license imposes special exceptions to the GPL, Covered     *
+ * Work may not be combined (even as part of a larger work) with plain GPL *
+ * software.  The terms, conditions, and exceptions of this license must   *
+ * be included as well.  This license is incompatible with some other open *
+ * source licenses as well.  In some cases we can relicense portions of    *
+ * Nmap or grant special permissions to use it in other open source        *
+ * software.  Please contact fyodor@nmap.org with any such requests.       *
+ * Similarly, we don't incorporate incompatible open source software into  *
+ * Covered Software without special permission from the copyright holders. *
+ *                                                                         *
+ * If you have any questions about the licensing restrictions on using     *
+ * Nmap in other works, are happy to help.  As mentioned above, we also    *
+ * offer alternative license to integrate Nmap into proprietary            *
+ * applications and appliances.  These contracts have been sold to dozens  *
+ * of software vendors, and generally include a perpetual license as well  *
+ * as providing for priority support and updates.  They also fund the      *
+ * continued development of Nmap.  Please email sales@nmap.com for further *
+ * information.                                                            *
+ *                                                                         *
+ * If you have received a written license agreement or contract for        *
+ * Covered Software stating terms other than these, you may choose to use  *
+ * and redistribute Covered Software under those terms instead of these.   *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the Nmap      *
+ * license file for more details (it's in a COPYING file included with     *
+ * Nmap, and also available from https://svn.nmap.org/nmap/COPYING)        *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "BPFGenerator.h"
+#include "output.h"
+#include <algorithm>
+
+/* The filters built here only look at the captured packets, never at the
+ * state of the probe engine, so they are much simpler than the matching done
+ * by FlowTable. They accept a packet if:
+ *
+ *  - It is IPv4 or IPv6, and it is addressed to one of our addresses.
+ *  - It is ICMP (ICMP errors may be responses to any kind of probe, and may
+ *    come from any router in the path), or it uses the same transport
+ *    protocol as our probes, comes from one of the targets and from one of
+ *    the target ports (and goes to one of our source ports, if they were
+ *    set).
+ *
+ * The sets of addresses and ports are kept as sorted lists of ranges, so
+ * consecutive addresses (like those obtained from a CIDR spec) only take one
+ * entry, and each set is checked with a binary search, so the number of
+ * instructions run for every packet only grows with the log of the number of
+ * ranges. Sets with too many ranges are merged into fewer, wider ranges,
+ * closing the smallest gaps first. */
+
+BPFGenerator::BPFGenerator(){
+  this->reset();
+} /* End of BPFGenerator constructor */
+
+
+BPFGenerator::~BPFGenerator(){
+
+} /* End of BPFGenerator destructor */
+
+
+void BPFGenerator::reset(){
+  this->prog.clear();
+  this->labels.clear();
+  this->fixups.clear();
+  this->src4.clear();
+  this->dst4.clear();
+  this->src6.clear();
+  this->dst6.clear();
+  this->tports.clear();
+  this->sports.clear();
+  this->proto=0;
+} /* End of reset() */
+
+
+static bool range_cmp(const struct bpf_range &a, const struct bpf_range &b){
+  return a.lo < b.lo;
+} /* End of range_cmp() */
+
+
+void BPFGenerator::add_value(vector<struct bpf_range> &set, u32 val){
+  struct bpf_range r;
+  r.lo=r.hi=val;
+  set.push_back(r);
+} /* End of add_value() */
+
+
+/* Adds an IPv6 address to the group that shares its first 96 bits. Once there
+ * are more than BPF_MAX_IPV6_GROUPS groups, the set won't be used for
+ * filtering, so no more groups are added. */
+void BPFGenerator::add_value6(vector<struct bpf_group6> &set, const u8 *addr){
+  u32 w[4];
+  size_t i=0;
+
+  for(i=0; i<4; i++)
+    w[i]=((u32)addr[4*i] << 24) | ((u32)addr[4*i+1] << 16) | ((u32)addr[4*i+2] << 8) | addr[4*i+3];
+  for(i=0; i<set.size(); i++){
+    if(set[i].prefix[0]==w[0] && set[i].prefix[1]==w[1] && set[i].prefix[2]==w[2])
+      break;
+  }
+  if(i==set.size()){
+    if(set.size()>BPF_MAX_IPV6_GROUPS)
+      return;
+    set.resize(set.size()+1);
+    memcpy(set[i].prefix, w, sizeof(set[i].prefix));
+  }
+  add_value(set[i].ranges, w[3]);
+} /* End of add_value6() */
+
+
+/* Sorts the set and merges overlapping and adjacent ranges. Then, if there
+ * are still more than "max" ranges, the ranges separated by the smallest gaps
+ * are merged until there are "max" left. */
+void BPFGenerator::compress(vector<struct bpf_range> &set, size_t max){
+  vector< pair<u32,size_t> > gaps;
+  vector<bool> merge;
+  size_t i=0, n=0;
+
+  if(set.empty())
+    return;
+  sort(set.begin(), set.end(), range_cmp);
+  for(i=1, n=0; i<set.size(); i++){
+    if(set[n].hi==0xFFFFFFFF || set[i].lo <= set[n].hi+1){
+      set[n].hi=MAX(set[n].hi, set[i].hi);
+    }else{
+      set[++n]=set[i];
+    }
+  }
+  set.resize(n+1);
+  if(max==0 || set.size()<=max)
+    return;
+
+  /* Find the smallest gaps and get rid of them */
+  for(i=1; i<set.size(); i++)
+    gaps.push_back(make_pair(set[i].lo-set[i-1].hi, i));
+  sort(gaps.begin(), gaps.end());
+  merge.assign(set.size(), false);
+  for(i=0; i<set.size()-max; i++)
+    merge[gaps[i].second]=true;
+  for(i=1, n=0; i<set.size(); i++){
+    if(merge[i])
+      set[n].hi=set[i].hi;
+    else
+      set[++n]=set[i];
+  }
+  set.resize(n+1);
+} /* End of compress() */
+
+
+/* Adds a target host and the source address used to reach it. */
+int BPFGenerator::addTarget(IPAddress *target, IPAddress *source){
+  struct in6_addr a6;
+
+  if(target==NULL)
+    return OP_FAILURE;
+  if(target->getVersion()==AF_INET){
+    add_value(this->src4, ntohl(target->getIPv4Address().s_addr));
+    if(source!=NULL && source->getVersion()==AF_INET)
+      add_value(this->dst4, ntohl(source->getIPv4Address().s_addr));
+  }else if(target->getVersion()==AF_INET6){
+    a6=target->getIPv6Address();
+    add_value6(this->src6, a6.s6_addr);
+    if(source!=NULL && source->getVersion()==AF_INET6){
+      a6=source->getIPv6Address();
+      add_value6(this->dst6, a6.s6_addr);
+    }
+  }else{
+    return OP_FAILURE;
+  }
+  return OP_SUCCESS;
+} /* End of addTarget() */
+
+
+/* Sets the transport protocol of the probes. Zero means that we only send
+ * ICMP, so nothing but ICMP is accepted. */
+int BPFGenerator::setProtocol(u8 val){
+  if(val!=0 && val!=IPPROTO_TCP && val!=IPPROTO_UDP)
+    return OP_FAILURE;
+  this->proto=val;
+  return OP_SUCCESS;
+} /* End of setProtocol() */
+
+
+/* Adds the ports we send probes to. Responses must come from one of them. */
+int BPFGenerator::addTargetPorts(const u16 *ports, u16 count){
+  for(u16 i=0; ports!=NULL && i<count; i++)
+    add_value(this->tports, ports[i]);
+  return OP_SUCCESS;
+} /* End of addTargetPorts() */
+
+
+/* Adds the ports we send probes from. Responses must be sent to one of them.
+ * Don't call this if source ports are chosen at random. */
+int BPFGenerator::addSourcePorts(const u16 *ports, u16 count){
+  for(u16 i=0; ports!=NULL && i<count; i++)
+    add_value(this->sports, ports[i]);
+  return OP_SUCCESS;
+} /* End of addSourcePorts() */
+
+
+/******************************************************************************
+ * Code generation. Conditional jumps in BPF can only skip 255 instructions,  *
+ * so they are only used to skip a single unconditional jump, which can go as *
+ * far as needed. Unconditional jumps point to labels, which are resolved     *
+ * once the whole program has been generated. All jumps go forward.          *
+ ******************************************************************************/
+
+int BPFGenerator::new_label(){
+  this->labels.push_back(-1);
+  return this->labels.size()-1;
+} /* End of new_label() */
+
+
+/* Makes the label point to the next instruction */
+void BPFGenerator::place(int label){
+  this->labels[label]=this->prog.size();
+} /* End of place() */
+
+
+void BPFGenerator::emit(u16 code, u32 k, u8 jt, u8 jf){
+  struct bpf_insn insn;
+  insn.code=code;
+  insn.jt=jt;
+  insn.jf=jf;
+  insn.k=k;
+  this->prog.push_back(insn);
+} /* End of emit() */
+
+
+void BPFGenerator::jump(int label){
+  this->fixups.push_back(make_pair(this->prog.size(), label));
+  this->emit(BPF_JMP|BPF_JA, 0, 0, 0);
+} /* End of jump() */
+
+
+/* Jumps to the label if the accumulator compares true to k */
+void BPFGenerator::jump_if(u16 code, u32 k, int label){
+  this->emit(BPF_JMP|code|BPF_K, k, 0, 1);
+  this->jump(label);
+} /* End of jump_if() */
+
+
+/* Jumps to the label if the accumulator compares false to k */
+void BPFGenerator::jump_unless(u16 code, u32 k, int label){
+  this->emit(BPF_JMP|code|BPF_K, k, 1, 0);
+  this->jump(label);
+} /* End of jump_unless() */
+
+
+/* Binary search of the accumulator in set[first, last). Jumps to "match" if
+ * it is found and to "nomatch" otherwise. */
+void BPFGenerator::range_tree(const vector<struct bpf_range> &set, size_t first, size_t last, int match, int nomatch){
+  size_t mid=0;
+  int left=0;
+
+  if(first>=last){
+    this->jump(nomatch);
+    return;
+  }
+  mid=first+(last-first)/2;
+  left=(mid>first) ? this->new_label() : nomatch;
+  if(set[mid].lo>0)
+    this->jump_unless(BPF_JGE, set[mid].lo, left);
+  this->jump_unless(BPF_JGT, set[mid].hi, match);
+  this->range_tree(set, mid+1, last, match, nomatch);
+  if(mid>first){
+    this->place(left);
+    this->range_tree(set, first, mid, match, nomatch);
+  }
+} /* End of range_tree() */
+
+
+/* Checks the ports of a TCP or UDP header. "mode" is BPF_ABS if "off" is the
+ * offset of the header, or BPF_IND if X has to be added to it. */
+void BPFGenerator::filter_ports(u16 mode, u32 off, int accept, int reject){
+  int ok=0;
+  if(!this->tports.empty()){
+    ok=this->new_label();
+    this->emit(BPF_LD|BPF_H|mode, off, 0, 0);
+    this->range_tree(this->tports, 0, this->tports.size(), ok, reject);
+    this->place(ok);
+  }
+  if(!this->sports.empty()){
+    ok=this->new_label();
+    this->emit(BPF_LD|BPF_H|mode, off+2, 0, 0);
+    this->range_tree(this->sports, 0, this->sports.size(), ok, reject);
+    this->place(ok);
+  }
+  this->jump(accept);
+} /* End of filter_ports() */
+
+
+void BPFGenerator::filter_ipv4(int l3off, int accept, int reject){
+  int ok=0;
+
+  /* Destination address must be one of ours */
+  if(!this->dst4.empty()){
+    ok=this->new_label();
+    this->emit(BPF_LD|BPF_W|BPF_ABS, l3off+16, 0, 0);
+    this->range_tree(this->dst4, 0, this->dst4.size(), ok, reject);
+    this->place(ok);
+  }
+  /* ICMP is always welcome, whoever sends it: errors often come from the
+   * routers in the path. Otherwise, we need the protocol of our probes */
+  this->emit(BPF_LD|BPF_B|BPF_ABS, l3off+9, 0, 0);
+  this->jump_if(BPF_JEQ, IPPROTO_ICMP, accept);
+  if(this->proto==0){
+    this->jump(reject);
+    return;
+  }
+  this->jump_unless(BPF_JEQ, this->proto, reject);
+
+  /* Source address must be one of the targets */
+  ok=this->new_label();
+  this->emit(BPF_LD|BPF_W|BPF_ABS, l3off+12, 0, 0);
+  this->range_tree(this->src4, 0, this->src4.size(), ok, reject);
+  this->place(ok);
+
+  /* Ports are only present in the first fragment */
+  this->emit(BPF_LD|BPF_H|BPF_ABS, l3off+6, 0, 0);
+  this->jump_if(BPF_JSET, 0x1FFF, accept);
+  this->emit(BPF_LDX|BPF_B|BPF_MSH, l3off, 0, 0);
+  this->filter_ports(BPF_IND, l3off, accept, reject);
+} /* End of filter_ipv4() */
+
+
+/* Checks the IPv6 address at offset "off" against a set of addresses. */
+void BPFGenerator::filter_addr6(const vector<struct bpf_group6> &set, u32 off, int reject){
+  int ok=0, next=0;
+
+  if(set.empty() || set.size()>BPF_MAX_IPV6_GROUPS)
+    return;
+  ok=this->new_label();
+  for(size_t i=0; i<set.size(); i++){
+    next=this->new_label();
+    for(u32 w=0; w<3; w++){
+      this->emit(BPF_LD|BPF_W|BPF_ABS, off+4*w, 0, 0);
+      this->jump_unless(BPF_JEQ, set[i].prefix[w], next);
+    }
+    this->emit(BPF_LD|BPF_W|BPF_ABS, off+12, 0, 0);
+    this->range_tree(set[i].ranges, 0, set[i].ranges.size(), ok, reject);
+    this->place(next);
+  }
+  this->jump(reject);
+  this->place(ok);
+} /* End of filter_addr6() */
+
+
+void BPFGenerator::filter_ipv6(int l3off, int accept, int reject){
+  this->filter_addr6(this->dst6, l3off+24, reject);
+
+  /* ICMPv6 is always welcome, whoever sends it. If there are extension
+   * headers, we can't tell where the transport header is, so let those
+   * through too. */
+  this->emit(BPF_LD|BPF_B|BPF_ABS, l3off+6, 0, 0);
+  this->jump_if(BPF_JEQ, IPPROTO_ICMPV6, accept);
+  this->jump_if(BPF_JEQ, IPPROTO_HOPOPTS, accept);
+  this->jump_if(BPF_JEQ, IPPROTO_ROUTING, accept);
+  this->jump_if(BPF_JEQ, IPPROTO_FRAGMENT, accept);
+  this->jump_if(BPF_JEQ, IPPROTO_DSTOPTS, accept);
+  if(this->proto==0){
+    this->jump(reject);
+    return;
+  }
+  this->jump_unless(BPF_JEQ, this->proto, reject);
+  this->filter_addr6(this->src6, l3off+8, reject);
+  this->filter_ports(BPF_ABS, l3off+40, accept, reject);
+} /* End of filter_ipv6() */
+
+
+/* Generates the filter for a capture device of the supplied datalink type.
+ * On success, "fp" points to the program, which stays valid until the next
+ * call to compile() or reset(). Returns OP_FAILURE if the datalink type is
+ * not supported or the program doesn't fit in BPF_MAX_INSNS instructions, in
+ * which case the caller should stick to a regular pcap filter expression. */
+int BPFGenerator::compile(int datalink, struct bpf_program *fp){
+  int l3off=0, accept=0, reject=0, ip6=0;
+  size_t groups=0;
+
+  if(fp==NULL || (this->src4.empty() && this->src6.empty()))
+    return OP_FAILURE;
+  if(datalink==DLT_EN10MB)
+    l3off=14;
+  else if(datalink==DLT_LINUX_SLL)
+    l3off=16;
+  else
+    return OP_FAILURE;
+
+  this->prog.clear();
+  this->labels.clear();
+  this->fixups.clear();
+
+  /* Get the sets ready */
+  compress(this->src4, BPF_MAX_ADDR_RANGES);
+  compress(this->dst4, BPF_MAX_ADDR_RANGES);
+  compress(this->tports, BPF_MAX_PORT_RANGES);
+  compress(this->sports, BPF_MAX_PORT_RANGES);
+  groups=MAX(this->src6.size(), 1);
+  for(size_t i=0; i<this->src6.size(); i++)
+    compress(this->src6[i].ranges, MAX(BPF_MAX_ADDR_RANGES/groups, 1));
+  groups=MAX(this->dst6.size(), 1);
+  for(size_t i=0; i<this->dst6.size(); i++)
+    compress(this->dst6[i].ranges, MAX(BPF_MAX_ADDR_RANGES/groups, 1));
+
+  /* The ethertype comes right before the network header in both Ethernet
+   * and Linux cooked captures. */
+  accept=this->new_label();
+  reject=this->new_label();
+  ip6=this->new_label();
+  this->emit(BPF_LD|BPF_H|BPF_ABS, l3off-2, 0, 0);
+  if(!this->src4.empty()){
+    this->jump_unless(BPF_JEQ, ETHTYPE_IPV4, ip6);
+    this->filter_ipv4(l3off, accept, reject);
+  }
+  this->place(ip6);
+  if(!this->src6.empty()){
+    this->jump_unless(BPF_JEQ, ETHTYPE_IPV6, reject);
+    this->filter_ipv6(l3off, accept, reject);
+  }else{
+    this->jump(reject);
+  }
+  this->place(reject);
+  this->emit(BPF_RET|BPF_K, 0, 0, 0);
+  this->place(accept);
+  this->emit(BPF_RET|BPF_K, BPF_ACCEPT_LEN, 0, 0);
+
+  /* Resolve the jumps */
+  for(size_t i=0; i<this->fixups.size(); i++){
+    assert(this->labels[this->fixups[i].second] > (int)this->fixups[i].first);
+    this->prog[this->fixups[i].first].k=this->labels[this->fixups[i].second]-this->fixups[i].first-1;
+  }
+  if(this->prog.size()>BPF_MAX_INSNS){
+    nping_print(DBG_2, "BPF program too long (%lu instructions)", (unsigned long)this->prog.size());
+    return OP_FAILURE;
+  }
+  fp->bf_len=this->prog.size();
+  fp->bf_insns=&this->prog[0];
+  return OP_SUCCESS;
+} /* End of compile() */
@@ -0,0 +1,202 @@
+/***************************************************************************
+ * BPFGenerator.h -- The BPFGenerator class builds the BPF programs that   *
+ * the kernel uses to drop captured packets that can't be responses to our *
+ * probes.                                                                 *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2014 Insecure.Com LLC. Nmap is    *
+ * also a registered trademark of Insecure.Com LLC.  This program is free  *
+ * software; you may redistribute and/or modify it under the terms of the  *
+ * GNU General Public License as published by the Free Software            *
+ * Foundation; Version 2 ("GPL"), BUT ONLY WITH ALL OF THE CLARIFICATIONS  *
+ * AND EXCEPTIONS DESCRIBED HEREIN.  This guarantees your right to use,    *
+ * modify, and redistribute this software under certain conditions.  If    *
+ * you wish to embed Nmap technology into proprietary software, we sell    *
+ * alternative licenses (contact sales@nmap.com).  Dozens of software      *
+ * vendors already license Nmap technology such as host discovery, port    *
+ * scanning, OS detection, version detection, and the Nmap Scripting       *
+ * Engine.                                                                 *
+ *                                                                         *
+ * Note that the GPL places important restrictions on "derivative works",  *
+ * yet it does not provide a detailed definition of that term.  To avoid   *
+ * misunderstandings, we interpret that term as broadly as copyright law   *
+ * allows.  For example, we consider an application to constitute a        *
+ * derivative work for the purpose of this license if it does any of the   *
+ * following with any software or content covered by this license          *
+ * ("Covered Software"):                                                   *
+ *                                                                         *
+ * o Integrates source code from Covered Software.                         *
+ *                                                                         *
+ * o Reads or includes copyrighted data files, such as Nmap's nmap-os-db   *
+ * or nmap-service-probes.                                                 *
+ *                                                                         *
+ * o Is designed specifically to execute Covered Software and parse the    *
+ * results (as opposed to typical shell or execution-menu apps, which will *
+ * execute anything you tell them to).                                     *
+ *                                                                         *
+ * o Includes Covered Software in a proprietary executable installer.  The *
+ * installers produced by InstallShield are an example of this.  Including *
+ * Nmap with other software in compressed or archival form does not        *
+ * trigger this provision, provided appropriate open source decompression  *
+ * or de-archiving software is widely available for no charge.  For the    *
+ * purposes of this license, an installer is considered to include Covered *
+ * Software even if it actually retrieves a copy of Covered Software from  *
+ * another source during runtime (such as by downloading it from the       *
+ * Internet).                                                              *
+ *                                                                         *
+ * o Links (statically or dynamically) to a library which does any of the  *
+ * above.                                                                  *
+ *                                                                         *
+ * o Executes a helper program, module, or script to do any of the above.  *
+ *                                                                         *
+ * This list is not exclusive, but is meant to clarify our interpretation  *
+ * of derived works with some common examples.  Other people may interpret *
+ * the plain GPL differently, so we consider this a special exception to   *
+ * the GPL that we apply to Covered Software.  Works which meet any of     *
+ * these conditions must conform to all of the terms of this license,      *
+ * particularly including the GPL Section 3 requirements of providing      *
+ * source code and allowing free redistribution of the work as a whole.    *
+ *                                                                         *
+ * As another special exception to the GPL terms, Insecure.Com LLC grants  *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two.                                  *
+ *                                                                         *
+ * Any redistribution of Covered Software, including any derived works,    *
+ * must obey and carry forward all of the terms of this license, including *
+ * obeying all GPL rules and restrictions.  For example, source code of    *
+ * the whole work must be provided and free redistribution must be         *
+ * allowed.  All GPL references to "this License", are to be treated as    *
+ * including the terms and conditions of this license text as well.        *
+ *                                                                         *
+ * Because this license imposes special exceptions to the GPL, Covered     *
+ * Work may not be combined (even as part of a larger work) with plain GPL *
+ * software.  The terms, conditions, and exceptions of this license must   *
+ * be included as well.  This license is incompatible with some other open *
+ * source licenses as well.  In some cases we can relicense portions of    *
+ * Nmap or grant special permissions to use it in other open source        *
+ * software.  Please contact fyodor@nmap.org with any such requests.       *
+ * Similarly, we don't incorporate incompatible open source software into  *
+ * Covered Software without special permission from the copyright holders. *
+ *                                                                         *
+ * If you have any questions about the licensing restrictions on using     *
+ * Nmap in other works, are happy to help.  As mentioned above, we also    *
+ * offer alternative license to integrate Nmap into proprietary            *
+ * applications and appliances.  These contracts have been sold to dozens  *
+ * of software vendors, and generally include a perpetual license as well  *
+ * as providing for priority support and updates.  They also fund the      *
+ * continued development of Nmap.  Please email sales@nmap.com for further *
+ * information.                                                            *
+ *                                                                         *
+ * If you have received a written license agreement or contract for        *
+ * Covered Software stating terms other than these, you may choose to use  *
+ * and redistribute Covered Software under those terms instead of these.   *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the Nmap      *
+ * license file for more details (it's in a COPYING file included with     *
+ * Nmap, and also available from https://svn.nmap.org/nmap/COPYING)        *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef __BPFGENERATOR_H__
+#define __BPFGENERATOR_H__ 1
+
+#include "nping.h"
+#include <vector>
+using namespace std;
+
+/* Classic BPF programs can't be longer than this (BPF_MAXINSNS on Linux) */
+#define BPF_MAX_INSNS 4096
+
+/* Maximum number of ranges in each set of addresses or ports. Bigger sets
+ * are merged into fewer, wider ranges, so the filter may let some extra
+ * packets through but never drops a response. */
+#define BPF_MAX_ADDR_RANGES 512
+#define BPF_MAX_PORT_RANGES 64
+
+/* Maximum number of different /96 prefixes for IPv6 addresses. If there are
+ * more, IPv6 source addresses are not filtered at all. */
+#define BPF_MAX_IPV6_GROUPS 16
+
+/* Number of bytes we ask the kernel to capture from accepted packets */
+#define BPF_ACCEPT_LEN 262144
+
+/* A range of 32-bit values (IPv4 addresses, ports or the last word of IPv6
+ * addresses), in host byte order. */
+struct bpf_range{
+  u32 lo;
+  u32 hi;
+};
+
+/* IPv6 addresses that share the first 96 bits */
+struct bpf_group6{
+  u32 prefix[3];
+  vector<struct bpf_range> ranges;
+};
+
+class BPFGenerator{
+
+  private:
+    vector<struct bpf_insn> prog;         /* Code generated so far          */
+    vector<int> labels;                   /* Position of each label         */
+    vector< pair<size_t,int> > fixups;    /* Jumps to labels (insn, label)  */
+
+    vector<struct bpf_range> src4;        /* IPv4 targets                   */
+    vector<struct bpf_range> dst4;        /* Our IPv4 addresses             */
+    vector<struct bpf_group6> src6;       /* IPv6 targets                   */
+    vector<struct bpf_group6> dst6;       /* Our IPv6 addresses             */
+    vector<struct bpf_range> tports;      /* Target ports                   */
+    vector<struct bpf_range> sports;      /* Source ports                   */
+    u8 proto;                             /* TCP, UDP or 0 for ICMP only    */
+
+    static void add_value(vector<struct bpf_range> &set, u32 val);
+    static void add_value6(vector<struct bpf_group6> &set, const u8 *addr);
+    static void compress(vector<struct bpf_range> &set, size_t max);
+
+    int new_label();
+    void place(int label);
+    void emit(u16 code, u32 k, u8 jt, u8 jf);
+    void jump(int label);
+    void jump_if(u16 code, u32 k, int label);
+    void jump_unless(u16 code, u32 k, int label);
+    void range_tree(const vector<struct bpf_range> &set, size_t first, size_t last, int match, int nomatch);
+    void filter_ipv4(int l3off, int accept, int reject);
+    void filter_ipv6(int l3off, int accept, int reject);
+    void filter_addr6(const vector<struct bpf_group6> &set, u32 off, int reject);
+    void filter_ports(u16 code, u32 off, int accept, int reject);
+
+  public:
+    BPFGenerator();
+    ~BPFGenerator();
+    void reset();
+    int addTarget(IPAddress *target, IPAddress *source);
+    int setProtocol(u8 proto);
+    int addTargetPorts(const u16 *ports, u16 count);
+    int addSourcePorts(const u16 *ports, u16 count);
+    int compile(int datalink, struct bpf_program *fp);
+};
+
+#endif /* __BPFGENERATOR_H__ */
@@ -130,80 +130,239 @@
 #include <openssl/hmac.h>
 #include <openssl/evp.h>
 #include <openssl/err.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#endif
 #endif
 
 extern NpingOps o;
 
+#ifdef HAVE_OPENSSL
+/* HMAC-SHA256 contexts. OpenSSL 3 provides them through EVP_MAC and
+ * deprecates HMAC_CTX, which became opaque in OpenSSL 1.1.0. mac_init()
+ * starts a new code. A NULL key reuses the one of the previous call. */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static EVP_MAC_CTX *mac_ctx_new(){
+  EVP_MAC_CTX *ctx=NULL;
+  EVP_MAC *mac=EVP_MAC_fetch(NULL, OSSL_MAC_NAME_HMAC, NULL);
+  if(mac==NULL)
+    return NULL;
+  /* The context holds its own reference to the algorithm */
+  ctx=EVP_MAC_CTX_new(mac);
+  EVP_MAC_free(mac);
+  return ctx;
+} /* End of mac_ctx_new() */
+
+static void mac_ctx_free(EVP_MAC_CTX *ctx){
+  EVP_MAC_CTX_free(ctx);
+} /* End of mac_ctx_free() */
+
+static int mac_init(EVP_MAC_CTX *ctx, const u8 *key, size_t key_len){
+  OSSL_PARAM params[2];
+  if(key==NULL)
+    return EVP_MAC_init(ctx, NULL, 0, NULL);
+  params[0]=OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *)"SHA256", 0);
+  params[1]=OSSL_PARAM_construct_end();
+  return EVP_MAC_init(ctx, key, key_len, params);
+} /* End of mac_init() */
+
+static int mac_update(EVP_MAC_CTX *ctx, const u8 *buff, size_t len){
+  return EVP_MAC_update(ctx, buff, len);
+} /* End of mac_update() */
+
+static int mac_final(EVP_MAC_CTX *ctx, u8 *dst_buff, size_t dst_len){
+  size_t result_len=0;
+  return EVP_MAC_final(ctx, dst_buff, &result_len, dst_len);
+} /* End of mac_final() */
+#else
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static HMAC_CTX *mac_ctx_new(){
+  HMAC_CTX *ctx=(HMAC_CTX *)safe_malloc(sizeof(HMAC_CTX));
+  HMAC_CTX_init(ctx);
+  return ctx;
+} /* End of mac_ctx_new() */
+
+static void mac_ctx_free(HMAC_CTX *ctx){
+  HMAC_CTX_cleanup(ctx);
+  free(ctx);
+} /* End of mac_ctx_free() */
+#else
+#define mac_ctx_new HMAC_CTX_new
+#define mac_ctx_free HMAC_CTX_free
+#endif
+
+static int mac_init(HMAC_CTX *ctx, const u8 *key, size_t key_len){
+  if(key==NULL)
+    return HMAC_Init_ex(ctx, NULL, 0, NULL, NULL);
+  return HMAC_Init_ex(ctx, key, (int)key_len, EVP_sha256(), NULL);
+} /* End of mac_init() */
+
+static int mac_update(HMAC_CTX *ctx, const u8 *buff, size_t len){
+  return HMAC_Update(ctx, buff, len);
+} /* End of mac_update() */
+
+static int mac_final(HMAC_CTX *ctx, u8 *dst_buff, size_t dst_len){
+  unsigned int result_len=0;
+  return HMAC_Final(ctx, dst_buff, &result_len);
+} /* End of mac_final() */
+#endif
+#endif
+
+
 Crypto::Crypto(){
+  this->enc_ctx=NULL;
+  this->dec_ctx=NULL;
+  this->mac_ctx=NULL;
   this->reset();
 } /* End of Crypto constructor */
 
 
-Crypto::~Crypto(){
+/** OpenSSL contexts can't be shared, so copies start with their own. */
+Crypto::Crypto(const Crypto &other){
+  this->enc_ctx=NULL;
+  this->dec_ctx=NULL;
+  this->mac_ctx=NULL;
+  this->reset();
+} /* End of Crypto copy constructor */
+
 
+Crypto::~Crypto(){
+  this->free_contexts();
 } /* End of Crypto destructor */
 
 
+Crypto &Crypto::operator=(const Crypto &other){
+  if(this!=&other)
+    this->reset();
+  return *this;
+} /* End of operator=() */
+
+
 /** Sets every attribute to its default value. */
 void Crypto::reset() {
-
+  this->free_contexts();
+  memset(this->enc_key, 0, AES_KEY_SIZE);
+  memset(this->dec_key, 0, AES_KEY_SIZE);
+  memset(this->mac_key, 0, HMAC_SHA256_CODE_LEN);
+  this->mac_key_len=0;
+  this->enc_keyed=false;
+  this->dec_keyed=false;
+  this->mac_keyed=false;
 } /* End of reset() */
 
 
-int Crypto::hmac_sha256(u8 *inbuff, size_t inlen, u8 *dst_buff, u8 *key, size_t key_len){
+void Crypto::free_contexts(){
+  #ifdef HAVE_OPENSSL
+    if(this->enc_ctx!=NULL)
+      EVP_CIPHER_CTX_free(this->enc_ctx);
+    if(this->dec_ctx!=NULL)
+      EVP_CIPHER_CTX_free(this->dec_ctx);
+    if(this->mac_ctx!=NULL)
+      mac_ctx_free(this->mac_ctx);
+  #endif
+  this->enc_ctx=NULL;
+  this->dec_ctx=NULL;
+  this->mac_ctx=NULL;
+} /* End of free_contexts() */
 
+
+/** Computes the HMAC-SHA256 code of the supplied buffer. The HMAC context is
+  * only rekeyed when the key differs from the one used in the previous call. */
+int Crypto::hmac(u8 *inbuff, size_t inlen, u8 *dst_buff, u8 *key, size_t key_len){
   #ifdef HAVE_OPENSSL
     if( o.doCrypto() ){
         u8 result[EVP_MAX_MD_SIZE];
-        memset(result, 0, EVP_MAX_MD_SIZE);
-        unsigned int result_len;
-        HMAC(EVP_sha256(), key, (int)key_len, inbuff, (int)inlen, result, &result_len);
-        memcpy(dst_buff, result, 256/8);
+        if(key_len>HMAC_SHA256_CODE_LEN)
+            return Crypto::hmac_sha256(inbuff, inlen, dst_buff, key, key_len);
+        if(this->mac_ctx==NULL && (this->mac_ctx=mac_ctx_new())==NULL)
+            return Crypto::hmac_sha256(inbuff, inlen, dst_buff, key, key_len);
+        /* With the same key, just start over from the precomputed pads */
+        if(!this->mac_keyed || key_len!=this->mac_key_len || memcmp(key, this->mac_key, key_len)!=0){
+            this->mac_keyed=false;
+            if( mac_init(this->mac_ctx, key, key_len)==0 )
+                return OP_FAILURE;
+            memcpy(this->mac_key, key, key_len);
+            this->mac_key_len=key_len;
+            this->mac_keyed=true;
+        }else if( mac_init(this->mac_ctx, NULL, 0)==0 ){
+            return OP_FAILURE;
+        }
+        if( mac_update(this->mac_ctx, inbuff, inlen)==0 || mac_final(this->mac_ctx, result, sizeof(result))==0 ){
+            this->mac_keyed=false;
+            return OP_FAILURE;
+        }
+        memcpy(dst_buff, result, HMAC_SHA256_CODE_LEN);
         return OP_SUCCESS;
     }
   #endif
   /* Set a bogus sum: all zero */
   memset(dst_buff, 0, HMAC_SHA256_CODE_LEN);
   return OP_SUCCESS;
-} /* End of hmac_sha256() */
+} /* End of hmac() */
 
 
-int Crypto::aes128_cbc_encrypt(u8 *inbuff, size_t inlen, u8 *dst_buff, u8 *key, size_t key_len, u8 *iv){
-  nping_print(DBG_4, "%s(%p, %lu, %p, %p, %lu, %p)", __func__, inbuff, (unsigned long)inlen, dst_buff, key, (unsigned long)key_len, iv);
-  if(inbuff==NULL || dst_buff==NULL || key==NULL || iv==NULL)
+/** Encrypts a buffer with AES-128 in CBC mode. */
+int Crypto::encrypt(u8 *inbuff, size_t inlen, u8 *dst_buff, u8 *key, size_t key_len, u8 *iv){
+  return this->encrypt_batch(&inbuff, &inlen, &dst_buff, 1, key, key_len, iv);
+} /* End of encrypt() */
+
+
+/** Encrypts several buffers with AES-128 in CBC mode, as if they were one.
+  * The first buffer is encrypted with the supplied IV and each of the others
+  * with the last ciphertext block of the previous one, which is how
+  * consecutive NEP messages are chained. Buffers may be encrypted in place. */
+int Crypto::encrypt_batch(u8 **inbuffs, size_t *inlens, u8 **dst_buffs, int count, u8 *key, size_t key_len, u8 *iv){
+  nping_print(DBG_4, "%s(%p, %p, %p, %d, %p, %lu, %p)", __func__, inbuffs, inlens, dst_buffs, count, key, (unsigned long)key_len, iv);
+  if(inbuffs==NULL || inlens==NULL || dst_buffs==NULL || count<=0 || key==NULL || iv==NULL)
       return OP_FAILURE;
-  if( ((inlen%AES_BLOCK_SIZE)!=0) || key_len<AES_KEY_SIZE)
+  if(key_len<AES_KEY_SIZE)
     return OP_FAILURE;
+  for(int i=0; i<count; i++){
+    if(inbuffs[i]==NULL || dst_buffs[i]==NULL || (inlens[i]%AES_BLOCK_SIZE)!=0)
+      return OP_FAILURE;
+  }
 
   #ifdef HAVE_OPENSSL
     if( o.doCrypto() ){
-        int flen=0, flen2=0;
-        EVP_CIPHER_CTX ctx;
-        EVP_CIPHER_CTX_init(&ctx);
-        EVP_CIPHER_CTX_set_padding(&ctx, 0);
-        int result=OP_SUCCESS;
-        if( EVP_EncryptInit(&ctx, EVP_aes_128_cbc(), key, iv)==0 ){
-            nping_print(DBG_4, "EVP_EncryptInit() failed");
-            result=OP_FAILURE;
-        }else if( EVP_EncryptUpdate(&ctx, dst_buff, &flen, inbuff, (int)inlen)==0 ){
-            nping_print(DBG_4, "EVP_EncryptUpdate() failed");
-            result=OP_FAILURE;
-        }else if( EVP_EncryptFinal(&ctx, dst_buff+flen, &flen2)==0 ){
-            nping_print(DBG_4, "EVP_EncryptFinal() failed");
-            result=OP_FAILURE;
+        int flen=0;
+        if(this->enc_ctx==NULL && (this->enc_ctx=EVP_CIPHER_CTX_new())==NULL)
+            return OP_FAILURE;
+        /* Only compute the key schedule when the key changes */
+        if(!this->enc_keyed || memcmp(key, this->enc_key, AES_KEY_SIZE)!=0){
+            this->enc_keyed=false;
+            if( EVP_EncryptInit_ex(this->enc_ctx, EVP_aes_128_cbc(), NULL, key, iv)==0 ){
+                nping_print(DBG_4, "EVP_EncryptInit_ex() failed");
+                return OP_FAILURE;
+            }
+            memcpy(this->enc_key, key, AES_KEY_SIZE);
+            this->enc_keyed=true;
+        }else if( EVP_EncryptInit_ex(this->enc_ctx, NULL, NULL, NULL, iv)==0 ){
+            nping_print(DBG_4, "EVP_EncryptInit_ex() failed");
+            return OP_FAILURE;
+        }
+        EVP_CIPHER_CTX_set_padding(this->enc_ctx, 0);
+        /* Without padding, whole blocks are encrypted straight away, so
+         * there is nothing left for EVP_EncryptFinal_ex() to flush. */
+        for(int i=0; i<count; i++){
+            if( EVP_EncryptUpdate(this->enc_ctx, dst_buffs[i], &flen, inbuffs[i], (int)inlens[i])==0 ){
+                nping_print(DBG_4, "EVP_EncryptUpdate() failed");
+                this->enc_keyed=false;
+                return OP_FAILURE;
+            }
         }
-        EVP_CIPHER_CTX_cleanup(&ctx);
-        return result;
+        return OP_SUCCESS;
     }
   #endif
   /* Do not encrypt, just set the plaintext */
-  for(size_t i=0; i<inlen; i++)
-    dst_buff[i]=inbuff[i];
-    return OP_SUCCESS;
-} /* End of aes128_cbc_encrypt() */
+  for(int i=0; i<count; i++)
+    memmove(dst_buffs[i], inbuffs[i], inlens[i]);
+  return OP_SUCCESS;
+} /* End of encrypt_batch() */
 
 
-int Crypto::aes128_cbc_decrypt(u8 *inbuff, size_t inlen, u8 *dst_buff, u8 *key, size_t key_len, u8 *iv){
+/** Decrypts a buffer encrypted with AES-128 in CBC mode. */
+int Crypto::decrypt(u8 *inbuff, size_t inlen, u8 *dst_buff, u8 *key, size_t key_len, u8 *iv){
   nping_print(DBG_4, "%s(%p, %lu, %p, %p, %lu, %p)", __func__, inbuff, (unsigned long)inlen, dst_buff, key, (unsigned long)key_len, iv);
   if(inbuff==NULL || dst_buff==NULL || key==NULL || iv==NULL)
       return OP_FAILURE;
@@ -212,54 +371,71 @@ int Crypto::aes128_cbc_decrypt(u8 *inbuff, size_t inlen, u8 *dst_buff, u8 *key,
 
   #ifdef HAVE_OPENSSL
     if( o.doCrypto() ){
-        int flen1=0, flen2=0;
-        EVP_CIPHER_CTX ctx;
-        EVP_CIPHER_CTX_init(&ctx);
-        EVP_CIPHER_CTX_set_padding(&ctx, 0);
-        int result=OP_SUCCESS;
-        if( EVP_DecryptInit(&ctx, EVP_aes_128_cbc(), key, iv)==0 ){
-            nping_print(DBG_4, "EVP_DecryptInit() failed");
-            result=OP_FAILURE;
-        }else if( EVP_DecryptUpdate(&ctx, dst_buff, &flen1, inbuff, (int)inlen)==0 ){
+        int flen=0;
+        if(this->dec_ctx==NULL && (this->dec_ctx=EVP_CIPHER_CTX_new())==NULL)
+            return OP_FAILURE;
+        if(!this->dec_keyed || memcmp(key, this->dec_key, AES_KEY_SIZE)!=0){
+            this->dec_keyed=false;
+            if( EVP_DecryptInit_ex(this->dec_ctx, EVP_aes_128_cbc(), NULL, key, iv)==0 ){
+                nping_print(DBG_4, "EVP_DecryptInit_ex() failed");
+                return OP_FAILURE;
+            }
+            memcpy(this->dec_key, key, AES_KEY_SIZE);
+            this->dec_keyed=true;
+        }else if( EVP_DecryptInit_ex(this->dec_ctx, NULL, NULL, NULL, iv)==0 ){
+            nping_print(DBG_4, "EVP_DecryptInit_ex() failed");
+            return OP_FAILURE;
+        }
+        /* With padding disabled, EVP_DecryptUpdate() doesn't hold the last
+         * block back, so the whole buffer is decrypted here. */
+        EVP_CIPHER_CTX_set_padding(this->dec_ctx, 0);
+        if( EVP_DecryptUpdate(this->dec_ctx, dst_buff, &flen, inbuff, (int)inlen)==0 ){
             nping_print(DBG_4, "EVP_DecryptUpdate() failed");
-            result=OP_FAILURE;
-        }else  if( EVP_DecryptFinal(&ctx, dst_buff+flen1, &flen2)==0 ){
-            nping_print(DBG_4, "OpenSSL bug: it says EVP_DecryptFinal() failed when it didn't (%s).",
-                    ERR_error_string(ERR_peek_last_error(), NULL));
-            /* We do not return OP_FAILURE in this case because the
-             * EVP_DecryptFinal() function seems to be buggy and fails when it shouldn't.
-             * We are passing a buffer whose length is multiple of the AES block
-             * size, we've disable padding, and still, the call fails.
-             * The call to EVP_DecryptUpdate() says we've decrypted all blocks but
-             * the last one and then EVP_DecryptFinal says we have decrypted nothing.
-             * However I've tested this for hours and everything works fine. The
-             * full buffer is decrypted correctly, from the first to the last byte,
-             * so we return OP_SUCCESS even if OpenSSL says the opposite. */
-
-            /* NOTE for developers debugging memory issues with Valgrind:
-             * None of these seems to free OpenSSL's internal error structures.
-             * Valgrind currently reports things like:
-             ==12849== 592 bytes in 1 blocks are still reachable in loss record 7 of 9
-            ==12849==    at 0x4C284A8: malloc (vg_replace_malloc.c:236)
-            ==12849==    by 0x531BF21: CRYPTO_malloc (in /lib/libcrypto.so.0.9.8)
-            ==12849==    by 0x537F25D: ERR_get_state (in /lib/libcrypto.so.0.9.8)
-            ==12849==    by 0x537E7BE: ERR_put_error (in /lib/libcrypto.so.0.9.8)
-            ==12849==    by 0x5381EB0: EVP_DecryptFinal_ex (in /lib/libcrypto.so.0.9.8)
-            ==12849==    by 0x429A49: Crypto::aes128_cbc_decrypt(unsigned char*...
-            ==12849==    by 0x41ABBA: EchoHeader::decrypt(unsigned char*, unsign...
-             */
-            //ERR_clear_error();
-            //ERR_free_strings();
-            //ERR_pop_to_mark();
+            this->dec_keyed=false;
+            return OP_FAILURE;
         }
-        EVP_CIPHER_CTX_cleanup(&ctx);
-        return result;
+        return OP_SUCCESS;
     }
   #endif
   /* Do not decrypt, just leave the ciphertext */
-  for(size_t i=0; i<inlen; i++)
-    dst_buff[i]=inbuff[i];
+  memmove(dst_buff, inbuff, inlen);
+  return OP_SUCCESS;
+} /* End of decrypt() */
+
+
+/** Computes an HMAC-SHA256 code from scratch. Use hmac() on a Crypto object
+  * to avoid setting up the HMAC context for each message. */
+int Crypto::hmac_sha256(u8 *inbuff, size_t inlen, u8 *dst_buff, u8 *key, size_t key_len){
+
+  #ifdef HAVE_OPENSSL
+    if( o.doCrypto() ){
+        u8 result[EVP_MAX_MD_SIZE];
+        memset(result, 0, EVP_MAX_MD_SIZE);
+        unsigned int result_len;
+        HMAC(EVP_sha256(), key, (int)key_len, inbuff, (int)inlen, result, &result_len);
+        memcpy(dst_buff, result, 256/8);
+        return OP_SUCCESS;
+    }
+  #endif
+  /* Set a bogus sum: all zero */
+  memset(dst_buff, 0, HMAC_SHA256_CODE_LEN);
   return OP_SUCCESS;
+} /* End of hmac_sha256() */
+
+
+/** Stateless version of encrypt(). It sets up a new cipher context on each
+  * call. */
+int Crypto::aes128_cbc_encrypt(u8 *inbuff, size_t inlen, u8 *dst_buff, u8 *key, size_t key_len, u8 *iv){
+  Crypto c;
+  return c.encrypt(inbuff, inlen, dst_buff, key, key_len, iv);
+} /* End of aes128_cbc_encrypt() */
+
+
+/** Stateless version of decrypt(). It sets up a new cipher context on each
+  * call. */
+int Crypto::aes128_cbc_decrypt(u8 *inbuff, size_t inlen, u8 *dst_buff, u8 *key, size_t key_len, u8 *iv){
+  Crypto c;
+  return c.decrypt(inbuff, inlen, dst_buff, key, key_len, iv);
 } /* End of aes128_cbc_decrypt() */
 
 
@@ -289,28 +465,28 @@ u8 *Crypto::deriveKey(const u8 *from, size_t fromlen, size_t *final_len){
         static u8 hash[MAX(SHA256_HASH_LEN, EVP_MAX_MD_SIZE)];
         static u8 next[MAX(SHA256_HASH_LEN, EVP_MAX_MD_SIZE)];
         unsigned int lastlen;
-        EVP_MD_CTX ctx;
-        EVP_MD_CTX_init(&ctx);
+        EVP_MD_CTX *ctx=EVP_MD_CTX_create();
+        const EVP_MD *md=EVP_sha256();
 
-        if( EVP_MD_size(EVP_sha256()) != SHA256_HASH_LEN )
-          nping_fatal(QT_2, "OpenSSL is broken. SHA256 len is %d\n", EVP_MD_size(EVP_sha256()) );
+        if( EVP_MD_size(md) != SHA256_HASH_LEN )
+          nping_fatal(QT_2, "OpenSSL is broken. SHA256 len is %d\n", EVP_MD_size(md) );
 
         /* Compute the SHA256 hash of the supplied buffer */
-        EVP_DigestInit(&ctx, EVP_sha256());
-        EVP_DigestUpdate(&ctx, from, fromlen);
-        EVP_DigestFinal(&ctx, hash, &lastlen);
+        EVP_DigestInit_ex(ctx, md, NULL);
+        EVP_DigestUpdate(ctx, from, fromlen);
+        EVP_DigestFinal_ex(ctx, hash, &lastlen);
 
-        /* Now compute the 1000th hash of that hash */
+        /* Now compute the 1000th hash of that hash. The digest context is
+         * reused for every round instead of being set up again. */
         for(int i=0; i<TIMES_KEY_DERIVATION; i++){
-        EVP_MD_CTX_init(&ctx);
-        EVP_DigestInit(&ctx, EVP_sha256());
-        EVP_DigestUpdate(&ctx, hash, SHA256_HASH_LEN);
-        EVP_DigestFinal(&ctx, next, &lastlen);
-        memcpy(hash, next, SHA256_HASH_LEN);
+          EVP_DigestInit_ex(ctx, md, NULL);
+          EVP_DigestUpdate(ctx, hash, SHA256_HASH_LEN);
+          EVP_DigestFinal_ex(ctx, next, &lastlen);
+          memcpy(hash, next, SHA256_HASH_LEN);
         }
         if(final_len!=NULL)
           *final_len=SHA256_HASH_LEN;
-        EVP_MD_CTX_cleanup(&ctx);
+        EVP_MD_CTX_destroy(ctx);
         return hash;
     }
   #endif
@@ -131,14 +131,54 @@
 #define AES_KEY_SIZE 16
 #define SHA256_HASH_LEN 32
 
+#ifdef HAVE_OPENSSL
+#include <openssl/opensslv.h>
+#endif
+
+/* OpenSSL contexts, only used through pointers. OpenSSL 3 deprecates the
+ * HMAC_CTX functions in favour of EVP_MAC. */
+struct evp_cipher_ctx_st;
+#if defined(HAVE_OPENSSL) && OPENSSL_VERSION_NUMBER >= 0x30000000L
+struct evp_mac_ctx_st;
+#define CRYPTO_MAC_CTX struct evp_mac_ctx_st
+#else
+struct hmac_ctx_st;
+#define CRYPTO_MAC_CTX struct hmac_ctx_st
+#endif
+
+/* Besides the stateless static functions, Crypto objects keep OpenSSL cipher
+ * and HMAC contexts that are set up once and reused for every message. The
+ * key schedule is only recomputed when a different key is supplied. Copies
+ * of a Crypto object don't share contexts: they start with fresh ones. */
 class Crypto {
 
+    private:
+        struct evp_cipher_ctx_st *enc_ctx;
+        struct evp_cipher_ctx_st *dec_ctx;
+        CRYPTO_MAC_CTX *mac_ctx;
+        u8 enc_key[AES_KEY_SIZE];
+        u8 dec_key[AES_KEY_SIZE];
+        u8 mac_key[HMAC_SHA256_CODE_LEN];
+        size_t mac_key_len;
+        bool enc_keyed;
+        bool dec_keyed;
+        bool mac_keyed;
+
+        void free_contexts();
+
     public:
 
         Crypto();
+        Crypto(const Crypto &other);
         ~Crypto();
+        Crypto &operator=(const Crypto &other);
         void reset();
 
+        int hmac(u8 *inbuff, size_t inlen, u8 *dst_buff, u8 *key, size_t key_len);
+        int encrypt(u8 *inbuff, size_t inlen, u8 *dst_buff, u8 *key, size_t key_len, u8 *iv);
+        int encrypt_batch(u8 **inbuffs, size_t *inlens, u8 **dst_buffs, int count, u8 *key, size_t key_len, u8 *iv);
+        int decrypt(u8 *inbuff, size_t inlen, u8 *dst_buff, u8 *key, size_t key_len, u8 *iv);
+
         static int hmac_sha256(u8 *inbuff, size_t inlen, u8 *dst_buff, u8 *key, size_t key_len);
         static int aes128_cbc_encrypt(u8 *inbuff, size_t inlen, u8 *dst_buff, u8 *key, size_t key_len, u8 *iv);
         static int aes128_cbc_decrypt(u8 *inbuff, size_t inlen, u8 *dst_buff, u8 *key, size_t key_len, u8 *iv);
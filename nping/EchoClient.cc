@@ -492,7 +492,7 @@ int EchoClient::parse_hs_server(u8 *pkt, size_t pktlen){
   /* Check the authenticity of the received message */
   this->ctx.setServerNonce(h.getServerNonce());
   this->ctx.generateMacKeyS2CInitial();
-  if( h.verifyMessageAuthenticationCode(this->ctx.getMacKeyS2C(), MAC_KEY_LEN )!=OP_SUCCESS ){
+  if( h.verifyMessageAuthenticationCode(this->ctx.getCryptoS2C(), this->ctx.getMacKeyS2C(), MAC_KEY_LEN )!=OP_SUCCESS ){
       nping_print(DBG_1, "NEP_HANDSHAKE_SERVER authentication failed" );
       return OP_FAILURE;
   }
@@ -558,14 +558,14 @@ int EchoClient::parse_hs_final(u8 *pkt, size_t pktlen){
   }
 
   /* Decrypt the encrypted part of the message before validating the MAC */
-  if((next_iv=h.decrypt(this->ctx.getCipherKeyS2C(), CIPHER_KEY_LEN, this->ctx.getServerNonce(), TYPE_NEP_HANDSHAKE_FINAL))==NULL){
+  if((next_iv=h.decrypt(this->ctx.getCryptoS2C(), this->ctx.getCipherKeyS2C(), CIPHER_KEY_LEN, this->ctx.getServerNonce(), TYPE_NEP_HANDSHAKE_FINAL))==NULL){
       nping_print(DBG_1, "Failed to decrypt NEP_HANDSHAKE_FINAL data." );
       return OP_FAILURE;
   }
   this->ctx.setNextDecryptionIV(next_iv);
 
   /* Check the authenticity of the received message */
-  if( h.verifyMessageAuthenticationCode(this->ctx.getMacKeyS2C(), MAC_KEY_LEN )!=OP_SUCCESS ){
+  if( h.verifyMessageAuthenticationCode(this->ctx.getCryptoS2C(), this->ctx.getMacKeyS2C(), MAC_KEY_LEN )!=OP_SUCCESS ){
       nping_print(DBG_1, "NEP_HANDSHAKE_FINAL authentication failed" );
       return OP_FAILURE;
   }
@@ -592,7 +592,7 @@ int EchoClient::parse_ready(u8 *pkt, size_t pktlen){
   h.storeRecvData(pkt, pktlen);
 
   /* Decrypt message */
-  if((next_iv=h.decrypt(this->ctx.getCipherKeyS2C(), CIPHER_KEY_LEN, this->ctx.getNextDecryptionIV(), TYPE_NEP_READY))==NULL){
+  if((next_iv=h.decrypt(this->ctx.getCryptoS2C(), this->ctx.getCipherKeyS2C(), CIPHER_KEY_LEN, this->ctx.getNextDecryptionIV(), TYPE_NEP_READY))==NULL){
       nping_print(DBG_1, "Failed to decrypt NEP_READY data." );
       return OP_FAILURE;
   }
@@ -632,7 +632,7 @@ int EchoClient::parse_ready(u8 *pkt, size_t pktlen){
   }
 
   /* Check the authenticity of the received message */
-  if( h.verifyMessageAuthenticationCode(this->ctx.getMacKeyS2C(), MAC_KEY_LEN )!=OP_SUCCESS ){
+  if( h.verifyMessageAuthenticationCode(this->ctx.getCryptoS2C(), this->ctx.getMacKeyS2C(), MAC_KEY_LEN )!=OP_SUCCESS ){
       nping_print(DBG_1, "NEP_READY authentication failed" );
       return OP_FAILURE;
   }
@@ -659,7 +659,7 @@ int EchoClient::parse_echo(u8 *pkt, size_t pktlen){
   h.storeRecvData(pkt, pktlen);
 
   /* Decrypt message */
-  if((next_iv=h.decrypt(this->ctx.getCipherKeyS2C(), CIPHER_KEY_LEN, this->ctx.getNextDecryptionIV(), TYPE_NEP_ECHO))==NULL){
+  if((next_iv=h.decrypt(this->ctx.getCryptoS2C(), this->ctx.getCipherKeyS2C(), CIPHER_KEY_LEN, this->ctx.getNextDecryptionIV(), TYPE_NEP_ECHO))==NULL){
       nping_print(DBG_1, "Failed to decrypt NEP_ECHO data." );
       return OP_FAILURE;
   }
@@ -703,7 +703,7 @@ int EchoClient::parse_echo(u8 *pkt, size_t pktlen){
   h.updateEchoInternals();
 
   /* Check the authenticity of the received message */
-  if( h.verifyMessageAuthenticationCode(this->ctx.getMacKeyS2C(), MAC_KEY_LEN )!=OP_SUCCESS ){
+  if( h.verifyMessageAuthenticationCode(this->ctx.getCryptoS2C(), this->ctx.getMacKeyS2C(), MAC_KEY_LEN )!=OP_SUCCESS ){
       nping_print(DBG_1, "NEP_ECHO authentication failed" );
       return OP_FAILURE;
   }else{
@@ -746,9 +746,9 @@ int EchoClient::generate_hs_client(EchoHeader *h){
       h->setPartnerAddress(this->srvaddr4.sin_addr);
   }
   h->setTotalLength();
-  h->setMessageAuthenticationCode( this->ctx.getMacKeyC2S(), MAC_KEY_LEN);
+  h->setMessageAuthenticationCode(this->ctx.getCryptoC2S(), this->ctx.getMacKeyC2S(), MAC_KEY_LEN);
 
-  if( (next_iv=h->encrypt(this->ctx.getCipherKeyC2S(), CIPHER_KEY_LEN, this->ctx.getClientNonce()))==NULL )
+  if( (next_iv=h->encrypt(this->ctx.getCryptoC2S(), this->ctx.getCipherKeyC2S(), CIPHER_KEY_LEN, this->ctx.getClientNonce()))==NULL )
       return OP_FAILURE;
   this->ctx.setNextEncryptionIV(next_iv);
 
@@ -868,10 +868,10 @@ int EchoClient::generate_packet_spec(EchoHeader *h, int spec_proto){
   }
   /* Done inserting packet field specifiers, now finish the packet */
   h->setTotalLength();
-  h->setMessageAuthenticationCode(this->ctx.getMacKeyC2S(), MAC_KEY_LEN);
+  h->setMessageAuthenticationCode(this->ctx.getCryptoC2S(), this->ctx.getMacKeyC2S(), MAC_KEY_LEN);
 
   /* Encrypt message */
-  if( (next_iv=h->encrypt(this->ctx.getCipherKeyC2S(), CIPHER_KEY_LEN, this->ctx.getNextEncryptionIV()))==NULL )
+  if( (next_iv=h->encrypt(this->ctx.getCryptoC2S(), this->ctx.getCipherKeyC2S(), CIPHER_KEY_LEN, this->ctx.getNextEncryptionIV()))==NULL )
       return OP_FAILURE;
   this->ctx.setNextEncryptionIV(next_iv);
 
@@ -879,17 +879,84 @@ int EchoClient::generate_packet_spec(EchoHeader *h, int spec_proto){
 } /* End of generate_packet_spec() */
 
 
-/** Handles reception of a full NEP message. (the common NEP header). Basically
-  * it stores received data in the internal buffer and passes the control to
-  * the nep_recv_echo() method, which is the one in charge of processing
-  * NEP_ECHO packets */
+/** Reassembles NEP_ECHO messages from data received through the side channel
+  * and passes every complete message to nep_recv_echo(). The stream is not
+  * aligned to message boundaries: a single read may carry several messages,
+  * and a message (even its header) may be split across reads. Incomplete
+  * messages are kept in this->lasthdr until the rest arrives. */
+int EchoClient::nep_recv_echo_data(nsock_pool nsp, nsock_iod nsi, u8 *recvbuff, int recvbytes){
+  nping_print(DBG_4, "%s(%d)", __func__, recvbytes);
+  EchoHeader pkt_in;
+  u8 aux[128];
+  int plen=0;
+  int n=0;
+
+  while(recvbytes>0){
+
+    /* Complete the common header first */
+    if(this->readbytes<STD_NEP_HEADER_LEN){
+      n=MIN(recvbytes, (int)(STD_NEP_HEADER_LEN-this->readbytes));
+      memcpy(this->lasthdr+this->readbytes, recvbuff, n);
+      this->readbytes+=n;
+      recvbuff+=n;
+      recvbytes-=n;
+      if(this->readbytes<STD_NEP_HEADER_LEN)
+        break;
+    }
+
+    /* Decrypt the first 16 bytes so we can have a look at packet length */
+    this->ctx.getCryptoS2C()->decrypt(this->lasthdr, 16, aux, this->ctx.getCipherKeyS2C(), CIPHER_KEY_LEN, this->ctx.getNextDecryptionIV());
+    pkt_in.storeRecvData(aux, 16);
+    plen=pkt_in.getTotalLength()*4;
+    nping_print(DBG_4, "%s() Packet claims to have a length of %d bytes", __func__, plen);
+
+    /* If the packet is bigger than the maximum NEP packet, discard it. */
+    if(plen>MAX_NEP_PACKET_LENGTH){
+        nping_warning(DBG_1,"Warning. Received NEP packet (%dB) is bigger than %d bytes.", plen, MAX_NEP_PACKET_LENGTH);
+        return OP_FAILURE;
+    }else if(plen<STD_NEP_HEADER_LEN){
+        nping_warning(DBG_1,"Warning. Received NEP packet claims a bogus length (%dB).", plen);
+        return OP_FAILURE;
+    }
+
+    /* Take as much of the rest of the packet as we have */
+    n=MIN(recvbytes, plen-(int)this->readbytes);
+    memcpy(this->lasthdr+this->readbytes, recvbuff, n);
+    this->readbytes+=n;
+    recvbuff+=n;
+    recvbytes-=n;
+
+    /* If we have read the whole packet, give it to nep_recv_echo for processing */
+    if((int)this->readbytes==plen){
+        nping_print(DBG_4,"%s(): Received a full packet (%d).", __func__, plen);
+        this->nep_recv_echo(this->lasthdr, plen);
+        this->readbytes=0;
+    }
+  }
+
+  /* Schedule a read operation for the rest of the current packet, or for the
+   * header of the next echo packet */
+  if(this->readbytes==0){
+    nsock_readbytes(nsp, nsi, recv_std_header_handler, NSOCK_INFINITE, NULL, STD_NEP_HEADER_LEN);
+  }else if(this->readbytes<STD_NEP_HEADER_LEN){
+    nsock_readbytes(nsp, nsi, echoed_packet_handler, NSOCK_INFINITE, NULL, STD_NEP_HEADER_LEN-this->readbytes);
+  }else{
+    nping_print(DBG_4,"%s(): Missing %d bytes. Scheduled read operation for remaining bytes", __func__, plen-(int)this->readbytes);
+    nsock_readbytes(nsp, nsi, echoed_packet_handler, NSOCK_INFINITE, NULL, plen-this->readbytes);
+  }
+  return OP_SUCCESS;
+} /* End of nep_recv_echo_data() */
+
+
+/** Handles reception of the rest of a NEP message whose beginning is stored
+  * in this->lasthdr. The received data is passed to nep_recv_echo_data(),
+  * which completes the message and processes any other one that came after
+  * it. */
 int EchoClient::nep_echoed_packet_handler(nsock_pool nsp, nsock_event nse, void *arg){
   nping_print(DBG_4, "%s()", __func__);
-  EchoHeader pkt_in;
+  nsock_iod nsi = nse_iod(nse);
   u8 *recvbuff=NULL;
   int recvbytes=0;
-  u8 aux[128];
-  u8 *pkt_start=this->lasthdr;
   enum nse_status status=nse_status(nse);
   if (status!=NSE_STATUS_SUCCESS){
       if(status!=NSE_STATUS_KILL){
@@ -907,73 +974,20 @@ int EchoClient::nep_echoed_packet_handler(nsock_pool nsp, nsock_event nse, void
   }else{
     nping_print(DBG_4, "%s() Received %d bytes", __func__, recvbytes);
   }
-
- /* When we get here we'll have part of the packet stored in this->lasthdr and
-  * part of it (and possible more packets) stored in recvbuff. */
-  while(recvbytes>0){
-
-    /* Determine if we received the expected number of bytes or we received more
-    * than that. For that we need to decrypt the first 16 bytes so we can have
-    * a look at packet length */
-    Crypto::aes128_cbc_decrypt(pkt_start, 16, aux, this->ctx.getCipherKeyS2C(), CIPHER_KEY_LEN, this->ctx.getNextDecryptionIV());
-    pkt_in.storeRecvData(aux, 16);
-    int plen=pkt_in.getTotalLength()*4;
-    nping_print(DBG_4, "%s() Packet claims to have a length of %d bytes", __func__, plen);
-
-    /* If the packet is bigger than the maximum NEP packet, discard it. */
-    if(plen>MAX_NEP_PACKET_LENGTH){
-        nping_warning(DBG_1,"Warning. Received NEP packet (%dB) is bigger than %d bytes.", plen, MAX_NEP_PACKET_LENGTH);
-        return OP_FAILURE;
-    }
-
-    /* If we have read the whole packet, give it to nep_recv_echo for processing */
-    if (plen==((int)this->readbytes+recvbytes)){
-        memcpy(this->lasthdr+this->readbytes, recvbuff, recvbytes);
-        this->readbytes+=recvbytes;
-        nping_print(DBG_4,"%s(): Received exact length (%d).", __func__, recvbytes);
-        this->nep_recv_echo(this->lasthdr, this->readbytes);
-        nsock_readbytes(this->nsp, this->nsi, recv_std_header_handler, NSOCK_INFINITE, NULL, STD_NEP_HEADER_LEN);
-        return OP_SUCCESS;
-
-    /* This one can't happen in the first iteration since we scheduled the
-     * event with the exact amount of bytes, but may happen after that if we
-     * received more data and one of the packets is incomplete */
-    }else if(recvbytes<plen){
-        memcpy(this->lasthdr, recvbuff, recvbytes);
-        this->readbytes=recvbytes;
-        nping_print(DBG_4,"%s(): Missing %d bytes. Scheduled read operation for remaining bytes", __func__, plen-recvbytes);
-        nsock_readbytes(nsp, nsi, echoed_packet_handler, NSOCK_INFINITE, NULL, plen-recvbytes);
-        return OP_SUCCESS;
-
-    }else{ /* Received more than one packet */
-      nping_print(DBG_4,"%s(): Received more than one packet", __func__);
-      memcpy(this->lasthdr+this->readbytes, recvbuff, plen-this->readbytes);
-      this->nep_recv_echo(this->lasthdr, plen);
-      recvbuff+=plen-this->readbytes;
-      recvbytes-=plen-this->readbytes;
-      this->readbytes=0;
-      pkt_start=recvbuff;
-    }
-
-  }
-  return OP_SUCCESS;
+  return this->nep_recv_echo_data(nsp, nsi, recvbuff, recvbytes);
 } /* End of nep_echoed_packet_handler() */
 
 
-/** Handles reception of the first 16 bytes (the common NEP header). Basically
-  * it checks the Total Length field of the header to determine how many bytes
-  * are left to read to get the entire packet. If there are more bytes to be
-  * receives, a read event is scheduled. However, we may have read them all when
-  * this handler is called (due to nsock behaviour) so in that case we just pass
-  * control to nep_recv_echo(), which is the one in charge of processing
-  * NEP_ECHO packets */
+/** Handles reception of the first 16 bytes (the common NEP header). Nsock may
+  * return more than that, so the received data may contain the whole message
+  * or even more than one message. It is passed to nep_recv_echo_data(), which
+  * processes any complete message and schedules another read event for the
+  * rest. */
 int EchoClient::nep_recv_std_header_handler(nsock_pool nsp, nsock_event nse, void *arg){
   nping_print(DBG_4, "%s()", __func__);
   nsock_iod nsi = nse_iod(nse);
-  EchoHeader pkt_in;
   u8 *recvbuff=NULL;
   int recvbytes=0;
-  u8 aux[128];
   enum nse_status status=nse_status(nse);
   if (status!=NSE_STATUS_SUCCESS){
       if(status!=NSE_STATUS_KILL){
@@ -991,51 +1005,9 @@ int EchoClient::nep_recv_std_header_handler(nsock_pool nsp, nsock_event nse, voi
     nping_print(DBG_4, "%s() Received %d bytes", __func__, recvbytes);
   }
 
-  /* Here there are different possibilities. We may have received exactly one
-   * packet, we may have received more than one packet (as there is no way to
-   * make Nsock return an exact amount of bytes), or we may have received
-   * less than one packet. In the last case, we determine the number of bytes
-   * left and schedule another read event. */
-  while(recvbytes>0){
-
-    /* Decrypt the first 16 bytes so we can have a look at packet length */
-    Crypto::aes128_cbc_decrypt(recvbuff, 16, aux, this->ctx.getCipherKeyS2C(), CIPHER_KEY_LEN, this->ctx.getNextDecryptionIV());
-    pkt_in.storeRecvData(aux, 16);
-    int plen=pkt_in.getTotalLength()*4;
-
-    /* If the packet is bigger than the maximum NEP packet, discard it. */
-    if(plen>MAX_NEP_PACKET_LENGTH){
-        nping_warning(DBG_1,"Warning. Received NEP packet (%dB) is bigger than %d bytes.", plen, MAX_NEP_PACKET_LENGTH);
-        return OP_FAILURE;
-    }
-
-    /* If we have read the whole packet, give it to nep_recv_echo for processing */
-    if (plen==recvbytes){
-        nping_print(DBG_4,"%s(): Received exact length (%d).", __func__, recvbytes);
-        this->nep_recv_echo(recvbuff, recvbytes);
-        nsock_readbytes(this->nsp, this->nsi, recv_std_header_handler, NSOCK_INFINITE, NULL, STD_NEP_HEADER_LEN);
-        return OP_SUCCESS;
-
-    }else if(recvbytes<plen){
-        memcpy(this->lasthdr, recvbuff, recvbytes);
-        this->readbytes=recvbytes;
-        nping_print(DBG_4,"%s(): Missing %d bytes. Scheduled read operation for remaining bytes", __func__, plen-recvbytes);
-        nsock_readbytes(nsp, nsi, echoed_packet_handler, NSOCK_INFINITE, NULL, plen-recvbytes);
-        return OP_SUCCESS;
-
-    }else{ /* Received more than one packet */
-      nping_print(DBG_4,"%s(): Received more than one packet", __func__);
-      this->nep_recv_echo(recvbuff, plen);
-      recvbuff+=plen;
-      recvbytes-=plen;
-    }
-
-  }
-
-  /* Schedule another read event for the next echo packet */
-  nsock_readbytes(this->nsp, this->nsi, recv_std_header_handler, NSOCK_INFINITE, NULL, STD_NEP_HEADER_LEN);
-
-  return OP_SUCCESS;
+  /* A new message starts here */
+  this->readbytes=0;
+  return this->nep_recv_echo_data(nsp, nsi, recvbuff, recvbytes);
 } /* End of nep_recv_std_header_handler() */
 
 
@@ -154,6 +154,7 @@ class EchoClient  {
         int nep_send_packet_spec();
         int nep_recv_ready();
         int nep_recv_echo(u8 *packet, size_t packetlen);
+        int nep_recv_echo_data(nsock_pool nsp, nsock_iod nsi, u8 *recvbuff, int recvbytes);
 
         int parse_hs_server(u8 *pkt, size_t pktlen);
         int parse_hs_final(u8 *pkt, size_t pktlen);
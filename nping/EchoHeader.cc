@@ -322,6 +322,13 @@ u32 EchoHeader::getReserved(){
 
 
 int EchoHeader::setMessageAuthenticationCode(u8 *key, size_t keylen){
+  return this->setMessageAuthenticationCode(NULL, key, keylen);
+} /* End of setMessageAuthenticationCode() */
+
+
+/** Computes the message's MAC using the HMAC context of the supplied Crypto
+  * object. If it is NULL, a new HMAC context is set up for this message. */
+int EchoHeader::setMessageAuthenticationCode(Crypto *c, u8 *key, size_t keylen){
   u8 *macpnt=NULL;
   u8 *from=(u8 *)&(this->h);
   size_t bytes=0;
@@ -362,7 +369,10 @@ int EchoHeader::setMessageAuthenticationCode(u8 *key, size_t keylen){
     break;
   }
   /* Compute the code */
-  Crypto::hmac_sha256(from, bytes, macpnt, key, keylen);
+  if(c!=NULL)
+    c->hmac(from, bytes, macpnt, key, keylen);
+  else
+    Crypto::hmac_sha256(from, bytes, macpnt, key, keylen);
   return OP_SUCCESS;
 } /* End of setMessageAuthenticationCode() */
 
@@ -401,6 +411,11 @@ switch( this->getMessageType() ){
 
 
 int EchoHeader::verifyMessageAuthenticationCode(u8 *key, size_t keylen){
+  return this->verifyMessageAuthenticationCode(NULL, key, keylen);
+} /* End of verifyMessageAuthenticationCode() */
+
+
+int EchoHeader::verifyMessageAuthenticationCode(Crypto *c, u8 *key, size_t keylen){
   u8 mac_backup[MAC_LENGTH];
   u8 *aux;
 
@@ -411,7 +426,7 @@ int EchoHeader::verifyMessageAuthenticationCode(u8 *key, size_t keylen){
 
   /* Recompute the MAC */
   memset(aux, 0, MAC_LENGTH);
-  this->setMessageAuthenticationCode(key, keylen);
+  this->setMessageAuthenticationCode(c, key, keylen);
 
   /* Try to match both MACs*/
   if( (aux=this->getMessageAuthenticationCode())==NULL )
@@ -983,7 +998,15 @@ u8 *EchoHeader::getCiphertextBounds(size_t *final_len, int message_type){
   * block. This should be stored by the caller and used as the IV for the
   * next encrypted data. It returns NULL in case of error. */
 u8 *EchoHeader::encrypt(u8 *key, size_t key_len, u8 *iv){
+  return this->encrypt(NULL, key, key_len, iv);
+} /* End of encrypt() */
+
+
+/** Same as encrypt() but using the cipher context of the supplied Crypto
+  * object. If it is NULL, a new cipher context is set up for this message. */
+u8 *EchoHeader::encrypt(Crypto *c, u8 *key, size_t key_len, u8 *iv){
   nping_print(DBG_4, "%s(%p, %lu, %p)", __func__, key, (long unsigned)key_len, iv);
+  int result=OP_FAILURE;
   u8 *start=NULL;
   size_t len=0;
 
@@ -994,7 +1017,11 @@ u8 *EchoHeader::encrypt(u8 *key, size_t key_len, u8 *iv){
     return NULL;
 
   if(len>=CIPHER_BLOCK_SIZE){
-    if( Crypto::aes128_cbc_encrypt(start, len, (u8 *)(&this->h_tmp), key, key_len, iv) != OP_SUCCESS )
+    if(c!=NULL)
+        result=c->encrypt(start, len, (u8 *)(&this->h_tmp), key, key_len, iv);
+    else
+        result=Crypto::aes128_cbc_encrypt(start, len, (u8 *)(&this->h_tmp), key, key_len, iv);
+    if(result!=OP_SUCCESS)
         return NULL;
     else{
         memcpy(start, &this->h_tmp, len);
@@ -1006,8 +1033,48 @@ u8 *EchoHeader::encrypt(u8 *key, size_t key_len, u8 *iv){
 } /* End of encrypt() */
 
 
+/** Encrypts a sequence of consecutive NEP messages in place, as a single CBC
+  * stream: the first one with the supplied IV and each of the others with the
+  * last ciphertext block of the previous one. On success it returns a pointer
+  * to the last ciphertext block of the last message, to be used as the next
+  * IV. It returns NULL in case of error. */
+u8 *EchoHeader::encrypt_batch(Crypto *c, EchoHeader **msgs, int count, u8 *key, size_t key_len, u8 *iv){
+  nping_print(DBG_4, "%s(%d, %p, %lu, %p)", __func__, count, key, (long unsigned)key_len, iv);
+  u8 **bufs=NULL;
+  size_t *lens=NULL;
+  u8 *last=NULL;
+  int i=0;
+  Crypto tmp;
+
+  if(msgs==NULL || count<=0 || key==NULL || key_len==0 || iv==NULL)
+    return NULL;
+
+  bufs=(u8 **)safe_malloc(count*sizeof(u8 *));
+  lens=(size_t *)safe_malloc(count*sizeof(size_t));
+  for(i=0; i<count; i++){
+    if((bufs[i]=msgs[i]->getCiphertextBounds(&lens[i]))==NULL || lens[i]<CIPHER_BLOCK_SIZE)
+      break;
+  }
+  if(c==NULL)
+    c=&tmp;
+  if(i==count && c->encrypt_batch(bufs, lens, bufs, count, key, key_len, iv)==OP_SUCCESS)
+    last=bufs[count-1]+(lens[count-1]-CIPHER_BLOCK_SIZE);
+  free(bufs);
+  free(lens);
+  return last;
+} /* End of encrypt_batch() */
+
+
 u8 *EchoHeader::decrypt(u8 *key, size_t key_len, u8 *iv, int message_type){
+  return this->decrypt(NULL, key, key_len, iv, message_type);
+} /* End of decrypt() */
+
+
+/** Same as decrypt() but using the cipher context of the supplied Crypto
+  * object. If it is NULL, a new cipher context is set up for this message. */
+u8 *EchoHeader::decrypt(Crypto *c, u8 *key, size_t key_len, u8 *iv, int message_type){
   nping_print(DBG_4, "%s(%p, %lu, %p)", __func__, key, (long unsigned)key_len, iv);
+  int result=OP_FAILURE;
   u8 *start=NULL;
   size_t len=0;
   static u8 lastblock[CIPHER_BLOCK_SIZE];
@@ -1021,7 +1088,11 @@ u8 *EchoHeader::decrypt(u8 *key, size_t key_len, u8 *iv, int message_type){
   if(len>=CIPHER_BLOCK_SIZE){
     /* Keep a copy of the last ciphertext block */
     memcpy(lastblock, start+len-CIPHER_BLOCK_SIZE, CIPHER_BLOCK_SIZE);
-    if( Crypto::aes128_cbc_decrypt(start, len, (u8 *)(&this->h_tmp), key, key_len, iv) != OP_SUCCESS )
+    if(c!=NULL)
+        result=c->decrypt(start, len, (u8 *)(&this->h_tmp), key, key_len, iv);
+    else
+        result=Crypto::aes128_cbc_decrypt(start, len, (u8 *)(&this->h_tmp), key, key_len, iv);
+    if(result!=OP_SUCCESS)
         return NULL;
     else{
         memcpy(start, &this->h_tmp, len);
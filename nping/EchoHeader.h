@@ -127,6 +127,7 @@
 #define __ECHOHEADER_H__ 1
 
 #include "nping.h"
+#include "Crypto.h"
 
 #define ECHO_CURRENT_PROTO_VER  0x01
 
@@ -343,8 +344,10 @@ class EchoHeader : public ApplicationLayerElement {
         u32 getReserved();
 
         int setMessageAuthenticationCode(u8 *key, size_t keylen);
+        int setMessageAuthenticationCode(Crypto *c, u8 *key, size_t keylen);
         u8 *getMessageAuthenticationCode();
         int verifyMessageAuthenticationCode(u8 *key, size_t keylen);
+        int verifyMessageAuthenticationCode(Crypto *c, u8 *key, size_t keylen);
 
         int setServerNonce(u8 *nonce);
         u8 *getServerNonce();
@@ -388,7 +391,10 @@ class EchoHeader : public ApplicationLayerElement {
         u8 *getCiphertextBounds(size_t *len);
         u8 *getCiphertextBounds(size_t *final_len, int message_type);
         u8 *encrypt(u8 *key, size_t key_len, u8 *iv);
+        u8 *encrypt(Crypto *c, u8 *key, size_t key_len, u8 *iv);
+        static u8 *encrypt_batch(Crypto *c, EchoHeader **msgs, int count, u8 *key, size_t key_len, u8 *iv);
         u8 *decrypt(u8 *key, size_t key_len, u8 *iv, int message_type);
+        u8 *decrypt(Crypto *c, u8 *key, size_t key_len, u8 *iv, int message_type);
 };
 
 #endif /* __ECHOHEADER_H__ */
@@ -141,20 +141,66 @@ EchoServer::EchoServer() {
 
 
 EchoServer::~EchoServer() {
+  this->reset();
 } /* End of EchoServer destructor */
 
 
 /** Sets every attribute to its default value- */
 void EchoServer::reset() {
+  struct spec_entry *e=NULL, *next=NULL;
+#ifndef WIN32
+  this->end_workers();
+  this->wake_sd[0]=this->wake_sd[1]=-1;
+  this->wake_nsi=NULL;
+  this->wake_pending=false;
+  this->stop_workers=false;
+#endif
+  for(size_t i=0; i<this->client_ctx.size(); i++){
+    delete this->client_ctx[i].ctx;
+    free(this->client_ctx[i].outbuf);
+  }
+  for(size_t i=0; i<this->spec_index.size(); i++){
+    for(e=this->spec_index[i]; e!=NULL; e=next){
+      next=e->next;
+      delete e;
+    }
+  }
   this->client_ctx.clear();
+  this->total_clients=0;
   this->client_id_count=-1;
+  this->spec_index.assign(SPEC_INDEX_MIN_BUCKETS, (struct spec_entry *)NULL);
+  this->total_specs=0;
+  this->unindexed_clients.clear();
+  this->candidates.clear();
+  memset(this->magic_lens, 0, sizeof(this->magic_lens));
+  this->match_count=0;
 } /* End of reset() */
 
 
-/** Adds a new client context object to the server context list */
+/** Adds a new client context object to the server context list. Contexts are
+  * stored in a slot indexed by the client identifier, so they can be looked
+  * up in constant time. */
 int EchoServer::addClientContext(NEPContext ctx){
   nping_print(DBG_4, "%s(ctx->id=%d)", __func__, ctx.getIdentifier());
-  this->client_ctx.push_back(ctx);
+  clientid_t clnt=ctx.getIdentifier();
+  struct client_slot empty;
+  if(clnt<0)
+    return OP_FAILURE;
+  if((size_t)clnt>=this->client_ctx.size()){
+    memset(&empty, 0, sizeof(empty));
+    this->client_ctx.resize(clnt+1, empty);
+  }
+  if(this->client_ctx[clnt].ctx!=NULL){
+    nping_warning(QT_2, "Client #%d is already in use. Discarding new session.", clnt);
+    return OP_FAILURE;
+  }
+  this->client_ctx[clnt].ctx=new NEPContext(ctx);
+  this->client_ctx[clnt].indexed=false;
+  this->client_ctx[clnt].unindexed=false;
+  this->client_ctx[clnt].closing=false;
+  this->client_ctx[clnt].writing=false;
+  this->client_ctx[clnt].mark=0;
+  this->total_clients++;
   return OP_SUCCESS;
 } /* End of addClientContext() */
 
@@ -163,15 +209,13 @@ int EchoServer::addClientContext(NEPContext ctx){
   * On success, it returns a pointer to the client's context object. NULL is
   * returned when no context could be found.  */
 NEPContext *EchoServer::getClientContext(clientid_t clnt){
-  nping_print(DBG_4, "%s(%d) %lu", __func__, clnt, (unsigned long)this->client_ctx.size());
-  for(unsigned int i=0; i<this->client_ctx.size(); i++){
-    if(this->client_ctx[i].getIdentifier() == clnt ){
-        nping_print(DBG_3, "Found client with ID #%d at p%d. Total clients %lu", clnt, i, (unsigned long)this->client_ctx.size());
-        return &(this->client_ctx[i]);
-    }
+  nping_print(DBG_4, "%s(%d) %lu", __func__, clnt, (unsigned long)this->total_clients);
+  if(clnt<0 || (size_t)clnt>=this->client_ctx.size() || this->client_ctx[clnt].ctx==NULL ||
+     this->client_ctx[clnt].closing){
+    nping_print(DBG_3, "No client with ID #%d was found. Total clients %lu", clnt, (unsigned long)this->total_clients);
+    return NULL;
   }
-  nping_print(DBG_3, "No client with ID #%d was found. Total clients %lu", clnt, (unsigned long)this->client_ctx.size());
-  return NULL;
+  return this->client_ctx[clnt].ctx;
 } /* End of getClientContext() */
 
 
@@ -190,22 +234,47 @@ NEPContext *EchoServer::getClientContext(nsock_iod iod){
 
 /** Deletes context information associated with a given client. Returns
   * OP_SUCCESS if the context object was successfully deleted or OP_FAILURE if
-  * the context could not be found.  */
+  * the context could not be found. When echo workers are running, the context
+  * is only freed once the client's worker is done with it, but it can't be
+  * looked up anymore.  */
 int EchoServer::destroyClientContext(clientid_t clnt){
-  bool deleted=false;
-  vector<NEPContext>::iterator it;
-  /* Iterate through the context array and delete the one that belongs to clnt */
-  for ( it=this->client_ctx.begin(); it<this->client_ctx.end(); it++){
-      if(it->getIdentifier()==clnt){
-        this->client_ctx.erase(it);
-        deleted=true;
-        break;
-      }
+  NEPContext *ctx=NULL;
+  if( (ctx=this->getClientContext(clnt))==NULL )
+    return OP_FAILURE;
+  if(this->client_ctx[clnt].indexed)
+    this->unindex_client(ctx);
+  this->total_clients--;
+#ifndef WIN32
+  if(!this->workers.empty()){
+    struct echo_job job;
+    memset(&job, 0, sizeof(job));
+    job.ctx=ctx;
+    job.clnt=clnt;
+    job.release=true;
+    this->client_ctx[clnt].closing=true;
+    this->queue_job(&job);
+    return OP_SUCCESS;
   }
-  return (deleted) ? OP_SUCCESS : OP_FAILURE;
+#endif
+  this->release_slot(clnt);
+  return OP_SUCCESS;
 } /* End of destroyClientContext() */
 
 
+/** Frees a client's context and any NEP_ECHO messages still waiting to be
+  * sent to it, leaving the slot ready for a new client. */
+void EchoServer::release_slot(clientid_t clnt){
+  struct client_slot *slot=&this->client_ctx[clnt];
+  delete slot->ctx;
+  free(slot->outbuf);
+  slot->ctx=NULL;
+  slot->outbuf=NULL;
+  slot->outlen=slot->outsize=0;
+  slot->closing=false;
+  slot->writing=false;
+} /* End of release_slot() */
+
+
 /** Returns the Nsock IOD associated with a given client ID. */
 nsock_iod EchoServer::getClientNsockIOD(clientid_t clnt){
   nping_print(DBG_4, "%s(%d)", __func__, clnt);
@@ -376,214 +445,511 @@ int EchoServer::nep_listen_socket(){
 #define MIN_ACCEPTABLE_SCORE_UDP  8.0
 #define MIN_ACCEPTABLE_SCORE_ICMP 6.0
 
-clientid_t EchoServer::nep_match_headers(IPv4Header *ip4, IPv6Header *ip6, TCPHeader *tcp, UDPHeader *udp, ICMPv4Header *icmp4, RawData *payload){
-  nping_print(DBG_4, "%s(%p,%p,%p,%p,%p,%p)", __func__, ip4, ip6, tcp, udp, icmp4, payload);
-    unsigned int i=0, k=0;
+/* Returns the number of bytes of a field specifier value that the matching
+ * code compares against the packet, or zero if the field is not one of the
+ * identifying fields kept in the spec index. Identifying fields are the ones
+ * that tend to be different for every client session (IP identification, flow
+ * label, source ports, sequence numbers and payload magic). Zero values are too
+ * common to tell clients apart, so they are not indexed either. */
+static u8 spec_key_len(const fspec_t *fspec){
+  u8 len=0;
+  switch(fspec->field){
+    case PSPEC_IPv4_ID:
+    case PSPEC_TCP_SPORT:
+    case PSPEC_UDP_SPORT:
+      return 2;
+    case PSPEC_PAYLOAD_MAGIC:
+      return fspec->len;
+    case PSPEC_IPv4_FRAGOFF:
+    case PSPEC_TCP_URP:
+      len=2;
+    break;
+    case PSPEC_IPv6_FLOW:
+    case PSPEC_TCP_SEQ:
+    case PSPEC_TCP_ACK:
+      len=4;
+    break;
+    default:
+      return 0;
+  }
+  for(u8 i=0; i<len; i++){
+    if(fspec->value[i]!=0)
+      return len;
+  }
+  return 0;
+} /* End of spec_key_len() */
+
+
+/* Returns the score a field specifier adds when it matches a packet. This must
+ * be kept in sync with the weights used by nep_score_client(). */
+static double spec_weight(const fspec_t *fspec){
+  u16 v16=ntohs( *((u16 *)fspec->value) );
+  u32 v32=ntohl( *((u32 *)fspec->value) );
+  switch(fspec->field){
+    case PSPEC_IPv4_TOS:      return 1 * FACTOR_IPv4_TOS * ((fspec->value[0]==0) ? ZERO_PENALTY : 1);
+    case PSPEC_IPv4_PROTO:    return 1 * FACTOR_IPv4_PROTO;
+    case PSPEC_IPv4_ID:       return 2 * FACTOR_IPv4_ID;
+    case PSPEC_IPv4_FRAGOFF:  return 2 * FACTOR_IPv4_FRAGOFF * ((v16==0) ? ZERO_PENALTY : 1);
+    case PSPEC_IPv6_TCLASS:   return 1 * FACTOR_IPv6_TCLASS * ((fspec->value[0]==0) ? ZERO_PENALTY : 1);
+    case PSPEC_IPv6_FLOW:     return 3 * FACTOR_IPv6_FLOW * ((v32==0) ? ZERO_PENALTY : 1);
+    case PSPEC_IPv6_NHDR:     return 1 * FACTOR_IPv6_NHDR;
+    case PSPEC_TCP_SPORT:     return 2 * FACTOR_TCP_SPORT;
+    case PSPEC_TCP_DPORT:     return 2 * FACTOR_TCP_DPORT;
+    case PSPEC_TCP_SEQ:       return 4 * FACTOR_TCP_SEQ * ((v32==0) ? ZERO_PENALTY : 1);
+    case PSPEC_TCP_ACK:       return 4 * FACTOR_TCP_ACK * ((v32==0) ? ZERO_PENALTY : 1);
+    case PSPEC_TCP_FLAGS:     return 1 * FACTOR_TCP_FLAGS;
+    case PSPEC_TCP_WIN:       return 2 * FACTOR_TCP_WIN * ((v16==0) ? ZERO_PENALTY : 1);
+    case PSPEC_TCP_URP:       return 2 * FACTOR_TCP_URP * ((v16==0) ? ZERO_PENALTY : 1);
+    case PSPEC_ICMP_TYPE:     return 1 * FACTOR_ICMP_TYPE;
+    case PSPEC_ICMP_CODE:     return 1 * FACTOR_ICMP_CODE * ((fspec->value[0]==0) ? ZERO_PENALTY : 1);
+    case PSPEC_UDP_SPORT:     return 2 * FACTOR_UDP_SPORT;
+    case PSPEC_UDP_DPORT:     return 2 * FACTOR_UDP_DPORT;
+    case PSPEC_UDP_LEN:       return 2 * FACTOR_UDP_LEN * ((v16==8) ? ZERO_PENALTY : 1);
+    case PSPEC_PAYLOAD_MAGIC: return MIN(4, fspec->len) * FACTOR_PAYLOAD_MAGIC;
+    default:                  return 0;
+  }
+} /* End of spec_weight() */
+
+
+/* Returns true if a field specifier can match packets whose transport
+ * protocol is the given PSPEC_PROTO_* value. */
+static bool spec_applies(const fspec_t *fspec, u8 proto){
+  switch(fspec->field & 0xF0){
+    case 0xC0: return proto==PSPEC_PROTO_TCP;
+    case 0xD0: return proto==PSPEC_PROTO_ICMP;
+    case 0xE0: return proto==PSPEC_PROTO_UDP;
+    default:   return true;
+  }
+} /* End of spec_applies() */
+
+
+static u32 spec_hash(u8 field, u8 len, const u8 *value){
+  u32 h=2166136261U;
+  h=(h ^ field) * 16777619U;
+  h=(h ^ len) * 16777619U;
+  for(int i=0; i<len; i++)
+    h=(h ^ value[i]) * 16777619U;
+  return h;
+} /* End of spec_hash() */
+
+
+struct spec_entry *EchoServer::find_spec(u8 field, u8 len, const u8 *value, u32 hash){
+  struct spec_entry *e=this->spec_index[hash & (this->spec_index.size()-1)];
+  for( ; e!=NULL; e=e->next){
+    if(e->hash==hash && e->field==field && e->len==len && memcmp(e->value, value, len)==0)
+      return e;
+  }
+  return NULL;
+} /* End of find_spec() */
+
+
+void EchoServer::grow_spec_index(){
+  vector<struct spec_entry *> old;
+  struct spec_entry *e=NULL, *next=NULL;
+  size_t idx=0;
+
+  old.swap(this->spec_index);
+  this->spec_index.assign(old.size()*2, (struct spec_entry *)NULL);
+  for(size_t i=0; i<old.size(); i++){
+    for(e=old[i]; e!=NULL; e=next){
+      next=e->next;
+      idx=e->hash & (this->spec_index.size()-1);
+      e->next=this->spec_index[idx];
+      this->spec_index[idx]=e;
+    }
+  }
+  nping_print(DBG_3, "Packet spec index grown to %lu buckets", (unsigned long)this->spec_index.size());
+} /* End of grow_spec_index() */
+
+
+/** Adds the identifying fields of a client's packet spec to the spec index, so
+  * captured packets can be matched against the few clients that share one of
+  * their field values instead of against every client. Clients whose other
+  * fields alone may be enough to reach the minimum acceptable score are kept
+  * in a separate list and scored against every packet, so the result of the
+  * matching is the same as scoring all clients. */
+int EchoServer::index_client(NEPContext *ctx){
+  clientid_t clnt=ctx->getIdentifier();
+  struct spec_entry *e=NULL;
+  fspec_t *fspec=NULL;
+  double bound_tcp=0, bound_udp=0, bound_icmp=0;
+  u32 hash=0, idx=0;
+  u8 len=0;
+
+  if(clnt<0 || (size_t)clnt>=this->client_ctx.size() || this->client_ctx[clnt].indexed)
+    return OP_FAILURE;
+
+  for(int k=0; (fspec=ctx->getClientFieldSpec(k))!=NULL; k++){
+    if( (len=spec_key_len(fspec))==0 ){
+      /* Not indexed: account for the highest score it may contribute */
+      if(spec_applies(fspec, PSPEC_PROTO_TCP))
+        bound_tcp+=spec_weight(fspec);
+      if(spec_applies(fspec, PSPEC_PROTO_UDP))
+        bound_udp+=spec_weight(fspec);
+      if(spec_applies(fspec, PSPEC_PROTO_ICMP))
+        bound_icmp+=spec_weight(fspec);
+      continue;
+    }
+    hash=spec_hash(fspec->field, len, fspec->value);
+    if( (e=this->find_spec(fspec->field, len, fspec->value, hash))==NULL ){
+      if(this->total_specs >= this->spec_index.size())
+        this->grow_spec_index();
+      e=new struct spec_entry;
+      e->field=fspec->field;
+      e->len=len;
+      memcpy(e->value, fspec->value, len);
+      e->hash=hash;
+      idx=hash & (this->spec_index.size()-1);
+      e->next=this->spec_index[idx];
+      this->spec_index[idx]=e;
+      this->total_specs++;
+    }
+    e->clients.push_back(clnt);
+    if(fspec->field==PSPEC_PAYLOAD_MAGIC)
+      this->magic_lens[len]++;
+  }
+
+  if(bound_tcp>=MIN_ACCEPTABLE_SCORE_TCP || bound_udp>=MIN_ACCEPTABLE_SCORE_UDP ||
+     bound_icmp>=MIN_ACCEPTABLE_SCORE_ICMP){
+    nping_print(DBG_2, "Client #%d packet spec is not selective. It will be matched against every packet.", clnt);
+    this->unindexed_clients.push_back(clnt);
+    this->client_ctx[clnt].unindexed=true;
+  }
+  this->client_ctx[clnt].indexed=true;
+  return OP_SUCCESS;
+} /* End of index_client() */
+
+
+/** Removes a client's packet spec from the spec index. */
+int EchoServer::unindex_client(NEPContext *ctx){
+  clientid_t clnt=ctx->getIdentifier();
+  struct spec_entry *e=NULL, **prev=NULL;
+  fspec_t *fspec=NULL;
+  u32 hash=0;
+  u8 len=0;
+
+  if(clnt<0 || (size_t)clnt>=this->client_ctx.size() || !this->client_ctx[clnt].indexed)
+    return OP_FAILURE;
+
+  for(int k=0; (fspec=ctx->getClientFieldSpec(k))!=NULL; k++){
+    if( (len=spec_key_len(fspec))==0 )
+      continue;
+    hash=spec_hash(fspec->field, len, fspec->value);
+    if( (e=this->find_spec(fspec->field, len, fspec->value, hash))==NULL )
+      continue;
+    for(size_t i=0; i<e->clients.size(); i++){
+      if(e->clients[i]==clnt){
+        e->clients.erase(e->clients.begin()+i);
+        break;
+      }
+    }
+    if(fspec->field==PSPEC_PAYLOAD_MAGIC)
+      this->magic_lens[len]--;
+    if(e->clients.empty()){
+      prev=&(this->spec_index[hash & (this->spec_index.size()-1)]);
+      while(*prev!=e)
+        prev=&((*prev)->next);
+      *prev=e->next;
+      delete e;
+      this->total_specs--;
+    }
+  }
+
+  if(this->client_ctx[clnt].unindexed){
+    for(size_t i=0; i<this->unindexed_clients.size(); i++){
+      if(this->unindexed_clients[i]==clnt){
+        this->unindexed_clients.erase(this->unindexed_clients.begin()+i);
+        break;
+      }
+    }
+    this->client_ctx[clnt].unindexed=false;
+  }
+  this->client_ctx[clnt].indexed=false;
+  return OP_SUCCESS;
+} /* End of unindex_client() */
+
+
+/* Adds the clients whose packet spec has the supplied field value to the list
+ * of candidates for the current packet. */
+void EchoServer::add_candidates(u8 field, u8 len, const u8 *value){
+  struct spec_entry *e=NULL;
+  clientid_t clnt;
+  if( (e=this->find_spec(field, len, value, spec_hash(field, len, value)))==NULL )
+    return;
+  for(size_t i=0; i<e->clients.size(); i++){
+    clnt=e->clients[i];
+    if(this->client_ctx[clnt].mark!=this->match_count){
+      this->client_ctx[clnt].mark=this->match_count;
+      this->candidates.push_back(clnt);
+    }
+  }
+} /* End of add_candidates() */
+
+
+/* Returns the score of a captured packet for the supplied client's packet
+ * spec. The higher the score, the more likely is that the packet was sent
+ * by that client. */
+double EchoServer::nep_score_client(NEPContext *ctx, IPv4Header *ip4, IPv6Header *ip6, TCPHeader *tcp, UDPHeader *udp, ICMPv4Header *icmp4, RawData *payload){
+    unsigned int k=0;
     u8 *buff=NULL;
     int bufflen=-1;
-    NEPContext *ctx;
     fspec_t *fspec;
-    float current_score=0;
-    float candidate_score=-1;
-    float minimum_score=0;
-    clientid_t candidate=-1;
+    double current_score=0;
+
+    nping_print(DBG_2, "%s() Trying to match packet against client #%d", __func__, ctx->getIdentifier());
+    /* Iterate through client's list of packet field specifiers */
+    for(k=0; (fspec=ctx->getClientFieldSpec(k))!=NULL; k++){
+        switch(fspec->field){
+            case PSPEC_IPv4_TOS:
+                if(ip4==NULL)break;
+                nping_print(DBG_3, "%s() Trying to match IP TOS", __func__);
+                if( ip4->getTOS()==fspec->value[0] ){
+                    nping_print(DBG_3, "[Match] IP TOS=%02x", ip4->getTOS());
+                    current_score += 1 * FACTOR_IPv4_TOS * ((ip4->getTOS()==0) ? ZERO_PENALTY : 1);
+                }
+            break;
+            case PSPEC_IPv4_PROTO:
+                if(ip4==NULL)break;
+                nping_print(DBG_3, "%s() Trying to match IP Next Protocol", __func__);
+                if( ip4->getNextProto()==fspec->value[0] ){
+                    nping_print(DBG_3, "[Match] IP Proto=%02x", ip4->getNextProto());
+                    current_score += 1 * FACTOR_IPv4_PROTO;
+                }
+            break;
+            case PSPEC_IPv4_ID:
+                if(ip4==NULL)break;
+                nping_print(DBG_3, "%s() Trying to match IP Identification", __func__);
+                if( ip4->getIdentification()==ntohs( *((u16 *)fspec->value) ) ){
+                    nping_print(DBG_3, "[Match] IP Id=%u", ip4->getIdentification());
+                    current_score += 2 * FACTOR_IPv4_ID;
+                }
+            break;
+            case PSPEC_IPv4_FRAGOFF:
+                if(ip4==NULL)break;
+                nping_print(DBG_3, "%s() Trying to match IP Fragment offset", __func__);
+                if( ip4->getFragOffset()==ntohs( *((u16 *)fspec->value)) ){
+                    nping_print(DBG_3, "[Match] IP FragOff=%u", ip4->getFragOffset() );
+                    current_score += 2 * FACTOR_IPv4_FRAGOFF * ((ip4->getFragOffset()==0) ? ZERO_PENALTY : 1);
+                }
+            break;
 
-    /* Iterate through the list of connected clients */
-    for(i=0; i<this->client_ctx.size(); i++ ){
-        current_score=0;
-        ctx=&(this->client_ctx[i]);
-        nping_print(DBG_2, "%s() Trying to match packet against client #%d", __func__, ctx->getIdentifier());
-        if( ctx->ready() ){
-            /* Iterate through client's list of packet field specifiers */
-            for(k=0; (fspec=ctx->getClientFieldSpec(k))!=NULL; k++){
-                switch(fspec->field){
-                    case PSPEC_IPv4_TOS:
-                        if(ip4==NULL)break;
-                        nping_print(DBG_3, "%s() Trying to match IP TOS", __func__);
-                        if( ip4->getTOS()==fspec->value[0] ){
-                            nping_print(DBG_3, "[Match] IP TOS=%02x", ip4->getTOS());
-                            current_score += 1 * FACTOR_IPv4_TOS * ((ip4->getTOS()==0) ? ZERO_PENALTY : 1);
-                        }
-                    break;
-                    case PSPEC_IPv4_PROTO:
-                        if(ip4==NULL)break;
-                        nping_print(DBG_3, "%s() Trying to match IP Next Protocol", __func__);
-                        if( ip4->getNextProto()==fspec->value[0] ){
-                            nping_print(DBG_3, "[Match] IP Proto=%02x", ip4->getNextProto());
-                            current_score += 1 * FACTOR_IPv4_PROTO;
-                        }
-                    break;
-                    case PSPEC_IPv4_ID:
-                        if(ip4==NULL)break;
-                        nping_print(DBG_3, "%s() Trying to match IP Identification", __func__);
-                        if( ip4->getIdentification()==ntohs( *((u16 *)fspec->value) ) ){
-                            nping_print(DBG_3, "[Match] IP Id=%u", ip4->getIdentification());
-                            current_score += 2 * FACTOR_IPv4_ID;
-                        }
-                    break;
-                    case PSPEC_IPv4_FRAGOFF:
-                        if(ip4==NULL)break;
-                        nping_print(DBG_3, "%s() Trying to match IP Fragment offset", __func__);
-                        if( ip4->getFragOffset()==ntohs( *((u16 *)fspec->value)) ){
-                            nping_print(DBG_3, "[Match] IP FragOff=%u", ip4->getFragOffset() );
-                            current_score += 2 * FACTOR_IPv4_FRAGOFF * ((ip4->getFragOffset()==0) ? ZERO_PENALTY : 1);
-                        }
+            case PSPEC_IPv6_TCLASS:
+                if(ip6==NULL)break;
+                nping_print(DBG_3, "%s() Trying to match IPv6 Traffic Class", __func__);
+                if( ip6->getTrafficClass()==fspec->value[0] ){
+                    nping_print(DBG_3, "[Match] IPv6 TClass=%u", ip6->getTrafficClass() );
+                    current_score += 1 * FACTOR_IPv6_TCLASS  * ((ip6->getTrafficClass()==0) ? ZERO_PENALTY : 1);
+                }
+            break;
+            case PSPEC_IPv6_FLOW:
+                if(ip6==NULL)break;
+                nping_print(DBG_3, "%s() Trying to match IPv6 Flow Label", __func__);
+                if( ip6->getFlowLabel()==ntohl( *((u32 *)fspec->value)) ){
+                    nping_print(DBG_3, "[Match] IPv6 Flow=%lu", (long unsigned)ip6->getFlowLabel() );
+                    current_score += 3 * FACTOR_IPv6_FLOW  * ((ip6->getFlowLabel()==0) ? ZERO_PENALTY : 1);
+                }
+            break;
+            case PSPEC_IPv6_NHDR:
+                if(ip6==NULL)break;
+                nping_print(DBG_3, "%s() Trying to match IPv6 Next Header", __func__);
+                if( ip6->getNextHeader()==fspec->value[0] ){
+                    nping_print(DBG_3, "[Match] IPv6 NextHdr=%02x", ip6->getNextHeader());
+                    current_score += 1 * FACTOR_IPv6_NHDR;
+                }
+            break;
+            case PSPEC_TCP_SPORT:
+                if(tcp==NULL)break;
+                nping_print(DBG_3, "%s() Trying to match TCP Source Port", __func__);
+                if( tcp->getSourcePort()==ntohs( *((u16 *)fspec->value) ) ){
+                    nping_print(DBG_3, "[Match] TCP Src=%u", tcp->getSourcePort());
+                    current_score += 2 * FACTOR_TCP_SPORT;
+                }
+            break;
+            case PSPEC_TCP_DPORT:
+                if(tcp==NULL)break;
+                nping_print(DBG_3, "%s() Trying to match TCP Destination Port", __func__);
+                if( tcp->getDestinationPort()==ntohs( *((u16 *)fspec->value) ) ){
+                    nping_print(DBG_3, "[Match] TCP Dst=%u", tcp->getDestinationPort());
+                    current_score += 2 * FACTOR_TCP_DPORT;
+                }
+            break;
+            case PSPEC_TCP_SEQ:
+                if(tcp==NULL)break;
+                nping_print(DBG_3, "%s() Trying to match TCP Sequence Number", __func__);
+                if( tcp->getSeq()==ntohl( *((u32 *)fspec->value) ) ){
+                    nping_print(DBG_3, "[Match] TCP Seq=%u", tcp->getSeq());
+                    current_score += 4 * FACTOR_TCP_SEQ  * ((tcp->getSeq()==0) ? ZERO_PENALTY : 1);
+                }
+            break;
+            case PSPEC_TCP_ACK:
+                if(tcp==NULL)break;
+                nping_print(DBG_3, "%s() Trying to match TCP Acknowledgment", __func__);
+                if( tcp->getAck()==ntohl( *((u32 *)fspec->value) ) ){
+                    nping_print(DBG_3, "[Match] TCP Ack=%u", tcp->getAck());
+                    current_score += 4 * FACTOR_TCP_ACK  * ((tcp->getAck()==0) ? ZERO_PENALTY : 1);
+                }
+            break;
+            case PSPEC_TCP_FLAGS:
+                if(tcp==NULL)break;
+                if( tcp->getFlags()==fspec->value[0] ){
+                    nping_print(DBG_3, "%s() Trying to match TCP Flags", __func__);
+                    nping_print(DBG_3, "[Match] TCP Flags=%02x", tcp->getFlags());
+                    current_score += 1 * FACTOR_TCP_FLAGS;
+                }
+            break;
+            case PSPEC_TCP_WIN:
+                if(tcp==NULL)break;
+                nping_print(DBG_3, "%s() Trying to match TCP Window", __func__);
+                if( tcp->getWindow()==ntohs( *((u16 *)fspec->value) ) ){
+                    nping_print(DBG_3, "[Match] TCP Win=%u", tcp->getWindow());
+                    current_score += 2 * FACTOR_TCP_WIN  * ((tcp->getWindow()==0) ? ZERO_PENALTY : 1);
+                }
+            break;
+            case PSPEC_TCP_URP:
+                if(tcp==NULL)break;
+                nping_print(DBG_3, "%s() Trying to match TCP Urgent Pointer", __func__);
+                if( tcp->getUrgPointer()==ntohs( *((u16 *)fspec->value) ) ){
+                    nping_print(DBG_3, "[Match] TCP Win=%u", tcp->getUrgPointer());
+                    current_score += 2 * FACTOR_TCP_URP  * ((tcp->getUrgPointer()==0) ? ZERO_PENALTY : 1);
+                }
+            break;
+            case PSPEC_ICMP_TYPE:
+                if(icmp4==NULL)break;
+                nping_print(DBG_3, "%s() Trying to match ICMPv4 Type", __func__);
+                if( icmp4->getType()==fspec->value[0] ){
+                    nping_print(DBG_3, "[Match] ICMPv4 Type=%02x", icmp4->getType());
+                    current_score += 1 * FACTOR_ICMP_TYPE;
+                }
+            break;
+            case PSPEC_ICMP_CODE:
+                if(icmp4==NULL)break;
+                nping_print(DBG_3, "%s() Trying to match ICMPv4 Code", __func__);
+                if( icmp4->getCode()==fspec->value[0] ){
+                    nping_print(DBG_3, "[Match] ICMPv4 Code=%02x", icmp4->getCode());
+                    current_score += 1 * FACTOR_ICMP_CODE  * ((icmp4->getCode()==0) ? ZERO_PENALTY : 1);
+                }
+            break;
+            case PSPEC_UDP_SPORT:
+                if(udp==NULL)break;
+                nping_print(DBG_3, "%s() Trying to match UDP Source Port", __func__);
+                if( udp->getSourcePort()==ntohs( *((u16 *)fspec->value) ) ){
+                    nping_print(DBG_3, "[Match] UDP Src=%u", udp->getSourcePort());
+                    current_score += 2 * FACTOR_UDP_SPORT;
+                }
+            break;
+            case PSPEC_UDP_DPORT:
+                if(udp==NULL)break;
+                nping_print(DBG_3, "%s() Trying to match UDP Destination Port", __func__);
+                if( udp->getDestinationPort()==ntohs( *((u16 *)fspec->value) ) ){
+                    nping_print(DBG_3, "[Match] UDP Dst=%u", udp->getDestinationPort());
+                    current_score += 2 * FACTOR_UDP_DPORT;
+                }
+            break;
+            case PSPEC_UDP_LEN:
+                if(udp==NULL)break;
+                nping_print(DBG_3, "%s() Trying to match UDP Length", __func__);
+                if( udp->getTotalLength()==ntohs( *((u16 *)fspec->value) ) ){
+                    nping_print(DBG_3, "[Match] UDP Len=%u", udp->getTotalLength());
+                    current_score += 2 * FACTOR_UDP_LEN * ((udp->getTotalLength()==8) ? ZERO_PENALTY : 1);
+                }
+            break;
+            case PSPEC_PAYLOAD_MAGIC:
+                if(payload==NULL)break;
+                nping_print(DBG_3, "%s() Trying to match Payload Magic value", __func__);
+                buff=payload->getBinaryBuffer(&bufflen);
+                if(buff==NULL || bufflen<=0 || fspec->len>bufflen)
                     break;
+                if( memcmp(buff, fspec->value, fspec->len)==0 ){
+                    nping_print(DBG_3|NO_NEWLINE, "[Match] Payload magic=0x");
+                    for(unsigned int i=0; i<fspec->len; i++)
+                        nping_print(DBG_3|NO_NEWLINE,"%02x", fspec->value[i]);
+                    nping_print(DBG_3, ";");
+                    /* The payload magic may affect the score only between
+                     * zero and 4 bytes. This is done to prevent long
+                     * common strings like "GET / HTTP/1.1\r\n"
+                     * increasing the score a lot and cause problems for
+                     * the matching logic. */
+                    current_score+= MIN(4, fspec->len)*FACTOR_PAYLOAD_MAGIC;
+                }
+            break;
 
-                    case PSPEC_IPv6_TCLASS:
-                        if(ip6==NULL)break;
-                        nping_print(DBG_3, "%s() Trying to match IPv6 Traffic Class", __func__);
-                        if( ip6->getTrafficClass()==fspec->value[0] ){
-                            nping_print(DBG_3, "[Match] IPv6 TClass=%u", ip6->getTrafficClass() );
-                            current_score += 1 * FACTOR_IPv6_TCLASS  * ((ip6->getTrafficClass()==0) ? ZERO_PENALTY : 1);
-                        }
-                    break;
-                    case PSPEC_IPv6_FLOW:
-                        if(ip6==NULL)break;
-                        nping_print(DBG_3, "%s() Trying to match IPv6 Flow Label", __func__);
-                        if( ip6->getFlowLabel()==ntohl( *((u32 *)fspec->value)) ){
-                            nping_print(DBG_3, "[Match] IPv6 Flow=%lu", (long unsigned)ip6->getFlowLabel() );
-                            current_score += 3 * FACTOR_IPv6_FLOW  * ((ip6->getFlowLabel()==0) ? ZERO_PENALTY : 1);
-                        }
-                    break;
-                    case PSPEC_IPv6_NHDR:
-                        if(ip6==NULL)break;
-                        nping_print(DBG_3, "%s() Trying to match IPv6 Next Header", __func__);
-                        if( ip6->getNextHeader()==fspec->value[0] ){
-                            nping_print(DBG_3, "[Match] IPv6 NextHdr=%02x", ip6->getNextHeader());
-                            current_score += 1 * FACTOR_IPv6_NHDR;
-                        }
-                    break;
-                    case PSPEC_TCP_SPORT:
-                        if(tcp==NULL)break;
-                        nping_print(DBG_3, "%s() Trying to match TCP Source Port", __func__);
-                        if( tcp->getSourcePort()==ntohs( *((u16 *)fspec->value) ) ){
-                            nping_print(DBG_3, "[Match] TCP Src=%u", tcp->getSourcePort());
-                            current_score += 2 * FACTOR_TCP_SPORT;
-                        }
-                    break;
-                    case PSPEC_TCP_DPORT:
-                        if(tcp==NULL)break;
-                        nping_print(DBG_3, "%s() Trying to match TCP Destination Port", __func__);
-                        if( tcp->getDestinationPort()==ntohs( *((u16 *)fspec->value) ) ){
-                            nping_print(DBG_3, "[Match] TCP Dst=%u", tcp->getDestinationPort());
-                            current_score += 2 * FACTOR_TCP_DPORT;
-                        }
-                    break;
-                    case PSPEC_TCP_SEQ:
-                        if(tcp==NULL)break;
-                        nping_print(DBG_3, "%s() Trying to match TCP Sequence Number", __func__);
-                        if( tcp->getSeq()==ntohl( *((u32 *)fspec->value) ) ){
-                            nping_print(DBG_3, "[Match] TCP Seq=%u", tcp->getSeq());
-                            current_score += 4 * FACTOR_TCP_SEQ  * ((tcp->getSeq()==0) ? ZERO_PENALTY : 1);
-                        }
-                    break;
-                    case PSPEC_TCP_ACK:
-                        if(tcp==NULL)break;
-                        nping_print(DBG_3, "%s() Trying to match TCP Acknowledgment", __func__);
-                        if( tcp->getAck()==ntohl( *((u32 *)fspec->value) ) ){
-                            nping_print(DBG_3, "[Match] TCP Ack=%u", tcp->getAck());
-                            current_score += 4 * FACTOR_TCP_ACK  * ((tcp->getAck()==0) ? ZERO_PENALTY : 1);
-                        }
-                    break;
-                    case PSPEC_TCP_FLAGS:
-                        if(tcp==NULL)break;
-                        if( tcp->getFlags()==fspec->value[0] ){
-                            nping_print(DBG_3, "%s() Trying to match TCP Flags", __func__);
-                            nping_print(DBG_3, "[Match] TCP Flags=%02x", tcp->getFlags());
-                            current_score += 1 * FACTOR_TCP_FLAGS;
-                        }
-                    break;
-                    case PSPEC_TCP_WIN:
-                        if(tcp==NULL)break;
-                        nping_print(DBG_3, "%s() Trying to match TCP Window", __func__);
-                        if( tcp->getWindow()==ntohs( *((u16 *)fspec->value) ) ){
-                            nping_print(DBG_3, "[Match] TCP Win=%u", tcp->getWindow());
-                            current_score += 2 * FACTOR_TCP_WIN  * ((tcp->getWindow()==0) ? ZERO_PENALTY : 1);
-                        }
-                    break;
-                    case PSPEC_TCP_URP:
-                        if(tcp==NULL)break;
-                        nping_print(DBG_3, "%s() Trying to match TCP Urgent Pointer", __func__);
-                        if( tcp->getUrgPointer()==ntohs( *((u16 *)fspec->value) ) ){
-                            nping_print(DBG_3, "[Match] TCP Win=%u", tcp->getUrgPointer());
-                            current_score += 2 * FACTOR_TCP_URP  * ((tcp->getUrgPointer()==0) ? ZERO_PENALTY : 1);
-                        }
-                    break;
-                    case PSPEC_ICMP_TYPE:
-                        if(icmp4==NULL)break;
-                        nping_print(DBG_3, "%s() Trying to match ICMPv4 Type", __func__);
-                        if( icmp4->getType()==fspec->value[0] ){
-                            nping_print(DBG_3, "[Match] ICMPv4 Type=%02x", icmp4->getType());
-                            current_score += 1 * FACTOR_ICMP_TYPE;
-                        }
-                    break;
-                    case PSPEC_ICMP_CODE:
-                        if(icmp4==NULL)break;
-                        nping_print(DBG_3, "%s() Trying to match ICMPv4 Code", __func__);
-                        if( icmp4->getCode()==fspec->value[0] ){
-                            nping_print(DBG_3, "[Match] ICMPv4 Code=%02x", icmp4->getCode());
-                            current_score += 1 * FACTOR_ICMP_CODE  * ((icmp4->getCode()==0) ? ZERO_PENALTY : 1);
-                        }
-                    break;
-                    case PSPEC_UDP_SPORT:
-                        if(udp==NULL)break;
-                        nping_print(DBG_3, "%s() Trying to match UDP Source Port", __func__);
-                        if( udp->getSourcePort()==ntohs( *((u16 *)fspec->value) ) ){
-                            nping_print(DBG_3, "[Match] UDP Src=%u", udp->getSourcePort());
-                            current_score += 2 * FACTOR_UDP_SPORT;
-                        }
-                    break;
-                    case PSPEC_UDP_DPORT:
-                        if(udp==NULL)break;
-                        nping_print(DBG_3, "%s() Trying to match UDP Destination Port", __func__);
-                        if( udp->getDestinationPort()==ntohs( *((u16 *)fspec->value) ) ){
-                            nping_print(DBG_3, "[Match] UDP Dst=%u", udp->getDestinationPort());
-                            current_score += 2 * FACTOR_UDP_DPORT;
-                        }
-                    break;
-                    case PSPEC_UDP_LEN:
-                        if(udp==NULL)break;
-                        nping_print(DBG_3, "%s() Trying to match UDP Length", __func__);
-                        if( udp->getTotalLength()==ntohs( *((u16 *)fspec->value) ) ){
-                            nping_print(DBG_3, "[Match] UDP Len=%u", udp->getTotalLength());
-                            current_score += 2 * FACTOR_UDP_LEN * ((udp->getTotalLength()==8) ? ZERO_PENALTY : 1);
-                        }
-                    break;
-                    case PSPEC_PAYLOAD_MAGIC:
-                        if(payload==NULL)break;
-                        nping_print(DBG_3, "%s() Trying to match Payload Magic value", __func__);
-                        buff=payload->getBinaryBuffer(&bufflen);
-                        if(buff==NULL || bufflen<=0 || fspec->len>bufflen)
-                            break;
-                        if( memcmp(buff, fspec->value, fspec->len)==0 ){
-                            nping_print(DBG_3|NO_NEWLINE, "[Match] Payload magic=0x");
-                            for(unsigned int i=0; i<fspec->len; i++)
-                                nping_print(DBG_3|NO_NEWLINE,"%02x", fspec->value[i]);
-                            nping_print(DBG_3, ";");
-                            /* The payload magic may affect the score only between
-                             * zero and 4 bytes. This is done to prevent long
-                             * common strings like "GET / HTTP/1.1\r\n"
-                             * increasing the score a lot and cause problems for
-                             * the matching logic. */
-                            current_score+= MIN(4, fspec->len)*FACTOR_PAYLOAD_MAGIC;
-                        }
-                    break;
+            default:
+                nping_warning(QT_2, "Bogus field specifier found in client #%d context. Please report a bug", ctx->getIdentifier());
+            break;
+        }
+    } /* End of field specifiers loop */
+    return current_score;
+} /* End of nep_score_client() */
 
-                    default:
-                        nping_warning(QT_2, "Bogus field specifier found in client #%d context. Please report a bug", ctx->getIdentifier());
-                    break;
-                }
-            } /* End of field specifiers loop */
 
-            nping_print(DBG_3, "%s() current_score=%.02f candidate_score=%.02f", __func__, current_score, candidate_score);
-            if( (current_score>0) && (current_score>=candidate_score)){
-                candidate_score=current_score;
-                candidate=ctx->getIdentifier();
-                nping_print(DBG_3, "%s() Found better candidate (client #%d; score=%.02f)", __func__, candidate, candidate_score);
-            }
+clientid_t EchoServer::nep_match_headers(IPv4Header *ip4, IPv6Header *ip6, TCPHeader *tcp, UDPHeader *udp, ICMPv4Header *icmp4, RawData *payload){
+  nping_print(DBG_4, "%s(%p,%p,%p,%p,%p,%p)", __func__, ip4, ip6, tcp, udp, icmp4, payload);
+    u8 *buff=NULL;
+    int bufflen=-1;
+    NEPContext *ctx;
+    double current_score=0;
+    double candidate_score=-1;
+    float minimum_score=0;
+    clientid_t candidate=-1;
+    clientid_t clnt;
+    u16 aux16;
+    u32 aux32;
+
+    /* Collect the clients that share at least one identifying field value
+     * with the packet. Any other client can't reach the minimum score. */
+    this->candidates.clear();
+    this->match_count++;
+    if(ip4!=NULL){
+        aux16=htons(ip4->getIdentification());
+        this->add_candidates(PSPEC_IPv4_ID, 2, (u8 *)&aux16);
+        aux16=htons(ip4->getFragOffset());
+        this->add_candidates(PSPEC_IPv4_FRAGOFF, 2, (u8 *)&aux16);
+    }
+    if(ip6!=NULL){
+        aux32=htonl(ip6->getFlowLabel());
+        this->add_candidates(PSPEC_IPv6_FLOW, 4, (u8 *)&aux32);
+    }
+    if(tcp!=NULL){
+        aux16=htons(tcp->getSourcePort());
+        this->add_candidates(PSPEC_TCP_SPORT, 2, (u8 *)&aux16);
+        aux32=htonl(tcp->getSeq());
+        this->add_candidates(PSPEC_TCP_SEQ, 4, (u8 *)&aux32);
+        aux32=htonl(tcp->getAck());
+        this->add_candidates(PSPEC_TCP_ACK, 4, (u8 *)&aux32);
+        aux16=htons(tcp->getUrgPointer());
+        this->add_candidates(PSPEC_TCP_URP, 2, (u8 *)&aux16);
+    }
+    if(udp!=NULL){
+        aux16=htons(udp->getSourcePort());
+        this->add_candidates(PSPEC_UDP_SPORT, 2, (u8 *)&aux16);
+    }
+    if(payload!=NULL && (buff=payload->getBinaryBuffer(&bufflen))!=NULL){
+        for(int len=1; len<=MIN(bufflen, PACKETSPEC_FIELD_LEN); len++){
+            if(this->magic_lens[len]>0)
+                this->add_candidates(PSPEC_PAYLOAD_MAGIC, len, buff);
+        }
+    }
+    for(size_t i=0; i<this->unindexed_clients.size(); i++){
+        clnt=this->unindexed_clients[i];
+        if(this->client_ctx[clnt].mark!=this->match_count){
+            this->client_ctx[clnt].mark=this->match_count;
+            this->candidates.push_back(clnt);
+        }
+    }
+
+    /* Score the candidates. Ties go to the most recent session. */
+    for(size_t i=0; i<this->candidates.size(); i++){
+        clnt=this->candidates[i];
+        if( (ctx=this->getClientContext(clnt))==NULL || !ctx->ready() )
+            continue;
+        current_score=this->nep_score_client(ctx, ip4, ip6, tcp, udp, icmp4, payload);
+        nping_print(DBG_3, "%s() current_score=%.02f candidate_score=%.02f", __func__, current_score, candidate_score);
+        if( (current_score>0) && (current_score>candidate_score || (current_score==candidate_score && clnt>candidate)) ){
+            candidate_score=current_score;
+            candidate=clnt;
+            nping_print(DBG_3, "%s() Found better candidate (client #%d; score=%.02f)", __func__, candidate, candidate_score);
         }
-    } /* End of connected clients loop */
+    }
 
     if( tcp!=NULL )
         minimum_score=MIN_ACCEPTABLE_SCORE_TCP;
@@ -874,31 +1240,13 @@ clientid_t EchoServer::nep_match_packet(const u8 *pkt, size_t pktlen){
 } /* End of nep_match_packet() */
 
 
-int EchoServer::nep_capture_handler(nsock_pool nsp, nsock_event nse, void *param){
+/* Echoes a captured packet back to the client it belongs to, if any. */
+int EchoServer::nep_echo_packet(nsock_pool nsp, const u8 *packet, size_t packetlen){
   nping_print(DBG_4, "%s()", __func__);
   clientid_t clnt=CLIENT_NOT_FOUND;
-  const unsigned char *packet=NULL;
-  const unsigned char *link=NULL;
-  nsock_iod nsi = nse_iod(nse);
-  struct timeval pcaptime;
   nsock_iod clnt_iod=NULL;
   NEPContext *ctx=NULL;
   EchoHeader pkt_out;
-  size_t linklen=0;
-  size_t packetlen=0;
-  handler_arg_t arg;
-  arg.me=this;
-  arg.param=NULL;
-
-  /* If there are connected clients, schedule another packet capture event */
-  if(this->client_ctx.size()>0){
-    nsock_pcap_read_packet(nsp, nsi, capture_handler, NSOCK_INFINITE, &arg);
-    nping_print(DBG_3, "Scheduled next capture event");
-  }
-
-  /* Get the actual captured packet */
-  nse_readpcap(nse, &link, &linklen, &packet, &packetlen, NULL, &pcaptime);
-  nping_print(DBG_3, "Captured %lu bytes", (unsigned long)packetlen);
 
   /* Update Rx stats */
   /* TODO @todo Here find a way to determine which IP and upper layer proto
@@ -926,13 +1274,84 @@ int EchoServer::nep_capture_handler(nsock_pool nsp, nsock_event nse, void *param
   }
 
   if( ctx->ready() ){
+#ifndef WIN32
+      /* Let the client's worker generate the NEP_ECHO message */
+      if(!this->workers.empty()){
+          struct echo_job job;
+          job.ctx=ctx;
+          job.clnt=clnt;
+          job.release=false;
+          job.data=(u8 *)safe_malloc(packetlen);
+          memcpy(job.data, packet, packetlen);
+          job.len=job.pktlen=packetlen;
+          this->queue_job(&job);
+          return OP_SUCCESS;
+      }
+#endif
       this->generate_echo(&pkt_out, packet, packetlen, ctx);
-      nsock_write(nsp, clnt_iod, echo_handler, NSOCK_INFINITE, NULL, (const char *)pkt_out.getBinaryBuffer(), pkt_out.getLen());
+      this->send_echo(nsp, clnt, pkt_out.getBinaryBuffer(), pkt_out.getLen());
       /* TODO @todo Here find a way to determine which IP and upper layer proto
        * the packet has so we can update the stats properly. */
       o.stats.update_echoed(0,0,packetlen);
   }
   return OP_SUCCESS;
+} /* End of nep_echo_packet() */
+
+
+/* Queues a NEP_ECHO message for a client. Nsock doesn't send the writes that
+ * are pending on the same IOD in the order they were scheduled, and the client
+ * rejects echoes that arrive out of sequence, so messages are appended to the
+ * client's output buffer and only one write per client is kept in progress. */
+void EchoServer::send_echo(nsock_pool nsp, clientid_t clnt, const u8 *msg, u32 len){
+  struct client_slot *slot=&this->client_ctx[clnt];
+  if(slot->outlen+len > slot->outsize){
+    slot->outsize=MAX(slot->outlen+len, slot->outsize*2);
+    slot->outbuf=(u8 *)safe_realloc(slot->outbuf, slot->outsize);
+  }
+  memcpy(slot->outbuf+slot->outlen, msg, len);
+  slot->outlen+=len;
+  if(!slot->writing)
+    this->flush_echoes(nsp, clnt);
+} /* End of send_echo() */
+
+
+/* Writes everything stored in a client's output buffer. nsock_write() keeps
+ * its own copy of the data, so the buffer can be reused straight away. */
+void EchoServer::flush_echoes(nsock_pool nsp, clientid_t clnt){
+  struct client_slot *slot=&this->client_ctx[clnt];
+  nsock_iod clnt_iod=NULL;
+  if(slot->outlen==0 || slot->ctx==NULL || (clnt_iod=slot->ctx->getNsockIOD())==NULL){
+    slot->writing=false;
+    return;
+  }
+  nsock_write(nsp, clnt_iod, echo_handler, NSOCK_INFINITE, NULL, (const char *)slot->outbuf, slot->outlen);
+  slot->outlen=0;
+  slot->writing=true;
+} /* End of flush_echoes() */
+
+
+int EchoServer::nep_capture_handler(nsock_pool nsp, nsock_event nse, void *param){
+  nping_print(DBG_4, "%s()", __func__);
+  const unsigned char *packet=NULL;
+  nsock_iod nsi = nse_iod(nse);
+  size_t packetlen=0;
+  size_t cursor=0;
+  handler_arg_t arg;
+  arg.me=this;
+  arg.param=NULL;
+
+  /* If there are connected clients, schedule another packet capture event */
+  if(this->total_clients>0){
+    nsock_pcap_read_packets(nsp, nsi, capture_handler, NSOCK_INFINITE, PCAP_READ_BATCH, &arg);
+    nping_print(DBG_3, "Scheduled next capture event");
+  }
+
+  /* The event may carry several captured packets. Echo them all. */
+  while(nse_readpcap_next(nse, &cursor, NULL, NULL, &packet, &packetlen, NULL, NULL)){
+    nping_print(DBG_3, "Captured %lu bytes", (unsigned long)packetlen);
+    this->nep_echo_packet(nsp, packet, packetlen);
+  }
+  return OP_SUCCESS;
 } /* End of nep_capture_handler() */
 
 
@@ -944,6 +1363,11 @@ int EchoServer::nep_echo_handler(nsock_pool nsp, nsock_event nse, void *param){
       this->nep_session_ended_handler(nsp, nse, param);
   }else{
     nping_print(DBG_1, "SENT: NEP_ECHO");
+    /* Send whatever was echoed while this write was in progress */
+    clientid_t *clnt=(clientid_t *)nsi_getud(nse_iod(nse));
+    NEPContext *ctx=NULL;
+    if(clnt!=NULL && (ctx=this->getClientContext(*clnt))!=NULL && ctx->getNsockIOD()==nse_iod(nse))
+      this->flush_echoes(nsp, *clnt);
   }
   return OP_SUCCESS;
 } /* End of nep_echo_handler() */
@@ -1061,6 +1485,7 @@ int EchoServer::nep_packetspec_handler(nsock_pool nsp, nsock_event nse, void *pa
       return OP_FAILURE;
   }
   ctx->setState(STATE_READY_SENT);
+  this->index_client(ctx);
   nping_print(VB_1, "[%lu] NEP handshake with client #%d (%s:%d) was performed successfully", (unsigned long)time(NULL), ctx->getIdentifier(), IPAddress::toString(ctx->getAddress()), sockaddr2port(ctx->getAddress()));
 
   /* Craft response and send it */
@@ -1115,6 +1540,24 @@ int EchoServer::nep_session_ended_handler(nsock_pool nsp, nsock_event nse, void
 } /* End of nep_session_ended_handler() */
 
 
+/* Called when an echo worker has NEP_ECHO messages ready to be sent. */
+int EchoServer::nep_wake_handler(nsock_pool nsp, nsock_event nse, void *param){
+  nping_print(DBG_4, "%s()", __func__);
+#ifndef WIN32
+  if(nse_status(nse)!=NSE_STATUS_SUCCESS){
+    nping_warning(QT_2, "Lost contact with the echo workers: %s", strerror(nse_errorcode(nse)));
+    return OP_FAILURE;
+  }
+  /* Clear the flag before draining, so any message queued from now on
+   * triggers a new wake-up. */
+  __atomic_store_n(&this->wake_pending, false, __ATOMIC_RELEASE);
+  this->drain_workers(nsp);
+  nsock_read(nsp, this->wake_nsi, wake_handler, NSOCK_INFINITE, NULL);
+#endif
+  return OP_SUCCESS;
+} /* End of nep_wake_handler() */
+
+
 
 /** Processes and validates a received NEP_HANDSHAKE_CLIENT message. On success
   * it returns OP_SUCCESS. OP_FAILURE is returned in case the received packet
@@ -1181,14 +1624,14 @@ int EchoServer::parse_hs_client(u8 *pkt, size_t pktlen, NEPContext *ctx){
 
 
   /* Decrypt the encrypted part of the message before validating the MAC */
-  if((next_iv=h.decrypt(ctx->getCipherKeyC2S(), CIPHER_KEY_LEN, ctx->getClientNonce(), TYPE_NEP_HANDSHAKE_CLIENT))==NULL){
+  if((next_iv=h.decrypt(ctx->getCryptoC2S(), ctx->getCipherKeyC2S(), CIPHER_KEY_LEN, ctx->getClientNonce(), TYPE_NEP_HANDSHAKE_CLIENT))==NULL){
       nping_print(DBG_1, "Failed to decrypt NEP_HANDSHAKE_CLIENT data." );
       return OP_FAILURE;
   }
   ctx->setNextDecryptionIV(next_iv);
 
   /* Check the authenticity of the received message */
-  if( h.verifyMessageAuthenticationCode( ctx->getMacKeyC2S(), MAC_KEY_LEN)!=OP_SUCCESS ){
+  if( h.verifyMessageAuthenticationCode(ctx->getCryptoC2S(), ctx->getMacKeyC2S(), MAC_KEY_LEN)!=OP_SUCCESS ){
       nping_print(DBG_1, "NEP_HANDSHAKE_CLIENT authentication failed" );
       return OP_FAILURE;
   }
@@ -1220,7 +1663,7 @@ int EchoServer::parse_packet_spec(u8 *pkt, size_t pktlen, NEPContext *ctx){
   h.storeRecvData(pkt, pktlen);
 
   /* Decrypt message */
-  if((next_iv=h.decrypt(ctx->getCipherKeyC2S(), CIPHER_KEY_LEN, ctx->getNextDecryptionIV(), TYPE_NEP_PACKET_SPEC))==NULL){
+  if((next_iv=h.decrypt(ctx->getCryptoC2S(), ctx->getCipherKeyC2S(), CIPHER_KEY_LEN, ctx->getNextDecryptionIV(), TYPE_NEP_PACKET_SPEC))==NULL){
       nping_print(DBG_1, "Failed to decrypt NEP_PACKET_SPEC data." );
       return OP_FAILURE;
   }
@@ -1260,7 +1703,7 @@ int EchoServer::parse_packet_spec(u8 *pkt, size_t pktlen, NEPContext *ctx){
   }
 
   /* Check the authenticity of the received message */
-  if( h.verifyMessageAuthenticationCode( ctx->getMacKeyC2S(), MAC_KEY_LEN)!=OP_SUCCESS ){
+  if( h.verifyMessageAuthenticationCode(ctx->getCryptoC2S(), ctx->getMacKeyC2S(), MAC_KEY_LEN)!=OP_SUCCESS ){
       nping_print(DBG_1, "NEP_PACKET_SPEC authentication failed" );
       return OP_FAILURE;
   }
@@ -1320,7 +1763,7 @@ int EchoServer::generate_hs_server(EchoHeader *h, NEPContext *ctx){
   h->setTimestamp();
   h->setServerNonce( ctx->getServerNonce() );
   h->setTotalLength();
-  h->setMessageAuthenticationCode( ctx->getMacKeyS2C(), MAC_KEY_LEN);
+  h->setMessageAuthenticationCode(ctx->getCryptoS2C(), ctx->getMacKeyS2C(), MAC_KEY_LEN);
   return OP_SUCCESS;
 } /* End of generate_hs_server() */
 
@@ -1348,10 +1791,10 @@ int EchoServer::generate_hs_final(EchoHeader *h, NEPContext *ctx){
       h->setPartnerAddress(s4->sin_addr);
   }
   h->setTotalLength();
-  h->setMessageAuthenticationCode( ctx->getMacKeyS2C(), MAC_KEY_LEN);
+  h->setMessageAuthenticationCode(ctx->getCryptoS2C(), ctx->getMacKeyS2C(), MAC_KEY_LEN);
 
   /* Encrypt message */
-  if( (next_iv=h->encrypt(ctx->getCipherKeyS2C(), CIPHER_KEY_LEN, ctx->getServerNonce()))==NULL )
+  if( (next_iv=h->encrypt(ctx->getCryptoS2C(), ctx->getCipherKeyS2C(), CIPHER_KEY_LEN, ctx->getServerNonce()))==NULL )
       return OP_FAILURE;
   ctx->setNextEncryptionIV(next_iv);
 
@@ -1373,10 +1816,10 @@ int EchoServer::generate_ready(EchoHeader *h, NEPContext *ctx){
   h->setSequenceNumber( ctx->getNextServerSequence() );
   h->setTimestamp();
   h->setTotalLength();
-  h->setMessageAuthenticationCode(ctx->getMacKeyS2C(), MAC_KEY_LEN);
+  h->setMessageAuthenticationCode(ctx->getCryptoS2C(), ctx->getMacKeyS2C(), MAC_KEY_LEN);
 
   /* Encrypt message */
-  if( (next_iv=h->encrypt(ctx->getCipherKeyS2C(), CIPHER_KEY_LEN, ctx->getNextEncryptionIV()))==NULL )
+  if( (next_iv=h->encrypt(ctx->getCryptoS2C(), ctx->getCipherKeyS2C(), CIPHER_KEY_LEN, ctx->getNextEncryptionIV()))==NULL )
       return OP_FAILURE;
   ctx->setNextEncryptionIV(next_iv);
 
@@ -1384,11 +1827,11 @@ int EchoServer::generate_ready(EchoHeader *h, NEPContext *ctx){
 } /* End of generate_ready() */
 
 
-/** Generates a NEP_ECHO message. On success it returns OP_SUCCESS.
-  * OP_FAILURE is returned in case of error. */
-int EchoServer::generate_echo(EchoHeader *h, const u8 *pkt, size_t pktlen, NEPContext *ctx){
+/** Fills in a NEP_ECHO message and computes its MAC, leaving it ready to be
+  * encrypted. On success it returns OP_SUCCESS. OP_FAILURE is returned in
+  * case of error. */
+int EchoServer::build_echo(EchoHeader *h, const u8 *pkt, size_t pktlen, NEPContext *ctx){
   nping_print(DBG_4, "%s()", __func__);
-  u8 *next_iv=NULL;
   if(h==NULL || ctx==NULL || pkt==NULL || pktlen==0)
     return OP_FAILURE;
 
@@ -1429,9 +1872,20 @@ int EchoServer::generate_echo(EchoHeader *h, const u8 *pkt, size_t pktlen, NEPCo
   }
 
   h->setTotalLength();
-  h->setMessageAuthenticationCode(ctx->getMacKeyS2C(), MAC_KEY_LEN);
+  h->setMessageAuthenticationCode(ctx->getCryptoS2C(), ctx->getMacKeyS2C(), MAC_KEY_LEN);
+  return OP_SUCCESS;
+} /* End of build_echo() */
+
+
+/** Generates a NEP_ECHO message. On success it returns OP_SUCCESS.
+  * OP_FAILURE is returned in case of error. */
+int EchoServer::generate_echo(EchoHeader *h, const u8 *pkt, size_t pktlen, NEPContext *ctx){
+  nping_print(DBG_4, "%s()", __func__);
+  u8 *next_iv=NULL;
 
-  if( (next_iv=h->encrypt(ctx->getCipherKeyS2C(), CIPHER_KEY_LEN, ctx->getNextEncryptionIV()))==NULL )
+  if(this->build_echo(h, pkt, pktlen, ctx)!=OP_SUCCESS)
+      return OP_FAILURE;
+  if( (next_iv=h->encrypt(ctx->getCryptoS2C(), ctx->getCipherKeyS2C(), CIPHER_KEY_LEN, ctx->getNextEncryptionIV()))==NULL )
       return OP_FAILURE;
   ctx->setNextEncryptionIV(next_iv);
 
@@ -1439,6 +1893,28 @@ int EchoServer::generate_echo(EchoHeader *h, const u8 *pkt, size_t pktlen, NEPCo
 } /* End of generate_echo() */
 
 
+/** Generates several consecutive NEP_ECHO messages for the same client. They
+  * are encrypted in one go, as they are chained anyway: each message uses
+  * the last ciphertext block of the previous one as IV. On success it
+  * returns OP_SUCCESS. OP_FAILURE is returned in case of error. */
+int EchoServer::generate_echoes(EchoHeader **h, const u8 **pkts, const size_t *pktlens, int count, NEPContext *ctx){
+  nping_print(DBG_4, "%s(%d)", __func__, count);
+  u8 *next_iv=NULL;
+  if(h==NULL || pkts==NULL || pktlens==NULL || count<=0 || ctx==NULL)
+    return OP_FAILURE;
+
+  for(int i=0; i<count; i++){
+    if(this->build_echo(h[i], pkts[i], pktlens[i], ctx)!=OP_SUCCESS)
+      return OP_FAILURE;
+  }
+  if( (next_iv=EchoHeader::encrypt_batch(ctx->getCryptoS2C(), h, count, ctx->getCipherKeyS2C(), CIPHER_KEY_LEN, ctx->getNextEncryptionIV()))==NULL )
+      return OP_FAILURE;
+  ctx->setNextEncryptionIV(next_iv);
+
+  return OP_SUCCESS;
+} /* End of generate_echoes() */
+
+
 /** This is the server's main method. It sets up nsock and pcap, waits for
   * client connections and handles all the events of the client sessions. */
 int EchoServer::start() {
@@ -1470,6 +1946,9 @@ int EchoServer::start() {
   else if( o.getDebugging() > DBG_5 )
     nsock_set_loglevel(nsp, NSOCK_LOG_DBG_ALL);
 
+  /* Make room in the kernel for bursts of captured packets */
+  nsp_setpcapbufsize(nsp, PCAP_BUFFER_SIZE);
+
   /* Create new IOD for pcap */
   if ((pcap_nsi = nsi_new(nsp, NULL)) == NULL)
     nping_fatal(QT_3, "Failed to create new nsock_iod.  QUITTING.\n");
@@ -1483,6 +1962,10 @@ int EchoServer::start() {
     nping_fatal(QT_3, "Error opening capture device %s\n", o.getDevice());
   else
     nping_print(VB_0,"Packet capture will be performed using network interface %s.", o.getDevice());
+#ifndef WIN32
+  if(o.getThreads()>0)
+    this->start_workers(nsp, o.getThreads());
+#endif
   nping_print(VB_0,"Waiting for connections...");
 
   /* Get a socket suitable for an accept() call */
@@ -1531,7 +2014,7 @@ int EchoServer::start() {
             nsock_write(nsp, client_nsi, hs_server_handler, NSOCK_INFINITE, NULL, (const char *)h.getBufferPointer(), h.getLen() );
 
             /* For every client we schedule a packet capture event. */
-            nsock_pcap_read_packet(nsp, pcap_nsi, capture_handler, NSOCK_INFINITE, NULL);
+            nsock_pcap_read_packets(nsp, pcap_nsi, capture_handler, NSOCK_INFINITE, PCAP_READ_BATCH, NULL);
 
         }
         block_socket(listen_sd);
@@ -1550,8 +2033,206 @@ int EchoServer::start() {
 
 
 /** Performs cleanup functions */
+#ifndef WIN32
+/******************************************************************************/
+/**** ECHO WORKERS ************************************************************/
+/******************************************************************************/
+
+/* Starts the echo worker threads. Packets are still captured and matched by
+ * the thread that runs the nsock loop, but generating the NEP_ECHO messages,
+ * which is where the MAC and encryption work happens, is left to the workers.
+ * Every client is served by a single worker, so its messages are generated
+ * and sent in order. Workers wake the server up through a socket pair when
+ * they have messages ready to be sent. */
+int EchoServer::start_workers(nsock_pool nsp, u32 nworkers){
+  nping_print(DBG_4, "%s(%u)", __func__, nworkers);
+  struct echo_worker *w=NULL;
+  int err=0;
+
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, this->wake_sd)!=0)
+    nping_fatal(QT_3, "%s(): Unable to create socket pair: %s", __func__, strerror(errno));
+  unblock_socket(this->wake_sd[1]);
+  if( (this->wake_nsi=nsi_new2(nsp, this->wake_sd[0], NULL))==NULL )
+    nping_fatal(QT_3, "Failed to create new nsock_iod.  QUITTING.\n");
+  nsock_read(nsp, this->wake_nsi, wake_handler, NSOCK_INFINITE, NULL);
+
+  this->stop_workers=false;
+  for(u32 i=0; i<nworkers; i++){
+    w=new struct echo_worker;
+    w->server=this;
+    w->index=i;
+    w->jobs=new SPSCQueue<struct echo_job>(ECHO_WORKER_QUEUE_LEN);
+    w->done=new SPSCQueue<struct echo_job>(ECHO_WORKER_QUEUE_LEN);
+    w->batch=new EchoHeader[ECHO_WORKER_BATCH];
+    this->workers.push_back(w);
+  }
+  for(u32 i=0; i<nworkers; i++){
+    if((err=pthread_create(&this->workers[i]->thread, NULL, worker_main, this->workers[i]))!=0)
+      nping_fatal(QT_3, "%s(): Unable to start echo worker: %s", __func__, strerror(err));
+  }
+  nping_print(VB_1, "Echo messages will be generated by %u worker threads.", nworkers);
+  return OP_SUCCESS;
+} /* End of start_workers() */
+
+
+/* Stops the echo workers and discards the jobs they had not finished. */
+void EchoServer::end_workers(){
+  struct echo_job job;
+  if(this->workers.empty())
+    return;
+  __atomic_store_n(&this->stop_workers, true, __ATOMIC_RELEASE);
+  for(size_t i=0; i<this->workers.size(); i++)
+    pthread_join(this->workers[i]->thread, NULL);
+  for(size_t i=0; i<this->workers.size(); i++){
+    while(this->workers[i]->jobs->pop(&job))
+      free(job.data);
+    while(this->workers[i]->done->pop(&job))
+      free(job.data);
+    delete this->workers[i]->jobs;
+    delete this->workers[i]->done;
+    delete[] this->workers[i]->batch;
+    delete this->workers[i];
+  }
+  this->workers.clear();
+  /* The IOD has its own copy of wake_sd[0] */
+  close(this->wake_sd[0]);
+  close(this->wake_sd[1]);
+  this->wake_sd[0]=this->wake_sd[1]=-1;
+} /* End of end_workers() */
+
+
+/* Hands a job to the worker in charge of the job's client. If the worker is
+ * falling behind, captured packets are dropped rather than stalling the
+ * capture, but release jobs always make it to the queue. */
+void EchoServer::queue_job(struct echo_job *job){
+  struct echo_worker *w=this->workers[job->clnt % this->workers.size()];
+  while(!w->jobs->push(*job)){
+    if(!job->release){
+      nping_print(DBG_2, "Echo worker #%u is busy. Captured packet dropped.", w->index);
+      free(job->data);
+      return;
+    }
+    /* Make room for the release job */
+    this->drain_workers(NULL);
+    usleep(ECHO_WORKER_IDLE_WAIT);
+  }
+} /* End of queue_job() */
+
+
+void EchoServer::run_worker(struct echo_worker *w){
+  struct echo_job jobs[ECHO_WORKER_BATCH];
+  int njobs=0, i=0, j=0;
+  char wake=0;
+
+  while(1){
+    /* Take every job that is waiting, up to the batch size */
+    for(njobs=0; njobs<ECHO_WORKER_BATCH && w->jobs->pop(&jobs[njobs]); njobs++)
+      ;
+    if(njobs==0){
+      if(__atomic_load_n(&this->stop_workers, __ATOMIC_ACQUIRE))
+        break;
+      usleep(ECHO_WORKER_IDLE_WAIT);
+      continue;
+    }
+
+    /* Replace the captured packets with the NEP_ECHO messages that carry
+     * them. Release jobs just go back to the server. */
+    for(i=0; i<njobs; i=j){
+      for(j=i+1; j<njobs && !jobs[i].release && !jobs[j].release && jobs[j].ctx==jobs[i].ctx; j++)
+        ;
+      if(!jobs[i].release)
+        this->run_echo_jobs(w, jobs+i, j-i);
+    }
+
+    for(i=0; i<njobs; i++){
+      while(!w->done->push(jobs[i])){
+        if(__atomic_load_n(&this->stop_workers, __ATOMIC_ACQUIRE)){
+          for(; i<njobs; i++)
+            free(jobs[i].data);
+          return;
+        }
+        usleep(ECHO_WORKER_IDLE_WAIT);
+      }
+    }
+
+    /* Wake the server up unless somebody did it already */
+    if(!__atomic_exchange_n(&this->wake_pending, true, __ATOMIC_ACQ_REL)){
+      if(write(this->wake_sd[1], &wake, 1)<0 && errno!=EAGAIN)
+        nping_warning(QT_2, "Echo worker #%u couldn't wake the server: %s", w->index, strerror(errno));
+    }
+  }
+} /* End of run_worker() */
+
+
+/* Generates the NEP_ECHO messages for a run of jobs that belong to the same
+ * client. Each job's packet is replaced with its message, or with NULL if the
+ * messages couldn't be generated. */
+void EchoServer::run_echo_jobs(struct echo_worker *w, struct echo_job *jobs, int count){
+  EchoHeader *msgs[ECHO_WORKER_BATCH]={NULL};
+  const u8 *pkts[ECHO_WORKER_BATCH]={NULL};
+  size_t lens[ECHO_WORKER_BATCH]={0};
+  bool ok=false;
+  u8 *msg=NULL;
+
+  if(jobs==NULL || count<=0)
+    return;
+  for(int i=0; i<count; i++){
+    w->batch[i].reset();
+    msgs[i]=&w->batch[i];
+    pkts[i]=jobs[i].data;
+    lens[i]=jobs[i].pktlen;
+  }
+  ok=(this->generate_echoes(msgs, pkts, lens, count, jobs[0].ctx)==OP_SUCCESS);
+  for(int i=0; i<count; i++){
+    msg=NULL;
+    if(ok){
+      msg=(u8 *)safe_malloc(msgs[i]->getLen());
+      memcpy(msg, msgs[i]->getBinaryBuffer(), msgs[i]->getLen());
+      jobs[i].len=msgs[i]->getLen();
+    }
+    free(jobs[i].data);
+    jobs[i].data=msg;
+  }
+} /* End of run_echo_jobs() */
+
+
+/* Sends the NEP_ECHO messages the workers have generated and frees the
+ * contexts they have released. When nsp is NULL, messages are discarded. */
+void EchoServer::drain_workers(nsock_pool nsp){
+  struct echo_job job;
+  NEPContext *ctx=NULL;
+
+  for(size_t i=0; i<this->workers.size(); i++){
+    while(this->workers[i]->done->pop(&job)){
+      if(job.release){
+        this->release_slot(job.clnt);
+        nping_print(DBG_2, "Released client #%d context.", job.clnt);
+        continue;
+      }
+      /* The session may have ended while the message was being generated */
+      ctx=this->getClientContext(job.clnt);
+      if(nsp!=NULL && job.data!=NULL && ctx==job.ctx){
+        this->send_echo(nsp, job.clnt, job.data, job.len);
+        o.stats.update_echoed(0,0,job.pktlen);
+      }
+      free(job.data);
+    }
+  }
+} /* End of drain_workers() */
+
+
+void *EchoServer::worker_main(void *arg){
+  struct echo_worker *w=(struct echo_worker *)arg;
+  w->server->run_worker(w);
+  return NULL;
+} /* End of worker_main() */
+#endif
+
+
 int EchoServer::cleanup(){
-  // For the moment there is nothing to cleanup
+#ifndef WIN32
+  this->end_workers();
+#endif
   return OP_SUCCESS;
 } /* End of cleanup() */
 
@@ -1639,6 +2320,14 @@ void session_ended_handler(nsock_pool nsp, nsock_event nse, void *arg){
 } /* End of ready_handler() */
 
 
+/* This handler is a wrapper for the EchoServer::nep_wake_handler() method. */
+void wake_handler(nsock_pool nsp, nsock_event nse, void *arg){
+  nping_print(DBG_4, "%s()", __func__);
+  es.nep_wake_handler(nsp, nse, arg);
+  return;
+} /* End of wake_handler() */
+
+
 /* Void handler that does nothing */
 void empty_handler(nsock_pool nsp, nsock_event nse, void *arg){
   return;
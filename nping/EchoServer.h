@@ -128,17 +128,96 @@
 #include "nsock.h"
 #include <vector>
 #include "NEPContext.h"
+#ifndef WIN32
+#include <pthread.h>
+#include "ProbePipeline.h"
+#endif
 
 using namespace std;
 
 #define LISTEN_QUEUE_SIZE 10
+#define SPEC_INDEX_MIN_BUCKETS 256
+
+/* Capacity of the queues between the server and each echo worker */
+#define ECHO_WORKER_QUEUE_LEN 8192
+
+/* Time an echo worker sleeps when it has nothing to do (microseconds) */
+#define ECHO_WORKER_IDLE_WAIT 100
+
+/* Max number of jobs an echo worker takes at once. Consecutive echoes for
+ * the same client are encrypted together. */
+#define ECHO_WORKER_BATCH 32
+
+/* Per client bookkeeping. Slots are indexed by client identifier. */
+struct client_slot{
+  NEPContext *ctx;     /* Client context, NULL if the slot is free       */
+  bool indexed;        /* Packet spec has been added to the spec index   */
+  bool unindexed;      /* Client must be scored against every packet     */
+  bool closing;        /* Session ended. Waiting for its echo worker     */
+  bool writing;        /* A NEP_ECHO write is in progress                */
+  u32 mark;            /* Last packet the client was a candidate for     */
+  u8 *outbuf;          /* NEP_ECHO messages waiting for the write above  */
+  u32 outlen;          /* Bytes stored in outbuf                         */
+  u32 outsize;         /* Allocated size of outbuf                       */
+};
+
+#ifndef WIN32
+class EchoServer;
+
+/* A captured packet handed to an echo worker. The worker replaces it with the
+ * NEP_ECHO message that carries it and hands the job back. Release jobs carry
+ * no packet: they tell the server that the worker is done with a context. */
+struct echo_job{
+  NEPContext *ctx;     /* Context of the client the packet belongs to    */
+  clientid_t clnt;     /* Client identifier                              */
+  bool release;        /* Is it a release job?                           */
+  u8 *data;            /* Captured packet, and then the NEP_ECHO message */
+  u32 len;             /* Length of data                                 */
+  u32 pktlen;          /* Length of the captured packet                  */
+};
+
+/* State of an echo worker. Each one generates the NEP_ECHO messages, MAC and
+ * encryption included, for its own share of the client sessions. */
+struct echo_worker{
+  EchoServer *server;                  /* Server it belongs to          */
+  pthread_t thread;
+  SPSCQueue<struct echo_job> *jobs;    /* Packets to be echoed          */
+  SPSCQueue<struct echo_job> *done;    /* Messages ready to be sent     */
+  EchoHeader *batch;                   /* ECHO_WORKER_BATCH messages    */
+  u32 index;                           /* Number of the worker          */
+};
+#endif
+
+/* Clients whose packet spec contains a given identifying field value */
+struct spec_entry{
+  u8 field;
+  u8 len;
+  u8 value[PACKETSPEC_FIELD_LEN];
+  u32 hash;
+  vector<clientid_t> clients;
+  struct spec_entry *next;   /* Next entry in the same bucket */
+};
 
 class EchoServer  {
 
     private:
         /* Attributes */
-        vector<NEPContext> client_ctx;
+        vector<struct client_slot> client_ctx; /* Indexed by client ID      */
+        u32 total_clients;                     /* Number of used slots      */
         clientid_t client_id_count;
+        vector<struct spec_entry *> spec_index; /* Hash buckets             */
+        u32 total_specs;                       /* Entries in the spec index */
+        vector<clientid_t> unindexed_clients;  /* Always scored clients     */
+        vector<clientid_t> candidates;         /* Clients scored per packet */
+        u32 magic_lens[PACKETSPEC_FIELD_LEN+1]; /* Payload magics per length */
+        u32 match_count;                       /* Packets matched so far    */
+#ifndef WIN32
+        vector<struct echo_worker *> workers;  /* Echo worker threads       */
+        int wake_sd[2];                        /* Workers wake the server   */
+        nsock_iod wake_nsi;                    /* IOD for wake_sd[0]        */
+        bool wake_pending;                     /* Is a wake-up on its way?  */
+        bool stop_workers;                     /* Tells the workers to quit */
+#endif
 
         /* Methods */
         int nep_listen_socket();
@@ -148,6 +227,12 @@ class EchoServer  {
         int destroyClientContext(clientid_t clnt);
         nsock_iod getClientNsockIOD(clientid_t clnt);
         clientid_t getNewClientID();
+        int index_client(NEPContext *ctx);
+        int unindex_client(NEPContext *ctx);
+        struct spec_entry *find_spec(u8 field, u8 len, const u8 *value, u32 hash);
+        void grow_spec_index();
+        void add_candidates(u8 field, u8 len, const u8 *value);
+        double nep_score_client(NEPContext *ctx, IPv4Header *ip4, IPv6Header *ip6, TCPHeader *tcp, UDPHeader *udp, ICMPv4Header *icmp4, RawData *payload);
         clientid_t nep_match_packet(const u8 *pkt, size_t pktlen);
         clientid_t nep_match_headers(IPv4Header *ip4, IPv6Header *ip6, TCPHeader *tcp, UDPHeader *udp, ICMPv4Header *icmp4, RawData *payload);
         int parse_hs_client(u8 *pkt, size_t pktlen, NEPContext *ctx);
@@ -156,7 +241,22 @@ class EchoServer  {
         int generate_hs_server(EchoHeader *h, NEPContext *ctx);
         int generate_hs_final(EchoHeader *h, NEPContext *ctx);
         int generate_ready(EchoHeader *h, NEPContext *ctx);
+        int build_echo(EchoHeader *h, const u8 *pkt, size_t pktlen, NEPContext *ctx);
         int generate_echo(EchoHeader *h, const u8 *pkt, size_t pktlen, NEPContext *ctx);
+        int generate_echoes(EchoHeader **h, const u8 **pkts, const size_t *pktlens, int count, NEPContext *ctx);
+        int nep_echo_packet(nsock_pool nsp, const u8 *pkt, size_t pktlen);
+        void send_echo(nsock_pool nsp, clientid_t clnt, const u8 *msg, u32 len);
+        void flush_echoes(nsock_pool nsp, clientid_t clnt);
+        void release_slot(clientid_t clnt);
+#ifndef WIN32
+        int start_workers(nsock_pool nsp, u32 nworkers);
+        void end_workers();
+        void queue_job(struct echo_job *job);
+        void run_worker(struct echo_worker *w);
+        void run_echo_jobs(struct echo_worker *w, struct echo_job *jobs, int count);
+        void drain_workers(nsock_pool nsp);
+        static void *worker_main(void *arg);
+#endif
 
     public:
 
@@ -174,6 +274,7 @@ class EchoServer  {
         int nep_packetspec_handler(nsock_pool nsp, nsock_event nse, void *param);
         int nep_ready_handler(nsock_pool nsp, nsock_event nse, void *param);
         int nep_session_ended_handler(nsock_pool nsp, nsock_event nse, void *param);
+        int nep_wake_handler(nsock_pool nsp, nsock_event nse, void *param);
 
 }; /* End of class EchoServer */
 
@@ -192,5 +293,6 @@ void packetspec_handler(nsock_pool nsp, nsock_event nse, void *arg);
 void ready_handler(nsock_pool nsp, nsock_event nse, void *arg);
 void empty_handler(nsock_pool nsp, nsock_event nse, void *arg);
 void session_ended_handler(nsock_pool nsp, nsock_event nse, void *arg);
+void wake_handler(nsock_pool nsp, nsock_event nse, void *arg);
 
 #endif /* __ECHOSERVER_H__ */
@@ -0,0 +1,619 @@
+/***************************************************************************
+ * FlowTable.cc -- The FlowTable class keeps track of the probes that are  *
+ * waiting for a response, indexed by flow so that captured packets can be *
+ * matched against them in constant time.                                  *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2014 Insecure.Com LLC. Nmap is    *
+ * also a registered trademark of Insecure.Com LLC.  This program is free  *
+ * software; you may redistribute and/or modify it under the terms of the  *
+ * GNU General Public License as published by the Free Software            *
+ * Foundation; Version 2 ("GPL"), BUT ONLY WITH ALL OF THE CLARIFICATIONS  *
+ * AND EXCEPTIONS DESCRIBED HEREIN.  This guarantees your right to use,    *
+ * modify, and redistribute this software under certain conditions.  If    *
+ * you wish to embed Nmap technology into proprietary software, we sell    *
+ * alternative licenses (contact sales@nmap.com).  Dozens of software      *
+ * vendors already license Nmap technology such as host discovery, port    *
+ * scanning, OS detection, version detection, and the Nmap Scripting       *
+ * Engine.                                                                 *
+ *                                                                         *
+ * Note that the GPL places important restrictions on "derivative works",  *
+ * yet it does not provide a detailed definition of that term.  To avoid   *
+ * misunderstandings, we interpret that term as broadly as copyright law   *
+ * allows.  For example, we consider an application to constitute a        *
+ * derivative work for the purpose of this license if it does any of the   *
+ * following with any software or content covered by this license          *
+ * ("Covered Software"):                                                   *
+ *                                                                         *
+ * o Integrates source code from Covered Software.                         *
+ *                                                                         *
+ * o Reads or includes copyrighted data files, such as Nmap's nmap-os-db   *
+ * or nmap-service-probes.                                                 *
+ *                                                                         *
+ * o Is designed specifically to execute Covered Software and parse the    *
+ * results (as opposed to typical shell or execution-menu apps, which will *
+ * execute anything you tell them to).                                     *
+ *                                                                         *
+ * o Includes Covered Software in a proprietary executable installer.  The *
+ * installers produced by InstallShield are an example of this.  Including *
+ * Nmap with other software in compressed or archival form does not        *
+ * trigger this provision, provided appropriate open source decompression  *
+ * or de-archiving software is widely available for no charge.  For the    *
+ * purposes of this license, an installer is considered to include Covered *
+ * Software even if it actually retrieves a copy of Covered Software from  *
+ * another source during runtime (such as by downloading it from the       *
+ * Internet).                                                              *
+ *                                                                         *
+ * o Links (statically or dynamically) to a library which does any of the  *
+ * above.                                                                  *
+ *                                                                         *
+ * o Executes a helper program, module, or script to do any of the above.  *
+ *                                                                         *
+ * This list is not exclusive, but is meant to clarify our interpretation  *
+ * of derived works with some common examples.  Other people may interpret *
+ * the plain GPL differently, so we consider this a special exception to   *
+ * the GPL that we apply to Covered Software.  Works which meet any of     *
+ * these conditions must conform to all of the terms of this license,      *
+ * particularly including the GPL Section 3 requirements of providing      *
+ * source code and allowing free redistribution of the work as a whole.    *
+ *                                                                         *
+ * As another special exception to the GPL terms, Insecure.Com LLC grants  *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two.                                  *
+ *                                                                         *
+ * Any redistribution of Covered Software, including any derived works,    *
+ * must obey and carry forward all of the terms of this license, including *
+ * obeying all GPL rules and restrictions.  For example, source code of    *
+ * the whole work must be provided and free redistribution must be         *
+ * allowed.  All GPL references to "this License", are to be treated as    *
+ * including the terms and conditions of this license text as well.        *
+ *                                                                         *
+ * Because this license imposes special exceptions to the GPL, Covered     *
+ * Work may not be combined (even as part of a larger work) with plain GPL *
+ * software.  The terms, conditions, and exceptions of this license must   *
+ * be included as well.  This license is incompatible with some other open *
+ * source licenses as well.  In some cases we can relicense portions of    *
+ * Nmap or grant special permissions to use it in other open source        *
+ * software.  Please contact fyodor@nmap.org with any such requests.       *
+ * Similarly, we don't incorporate incompatible open source software into  *
+ * Covered Software without special permission from the copyright holders. *
+ *                                                                         *
+ * If you have any questions about the licensing restrictions on using     *
+ * Nmap in other works, are happy to help.  As mentioned above, we also    *
+ * offer alternative license to integrate Nmap into proprietary            *
+ * applications and appliances.  These contracts have been sold to dozens  *
+ * of software vendors, and generally include a perpetual license as well  *
+ * as providing for priority support and updates.  They also fund the      *
+ * continued development of Nmap.  Please email sales@nmap.com for further *
+ * information.                                                            *
+ *                                                                         *
+ * If you have received a written license agreement or contract for        *
+ * Covered Software stating terms other than these, you may choose to use  *
+ * and redistribute Covered Software under those terms instead of these.   *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the Nmap      *
+ * license file for more details (it's in a COPYING file included with     *
+ * Nmap, and also available from https://svn.nmap.org/nmap/COPYING)        *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "FlowTable.h"
+#include "TargetHost.h"
+#include "NpingOps.h"
+#include "output.h"
+
+extern NpingOps o;
+
+
+FlowTable::FlowTable(){
+  this->nflows=0;
+  this->serial=0;
+  this->buckets.assign(FLOW_TABLE_MIN_BUCKETS, (struct flow *)NULL);
+} /* End of FlowTable constructor */
+
+
+FlowTable::~FlowTable(){
+  struct flow *f=NULL, *nextf=NULL;
+  /* Probes are not freed here, as they belong to the hosts' rings */
+  for(size_t i=0; i<this->buckets.size(); i++){
+    for(f=this->buckets[i]; f!=NULL; f=nextf){
+      nextf=f->next;
+      free(f);
+    }
+  }
+  for(size_t i=0; i<this->free_flows.size(); i++)
+    free(this->free_flows[i]);
+} /* End of FlowTable destructor */
+
+
+/* Returns true if ICMP messages of the supplied type carry an identifier and
+ * a sequence number that must be the same in the probe and in the response
+ * (or in the copy of the probe included in an ICMP error message). */
+static bool icmp_has_id_seq(int proto, u8 type){
+  if(proto==HEADER_TYPE_ICMPv6)
+    return (type==ICMPv6_ECHO || type==ICMPv6_ECHOREPLY);
+  switch(type){
+    case ICMP_ECHO:
+    case ICMP_ECHOREPLY:
+    case ICMP_TSTAMP:
+    case ICMP_TSTAMPREPLY:
+    case ICMP_INFO:
+    case ICMP_INFOREPLY:
+    case ICMP_MASK:
+    case ICMP_MASKREPLY:
+    case ICMP_DOMAINNAME:
+    case ICMP_DOMAINNAMEREPLY:
+      return true;
+  }
+  return false;
+} /* End of icmp_has_id_seq() */
+
+
+/* Returns the selector of the supplied transport or ICMP header, as it would
+ * be seen in the probe. */
+static u32 layer4_selector(PacketElement *l4){
+  if(l4->protocol_id()==HEADER_TYPE_TCP || l4->protocol_id()==HEADER_TYPE_UDP){
+    return ((u32)((TransportLayerElement *)l4)->getSourcePort() << 16) |
+           ((TransportLayerElement *)l4)->getDestinationPort();
+  }else if(l4->protocol_id()==HEADER_TYPE_ICMPv4 && icmp_has_id_seq(HEADER_TYPE_ICMPv4, ((ICMPHeader *)l4)->getType())){
+    return ((u32)((ICMPv4Header *)l4)->getIdentifier() << 16) |
+           ((ICMPv4Header *)l4)->getSequence();
+  }else if(l4->protocol_id()==HEADER_TYPE_ICMPv6 && icmp_has_id_seq(HEADER_TYPE_ICMPv6, ((ICMPHeader *)l4)->getType())){
+    return ((u32)((ICMPv6Header *)l4)->getIdentifier() << 16) |
+           (u16)((ICMPv6Header *)l4)->getSequence();
+  }
+  return 0;
+} /* End of layer4_selector() */
+
+
+/* Skips extension headers and the like until it finds TCP, UDP or ICMP. */
+static PacketElement *find_layer4(PacketElement *elem){
+  for( ; elem!=NULL; elem=elem->getNextElement()){
+    switch(elem->protocol_id()){
+      case HEADER_TYPE_TCP:
+      case HEADER_TYPE_UDP:
+      case HEADER_TYPE_ICMPv4:
+      case HEADER_TYPE_ICMPv6:
+        return elem;
+    }
+  }
+  return NULL;
+} /* End of find_layer4() */
+
+
+/* Stores the addresses of the supplied IPv4 or IPv6 header in the key. If
+ * "probe" is true, the header is the one of a probe we sent (e.g. the copy
+ * included in an ICMP error), so its destination is the peer. Otherwise it
+ * is a response and its source is the peer. The accessors of the actual IP
+ * classes are used, as those of NetworkLayerElement are not overridden by
+ * them (they are const there). In multicast mode the responses come from
+ * whoever joined the group, not from the address the probe was sent to, so
+ * the peer is left empty and acts as a wildcard. */
+static void ip_addresses(PacketElement *ip, bool probe, struct flow_key *key){
+  const u8 *src=NULL, *dst=NULL;
+
+  if(ip->protocol_id()==HEADER_TYPE_IPv4){
+    key->addrlen=4;
+    src=((IPv4Header *)ip)->getSourceAddress();
+    dst=((IPv4Header *)ip)->getDestinationAddress();
+  }else{
+    key->addrlen=16;
+    src=((IPv6Header *)ip)->getSourceAddress();
+    dst=((IPv6Header *)ip)->getDestinationAddress();
+  }
+  memcpy(key->peer, probe ? dst : src, key->addrlen);
+  memcpy(key->local, probe ? src : dst, key->addrlen);
+  if(o.doMulticast())
+    memset(key->peer, 0, sizeof(key->peer));
+} /* End of ip_addresses() */
+
+
+/* Computes the flow key of a probe we are about to send. Returns false if
+ * the probe is not something we can get a response for. Such probes are
+ * still stored, with an empty key, so they are disposed of like the rest. */
+bool FlowTable::probe_key(PacketElement *pkt, struct flow_key *key){
+  PacketElement *l4=NULL;
+  u32 addr=0;
+
+  memset(key, 0, sizeof(struct flow_key));
+  if(pkt!=NULL && pkt->protocol_id()==HEADER_TYPE_ETHERNET)
+    pkt=pkt->getNextElement();
+  if(pkt==NULL)
+    return false;
+
+  if(pkt->protocol_id()==HEADER_TYPE_ARP){
+    addr=((ARPHeader *)pkt)->getTargetIP();
+    memcpy(key->peer, &addr, 4);
+    addr=((ARPHeader *)pkt)->getSenderIP();
+    memcpy(key->local, &addr, 4);
+    key->addrlen=4;
+    return true;
+  }else if(pkt->protocol_id()!=HEADER_TYPE_IPv4 && pkt->protocol_id()!=HEADER_TYPE_IPv6){
+    return false;
+  }
+  ip_addresses(pkt, true, key);
+  if((l4=find_layer4(pkt->getNextElement()))!=NULL)
+    key->selector=layer4_selector(l4);
+  return true;
+} /* End of probe_key() */
+
+
+/* Returns true if ICMP messages of the supplied type are errors that carry a
+ * copy of the datagram that triggered them. */
+static bool icmp_is_error(int proto, u8 type){
+  if(proto==HEADER_TYPE_ICMPv6){
+    switch(type){
+      case ICMPv6_UNREACH:
+      case ICMPv6_PKTTOOBIG:
+      case ICMPv6_TIMXCEED:
+      case ICMPv6_PARAMPROB:
+        return true;
+    }
+  }else{
+    switch(type){
+      case ICMP_UNREACH:
+      case ICMP_TIMXCEED:
+      case ICMP_PARAMPROB:
+      case ICMP_SOURCEQUENCH:
+      case ICMP_REDIRECT:
+      case ICMP_SECURITYFAILURES:
+        return true;
+    }
+  }
+  return false;
+} /* End of icmp_is_error() */
+
+
+/* Same as layer4_selector() but reading the header at position "idx" of a
+ * packet view. TCP and UDP carry the ports in the first four bytes of the
+ * header, ICMP carries the identifier and sequence number right after the
+ * type, code and checksum. */
+static u32 view_selector(const packet_view_t *view, int idx){
+  const u8 *l4=PacketParser::view_header(view, idx);
+  int proto=view->hdr[idx].type;
+  if(proto==HEADER_TYPE_TCP || proto==HEADER_TYPE_UDP){
+    return ((u32)l4[0] << 24) | ((u32)l4[1] << 16) | ((u32)l4[2] << 8) | l4[3];
+  }else if((proto==HEADER_TYPE_ICMPv4 || proto==HEADER_TYPE_ICMPv6) && icmp_has_id_seq(proto, l4[0])){
+    return ((u32)l4[4] << 24) | ((u32)l4[5] << 16) | ((u32)l4[6] << 8) | l4[7];
+  }
+  return 0;
+} /* End of view_selector() */
+
+
+/* Same as ip_addresses() but reading the IP header at position "idx" of a
+ * packet view. If "probe" is true, the header is the one of a probe we
+ * sent (e.g. the copy included in an ICMP error), so its destination is the
+ * peer. Otherwise it is a response and its source is the peer. */
+static void view_addresses(const packet_view_t *view, int idx, bool probe, struct flow_key *key){
+  const u8 *net=PacketParser::view_header(view, idx);
+  const u8 *src=NULL, *dst=NULL;
+
+  if(view->hdr[idx].type==HEADER_TYPE_IPv4){
+    key->addrlen=4;
+    src=net+12;
+  }else{
+    key->addrlen=16;
+    src=net+8;
+  }
+  dst=src+key->addrlen;
+  memcpy(key->peer, probe ? dst : src, key->addrlen);
+  memcpy(key->local, probe ? src : dst, key->addrlen);
+  if(o.doMulticast())
+    memset(key->peer, 0, sizeof(key->peer));
+} /* End of view_addresses() */
+
+
+/* Computes the flow key of a captured packet. The key is the one of the probe
+ * the packet would be a response to. If the packet is an ICMP error message,
+ * the addresses and the selector are taken from the copy of the original
+ * datagram, as errors may come from any router along the way. Everything
+ * is read straight from the captured bytes, so packets that don't belong to
+ * any flow are discarded without ever building their PacketElements. */
+bool FlowTable::response_key(const packet_view_t *pkt, struct flow_key *key){
+  const u8 *net=NULL, *l4=NULL;
+  int idx=-1, inner=-1;
+
+  memset(key, 0, sizeof(struct flow_key));
+  if((net=PacketParser::view_header(pkt, pkt->net))==NULL)
+    return false;
+
+  if(pkt->hdr[pkt->net].type==HEADER_TYPE_ARP){
+    memcpy(key->peer, net+14, 4);  /* Sender protocol address */
+    memcpy(key->local, net+24, 4); /* Target protocol address */
+    key->addrlen=4;
+    return true;
+  }
+  view_addresses(pkt, pkt->net, false, key);
+  if((idx=PacketParser::find_transport_layer(pkt, pkt->net+1))<0)
+    return true;
+
+  l4=PacketParser::view_header(pkt, idx);
+  if(pkt->hdr[idx].type==HEADER_TYPE_TCP || pkt->hdr[idx].type==HEADER_TYPE_UDP){
+    /* The ports are swapped in the response */
+    key->selector=((u32)l4[2] << 24) | ((u32)l4[3] << 16) | ((u32)l4[0] << 8) | l4[1];
+  }else if(pkt->hdr[idx].type!=HEADER_TYPE_ICMPv4 && pkt->hdr[idx].type!=HEADER_TYPE_ICMPv6){
+    return true;
+  }else if(icmp_is_error(pkt->hdr[idx].type, l4[0])){
+    inner=idx+1;
+    if(inner<pkt->count && (pkt->hdr[inner].type==HEADER_TYPE_IPv4 || pkt->hdr[inner].type==HEADER_TYPE_IPv6)){
+      memset(key, 0, sizeof(struct flow_key));
+      view_addresses(pkt, inner, true, key);
+      if((idx=PacketParser::find_transport_layer(pkt, inner+1))>=0)
+        key->selector=view_selector(pkt, idx);
+    }
+  }else{
+    key->selector=view_selector(pkt, idx);
+  }
+  return true;
+} /* End of response_key() */
+
+
+/* FNV-1a hash of the flow key */
+u32 FlowTable::hash_key(const struct flow_key *key){
+  u32 h=2166136261U;
+  for(int i=0; i<key->addrlen; i++)
+    h=(h ^ key->peer[i]) * 16777619U;
+  for(int i=0; i<key->addrlen; i++)
+    h=(h ^ key->local[i]) * 16777619U;
+  for(int i=0; i<4; i++)
+    h=(h ^ ((key->selector >> (8*i)) & 0xFF)) * 16777619U;
+  return h;
+} /* End of hash_key() */
+
+
+struct flow *FlowTable::find_flow(const struct flow_key *key, u32 hash){
+  struct flow *f=this->buckets[hash & (this->buckets.size()-1)];
+  for( ; f!=NULL; f=f->next){
+    if(f->hash==hash && f->key.selector==key->selector &&
+       f->key.addrlen==key->addrlen &&
+       memcmp(f->key.peer, key->peer, key->addrlen)==0 &&
+       memcmp(f->key.local, key->local, key->addrlen)==0)
+      return f;
+  }
+  return NULL;
+} /* End of find_flow() */
+
+
+/* Returns the oldest probe of the flow the received packet is a response
+ * to, or NULL if there is none. */
+struct flow_probe *FlowTable::match_flow(struct flow *f, packet_view_t *rcvd){
+  if(f==NULL)
+    return NULL;
+  for(struct flow_probe *p=f->first; p!=NULL; p=p->next){
+    if(PacketParser::is_response(p->pkt, rcvd))
+      return p;
+  }
+  return NULL;
+} /* End of match_flow() */
+
+
+/* Doubles the number of buckets and redistributes the flows. */
+void FlowTable::grow(){
+  vector<struct flow *> old;
+  struct flow *f=NULL, *next=NULL;
+  size_t idx=0;
+
+  old.swap(this->buckets);
+  this->buckets.assign(old.size()*2, (struct flow *)NULL);
+  for(size_t i=0; i<old.size(); i++){
+    for(f=old[i]; f!=NULL; f=next){
+      next=f->next;
+      idx=f->hash & (this->buckets.size()-1);
+      f->next=this->buckets[idx];
+      this->buckets[idx]=f;
+    }
+  }
+  nping_print(DBG_3, "Flow table grown to %lu buckets", (unsigned long)this->buckets.size());
+} /* End of grow() */
+
+
+/* Adds a probe to the table. The caller must have set the packet, the host
+ * and the time it was sent. The probe is appended to its flow. */
+void FlowTable::insert(struct flow_probe *p){
+  struct flow_key key;
+  struct flow *f=NULL;
+  u32 hash=0, idx=0;
+  assert(p!=NULL && p->pkt!=NULL && p->host!=NULL);
+
+  this->probe_key(p->pkt, &key);
+  hash=this->hash_key(&key);
+
+  /* Find the flow or create a new one */
+  if((f=this->find_flow(&key, hash))==NULL){
+    if(this->nflows >= this->buckets.size()*2)
+      this->grow();
+    if(this->free_flows.size()>0){
+      f=this->free_flows.back();
+      this->free_flows.pop_back();
+    }else{
+      f=(struct flow *)safe_malloc(sizeof(struct flow));
+    }
+    f->key=key;
+    f->hash=hash;
+    f->first=f->last=NULL;
+    idx=hash & (this->buckets.size()-1);
+    f->next=this->buckets[idx];
+    this->buckets[idx]=f;
+    this->nflows++;
+  }
+
+  /* Append the probe to the flow */
+  p->serial=this->serial++;
+  p->flow=f;
+  p->next=NULL;
+  p->prev=f->last;
+  if(f->last!=NULL)
+    f->last->next=p;
+  else
+    f->first=p;
+  f->last=p;
+} /* End of insert() */
+
+
+/* Returns the oldest probe the supplied packet is a response to, or NULL if
+ * it doesn't answer any of them. Besides its own flow, the packet may answer
+ * probes for which no selector could be determined, so those are checked too.
+ * The probe is not removed from the table. */
+struct flow_probe *FlowTable::lookup(packet_view_t *rcvd){
+  struct flow_key key;
+  struct flow_probe *a=NULL, *b=NULL;
+
+  if(rcvd==NULL || !this->response_key(rcvd, &key))
+    return NULL;
+  a=this->match_flow(this->find_flow(&key, this->hash_key(&key)), rcvd);
+  if(key.selector!=0){
+    key.selector=0;
+    b=this->match_flow(this->find_flow(&key, this->hash_key(&key)), rcvd);
+  }
+  if(a==NULL || (b!=NULL && b->serial < a->serial))
+    return b;
+  return a;
+} /* End of lookup() */
+
+
+/* Removes a probe from the table. Returns the packet, so the caller can
+ * dispose of it, and leaves the probe empty. */
+PacketElement *FlowTable::remove(struct flow_probe *p){
+  struct flow *f=NULL, **pf=NULL;
+  PacketElement *pkt=NULL;
+  assert(p!=NULL && p->pkt!=NULL);
+
+  f=p->flow;
+  pkt=p->pkt;
+
+  /* Unlink it from the flow */
+  if(p->prev!=NULL)
+    p->prev->next=p->next;
+  else
+    f->first=p->next;
+  if(p->next!=NULL)
+    p->next->prev=p->prev;
+  else
+    f->last=p->prev;
+  p->pkt=NULL;
+  p->flow=NULL;
+  p->prev=p->next=NULL;
+
+  /* Get rid of the flow if there's nothing left in it */
+  if(f->first==NULL){
+    for(pf=&this->buckets[f->hash & (this->buckets.size()-1)]; *pf!=NULL; pf=&(*pf)->next){
+      if(*pf==f){
+        *pf=f->next;
+        break;
+      }
+    }
+    this->nflows--;
+    this->free_flows.push_back(f);
+  }
+  return pkt;
+} /* End of remove() */
+
+
+/* Returns the number of flows in the table */
+u32 FlowTable::size(){
+  return this->nflows;
+} /* End of size() */
+
+
+/*****************************************************************************/
+/* Implementation of ProbeRing class.                                        */
+/*****************************************************************************/
+
+ProbeRing::ProbeRing(){
+  this->slots=NULL;
+  this->depth=0;
+  this->head=0;
+  this->used=0;
+} /* End of ProbeRing constructor */
+
+
+ProbeRing::~ProbeRing(){
+  if(this->slots!=NULL)
+    free(this->slots);
+} /* End of ProbeRing destructor */
+
+
+/* Allocates room for "val" probes. This can only be done while the ring is
+ * empty. */
+int ProbeRing::setDepth(u32 val){
+  if(val==0 || this->used>0)
+    return OP_FAILURE;
+  if(this->slots!=NULL)
+    free(this->slots);
+  this->slots=(struct flow_probe *)safe_zalloc(sizeof(struct flow_probe)*val);
+  this->depth=val;
+  this->head=0;
+  return OP_SUCCESS;
+} /* End of setDepth() */
+
+
+u32 ProbeRing::getDepth(){
+  return this->depth;
+} /* End of getDepth() */
+
+
+/* Returns the slot where the next probe must be stored. If the ring is full,
+ * that is the slot of the oldest probe, which may still be in use. In that
+ * case it's up to the caller to remove it from the flow table first. */
+struct flow_probe *ProbeRing::push(){
+  struct flow_probe *p=NULL;
+  assert(this->depth>0);
+  if(this->used==this->depth){
+    p=&this->slots[this->head];
+    this->head=(this->head+1)%this->depth;
+  }else{
+    p=&this->slots[(this->head+this->used)%this->depth];
+    this->used++;
+  }
+  return p;
+} /* End of push() */
+
+
+/* Takes the oldest slot off the ring and returns it, or NULL if the ring is
+ * empty. If the slot still holds a probe, it's up to the caller to remove it
+ * from the flow table. */
+struct flow_probe *ProbeRing::pop(){
+  struct flow_probe *p=NULL;
+  if(this->used==0)
+    return NULL;
+  p=&this->slots[this->head];
+  this->head=(this->head+1)%this->depth;
+  this->used--;
+  return p;
+} /* End of pop() */
+
+
+/* Must be called after a probe is removed from the flow table. Empty slots at
+ * the beginning of the ring are given back, so they can be reused before
+ * overwriting any probe that is still waiting for a response. */
+void ProbeRing::release(struct flow_probe *p){
+  assert(p!=NULL && p->pkt==NULL);
+  while(this->used>0 && this->slots[this->head].pkt==NULL){
+    this->head=(this->head+1)%this->depth;
+    this->used--;
+  }
+} /* End of release() */
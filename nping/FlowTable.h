@@ -0,0 +1,219 @@
+/***************************************************************************
+ * FlowTable.h -- The FlowTable class keeps track of the probes that are   *
+ * waiting for a response, indexed by flow so that captured packets can be *
+ * matched against them in constant time.                                  *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2014 Insecure.Com LLC. Nmap is    *
+ * also a registered trademark of Insecure.Com LLC.  This program is free  *
+ * software; you may redistribute and/or modify it under the terms of the  *
+ * GNU General Public License as published by the Free Software            *
+ * Foundation; Version 2 ("GPL"), BUT ONLY WITH ALL OF THE CLARIFICATIONS  *
+ * AND EXCEPTIONS DESCRIBED HEREIN.  This guarantees your right to use,    *
+ * modify, and redistribute this software under certain conditions.  If    *
+ * you wish to embed Nmap technology into proprietary software, we sell    *
+ * alternative licenses (contact sales@nmap.com).  Dozens of software      *
+ * vendors already license Nmap technology such as host discovery, port    *
+ * scanning, OS detection, version detection, and the Nmap Scripting       *
+ * Engine.                                                                 *
+ *                                                                         *
+ * Note that the GPL places important restrictions on "derivative works",  *
+ * yet it does not provide a detailed definition of that term.  To avoid   *
+ * misunderstandings, we interpret that term as broadly as copyright law   *
+ * allows.  For example, we consider an application to constitute a        *
+ * derivative work for the purpose of this license if it does any of the   *
+ * following with any software or content covered by this license          *
+ * ("Covered Software"):                                                   *
+ *                                                                         *
+ * o Integrates source code from Covered Software.                         *
+ *                                                                         *
+ * o Reads or includes copyrighted data files, such as Nmap's nmap-os-db   *
+ * or nmap-service-probes.                                                 *
+ *                                                                         *
+ * o Is designed specifically to execute Covered Software and parse the    *
+ * results (as opposed to typical shell or execution-menu apps, which will *
+ * execute anything you tell them to).                                     *
+ *                                                                         *
+ * o Includes Covered Software in a proprietary executable installer.  The *
+ * installers produced by InstallShield are an example of this.  Including *
+ * Nmap with other software in compressed or archival form does not        *
+ * trigger this provision, provided appropriate open source decompression  *
+ * or de-archiving software is widely available for no charge.  For the    *
+ * purposes of this license, an installer is considered to include Covered *
+ * Software even if it actually retrieves a copy of Covered Software from  *
+ * another source during runtime (such as by downloading it from the       *
+ * Internet).                                                              *
+ *                                                                         *
+ * o Links (statically or dynamically) to a library which does any of the  *
+ * above.                                                                  *
+ *                                                                         *
+ * o Executes a helper program, module, or script to do any of the above.  *
+ *                                                                         *
+ * This list is not exclusive, but is meant to clarify our interpretation  *
+ * of derived works with some common examples.  Other people may interpret *
+ * the plain GPL differently, so we consider this a special exception to   *
+ * the GPL that we apply to Covered Software.  Works which meet any of     *
+ * these conditions must conform to all of the terms of this license,      *
+ * particularly including the GPL Section 3 requirements of providing      *
+ * source code and allowing free redistribution of the work as a whole.    *
+ *                                                                         *
+ * As another special exception to the GPL terms, Insecure.Com LLC grants  *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two.                                  *
+ *                                                                         *
+ * Any redistribution of Covered Software, including any derived works,    *
+ * must obey and carry forward all of the terms of this license, including *
+ * obeying all GPL rules and restrictions.  For example, source code of    *
+ * the whole work must be provided and free redistribution must be         *
+ * allowed.  All GPL references to "this License", are to be treated as    *
+ * including the terms and conditions of this license text as well.        *
+ *                                                                         *
+ * Because this license imposes special exceptions to the GPL, Covered     *
+ * Work may not be combined (even as part of a larger work) with plain GPL *
+ * software.  The terms, conditions, and exceptions of this license must   *
+ * be included as well.  This license is incompatible with some other open *
+ * source licenses as well.  In some cases we can relicense portions of    *
+ * Nmap or grant special permissions to use it in other open source        *
+ * software.  Please contact fyodor@nmap.org with any such requests.       *
+ * Similarly, we don't incorporate incompatible open source software into  *
+ * Covered Software without special permission from the copyright holders. *
+ *                                                                         *
+ * If you have any questions about the licensing restrictions on using     *
+ * Nmap in other works, are happy to help.  As mentioned above, we also    *
+ * offer alternative license to integrate Nmap into proprietary            *
+ * applications and appliances.  These contracts have been sold to dozens  *
+ * of software vendors, and generally include a perpetual license as well  *
+ * as providing for priority support and updates.  They also fund the      *
+ * continued development of Nmap.  Please email sales@nmap.com for further *
+ * information.                                                            *
+ *                                                                         *
+ * If you have received a written license agreement or contract for        *
+ * Covered Software stating terms other than these, you may choose to use  *
+ * and redistribute Covered Software under those terms instead of these.   *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the Nmap      *
+ * license file for more details (it's in a COPYING file included with     *
+ * Nmap, and also available from https://svn.nmap.org/nmap/COPYING)        *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef __FLOWTABLE_H__
+#define __FLOWTABLE_H__ 1
+
+#include "nping.h"
+#include <vector>
+using namespace std;
+
+class TargetHost;
+class PacketElement;
+
+/* Initial number of buckets of the flow table. It doubles as needed. */
+#define FLOW_TABLE_MIN_BUCKETS 256
+
+/* Identifies the flow a probe belongs to. The key of a response is the same
+ * as the key of the probe it answers, so the candidates can be found without
+ * looking at any other probe. The selector holds the ports (TCP and UDP) or
+ * the identifier and sequence number (ICMP messages that carry them). It is
+ * zero for probes that can't be narrowed down any further. */
+struct flow_key{
+  u8 peer[16];      /* Target address (probe dst, response src) */
+  u8 local[16];     /* Our address (probe src, response dst)    */
+  u8 addrlen;       /* Length of the addresses                  */
+  u32 selector;     /* Ports or ICMP id/seq. Zero if none       */
+};
+
+struct flow;
+
+/* A probe that is waiting for a response. Probes live in the ProbeRing of
+ * their target host and are linked into the list of probes of their flow.
+ * Empty slots have a NULL packet. */
+struct flow_probe{
+  PacketElement *pkt;            /* The probe itself                     */
+  TargetHost *host;              /* Target it was sent to                */
+  struct timeval sent_time;      /* When it was stored                   */
+  u64 serial;                    /* Order of insertion in the table      */
+  struct flow *flow;             /* Flow it belongs to                   */
+  struct flow_probe *prev, *next; /* Probes of the same flow             */
+};
+
+/* A flow: all the probes that share the same key, oldest first. */
+struct flow{
+  struct flow_key key;
+  u32 hash;
+  struct flow_probe *first;
+  struct flow_probe *last;
+  struct flow *next;             /* Next flow in the same bucket         */
+};
+
+class FlowTable{
+
+  private:
+    vector<struct flow *> buckets;     /* Hash buckets                   */
+    u32 nflows;                        /* Number of flows in the table   */
+    u64 serial;                        /* Next probe serial number       */
+    vector<struct flow *> free_flows;  /* Recycled flow structures       */
+
+    static bool probe_key(PacketElement *pkt, struct flow_key *key);
+    static bool response_key(const packet_view_t *pkt, struct flow_key *key);
+    static u32 hash_key(const struct flow_key *key);
+    struct flow *find_flow(const struct flow_key *key, u32 hash);
+    struct flow_probe *match_flow(struct flow *f, packet_view_t *rcvd);
+    void grow();
+
+  public:
+    FlowTable();
+    ~FlowTable();
+
+    void insert(struct flow_probe *probe);
+    struct flow_probe *lookup(packet_view_t *rcvd);
+    PacketElement *remove(struct flow_probe *probe);
+    u32 size();
+};
+
+/* Fixed-capacity ring with the last probes sent to a host, oldest first.
+ * Slots are reused in order, so storing a probe never moves the others and
+ * the oldest probe is simply overwritten when the ring is full. Slots whose
+ * probe got a response are left empty until the ring wraps around. */
+class ProbeRing{
+
+  private:
+    struct flow_probe *slots;  /* Storage for the probes                 */
+    u32 depth;                 /* Number of slots                        */
+    u32 head;                  /* Slot of the oldest probe               */
+    u32 used;                  /* Slots in use, counting from head       */
+
+  public:
+    ProbeRing();
+    ~ProbeRing();
+    int setDepth(u32 depth);
+    u32 getDepth();
+    struct flow_probe *push();
+    struct flow_probe *pop();
+    void release(struct flow_probe *probe);
+};
+
+#endif /* __FLOWTABLE_H__ */
@@ -154,6 +154,8 @@ void NEPContext::reset() {
   memset(this->server_nonce, 0, NONCE_LEN);
   memset(this->client_nonce, 0, NONCE_LEN);
   memset(&this->clnt_addr, 0, sizeof(struct sockaddr_storage ));
+  this->crypto_c2s.reset();
+  this->crypto_s2c.reset();
   server_nonce_set=false;
   client_nonce_set=false;
 } /* End of reset() */
@@ -510,6 +512,19 @@ int NEPContext::generateCipherKeyS2C(){
 } /* End of generateCipherKeyS2C() */
 
 
+/** Returns the cipher and HMAC contexts used for C->S messages. They are
+  * kept across messages so OpenSSL doesn't need to set them up every time. */
+Crypto *NEPContext::getCryptoC2S(){
+  return &this->crypto_c2s;
+} /* End of getCryptoC2S() */
+
+
+/** Returns the cipher and HMAC contexts used for S->C messages. */
+Crypto *NEPContext::getCryptoS2C(){
+  return &this->crypto_s2c;
+} /* End of getCryptoS2C() */
+
+
 /** Generates a random nonce which is, if possible, cryptographically secure.
   * This method is used by the Echo client to generate its own nonce for the
   * initial NEP_HANDSHAKE_CLIENT message */
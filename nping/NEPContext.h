@@ -127,6 +127,7 @@
 
 #include "nsock.h"
 #include "EchoHeader.h"
+#include "Crypto.h"
 #include <vector>
 using namespace std;
 
@@ -195,6 +196,8 @@ class NEPContext {
         u8 nep_key_ciphertext_s2c[CIPHER_KEY_LEN];
         u8 server_nonce[NONCE_LEN];
         u8 client_nonce[NONCE_LEN];
+        Crypto crypto_c2s; /**<  Reusable cipher/HMAC contexts, C->S     */
+        Crypto crypto_s2c; /**<  Reusable cipher/HMAC contexts, S->C     */
         bool server_nonce_set;
         bool client_nonce_set;
         vector<fspec_t> fspecs;
@@ -260,6 +263,9 @@ class NEPContext {
         u8 *getCipherKeyS2C(size_t *final_len);
         int generateCipherKeyS2C();
 
+        Crypto *getCryptoC2S();
+        Crypto *getCryptoS2C();
+
         int generateClientNonce();
         int generateServerNonce();
         int setClientNonce(u8 *buff);
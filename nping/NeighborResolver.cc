@@ -0,0 +1,440 @@
+/***************************************************************************
+ * NeighborResolver.cc -- The NeighborResolver class resolves the MAC      *
+ * addresses of many on-link hosts at once, using ARP for IPv4 and         *
+ * Neighbor Discovery for IPv6.                                            *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2014 Insecure.Com LLC. Nmap is    *
+ * also a registered trademark of Insecure.Com LLC.  This program is free  *
+ * software; you may redistribute and/or modify it under the terms of the  *
+ * GNU General Public License as published by the Free Software            *
+ * Foundation; Version 2 ("GPL"), BUT ONLY WITH ALL OF THE CLARIFICATIONS  *
+ * AND EXCEPTIONS DESCRIBED HEREIN.  This guarantees your right to use,    *
+ * modify, and redistribute this software under certain conditions.  If    *
+ * you wish to embed Nmap technology into proprietary software, we sell    *
+ * alternative licenses (contact sales@nmap.com).  Dozens of software      *
+ * vendors already license Nmap technology such as host discovery, port    *
+ * scanning, OS detection, version detection, and the Nmap Scripting       *
+ * Engine.                                                                 *
+ *                                                                         *
+ * Note that the GPL places important restrictions on "derivative works",  *
+ * yet it does not provide a detailed definition of that term.  To avoid   *
+ * misunderstandings, we interpret that term as broadly as copyright law   *
+ * allows.  For example, we consider an application to constitute a        *
+ * derivative work for the purpose of this license if it does any of the   *
+ * following with any software or content covered by this license          *
+ * ("Covered Software"):                                                   *
+ *                                                                         *
+ * o Integrates source code from Covered Software.                         *
+ *                                                                         *
+ * o Reads or includes copyrighted data files, such as Nmap's nmap-os-db   *
+ * or nmap-service-probes.                                                 *
+ *                                                                         *
+ * o Is designed specifically to execute Covered Software and parse the    *
+ * results (as opposed to typical shell or execution-menu apps, which will *
+ * execute anything you tell them to).                                     *
+ *                                                                         *
+ * o Includes Covered Software in a proprietary executable installer.  The *
+ * installers produced by InstallShield are an example of this.  Including *
+ * Nmap with other software in compressed or archival form does not        *
+ * trigger this provision, provided appropriate open source decompression  *
+ * or de-archiving software is widely available for no charge.  For the    *
+ * purposes of this license, an installer is considered to include Covered *
+ * Software even if it actually retrieves a copy of Covered Software from  *
+ * another source during runtime (such as by downloading it from the       *
+ * Internet).                                                              *
+ *                                                                         *
+ * o Links (statically or dynamically) to a library which does any of the  *
+ * above.                                                                  *
+ *                                                                         *
+ * o Executes a helper program, module, or script to do any of the above.  *
+ *                                                                         *
+ * This list is not exclusive, but is meant to clarify our interpretation  *
+ * of derived works with some common examples.  Other people may interpret *
+ * the plain GPL differently, so we consider this a special exception to   *
+ * the GPL that we apply to Covered Software.  Works which meet any of     *
+ * these conditions must conform to all of the terms of this license,      *
+ * particularly including the GPL Section 3 requirements of providing      *
+ * source code and allowing free redistribution of the work as a whole.    *
+ *                                                                         *
+ * As another special exception to the GPL terms, Insecure.Com LLC grants  *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two.                                  *
+ *                                                                         *
+ * Any redistribution of Covered Software, including any derived works,    *
+ * must obey and carry forward all of the terms of this license, including *
+ * obeying all GPL rules and restrictions.  For example, source code of    *
+ * the whole work must be provided and free redistribution must be         *
+ * allowed.  All GPL references to "this License", are to be treated as    *
+ * including the terms and conditions of this license text as well.        *
+ *                                                                         *
+ * Because this license imposes special exceptions to the GPL, Covered     *
+ * Work may not be combined (even as part of a larger work) with plain GPL *
+ * software.  The terms, conditions, and exceptions of this license must   *
+ * be included as well.  This license is incompatible with some other open *
+ * source licenses as well.  In some cases we can relicense portions of    *
+ * Nmap or grant special permissions to use it in other open source        *
+ * software.  Please contact fyodor@nmap.org with any such requests.       *
+ * Similarly, we don't incorporate incompatible open source software into  *
+ * Covered Software without special permission from the copyright holders. *
+ *                                                                         *
+ * If you have any questions about the licensing restrictions on using     *
+ * Nmap in other works, are happy to help.  As mentioned above, we also    *
+ * offer alternative license to integrate Nmap into proprietary            *
+ * applications and appliances.  These contracts have been sold to dozens  *
+ * of software vendors, and generally include a perpetual license as well  *
+ * as providing for priority support and updates.  They also fund the      *
+ * continued development of Nmap.  Please email sales@nmap.com for further *
+ * information.                                                            *
+ *                                                                         *
+ * If you have received a written license agreement or contract for        *
+ * Covered Software stating terms other than these, you may choose to use  *
+ * and redistribute Covered Software under those terms instead of these.   *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the Nmap      *
+ * license file for more details (it's in a COPYING file included with     *
+ * Nmap, and also available from https://svn.nmap.org/nmap/COPYING)        *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "nping.h"
+#include "NeighborResolver.h"
+#include "NpingOps.h"
+#include "output.h"
+#include <algorithm>
+
+extern NpingOps o;
+
+
+NeighborResolver::NeighborResolver(){
+  this->reset();
+} /* End of NeighborResolver constructor */
+
+
+NeighborResolver::~NeighborResolver(){
+
+} /* End of NeighborResolver destructor */
+
+
+/* Forgets all the requests, so the object can be reused */
+void NeighborResolver::reset(){
+  this->requests.clear();
+  this->pcap_iods.clear();
+  this->pending=0;
+  this->sends=0;
+} /* End of reset() */
+
+
+/* Adds an address to the set of addresses to resolve. "source" is the
+ * address the requests are sent from and "iface" the interface the target
+ * is reached through. Duplicates are fine: each address is only resolved
+ * once. */
+int NeighborResolver::add(IPAddress *target, IPAddress *source, NetworkInterface *iface){
+  struct neighbor_request req;
+  assert(target!=NULL && source!=NULL && iface!=NULL);
+  memset(&req, 0, sizeof(req));
+  target->getAddress(&req.target);
+  source->getAddress(&req.source);
+  req.iface=iface;
+  req.resolved=false;
+  this->requests.push_back(req);
+  return OP_SUCCESS;
+} /* End of add() */
+
+
+/* Returns the number of addresses added since the last reset() */
+u32 NeighborResolver::size(){
+  return this->requests.size();
+} /* End of size() */
+
+
+static bool neighbor_request_lt(const struct neighbor_request &a, const struct neighbor_request &b){
+  return sockaddr_storage_cmp(&a.target, &b.target) < 0;
+}
+
+
+/* Returns the request for the supplied address or NULL if we don't have
+ * one. Requests must be sorted (see resolve()). */
+struct neighbor_request *NeighborResolver::find(const struct sockaddr_storage *ss){
+  struct neighbor_request key;
+  vector<struct neighbor_request>::iterator it;
+  memcpy(&key.target, ss, sizeof(struct sockaddr_storage));
+  it=lower_bound(this->requests.begin(), this->requests.end(), key, neighbor_request_lt);
+  if(it==this->requests.end() || sockaddr_storage_cmp(&it->target, ss)!=0)
+    return NULL;
+  return &(*it);
+} /* End of find() */
+
+
+/* Resolves all the addresses added so far. Results are stored in
+ * libnetutil's MAC cache. Returns OP_SUCCESS if every address was
+ * resolved and OP_FAILURE otherwise; use get() to tell which ones were. */
+int NeighborResolver::resolve(){
+  nping_print(DBG_4, "%s()", __func__);
+  nsock_pool nsp;
+  const int timeouts[] = NEIGHBOR_TIMEOUTS;
+  vector<struct neighbor_request> unique;
+  u8 mac[6];
+  int loaded=0;
+
+  if(this->requests.size()==0)
+    return OP_SUCCESS;
+
+  /* Sort the requests so we can get rid of duplicates (hosts that share a
+   * gateway) and look up replies quickly. */
+  sort(this->requests.begin(), this->requests.end(), neighbor_request_lt);
+  for(size_t i=0; i<this->requests.size(); i++){
+    if(unique.size()==0 || sockaddr_storage_cmp(&unique.back().target, &this->requests[i].target)!=0)
+      unique.push_back(this->requests[i]);
+  }
+  this->requests.swap(unique);
+
+  /* Fetch the system's neighbor table in one go instead of asking for each
+   * address. Anything in it is as good as a reply. */
+  if((loaded=mac_cache_load_neighbors())>=0)
+    nping_print(DBG_3, "Loaded %d entries from the system's neighbor table.", loaded);
+  this->pending=0;
+  for(size_t i=0; i<this->requests.size(); i++){
+    if(mac_cache_get(&this->requests[i].target, mac))
+      this->requests[i].resolved=true;
+    else
+      this->pending++;
+  }
+  nping_print(DBG_2, "ARP/ND: %u of %u addresses found in the neighbor cache.", (u32)(this->requests.size()-this->pending), (u32)this->requests.size());
+  if(this->pending==0)
+    return OP_SUCCESS;
+
+  /* We have to ask the network for the rest. Solicit them all at once and
+   * handle the replies as they come. */
+  if((nsp=nsp_new(NULL))==NULL)
+    nping_fatal(QT_3, "Failed to create new pool.  QUITTING.\n");
+  if(o.getDebugging()==DBG_5)
+    nsock_set_loglevel(nsp, NSOCK_LOG_INFO);
+  else if(o.getDebugging()>DBG_5)
+    nsock_set_loglevel(nsp, NSOCK_LOG_DBG_ALL);
+  this->open_sniffers(nsp);
+  this->sends=0;
+  this->send_requests();
+  nsock_timer_create(nsp, neighbor_timer_handler_wrapper, timeouts[0], this);
+  nsock_loop(nsp, -1);
+  nsp_delete(nsp);
+  this->pcap_iods.clear();
+
+  nping_print(DBG_2, "ARP/ND: %u addresses could not be resolved.", this->pending);
+  return (this->pending==0) ? OP_SUCCESS : OP_FAILURE;
+} /* End of resolve() */
+
+
+/* Fetches the MAC address of "target" once it's been resolved. Returns
+ * OP_SUCCESS if the address is known and OP_FAILURE otherwise. */
+int NeighborResolver::get(IPAddress *target, MACAddress *result){
+  struct sockaddr_storage ss;
+  u8 mac[6];
+  assert(target!=NULL && result!=NULL);
+  target->getAddress(&ss);
+  if(!mac_cache_get(&ss, mac))
+    return OP_FAILURE;
+  result->setAddress_bin(mac);
+  return OP_SUCCESS;
+} /* End of get() */
+
+
+/* Opens a capture descriptor on every interface we have unresolved
+ * requests for, with a filter that only lets ARP replies and Neighbor
+ * Advertisements addressed to us through. */
+int NeighborResolver::open_sniffers(nsock_pool nsp){
+  vector<NetworkInterface *> ifaces;
+  NetworkInterface *iface=NULL;
+  MACAddress ifacemac;
+  nsock_iod pcap_iod;
+  char pcapdev[128];
+  char filter[512];
+  const u8 *mac=NULL;
+  int errcode=0;
+
+  for(size_t i=0; i<this->requests.size(); i++){
+    if(!this->requests[i].resolved && std::find(ifaces.begin(), ifaces.end(), this->requests[i].iface)==ifaces.end())
+      ifaces.push_back(this->requests[i].iface);
+  }
+  for(size_t i=0; i<ifaces.size(); i++){
+    iface=ifaces[i];
+    ifacemac=iface->getAddress();
+    mac=ifacemac.getAddress_bin();
+    pcap_iod=nsi_new(nsp, (void *)iface->getName());
+    #ifdef WIN32
+      if (!DnetName2PcapName(iface->getName(), pcapdev, sizeof(pcapdev))) {
+        Strncpy(pcapdev, iface->getName(), sizeof(pcapdev));
+      }
+    #else
+      Strncpy(pcapdev, iface->getName(), sizeof(pcapdev));
+    #endif
+    /* ARP replies for our MAC address (matched on the ARP target address,
+     * as some devices broadcast their replies), or ICMPv6 Neighbor
+     * Advertisements without extension headers (see doArp() and doND() in
+     * libnetutil). */
+    Snprintf(filter, sizeof(filter), "(arp and arp[6:2] = 2 and arp[18:4] = 0x%02X%02X%02X%02X and arp[22:2] = 0x%02X%02X) or "
+             "(ether dst %02X:%02X:%02X:%02X:%02X:%02X and ip6[6:1] = %u and ip6[40:1] = %u)",
+             mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
+             mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], IPPROTO_ICMPV6, ICMPV6_NEIGHBOR_ADVERTISEMENT);
+    nping_print(DBG_3, "ARP/ND: capturing replies on %s with filter \"%s\"", pcapdev, filter);
+    if((errcode=nsock_pcap_open(nsp, pcap_iod, pcapdev, 128, 0, "%s", filter))!=0)
+      nping_fatal(QT_3, "Error opening capture device %s --> Error %d", pcapdev, errcode);
+    nsock_pcap_read_packets(nsp, pcap_iod, neighbor_reply_handler_wrapper, -1, NEIGHBOR_READ_BATCH, this);
+    this->pcap_iods.push_back(pcap_iod);
+  }
+  return OP_SUCCESS;
+} /* End of open_sniffers() */
+
+
+/* Builds the ARP request or Neighbor Solicitation for the supplied request
+ * in "frame", which must hold at least 128 bytes, and stores its length in
+ * "len". */
+int NeighborResolver::build_frame(struct neighbor_request *req, u8 *frame, size_t *len){
+  MACAddress srcmac=req->iface->getAddress();
+  struct sockaddr_in *tgt4=(struct sockaddr_in *)&req->target;
+  struct sockaddr_in *src4=(struct sockaddr_in *)&req->source;
+  struct sockaddr_in6 *tgt6=(struct sockaddr_in6 *)&req->target;
+  struct sockaddr_in6 *src6=(struct sockaddr_in6 *)&req->source;
+  u8 dstmac[6]={0x33, 0x33, 0xff, 0, 0, 0};
+  u8 dstip6[16]={0xff, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01, 0xff, 0, 0, 0};
+  eth_addr_t ethsrc, ethdst;
+
+  memcpy(ethsrc.data, srcmac.getAddress_bin(), ETH_ADDR_LEN);
+  if(req->target.ss_family==AF_INET){
+    eth_pack_hdr(frame, ETH_ADDR_BROADCAST, ethsrc, ETH_TYPE_ARP);
+    arp_pack_hdr_ethip(frame + ETH_HDR_LEN, ARP_OP_REQUEST, ethsrc,
+                       src4->sin_addr, ETH_ADDR_BROADCAST, tgt4->sin_addr);
+    *len=ETH_HDR_LEN + ARP_HDR_LEN + ARP_ETHIP_LEN;
+  }else{
+    /* Solicited-node multicast address of the target, and the MAC
+     * address it maps to. */
+    memcpy(dstmac+3, tgt6->sin6_addr.s6_addr+13, 3);
+    memcpy(dstip6+13, tgt6->sin6_addr.s6_addr+13, 3);
+    memcpy(ethdst.data, dstmac, ETH_ADDR_LEN);
+    eth_pack_hdr(frame, ethdst, ethsrc, ETH_TYPE_IPV6);
+    ip6_pack_hdr(frame + ETH_HDR_LEN, 0, 0, 32, IPPROTO_ICMPV6, 255, *src6->sin6_addr.s6_addr, *dstip6);
+    icmpv6_pack_hdr_ns_mac(frame + ETH_HDR_LEN + IP6_HDR_LEN, tgt6->sin6_addr.s6_addr, ethsrc);
+    ip6_checksum(frame + ETH_HDR_LEN, IP6_HDR_LEN + ICMPV6_HDR_LEN + 4 + 16 + 8);
+    *len=ETH_HDR_LEN + IP6_HDR_LEN + ICMPV6_HDR_LEN + 4 + 16 + 8;
+  }
+  return OP_SUCCESS;
+} /* End of build_frame() */
+
+
+/* Sends an ARP request or a Neighbor Solicitation for every address that
+ * hasn't been resolved yet. */
+int NeighborResolver::send_requests(){
+  u8 frame[128];
+  size_t len=0;
+  eth_t *ethsd=NULL;
+  int rc=0;
+
+  this->sends++;
+  nping_print(DBG_2, "ARP/ND: soliciting %u addresses (attempt %d of %d).", this->pending, this->sends, NEIGHBOR_MAX_SENDS);
+  for(size_t i=0; i<this->requests.size(); i++){
+    if(this->requests[i].resolved)
+      continue;
+    if((ethsd=eth_open_cached(this->requests[i].iface->getName()))==NULL)
+      nping_fatal(QT_3, "%s: Failed to open ethernet device (%s)", __func__, this->requests[i].iface->getName());
+    this->build_frame(&this->requests[i], frame, &len);
+    if((rc=eth_send(ethsd, frame, len))!=(int)len)
+      nping_warning(QT_2, "WARNING: eth_send of ARP/ND request returned %d rather than expected %d bytes", rc, (int)len);
+  }
+  return OP_SUCCESS;
+} /* End of send_requests() */
+
+
+/* Handles the captured ARP replies and Neighbor Advertisements. */
+void NeighborResolver::reply_handler(nsock_pool nsp, nsock_event nse, void *arg){
+  nsock_iod nsi=nse_iod(nse);
+  const unsigned char *l3=NULL;
+  size_t l3len=0;
+  size_t cursor=0;
+  struct sockaddr_storage ss;
+  struct sockaddr_in *s4=(struct sockaddr_in *)&ss;
+  struct sockaddr_in6 *s6=(struct sockaddr_in6 *)&ss;
+  struct neighbor_request *req=NULL;
+  const u8 *mac=NULL;
+
+  if(nse_status(nse)!=NSE_STATUS_SUCCESS)
+    return;
+
+  while(nse_readpcap_next(nse, &cursor, NULL, NULL, &l3, &l3len, NULL, NULL)){
+    memset(&ss, 0, sizeof(ss));
+    mac=NULL;
+    /* ARP reply: hw type Ethernet, protocol IPv4, sizes 6 and 4 */
+    if(l3len>=ARP_HDR_LEN + ARP_ETHIP_LEN && memcmp(l3, "\x00\x01\x08\x00\x06\x04\x00\x02", 8)==0){
+      ss.ss_family=AF_INET;
+      memcpy(&s4->sin_addr.s_addr, l3 + 14, 4);
+      mac=l3 + 8;
+    /* Neighbor Advertisement with a target link-layer address option */
+    }else if(l3len>=IP6_HDR_LEN + 32 && (l3[0]>>4)==6 && l3[6]==IPPROTO_ICMPV6 &&
+             l3[IP6_HDR_LEN]==ICMPV6_NEIGHBOR_ADVERTISEMENT &&
+             l3[IP6_HDR_LEN + 24]==2 && l3[IP6_HDR_LEN + 25]==1){
+      ss.ss_family=AF_INET6;
+      memcpy(s6->sin6_addr.s6_addr, l3 + IP6_HDR_LEN + 8, 16);
+      mac=l3 + IP6_HDR_LEN + 26;
+    }else{
+      continue;
+    }
+    if((req=this->find(&ss))!=NULL && !req->resolved){
+      mac_cache_set(&ss, (u8 *)mac);
+      req->resolved=true;
+      this->pending--;
+    }
+  }
+  if(this->pending==0)
+    nsock_loop_quit(nsp);
+  else
+    nsock_pcap_read_packets(nsp, nsi, neighbor_reply_handler_wrapper, -1, NEIGHBOR_READ_BATCH, this);
+} /* End of reply_handler() */
+
+
+/* Retransmits the requests that haven't been answered, or gives up when
+ * we have run out of attempts. */
+void NeighborResolver::timer_handler(nsock_pool nsp, nsock_event nse, void *arg){
+  const int timeouts[] = NEIGHBOR_TIMEOUTS;
+
+  if(nse_status(nse)!=NSE_STATUS_SUCCESS)
+    return;
+  if(this->pending==0 || this->sends>=NEIGHBOR_MAX_SENDS){
+    nsock_loop_quit(nsp);
+    return;
+  }
+  this->send_requests();
+  nsock_timer_create(nsp, neighbor_timer_handler_wrapper, timeouts[this->sends-1]-timeouts[this->sends-2], this);
+} /* End of timer_handler() */
+
+
+void neighbor_reply_handler_wrapper(nsock_pool nsp, nsock_event nse, void *arg){
+  ((NeighborResolver *)arg)->reply_handler(nsp, nse, arg);
+} /* End of neighbor_reply_handler_wrapper() */
+
+
+void neighbor_timer_handler_wrapper(nsock_pool nsp, nsock_event nse, void *arg){
+  ((NeighborResolver *)arg)->timer_handler(nsp, nse, arg);
+} /* End of neighbor_timer_handler_wrapper() */
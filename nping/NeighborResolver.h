@@ -0,0 +1,186 @@
+/***************************************************************************
+ * NeighborResolver.h -- The NeighborResolver class resolves the MAC       *
+ * addresses of many on-link hosts at once, using ARP for IPv4 and         *
+ * Neighbor Discovery for IPv6.                                            *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2014 Insecure.Com LLC. Nmap is    *
+ * also a registered trademark of Insecure.Com LLC.  This program is free  *
+ * software; you may redistribute and/or modify it under the terms of the  *
+ * GNU General Public License as published by the Free Software            *
+ * Foundation; Version 2 ("GPL"), BUT ONLY WITH ALL OF THE CLARIFICATIONS  *
+ * AND EXCEPTIONS DESCRIBED HEREIN.  This guarantees your right to use,    *
+ * modify, and redistribute this software under certain conditions.  If    *
+ * you wish to embed Nmap technology into proprietary software, we sell    *
+ * alternative licenses (contact sales@nmap.com).  Dozens of software      *
+ * vendors already license Nmap technology such as host discovery, port    *
+ * scanning, OS detection, version detection, and the Nmap Scripting       *
+ * Engine.                                                                 *
+ *                                                                         *
+ * Note that the GPL places important restrictions on "derivative works",  *
+ * yet it does not provide a detailed definition of that term.  To avoid   *
+ * misunderstandings, we interpret that term as broadly as copyright law   *
+ * allows.  For example, we consider an application to constitute a        *
+ * derivative work for the purpose of this license if it does any of the   *
+ * following with any software or content covered by this license          *
+ * ("Covered Software"):                                                   *
+ *                                                                         *
+ * o Integrates source code from Covered Software.                         *
+ *                                                                         *
+ * o Reads or includes copyrighted data files, such as Nmap's nmap-os-db   *
+ * or nmap-service-probes.                                                 *
+ *                                                                         *
+ * o Is designed specifically to execute Covered Software and parse the    *
+ * results (as opposed to typical shell or execution-menu apps, which will *
+ * execute anything you tell them to).                                     *
+ *                                                                         *
+ * o Includes Covered Software in a proprietary executable installer.  The *
+ * installers produced by InstallShield are an example of this.  Including *
+ * Nmap with other software in compressed or archival form does not        *
+ * trigger this provision, provided appropriate open source decompression  *
+ * or de-archiving software is widely available for no charge.  For the    *
+ * purposes of this license, an installer is considered to include Covered *
+ * Software even if it actually retrieves a copy of Covered Software from  *
+ * another source during runtime (such as by downloading it from the       *
+ * Internet).                                                              *
+ *                                                                         *
+ * o Links (statically or dynamically) to a library which does any of the  *
+ * above.                                                                  *
+ *                                                                         *
+ * o Executes a helper program, module, or script to do any of the above.  *
+ *                                                                         *
+ * This list is not exclusive, but is meant to clarify our interpretation  *
+ * of derived works with some common examples.  Other people may interpret *
+ * the plain GPL differently, so we consider this a special exception to   *
+ * the GPL that we apply to Covered Software.  Works which meet any of     *
+ * these conditions must conform to all of the terms of this license,      *
+ * particularly including the GPL Section 3 requirements of providing      *
+ * source code and allowing free redistribution of the work as a whole.    *
+ *                                                                         *
+ * As another special exception to the GPL terms, Insecure.Com LLC grants  *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two.                                  *
+ *                                                                         *
+ * Any redistribution of Covered Software, including any derived works,    *
+ * must obey and carry forward all of the terms of this license, including *
+ * obeying all GPL rules and restrictions.  For example, source code of    *
+ * the whole work must be provided and free redistribution must be         *
+ * allowed.  All GPL references to "this License", are to be treated as    *
+ * including the terms and conditions of this license text as well.        *
+ *                                                                         *
+ * Because this license imposes special exceptions to the GPL, Covered     *
+ * Work may not be combined (even as part of a larger work) with plain GPL *
+ * software.  The terms, conditions, and exceptions of this license must   *
+ * be included as well.  This license is incompatible with some other open *
+ * source licenses as well.  In some cases we can relicense portions of    *
+ * Nmap or grant special permissions to use it in other open source        *
+ * software.  Please contact fyodor@nmap.org with any such requests.       *
+ * Similarly, we don't incorporate incompatible open source software into  *
+ * Covered Software without special permission from the copyright holders. *
+ *                                                                         *
+ * If you have any questions about the licensing restrictions on using     *
+ * Nmap in other works, are happy to help.  As mentioned above, we also    *
+ * offer alternative license to integrate Nmap into proprietary            *
+ * applications and appliances.  These contracts have been sold to dozens  *
+ * of software vendors, and generally include a perpetual license as well  *
+ * as providing for priority support and updates.  They also fund the      *
+ * continued development of Nmap.  Please email sales@nmap.com for further *
+ * information.                                                            *
+ *                                                                         *
+ * If you have received a written license agreement or contract for        *
+ * Covered Software stating terms other than these, you may choose to use  *
+ * and redistribute Covered Software under those terms instead of these.   *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the Nmap      *
+ * license file for more details (it's in a COPYING file included with     *
+ * Nmap, and also available from https://svn.nmap.org/nmap/COPYING)        *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef __NEIGHBORRESOLVER_H__
+#define __NEIGHBORRESOLVER_H__ 1
+
+#include "nping.h"
+#include "nsock.h"
+#include "NetworkInterface.h"
+#include <vector>
+using namespace std;
+
+/* Retransmission times of the ARP/ND solicitations, in milliseconds since
+ * the first ones were sent. The last one is when we give up. These are the
+ * same times libnetutil's doArp() and doND() use for a single address. */
+#define NEIGHBOR_TIMEOUTS { 100, 400, 800 }
+#define NEIGHBOR_MAX_SENDS 3
+
+/* Max number of captured replies handled per nsock event */
+#define NEIGHBOR_READ_BATCH 64
+
+struct neighbor_request {
+  struct sockaddr_storage target;  /* Address whose MAC we want          */
+  struct sockaddr_storage source;  /* Address we send the requests from  */
+  NetworkInterface *iface;         /* Interface the target is reached by */
+  bool resolved;                   /* Have we got its MAC yet?           */
+};
+
+/* Resolves the MAC addresses of a set of IP addresses in one go. Addresses
+ * are first looked up in libnetutil's MAC cache, which is loaded with the
+ * system's neighbor table beforehand. For the rest, all the ARP requests
+ * and Neighbor Solicitations are sent at once, replies are captured through
+ * nsock, and the ones that don't get an answer are retransmitted. Results
+ * are stored in the MAC cache, so they can be fetched with get() or with
+ * mac_cache_get(). */
+class NeighborResolver{
+
+  private:
+    vector<struct neighbor_request> requests; /* Sorted after resolve() */
+    vector<nsock_iod> pcap_iods;              /* One per interface      */
+    u32 pending;                              /* Unresolved requests    */
+    int sends;                                /* Rounds sent so far     */
+
+    int send_requests();
+    int open_sniffers(nsock_pool nsp);
+    int build_frame(struct neighbor_request *req, u8 *frame, size_t *len);
+    struct neighbor_request *find(const struct sockaddr_storage *ss);
+
+  public:
+    NeighborResolver();
+    ~NeighborResolver();
+    void reset();
+    int add(IPAddress *target, IPAddress *source, NetworkInterface *iface);
+    u32 size();
+    int resolve();
+    int get(IPAddress *target, MACAddress *result);
+
+    void reply_handler(nsock_pool nsp, nsock_event nse, void *arg);
+    void timer_handler(nsock_pool nsp, nsock_event nse, void *arg);
+};
+
+/* Handler wrappers */
+void neighbor_reply_handler_wrapper(nsock_pool nsp, nsock_event nse, void *arg);
+void neighbor_timer_handler_wrapper(nsock_pool nsp, nsock_event nse, void *arg);
+
+#endif /* __NEIGHBORRESOLVER_H__ */
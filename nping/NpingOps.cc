@@ -158,6 +158,16 @@ NpingOps::NpingOps() {
 
   show_all_stats=false;
 
+  output_file=NULL;
+  output_format=OUTPUT_FORMAT_NONE;
+  output_format_set=false;
+
+  stats_interval=0;
+  stats_interval_set=false;
+
+  stats_socket=NULL;
+  stats_socket_set=false;
+
   /* Operation and Performance */
   rounds=DEFAULT_PACKET_ROUNDS;
   rounds_set=false;
@@ -167,6 +177,19 @@ NpingOps::NpingOps() {
   delay=DEFAULT_DELAY;
   delay_set=false;
 
+  rate=0;
+  rate_set=false;
+
+  tx_batch=DEFAULT_TX_BATCH;
+  tx_batch_set=false;
+  inflight=DEFAULT_INFLIGHT_PROBES;
+  inflight_set=false;
+  threads=0;
+  threads_set=false;
+
+  precompile=false;
+  precompile_set=false;
+
   memset(device, 0, MAX_DEV_LEN);
   device_set=false;
 
@@ -268,6 +291,8 @@ NpingOps::NpingOps() {
   delayed_rcvd_pkt_set=false;
   delayed_rcvd_ts=0;
 
+  hosts_loaded=0;
+
 } /* End of NpingOps() */
 
 
@@ -624,6 +649,84 @@ int NpingOps::getDetailLevel(){
 } /* End of getDetailLevel() */
 
 
+/** Sets the file where a structured record is written for every packet that
+ *  is sent or received, and the format of those records (OUTPUT_FORMAT_JSONL
+ *  or OUTPUT_FORMAT_BINARY). A filename of "-" means the standard output.
+ *  @return OP_SUCCESS on success and OP_FAILURE in case of error.           */
+int NpingOps::setStructuredOutput(char *filename, int format){
+  if(filename==NULL || (format!=OUTPUT_FORMAT_JSONL && format!=OUTPUT_FORMAT_BINARY))
+    return OP_FAILURE;
+  this->output_file=filename;
+  this->output_format=format;
+  this->output_format_set=true;
+  return OP_SUCCESS;
+} /* End of setStructuredOutput() */
+
+
+/** Returns value of attribute output_file */
+char *NpingOps::getStructuredOutputFile(){
+  return this->output_file;
+} /* End of getStructuredOutputFile() */
+
+
+/** Returns value of attribute output_format */
+int NpingOps::getStructuredOutputFormat(){
+  return this->output_format;
+} /* End of getStructuredOutputFormat() */
+
+
+/* Returns true if option has been set */
+bool NpingOps::issetStructuredOutput(){
+  return this->output_format_set;
+} /* End of issetStructuredOutput() */
+
+
+/** Sets the time between live statistics reports, in milliseconds.
+ *  @return OP_SUCCESS on success and OP_FAILURE in case of error.           */
+int NpingOps::setStatsInterval(long t){
+  if(t<=0)
+    return OP_FAILURE;
+  this->stats_interval=t;
+  this->stats_interval_set=true;
+  return OP_SUCCESS;
+} /* End of setStatsInterval() */
+
+
+/** Returns value of attribute stats_interval */
+long NpingOps::getStatsInterval(){
+  return this->stats_interval;
+} /* End of getStatsInterval() */
+
+
+/* Returns true if option has been set */
+bool NpingOps::issetStatsInterval(){
+  return this->stats_interval_set;
+} /* End of issetStatsInterval() */
+
+
+/** Sets the path of the Unix domain socket that serves live statistics.
+ *  @return OP_SUCCESS on success and OP_FAILURE in case of error.           */
+int NpingOps::setStatsSocket(char *path){
+  if(path==NULL || path[0]=='\0')
+    return OP_FAILURE;
+  this->stats_socket=path;
+  this->stats_socket_set=true;
+  return OP_SUCCESS;
+} /* End of setStatsSocket() */
+
+
+/** Returns value of attribute stats_socket */
+char *NpingOps::getStatsSocket(){
+  return this->stats_socket;
+} /* End of getStatsSocket() */
+
+
+/* Returns true if option has been set */
+bool NpingOps::issetStatsSocket(){
+  return this->stats_socket_set;
+} /* End of issetStatsSocket() */
+
+
 /******************************************************************************
  *  Operation and Performance                                                 *
  ******************************************************************************/
@@ -681,6 +784,8 @@ int NpingOps::setDelay(long t){
     nping_fatal(QT_3,"setDelay(): Invalid time supplied\n");
   this->delay=t;
   this->delay_set=true;
+  /* The delay and the rate are inverses, the last one set wins. */
+  this->rate_set=false;
   return OP_SUCCESS;
 } /* End of setDelay() */
 
@@ -697,6 +802,131 @@ bool NpingOps::issetDelay(){
 } /* End of issetDelay() */
 
 
+/** Sets the transmission rate, in packets per second. When a rate is set, it
+ *  takes precedence over the inter-probe delay, so rates above 1000 pps can
+ *  be achieved.
+ *  @return OP_SUCCESS on success and OP_FAILURE in case of error.           */
+int NpingOps::setRate(u32 pps){
+  if(pps==0)
+    return OP_FAILURE;
+  this->rate=pps;
+  this->rate_set=true;
+  return OP_SUCCESS;
+} /* End of setRate() */
+
+
+/** Returns value of attribute rate */
+u32 NpingOps::getRate(){
+  return this->rate;
+} /* End of getRate() */
+
+
+/* Returns true if option has been set */
+bool NpingOps::issetRate(){
+  return this->rate_set;
+} /* End of issetRate() */
+
+
+/** Sets the maximum number of packets that the ProbeEngine accumulates
+ *  before handing them to the kernel in a single batch. A value of 1
+ *  disables batching, so every packet is sent as soon as it is produced.
+ *  @return OP_SUCCESS on success and OP_FAILURE in case of error.           */
+int NpingOps::setTxBatch(u32 val){
+  if(val==0 || val>MAX_TX_BATCH)
+    return OP_FAILURE;
+  this->tx_batch=val;
+  this->tx_batch_set=true;
+  return OP_SUCCESS;
+} /* End of setTxBatch() */
+
+
+/** Returns value of attribute tx_batch */
+u32 NpingOps::getTxBatch(){
+  return this->tx_batch;
+} /* End of getTxBatch() */
+
+
+/* Returns true if option has been set */
+bool NpingOps::issetTxBatch(){
+  return this->tx_batch_set;
+} /* End of issetTxBatch() */
+
+
+/** Sets the number of probes that each target host remembers so responses
+ *  can be matched against them. Once a host has sent that many probes, the
+ *  oldest one is forgotten every time a new one is sent.
+ *  @return OP_SUCCESS on success and OP_FAILURE in case of error.           */
+int NpingOps::setInflight(u32 val){
+  if(val==0 || val>MAX_INFLIGHT_PROBES)
+    return OP_FAILURE;
+  this->inflight=val;
+  this->inflight_set=true;
+  return OP_SUCCESS;
+} /* End of setInflight() */
+
+
+/** Returns value of attribute inflight */
+u32 NpingOps::getInflight(){
+  return this->inflight;
+} /* End of getInflight() */
+
+
+/* Returns true if option has been set */
+bool NpingOps::issetInflight(){
+  return this->inflight_set;
+} /* End of issetInflight() */
+
+
+/** Sets the number of threads that transmit probes. When set, probes are
+ *  sent by that many threads, each one in charge of a subset of the targets,
+ *  while captured packets are handled by two additional threads (see
+ *  ProbePipeline.cc). In echo server mode, it sets the number of threads that
+ *  generate NEP_ECHO messages. Zero means everything is done by a single
+ *  thread.
+ *  @return OP_SUCCESS on success and OP_FAILURE in case of error.           */
+int NpingOps::setThreads(u32 val){
+  if(val>MAX_SENDER_THREADS)
+    return OP_FAILURE;
+  this->threads=val;
+  this->threads_set=true;
+  return OP_SUCCESS;
+} /* End of setThreads() */
+
+
+/** Returns value of attribute threads */
+u32 NpingOps::getThreads(){
+  return this->threads;
+} /* End of getThreads() */
+
+
+/* Returns true if option has been set */
+bool NpingOps::issetThreads(){
+  return this->threads_set;
+} /* End of issetThreads() */
+
+
+/** Sets Precompile. When enabled, TargetHosts build their probes by patching
+ *  a precompiled wire image instead of allocating new headers every time.
+ *  @return OP_SUCCESS on success and OP_FAILURE in case of error.           */
+int NpingOps::setPrecompile(bool val){
+  this->precompile=val;
+  this->precompile_set=true;
+  return OP_SUCCESS;
+} /* End of setPrecompile() */
+
+
+/** Returns value of attribute precompile */
+bool NpingOps::precompileProbes(){
+  return this->precompile;
+} /* End of precompileProbes() */
+
+
+/* Returns true if option has been set */
+bool NpingOps::issetPrecompile(){
+  return this->precompile_set;
+} /* End of issetPrecompile() */
+
+
 /** Sets network device. Supplied parameter must be a valid network interface
  *  name.
  *  @return OP_SUCCESS on success and OP_FAILURE in case of error.           */
@@ -1464,6 +1694,13 @@ void NpingOps::validateOptions() {
     if(this->mode(DO_UDP_UNPRIV))
       nping_fatal(QT_3, "Unprivileged UDP is not supported in Echo mode.");
 
+    /* The echo client pairs each CAPT packet with the last packet sent, so
+     * packets must leave one at a time. */
+    if(this->getTxBatch()>1)
+      nping_fatal(QT_3, "Batched transmission (--batch) is not supported in Echo mode.");
+    if(this->getThreads()>0)
+      nping_fatal(QT_3, "Multi-threaded transmission (--threads) is not supported in Echo mode.");
+
     /* Now let's check if we are running in echo client mode. In this case
      * the protocol fields cannot vary. Otherwise packets would differ from
      * the specification passed to the server during the session
@@ -1503,6 +1740,19 @@ void NpingOps::validateOptions() {
 #endif
 
 /** MISCELLANEOUS ************************************************************/
+  if(this->issetTxBatch() && this->getTxBatch()>1 && !this->isRoot())
+    nping_warning(QT_1, "Warning: --batch only applies to raw packet modes. It will be ignored.");
+
+  if(this->getThreads()>0){
+#ifdef WIN32
+    nping_fatal(QT_3, "Multi-threaded transmission (--threads) is not supported on Windows.");
+#endif
+    if(!this->mode(MODE_IS_PRIVILEGED) && this->getRole()!=ROLE_SERVER){
+      nping_warning(QT_1, "Warning: --threads only applies to raw packet modes and to the echo server. It will be ignored.");
+      this->threads=0;
+    }
+  }
+
   if(this->source_ports!=NULL && this->mode(DO_TCP_CONNECT) && (u16)this->getRounds()>this->sportcount ){
     if(!this->isRoot()){
       nping_warning(QT_1, "Warning: Setting a source port in TCP-Connect mode may not work if you are not root");
@@ -1561,8 +1811,8 @@ void NpingOps::displayNpingDoneMsg(){
               );
   }else{
     nping_print(QT_1, "Nping done: %lu %s pinged in %.2f seconds",
-               (long unsigned int)this->target_hosts.size(),
-               (this->target_hosts.size() == 1)? "IP address" : "IP addresses",
+               (long unsigned int)this->totalTargetHosts(),
+               (this->totalTargetHosts() == 1)? "IP address" : "IP addresses",
                this->stats.get_runtime_elapsed(NULL)
               );
   }
@@ -1577,9 +1827,10 @@ void NpingOps::displayStatistics(){
 
   nping_print(VB_0|NO_NEWLINE,"\n"); /* Print newline */
  
-  /* Per-target RTT statistics */
+  /* Per-target RTT statistics. They are only available when all the targets
+   * fit in a single window (see nextTargetHosts()). */
   if(this->getRole()!=ROLE_SERVER){
-    if(this->target_hosts.size() > 1){
+    if(this->target_hosts.size() > 1 && this->target_hosts.size()==this->totalTargetHosts()){
       for(u32 i=0; i<this->target_hosts.size(); i++){
 
         /* First, check if we got any response from this target host. If we
@@ -1678,6 +1929,7 @@ void NpingOps::displayStatistics(){
   nping_print(QT_1|NO_NEWLINE,"Tx time: %.5lfs ", this->stats.get_tx_elapsed() );
   nping_print(QT_1|NO_NEWLINE,"| Tx bytes/s: %.2lf ", this->stats.get_tx_byte_rate() );
   nping_print(QT_1,"| Tx pkts/s: %.2lf", this->stats.get_tx_pkt_rate() );
+  nping_print(DBG_1,"Max Tx lag: %.3lfms", this->stats.get_max_tx_lag()/1000.0 );
   nping_print(QT_1|NO_NEWLINE,"Rx time: %.5lfs ", this->stats.get_rx_elapsed() );
   nping_print(QT_1|NO_NEWLINE,"| Rx bytes/s: %.2lf ", this->stats.get_rx_byte_rate() );
   nping_print(QT_1,"| Rx pkts/s: %.2lf", this->stats.get_rx_pkt_rate() );
@@ -1686,6 +1938,8 @@ void NpingOps::displayStatistics(){
 
 /* Close open files, free allocated memory, etc. */
 int NpingOps::cleanup(){
+  this->reporter.stop();
+  this->output.close();
   return OP_SUCCESS;
 } /* End of cleanup() */
 
@@ -1904,292 +2158,404 @@ int NpingOps::addTargetSpec(const char *spec){
 } /* End of addTargetSpec() */
 
 
-/* Processes the internal array of specs and turns it into an array of
- * TargetHosts. */
+/* Processes the internal array of specs and instances the TargetHosts for
+ * the first addresses in it (see nextTargetHosts()). */
 int NpingOps::setupTargetHosts(){
   nping_print(DBG_4, "%s()", __func__);
   const char *errmsg=NULL;
-  TargetHost *newhost=NULL;
-  NetworkInterface *newiface=NULL;
-  struct sockaddr_storage dst_ss;
-  struct sockaddr_storage src_ss;
-  struct route_nfo route;
-  IPAddress *auxaddr;
-  bool iface_found=false;
-  bool do_eth=false;
-  MACAddress destmac;
-
-  /* Store the spoof address if we have it */
-  if(this->spoof_addr!=NULL){
-    this->spoof_addr->getAddress(&src_ss);
-  }
 
-  /* Turn each target spec into an array of addresses */
+  /* Parse each target spec. Addresses are not generated until they are
+   * needed, so this is cheap no matter how many addresses the specs cover. */
   nping_print(DBG_4, "Parsing target specs...");
   for(u32 i=0; i<this->target_specs.size(); i++){
     assert(this->af()==AF_INET || this->af()==AF_INET6 || this->af()==AF_UNSPEC);
     nping_print(DBG_4, "Parsing target spec #%u (%s)", i, this->target_specs[i]);
-    /* We always use spec_to_addresses() but we call it in different ways depending
+    /* We always use parse_target_spec() but we call it in different ways depending
      * on the address family that we want to use. */
     if(starts_with(this->target_specs[i], "ipv4://")){
       nping_print(DBG_4, "Explicit IPv4 target (ipv4://)");
-      errmsg=spec_to_addresses( this->target_specs[i]+strlen("ipv4://"), AF_INET, this->target_addresses, MAX_IPv4_NETMASK_ALLOWED);
+      errmsg=this->target_gen.addSpec(this->target_specs[i], this->target_specs[i]+strlen("ipv4://"), AF_INET, MAX_IPv4_NETMASK_ALLOWED);
     }else if(starts_with(this->target_specs[i], "ipv6://")){
       nping_print(DBG_4, "Explicit IPv6 target (ipv6://)");
-      errmsg=spec_to_addresses( this->target_specs[i]+strlen("ipv6://"), AF_INET6, this->target_addresses, MAX_IPv6_NETMASK_ALLOWED);
+      errmsg=this->target_gen.addSpec(this->target_specs[i], this->target_specs[i]+strlen("ipv6://"), AF_INET6, MAX_IPv6_NETMASK_ALLOWED);
     }else if(IPAddress::isIPv4Address(this->target_specs[i])){
       nping_print(DBG_4, "Explicit IPv4 address");
-      errmsg=spec_to_addresses( this->target_specs[i], AF_INET, this->target_addresses, MAX_IPv4_NETMASK_ALLOWED);
+      errmsg=this->target_gen.addSpec(this->target_specs[i], this->target_specs[i], AF_INET, MAX_IPv4_NETMASK_ALLOWED);
     }else if(IPAddress::isIPv6Address(this->target_specs[i])){
       nping_print(DBG_4, "Explicit IPv6 address");
-      errmsg=spec_to_addresses( this->target_specs[i], AF_INET6, this->target_addresses, MAX_IPv6_NETMASK_ALLOWED);
+      errmsg=this->target_gen.addSpec(this->target_specs[i], this->target_specs[i], AF_INET6, MAX_IPv6_NETMASK_ALLOWED);
     }else if(this->af()==AF_INET){
       nping_print(DBG_4, "AF_INET set");
-      errmsg=spec_to_addresses( this->target_specs[i], AF_INET, this->target_addresses, MAX_IPv4_NETMASK_ALLOWED);
+      errmsg=this->target_gen.addSpec(this->target_specs[i], this->target_specs[i], AF_INET, MAX_IPv4_NETMASK_ALLOWED);
     }else if(this->af()==AF_INET6){
       nping_print(DBG_4, "AF_INET6 set");
-      errmsg=spec_to_addresses( this->target_specs[i], AF_INET6, this->target_addresses, MAX_IPv6_NETMASK_ALLOWED);
+      errmsg=this->target_gen.addSpec(this->target_specs[i], this->target_specs[i], AF_INET6, MAX_IPv6_NETMASK_ALLOWED);
     }else{ // AF_UNSPEC
       nping_print(DBG_4, "No address family set. Using OS default.");
-      errmsg=spec_to_addresses(this->target_specs[i], AF_UNSPEC, this->target_addresses, 0);
+      errmsg=this->target_gen.addSpec(this->target_specs[i], this->target_specs[i], AF_UNSPEC, 0);
     }
     if(errmsg!=NULL){
       nping_warning(QT_1, "WARNING: %s (%s)", errmsg, this->target_specs[i]);
     }
-    /* Store the targetspec that originated the address in a list. This is
-     * done so later we can associate hostnames to TargetHost objects, and
-     * we need to do it because otherwise, when IP ranges are expanded, it gets
-     * impossible to tell which address came from what spec. */
-    while(this->target_hostnames.size() < this->target_addresses.size()){
-      this->target_hostnames.push_back(this->target_specs[i]);
-    }
   }
+  nping_print(DBG_4, "%llu target addresses found.", (unsigned long long)this->target_gen.size());
 
-  /* Now for each address, let's determine if we have enough info to route
-   * packets to it. If we have, turn the address into a full TargetHost object
-   * and store it in the list of targets */
-  for(u32 i=0; i<this->target_addresses.size(); i++){
-
-    /* Instantiate a new target host */
-    nping_print(DBG_4, "Instantiate new TargetHost.");
-    newhost = new TargetHost();
-    /* Setup target and source addresses (if applicable) */
-    newhost->setTargetAddress(this->target_addresses[i]);
-    if(this->spoof_addr!=NULL){
-      nping_print(DBG_4, "Setting spoofed address.");
-      newhost->setSourceAddress(this->spoof_addr);
-    }
-    /* Setup hostname. Note that only holds a hostname when the user passed one.
-     * If he passed an IP address, then the ASCII representation of the address
-     * is what gets stored in the object. */
-    newhost->setHostname(this->target_hostnames[i]);
-
-    /* Determine if the target address is multicast or unicast. If it's
-     * multicast, we set a global flag. This is important for some Nping
-     * routines because when we target multicast addresses we can receive
-     * more than one response for the same probe. Also, we should expect
-     * responses from addresses that don't match the original probe's
-     * destination IP. */
-    if(newhost->getTargetAddress()->isMulticast()){
-      this->doMulticast(true);
-    }
+  /* Now instance the TargetHosts for the first window of addresses */
+  this->hosts_loaded=0;
+  this->nextTargetHosts();
+  return OP_SUCCESS;
+} /* End of setupTargetHosts() */
+
+
+/* Turns the supplied address into a full TargetHost object, after checking
+ * that we have enough info to route packets to it. The host takes ownership
+ * of "addr". "name" is the target spec the address comes from. Returns NULL
+ * if the target can't be reached (the address is freed in that case). If
+ * packets to the host must be sent at the Ethernet level and its next hop
+ * MAC address is still unknown, the address is queued for resolution in
+ * "neighbors" and "needs_mac" is set to true; the caller must then call
+ * setupEth() once it has been resolved. */
+TargetHost *NpingOps::newTargetHost(IPAddress *addr, const char *name, bool *needs_mac){
+  nping_print(DBG_4, "%s()", __func__);
+  TargetHost *newhost=NULL;
+  NetworkInterface *newiface=NULL;
+  struct sockaddr_storage dst_ss;
+  struct sockaddr_storage src_ss;
+  struct route_nfo route;
+  IPAddress *auxaddr;
+  bool iface_found=false;
+  bool do_eth=false;
 
-    /* If we are running some mode that requires raw sockets, perform
-     * route determination so we can fill up the TargetHost object with
-     * extra info for later. If we are not, we just store it in the the global
-     * NpingOps::target_hosts array right away. */
-    if(this->mode(MODE_IS_PRIVILEGED)){
-      nping_print(DBG_4, "Determine route for target #%u", i);
-      memset(&dst_ss, 0, sizeof(struct sockaddr_storage));
-      memset(&route, 0, sizeof(struct route_nfo));
-      this->target_addresses[i]->getAddress(&dst_ss);
-
-      /* Let's see if we can route packets to the current target. */
-      if(route_dst(&dst_ss, &route, this->device_set ? this->device : NULL, this->spoof_addr!=NULL ? &src_ss : NULL) == 1 ){  // TODO: implement spoofsrc
-        /* Yes, we can! Extract the info returned by route_dst() and store it
-         * in the target's class */
-        nping_print(DBG_4, "Route found!");
-
-        /* Windows does not let us send raw packets to localhost so we skip
-         * localhost if we detect it. */
-        if(this->win32()){
-          if (route.ii.device_type == devt_loopback){
-            nping_warning(QT_2, "Skipping %s because Windows does not allow localhost scans (try --unprivileged).", this->target_addresses[i]->toString());
-            delete newhost;
-            continue;
-          }
-        }
+  *needs_mac=false;
 
-        /* Set the source IP address. Note that we handle the case where
-         * we have a spoof address above */
-        if(this->spoof_addr==NULL){
-          nping_print(DBG_4, "Setting source address.");
-          auxaddr=new IPAddress();
-          auxaddr->setAddress(route.srcaddr);
-          newhost->setSourceAddress(auxaddr);
-        }
+  /* Store the spoof address if we have it */
+  if(this->spoof_addr!=NULL){
+    this->spoof_addr->getAddress(&src_ss);
+  }
 
-        /* Network distance */
-        if(route.direct_connect!=0){
-          nping_print(DBG_4, "Target host is directly connected.");
-          newhost->setNetworkDistance(DISTANCE_DIRECT);
-        }else{
-          nping_print(DBG_4, "Target host is more than one hop away.");
-          auxaddr=new IPAddress();
-          auxaddr->setAddress(route.nexthop);
-          newhost->setNextHopAddress(auxaddr);
-        }
+  /* Instantiate a new target host */
+  nping_print(DBG_4, "Instantiate new TargetHost.");
+  newhost = new TargetHost();
+  /* Setup target and source addresses (if applicable) */
+  newhost->setTargetAddress(addr);
+  if(this->spoof_addr!=NULL){
+    nping_print(DBG_4, "Setting spoofed address.");
+    newhost->setSourceAddress(this->spoof_addr);
+  }
+  /* Setup hostname. Note that only holds a hostname when the user passed one.
+   * If he passed an IP address, then the ASCII representation of the address
+   * is what gets stored in the object. */
+  newhost->setHostname(name);
+
+  /* Determine if the target address is multicast or unicast. If it's
+   * multicast, we set a global flag. This is important for some Nping
+   * routines because when we target multicast addresses we can receive
+   * more than one response for the same probe. Also, we should expect
+   * responses from addresses that don't match the original probe's
+   * destination IP. */
+  if(newhost->getTargetAddress()->isMulticast()){
+    this->doMulticast(true);
+  }
 
-        /* Interface information. Let's see if we previously found a target that
-         * requires the same interface. */
-        iface_found=false;
-        for(u32 k=0; k<this->interfaces.size(); k++){
-          if(!strcmp(this->interfaces[k]->getName(), route.ii.devname) ){
-            iface_found=true;
-            this->interfaces[k]->addAssociatedHost();
-            newhost->setInterface(this->interfaces[k]);
-            nping_print(DBG_4, "Same interface required. Reusing %s", route.ii.devname);
-            break;
-          }
+  /* If we are running some mode that requires raw sockets, perform
+   * route determination so we can fill up the TargetHost object with
+   * extra info for later. If we are not, the host is ready already. */
+  if(this->mode(MODE_IS_PRIVILEGED)){
+    nping_print(DBG_4, "Determine route for target %s", addr->toString());
+    memset(&dst_ss, 0, sizeof(struct sockaddr_storage));
+    memset(&route, 0, sizeof(struct route_nfo));
+    addr->getAddress(&dst_ss);
+
+    /* Let's see if we can route packets to the current target. */
+    if(route_dst(&dst_ss, &route, this->device_set ? this->device : NULL, this->spoof_addr!=NULL ? &src_ss : NULL) == 1 ){  // TODO: implement spoofsrc
+      /* Yes, we can! Extract the info returned by route_dst() and store it
+       * in the target's class */
+      nping_print(DBG_4, "Route found!");
+
+      /* Windows does not let us send raw packets to localhost so we skip
+       * localhost if we detect it. */
+      if(this->win32()){
+        if (route.ii.device_type == devt_loopback){
+          nping_warning(QT_2, "Skipping %s because Windows does not allow localhost scans (try --unprivileged).", addr->toString());
+          this->deleteTargetHost(newhost);
+          return NULL;
         }
-        /* If we haven't seen that interface before, instance a new NetworkInterface
-         * and store it in the interface vector. */
-        if(iface_found==false){
-          newiface=new NetworkInterface(route.ii);
-          newiface->addAssociatedHost();
-          newhost->setInterface(newiface);
-          this->interfaces.push_back(newiface);
-          nping_print(DBG_4, "New interface required: %s", route.ii.devname);
+      }
+
+      /* Set the source IP address. Note that we handle the case where
+       * we have a spoof address above */
+      if(this->spoof_addr==NULL){
+        nping_print(DBG_4, "Setting source address.");
+        auxaddr=new IPAddress();
+        auxaddr->setAddress(route.srcaddr);
+        newhost->setSourceAddress(auxaddr);
+      }
+
+      /* Network distance */
+      if(route.direct_connect!=0){
+        nping_print(DBG_4, "Target host is directly connected.");
+        newhost->setNetworkDistance(DISTANCE_DIRECT);
+      }else{
+        nping_print(DBG_4, "Target host is more than one hop away.");
+        auxaddr=new IPAddress();
+        auxaddr->setAddress(route.nexthop);
+        newhost->setNextHopAddress(auxaddr);
+      }
+
+      /* Interface information. Let's see if we previously found a target that
+       * requires the same interface. */
+      iface_found=false;
+      for(u32 k=0; k<this->interfaces.size(); k++){
+        if(!strcmp(this->interfaces[k]->getName(), route.ii.devname) ){
+          iface_found=true;
+          this->interfaces[k]->addAssociatedHost();
+          newhost->setInterface(this->interfaces[k]);
+          nping_print(DBG_4, "Same interface required. Reusing %s", route.ii.devname);
+          break;
         }
+      }
+      /* If we haven't seen that interface before, instance a new NetworkInterface
+       * and store it in the interface vector. */
+      if(iface_found==false){
+        newiface=new NetworkInterface(route.ii);
+        newiface->addAssociatedHost();
+        newhost->setInterface(newiface);
+        this->interfaces.push_back(newiface);
+        nping_print(DBG_4, "New interface required: %s", route.ii.devname);
+      }
 
-        /* Now let's see if we need to do address resolution on the target */
-        do_eth=false;
+      /* Now let's see if we need to do address resolution on the target */
+      do_eth=false;
 	  /* In Windows, we always try sending packets at the Ethernet level, unless
 	   * the user passed --send-ip.*/
 	  if(this->win32() && this->getSendPreference()==PACKET_SEND_NOPREF){
-          if(newhost->getInterface()->getType()!=devt_ethernet){
-            nping_fatal(QT_3, "Ethernet device required on Windows platforms. Target host only reachable through a non-Ethernet network interface (%s).", newhost->getInterface()->getName());
-          }else{
-            do_eth=true;
-          }
+        if(newhost->getInterface()->getType()!=devt_ethernet){
+          nping_fatal(QT_3, "Ethernet device required on Windows platforms. Target host only reachable through a non-Ethernet network interface (%s).", newhost->getInterface()->getName());
+        }else{
+          do_eth=true;
+        }
 	  }else if(this->getSendPreference()==PACKET_SEND_NOPREF){
-          /* For IPv6 we always try to send at the Ethernet level because many
-           * systems impose big limitations on raw IPv6 sockets. We want to be
-           * able to produce our own IPv6 headers and injecting packets at
-           * the Ethernet level is the best way to do that.
-           *
-           * If the target is IPv4 then we don't need to make our life more
-           * difficult resolving mac addresses, we just send through a raw
-           * socket. */
-          if(this->target_addresses[i]->getVersion()==AF_INET6){
-            /* Of course, the network interface must be Ethernet.*/
-            if(newhost->getInterface()->getType()==devt_ethernet)
-              do_eth=true;
-          }
-          /* If we are doing ARP, we need Ethernet... */
-          if(this->mode(DO_ARP) && this->target_addresses[i]->getVersion()==AF_INET){
+        /* For IPv6 we always try to send at the Ethernet level because many
+         * systems impose big limitations on raw IPv6 sockets. We want to be
+         * able to produce our own IPv6 headers and injecting packets at
+         * the Ethernet level is the best way to do that.
+         *
+         * If the target is IPv4 then we don't need to make our life more
+         * difficult resolving mac addresses, we just send through a raw
+         * socket. */
+        if(addr->getVersion()==AF_INET6){
+          /* Of course, the network interface must be Ethernet.*/
+          if(newhost->getInterface()->getType()==devt_ethernet)
             do_eth=true;
-          }
-        /* If the user explicitly requested Ethernet, go for it... */
-        }else if(this->getSendPreference()==PACKET_SEND_ETH){
-          /* ...unless the device is not Ethernet*/
-          if(newhost->getInterface()->getType()!=devt_ethernet){
-            nping_fatal(QT_3, "Ethernet requested for a host that is only reachable through a non-Ethernet network interface (%s).", newhost->getInterface()->getName());
-          }else{
-            do_eth=true;
-          }
         }
-
-        /* If we have determined that we should send at the Ethernet level and
-         * we still don't have a next hop MAC address, we need to resolve it. */
-        if(do_eth){
-          nping_print(DBG_4, "Target will be reached sending packets at the Ethernet level...");
-          /* Do not resolve it if the user passed a specific MAC address */
-          if(!this->eth.dst.is_set()){
-            /* First of all let's determine which IP address we need to use for
-             * the MAC resolution. If we are directly connected to the host
-             * then it's the host's address the one we are interested in. Otherwise
-             * we'll use the address of the default gateway */
-            IPAddress *address2resolve=NULL;;
-            if(newhost->getNetworkDistance()==DISTANCE_DIRECT){
-              address2resolve=newhost->getTargetAddress();
-            }else{
-              address2resolve=newhost->getNextHopAddress();
-            }
-            assert(address2resolve!=NULL);
-
-            /* Now do the actual ARP/ND resolution */
-            nping_print(DBG_4, "Attempting ARP/ND resolution...");
-            if(mac_resolve(address2resolve, newhost->getSourceAddress(),newhost->getInterface(), &destmac)!=OP_SUCCESS){
-              nping_warning(QT_1, "Failed to resolve MAC address for %s. Skipping target host %s", address2resolve->toString(),newhost->getTargetAddress()->toString());
-              continue;
-            }
-            nping_print(DBG_4, "ARP/ND resolution done!");
-          }
-          /* Now set up the eth info and associate it with the current host */
-          EthernetHeaderTemplate myeth;
-          /* Source MAC address */
-          if(this->eth.src.is_set()){
-            myeth.src=this->eth.src;
-          }else{
-            myeth.src=newhost->getInterface()->getAddress();
-          }
-          /* Destination MAC address */
-          if(this->eth.dst.is_set()){
-            myeth.dst=this->eth.dst;
-          }else{
-            myeth.dst=destmac; /* This was provided by mac_resolve() */
-          }
-          /* Ether type */
-          if(this->eth.type.is_set()){
-            myeth.type=this->eth.type;
-          }// Don't set it if the user didn't pass an explicit value
-          newhost->setEth(myeth);
+        /* If we are doing ARP, we need Ethernet... */
+        if(this->mode(DO_ARP) && addr->getVersion()==AF_INET){
+          do_eth=true;
         }
-
-        /* Now, tell the target host which packets it has to send. Note that when
-         * we are doing ARP, the IP header is useless, but we still pass it. This
-         * is OK, TargetHosts will ignore the header in this case. */
-        nping_print(DBG_4, "Storing packet info in the TargetHost...");
-        if(this->target_addresses[i]->getVersion()==AF_INET){
-          newhost->setIPv4(this->ip4);
+      /* If the user explicitly requested Ethernet, go for it... */
+      }else if(this->getSendPreference()==PACKET_SEND_ETH){
+        /* ...unless the device is not Ethernet*/
+        if(newhost->getInterface()->getType()!=devt_ethernet){
+          nping_fatal(QT_3, "Ethernet requested for a host that is only reachable through a non-Ethernet network interface (%s).", newhost->getInterface()->getName());
         }else{
-          newhost->setIPv6(this->ip6);
+          do_eth=true;
         }
-        if(this->mode(DO_ICMP)){
-          if(this->target_addresses[i]->getVersion()==AF_INET){
-            newhost->setICMPv4(this->icmp4);
-          }else{
-            newhost->setICMPv6(this->icmp6);
-          }
+      }
+
+      /* If we have determined that we should send at the Ethernet level and
+       * we still don't have a next hop MAC address, we need to resolve it.
+       * That is done for all the hosts of the window at once, in
+       * nextTargetHosts(), so here we just queue the address. */
+      if(do_eth){
+        nping_print(DBG_4, "Target will be reached sending packets at the Ethernet level...");
+        /* Do not resolve it if the user passed a specific MAC address */
+        if(!this->eth.dst.is_set()){
+          /* First of all let's determine which IP address we need to use for
+           * the MAC resolution. If we are directly connected to the host
+           * then it's the host's address the one we are interested in. Otherwise
+           * we'll use the address of the default gateway */
+          IPAddress *address2resolve=this->neighborAddress(newhost);
+          assert(address2resolve!=NULL);
+          nping_print(DBG_4, "Queuing %s for ARP/ND resolution...", address2resolve->toString());
+          this->neighbors.add(address2resolve, newhost->getSourceAddress(), newhost->getInterface());
+          *needs_mac=true;
+        }else{
+          this->setupEth(newhost, NULL);
         }
-        if(this->mode(DO_TCP))
-          newhost->setTCP(this->tcp);
-        if(this->mode(DO_UDP))
-          newhost->setUDP(this->udp);
-        if(this->mode(DO_ARP) && this->target_addresses[i]->getVersion()==AF_INET)
-          newhost->setARP(this->arp);
-        if(this->payload_buff!=NULL)
-          newhost->setPayload(this->payload_buff, this->payload_len);
+      }
+
+      /* Now, tell the target host which packets it has to send. Note that when
+       * we are doing ARP, the IP header is useless, but we still pass it. This
+       * is OK, TargetHosts will ignore the header in this case. */
+      nping_print(DBG_4, "Storing packet info in the TargetHost...");
+      if(addr->getVersion()==AF_INET){
+        newhost->setIPv4(this->ip4);
       }else{
-        /* We failed to determine a valid route for the target so we can't do anything but to skip it*/
-        delete newhost;
-        nping_warning(QT_1, "WARNING: Cannot find route for %s. Skipping that target host...", this->target_addresses[i]->toString());
-        continue;
+        newhost->setIPv6(this->ip6);
+      }
+      if(this->mode(DO_ICMP)){
+        if(addr->getVersion()==AF_INET){
+          newhost->setICMPv4(this->icmp4);
+        }else{
+          newhost->setICMPv6(this->icmp6);
+        }
       }
+      if(this->mode(DO_TCP))
+        newhost->setTCP(this->tcp);
+      if(this->mode(DO_UDP))
+        newhost->setUDP(this->udp);
+      if(this->mode(DO_ARP) && addr->getVersion()==AF_INET)
+        newhost->setARP(this->arp);
+      if(this->payload_buff!=NULL)
+        newhost->setPayload(this->payload_buff, this->payload_len);
+    }else{
+      /* We failed to determine a valid route for the target so we can't do anything but to skip it*/
+      nping_warning(QT_1, "WARNING: Cannot find route for %s. Skipping that target host...", addr->toString());
+      this->deleteTargetHost(newhost);
+      return NULL;
     }
-
-    /* Now we have all the info we need, so just add the new host to the globla
-     * list of target hosts. */
-    this->target_hosts.push_back(newhost);
-    nping_print(DBG_2, "Added target host %s.", this->target_addresses[i]->toString() );
   }
-  return OP_SUCCESS;
-}/* End of setupTargetHosts() */
 
+  nping_print(DBG_2, "Added target host %s.", addr->toString() );
+  return newhost;
+} /* End of newTargetHost() */
+
+
+/* Instances the TargetHosts for the next TARGET_WINDOW addresses of the
+ * target list and stores them in target_hosts. Addresses that can't be
+ * reached are skipped. Next hop MAC addresses are resolved for the whole
+ * window at once (see NeighborResolver). The hosts that were in target_hosts are moved to
+ * retired_hosts, so replies to their last probes can still be matched, and
+ * the ones that were retired before are deleted. Returns the number of
+ * hosts instanced, or -1 if there were no more addresses. If no host is
+ * instanced, nothing is changed. */
+int NpingOps::loadTargetWindow(){
+  vector<TargetHost *> window;
+  vector<TargetHost *> loaded;
+  vector<bool> resolve;
+  TargetHost *newhost=NULL;
+  IPAddress *addr=NULL;
+  const char *name=NULL;
+  bool needs_mac=false;
+  MACAddress destmac;
 
+  if(this->target_gen.done())
+    return -1;
+  while(loaded.size()<TARGET_WINDOW && !this->target_gen.done()){
+    addr=new IPAddress();
+    this->target_gen.next(addr, &name);
+    if((newhost=this->newTargetHost(addr, name, &needs_mac))!=NULL){
+      loaded.push_back(newhost);
+      resolve.push_back(needs_mac);
+    }
+  }
+
+  /* Now do the actual ARP/ND resolution, for all the hosts that need it */
+  if(this->neighbors.size()>0){
+    nping_print(DBG_4, "Attempting ARP/ND resolution...");
+    this->neighbors.resolve();
+    nping_print(DBG_4, "ARP/ND resolution done!");
+  }
+  for(size_t i=0; i<loaded.size(); i++){
+    if(resolve[i]){
+      addr=this->neighborAddress(loaded[i]);
+      if(this->neighbors.get(addr, &destmac)!=OP_SUCCESS){
+        nping_warning(QT_1, "Failed to resolve MAC address for %s. Skipping target host %s", addr->toString(), loaded[i]->getTargetAddress()->toString());
+        this->deleteTargetHost(loaded[i]);
+        continue;
+      }
+      this->setupEth(loaded[i], &destmac);
+    }
+    window.push_back(loaded[i]);
+  }
+  this->neighbors.reset();
+  if(window.size()==0)
+    return 0;
+  for(size_t i=0; i<this->retired_hosts.size(); i++)
+    this->deleteTargetHost(this->retired_hosts[i]);
+  this->retired_hosts=this->target_hosts;
+  this->target_hosts=window;
+  this->hosts_loaded+=window.size();
+  nping_print(DBG_2, "Loaded %u target hosts (%u so far).", (u32)window.size(), this->hosts_loaded);
+  return window.size();
+} /* End of loadTargetWindow() */
+
+
+/* Loads the next window of targets (see loadTargetWindow()). Windows where
+ * none of the hosts can be reached are skipped, so this only returns zero
+ * when there are no targets left, in which case nothing is changed.
+ * Otherwise it returns the number of hosts instanced. */
+u32 NpingOps::nextTargetHosts(){
+  int loaded=0;
+
+  while((loaded=this->loadTargetWindow())==0)
+    nping_print(DBG_2, "None of the hosts of the window could be reached. Loading the next one.");
+  return (loaded<0) ? 0 : loaded;
+} /* End of nextTargetHosts() */
+
+
+/* Returns the address whose MAC we need to send packets to the supplied host
+ * at the Ethernet level: the host's own address if it is directly connected,
+ * or its next hop's otherwise. */
+IPAddress *NpingOps::neighborAddress(TargetHost *host){
+  if(host->getNetworkDistance()==DISTANCE_DIRECT)
+    return host->getTargetAddress();
+  else
+    return host->getNextHopAddress();
+} /* End of neighborAddress() */
+
+
+/* Associates the supplied host with the Ethernet header template to use
+ * for its packets. "destmac" is the resolved next hop MAC address; it is
+ * ignored (and may be NULL) if the user supplied one. */
+void NpingOps::setupEth(TargetHost *host, MACAddress *destmac){
+  EthernetHeaderTemplate myeth;
+  /* Source MAC address */
+  if(this->eth.src.is_set()){
+    myeth.src=this->eth.src;
+  }else{
+    myeth.src=host->getInterface()->getAddress();
+  }
+  /* Destination MAC address */
+  if(this->eth.dst.is_set()){
+    myeth.dst=this->eth.dst;
+  }else{
+    assert(destmac!=NULL);
+    myeth.dst=*destmac; /* This was provided by the NeighborResolver */
+  }
+  /* Ether type */
+  if(this->eth.type.is_set()){
+    myeth.type=this->eth.type;
+  }// Don't set it if the user didn't pass an explicit value
+  host->setEth(myeth);
+} /* End of setupEth() */
+
+
+/* Returns true if there are addresses in the target list for which we
+ * haven't instanced a TargetHost yet. */
+bool NpingOps::moreTargetHosts(){
+  return !this->target_gen.done();
+} /* End of moreTargetHosts() */
+
+
+/* Frees a TargetHost and the addresses it owns */
+void NpingOps::deleteTargetHost(TargetHost *host){
+  IPAddress *tgt=host->getTargetAddress();
+  IPAddress *src=host->getSourceAddress();
+  IPAddress *nxthop=host->getNextHopAddress();
+  delete host;
+  if(tgt!=NULL)
+    delete tgt;
+  if(src!=NULL && src!=this->spoof_addr)
+    delete src;
+  if(nxthop!=NULL)
+    delete nxthop;
+} /* End of deleteTargetHost() */
+
+
+/* Returns the number of TargetHosts instanced so far */
 u32 NpingOps::totalTargetHosts(){
-  return this->target_hosts.size();
+  return this->hosts_loaded;
 } /* End of totalTargetHosts() */
 
 /* Returns true if the underlying OS is a Microsoft Windows system. */
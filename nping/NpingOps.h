@@ -182,10 +182,19 @@
 #define MAX_IPv4_NETMASK_ALLOWED 8
 #define MAX_IPv6_NETMASK_ALLOWED 104
 
+/* Maximum number of TargetHosts we instance at a time. Bigger target lists
+ * are processed in windows of this many hosts. */
+#define TARGET_WINDOW 4096
+
 #include "nping.h"
 #include "global_structures.h"
 #include "stats.h"
 #include "TargetHost.h"
+#include "TargetGenerator.h"
+#include "NeighborResolver.h"
+#include "OutputWriter.h"
+#include "StatsReporter.h"
+#include "FlowTable.h"
 #include "NetworkInterface.h"
 #include "HeaderTemplates.h"
 #include <string>
@@ -206,6 +215,13 @@ class NpingOps {
     bool show_sent_pkts_set;
     bool show_eth;            /* Print link layer headers?             */
     bool show_all_stats;      /* Print stats of hosts that didnt reply?*/
+    char *output_file;        /* File for structured output            */
+    int output_format;        /* Format of structured output           */
+    bool output_format_set;
+    long stats_interval;      /* Time between live stats reports       */
+    bool stats_interval_set;
+    char *stats_socket;       /* Unix socket that serves live stats    */
+    bool stats_socket_set;
 
     /* Operation and Performance */
     u64 rounds;               /* No of times a host is targeted        */
@@ -215,6 +231,16 @@ class NpingOps {
     bool host_timeout_set;
     long delay;               /* Delay between each probe              */
     bool delay_set;
+    u32 rate;                 /* Packets per second                    */
+    bool rate_set;
+    u32 tx_batch;             /* Max packets per transmission batch    */
+    bool tx_batch_set;
+    u32 inflight;             /* Probes per host kept for matching     */
+    bool inflight_set;
+    u32 threads;              /* Sender threads (0 = single-threaded)  */
+    bool threads_set;
+    bool precompile;          /* Build probes from wire templates?     */
+    bool precompile_set;
     char device[MAX_DEV_LEN]; /* Network interface                     */
     bool device_set;
     char *bpf_filter_spec;    /* Custom, user-supplied BPF filter spec */
@@ -299,14 +325,26 @@ class NpingOps {
     double delayed_rcvd_ts;            /* Time delayed pkt was received*/
 
    private:
-    vector<IPAddress *> target_addresses;  /* List of target IP addresses */
     vector<const char *> target_specs;     /* List of user target specs   */
-    vector<const char *> target_hostnames; /* List of target names        */
+    TargetGenerator target_gen;            /* Addresses of the specs      */
+    u32 hosts_loaded;                      /* TargetHosts instanced so far*/
+
+    NeighborResolver neighbors;            /* Pending ARP/ND resolutions  */
+
+    TargetHost *newTargetHost(IPAddress *addr, const char *name, bool *needs_mac);
+    int loadTargetWindow();
+    void deleteTargetHost(TargetHost *host);
+    IPAddress *neighborAddress(TargetHost *host);
+    void setupEth(TargetHost *host, MACAddress *destmac);
 
   public:
-    vector<TargetHost *> target_hosts;     /* List of Nping target hosts  */
+    vector<TargetHost *> target_hosts;     /* Current window of targets   */
+    vector<TargetHost *> retired_hosts;    /* Previous window of targets  */
     vector<NetworkInterface *> interfaces; /* List of relevant net ifaces */
     PacketStats stats;                      /* Global statistics           */
+    FlowTable flows;                        /* Probes awaiting a response  */
+    OutputWriter output;                    /* Structured output (if any)  */
+    StatsReporter reporter;                 /* Live statistics (if any)    */
     EthernetHeaderTemplate eth;            /* Header field values for Eth */
     ARPHeaderTemplate arp;                 /* Header field values for ARP */
     IPv4HeaderTemplate ip4;                /* Header field values for IPv4*/
@@ -354,11 +392,44 @@ class NpingOps {
 
     int getDetailLevel();
 
+    int setStructuredOutput(char *filename, int format);
+    char *getStructuredOutputFile();
+    int getStructuredOutputFormat();
+    bool issetStructuredOutput();
+
+    int setStatsInterval(long t);
+    long getStatsInterval();
+    bool issetStatsInterval();
+
+    int setStatsSocket(char *path);
+    char *getStatsSocket();
+    bool issetStatsSocket();
+
     /* Operation and Performance */
     int setDelay(long t);
     long getDelay();
     bool issetDelay();
 
+    int setRate(u32 pps);
+    u32 getRate();
+    bool issetRate();
+
+    int setTxBatch(u32 val);
+    u32 getTxBatch();
+    bool issetTxBatch();
+
+    int setInflight(u32 val);
+    u32 getInflight();
+    bool issetInflight();
+
+    int setThreads(u32 val);
+    u32 getThreads();
+    bool issetThreads();
+
+    int setPrecompile(bool val);
+    bool precompileProbes();
+    bool issetPrecompile();
+
     int setRounds(u64 val);
     u64 getRounds();
     bool issetRounds();
@@ -520,6 +591,8 @@ class NpingOps {
     /* TargetHost handling */
     int addTargetSpec(const char *spec);
     int setupTargetHosts();
+    u32 nextTargetHosts();
+    bool moreTargetHosts();
     u32 totalTargetHosts();
 
     /* Public attributes */
@@ -0,0 +1,589 @@
+/***************************************************************************
+ * OutputWriter.cc -- The OutputWriter class writes one compact, machine-  *
+ * readable record per sent or received packet, in JSON Lines or in a      *
+ * fixed-width binary format, from a background thread.                    *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2014 Insecure.Com LLC. Nmap is    *
+ * also a registered trademark of Insecure.Com LLC.  This program is free  *
+ * software; you may redistribute and/or modify it under the terms of the  *
+ * GNU General Public License as published by the Free Software            *
+ * Foundation; Version 2 ("GPL"), BUT ONLY WITH ALL OF THE CLARIFICATIONS  *
+ * AND EXCEPTIONS DESCRIBED HEREIN.  This guarantees your right to use,    *
+ * modify, and redistribute this software under certain conditions.  If    *
+ * you wish to embed Nmap technology into proprietary software, we sell    *
+ * alternative licenses (contact sales@nmap.com).  Dozens of software      *
+ * vendors already license Nmap technology such as host discovery, port    *
+ * scanning, OS detection, version detection, and the Nmap Scripting       *
+ * Engine.                                                                 *
+ *                                                                         *
+ * Note that the GPL places important restrictions on "derivative works",  *
+ * yet it does not provide a detailed definition of that term.  To avoid   *
+ * misunderstandings, we interpret that term as broadly as copyright law   *
+ * allows.  For example, we consider an application to constitute a        *
+ * derivative work for the purpose of this license if it does any of the   *
+ * following with any software or content covered by this license          *
+ * ("Covered Software"):                                                   *
+ *                                                                         *
+ * o Integrates source code from Covered Software.                         *
+ *                                                                         *
+ * o Reads or includes copyrighted data files, such as Nmap's nmap-os-db   *
+ * or nmap-service-probes.                                                 *
+ *                                                                         *
+ * o Is designed specifically to execute Covered Software and parse the    *
+ * results (as opposed to typical shell or execution-menu apps, which will *
+ * execute anything you tell them to).                                     *
+ *                                                                         *
+ * o Includes Covered Software in a proprietary executable installer.  The *
+ * installers produced by InstallShield are an example of this.  Including *
+ * Nmap with other software in compressed or archival form does not        *
+ * trigger this provision, provided appropriate open source decompression  *
+ * or de-archiving software is widely available for no charge.  For the    *
+ * purposes of this license, an installer is considered to include Covered *
+ * Software even if it actually retrieves a copy of Covered Software from  *
+ * another source during runtime (such as by downloading it from the       *
+ * Internet).                                                              *
+ *                                                                         *
+ * o Links (statically or dynamically) to a library which does any of the  *
+ * above.                                                                  *
+ *                                                                         *
+ * o Executes a helper program, module, or script to do any of the above.  *
+ *                                                                         *
+ * This list is not exclusive, but is meant to clarify our interpretation  *
+ * of derived works with some common examples.  Other people may interpret *
+ * the plain GPL differently, so we consider this a special exception to   *
+ * the GPL that we apply to Covered Software.  Works which meet any of     *
+ * these conditions must conform to all of the terms of this license,      *
+ * particularly including the GPL Section 3 requirements of providing      *
+ * source code and allowing free redistribution of the work as a whole.    *
+ *                                                                         *
+ * As another special exception to the GPL terms, Insecure.Com LLC grants  *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two.                                  *
+ *                                                                         *
+ * Any redistribution of Covered Software, including any derived works,    *
+ * must obey and carry forward all of the terms of this license, including *
+ * obeying all GPL rules and restrictions.  For example, source code of    *
+ * the whole work must be provided and free redistribution must be         *
+ * allowed.  All GPL references to "this License", are to be treated as    *
+ * including the terms and conditions of this license text as well.        *
+ *                                                                         *
+ * Because this license imposes special exceptions to the GPL, Covered     *
+ * Work may not be combined (even as part of a larger work) with plain GPL *
+ * software.  The terms, conditions, and exceptions of this license must   *
+ * be included as well.  This license is incompatible with some other open *
+ * source licenses as well.  In some cases we can relicense portions of    *
+ * Nmap or grant special permissions to use it in other open source        *
+ * software.  Please contact fyodor@nmap.org with any such requests.       *
+ * Similarly, we don't incorporate incompatible open source software into  *
+ * Covered Software without special permission from the copyright holders. *
+ *                                                                         *
+ * If you have any questions about the licensing restrictions on using     *
+ * Nmap in other works, are happy to help.  As mentioned above, we also    *
+ * offer alternative license to integrate Nmap into proprietary            *
+ * applications and appliances.  These contracts have been sold to dozens  *
+ * of software vendors, and generally include a perpetual license as well  *
+ * as providing for priority support and updates.  They also fund the      *
+ * continued development of Nmap.  Please email sales@nmap.com for further *
+ * information.                                                            *
+ *                                                                         *
+ * If you have received a written license agreement or contract for        *
+ * Covered Software stating terms other than these, you may choose to use  *
+ * and redistribute Covered Software under those terms instead of these.   *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the Nmap      *
+ * license file for more details (it's in a COPYING file included with     *
+ * Nmap, and also available from https://svn.nmap.org/nmap/COPYING)        *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "nping.h"
+#include "OutputWriter.h"
+#include "TargetHost.h"
+#include "NpingOps.h"
+#include "output.h"
+
+extern NpingOps o;
+
+
+OutputWriter::OutputWriter(){
+  this->fp=NULL;
+  this->close_fp=false;
+  this->format=OUTPUT_FORMAT_NONE;
+  this->active=NULL;
+  this->active_len=0;
+  this->spare=NULL;
+  this->spare_len=0;
+#ifndef WIN32
+  pthread_mutex_init(&this->lock, NULL);
+  pthread_cond_init(&this->ready, NULL);
+  pthread_cond_init(&this->written, NULL);
+  this->running=false;
+  this->stop=false;
+#endif
+} /* End of OutputWriter constructor */
+
+
+OutputWriter::~OutputWriter(){
+  this->close();
+#ifndef WIN32
+  pthread_cond_destroy(&this->written);
+  pthread_cond_destroy(&this->ready);
+  pthread_mutex_destroy(&this->lock);
+#endif
+} /* End of OutputWriter destructor */
+
+
+/* Opens the output file and, unless we are on Windows, starts the writer
+ * thread. A filename of "-" means the standard output.
+ * @return OP_SUCCESS on success and OP_FAILURE in case of error. */
+int OutputWriter::open(const char *filename, int format){
+  u8 hdr[OUTPUT_BINARY_HDRLEN];
+  u16 aux16=0;
+  assert(filename!=NULL);
+  if(this->fp!=NULL || (format!=OUTPUT_FORMAT_JSONL && format!=OUTPUT_FORMAT_BINARY))
+    return OP_FAILURE;
+
+  if(strcmp(filename, "-")==0){
+    this->fp=stdout;
+    this->close_fp=false;
+  }else if((this->fp=fopen(filename, format==OUTPUT_FORMAT_BINARY ? "wb" : "w"))!=NULL){
+    this->close_fp=true;
+  }else{
+    return OP_FAILURE;
+  }
+  this->format=format;
+
+  if(format==OUTPUT_FORMAT_BINARY){
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, OUTPUT_BINARY_MAGIC, 8);
+    aux16=htons(OUTPUT_BINARY_VERSION);
+    memcpy(hdr+8, &aux16, 2);
+    aux16=htons(OUTPUT_BINARY_RECLEN);
+    memcpy(hdr+10, &aux16, 2);
+    fwrite(hdr, 1, sizeof(hdr), this->fp);
+  }
+
+  this->active=(struct output_record *)safe_malloc(sizeof(struct output_record)*OUTPUT_BUFFER_RECORDS);
+  this->spare=(struct output_record *)safe_malloc(sizeof(struct output_record)*OUTPUT_BUFFER_RECORDS);
+  this->active_len=0;
+  this->spare_len=0;
+
+#ifndef WIN32
+  this->stop=false;
+  if(pthread_create(&this->thread, NULL, writer_main, this)!=0){
+    nping_warning(QT_2, "%s(): Unable to start the writer thread. Records will be written as buffers fill up.", __func__);
+  }else{
+    this->running=true;
+  }
+#endif
+  return OP_SUCCESS;
+} /* End of open() */
+
+
+/* Returns true if structured output is being written */
+bool OutputWriter::enabled(){
+  return this->format!=OUTPUT_FORMAT_NONE;
+} /* End of enabled() */
+
+
+/* Copies the address of a target host into a record's address field */
+static void target_address(TargetHost *tgt, u8 *addr){
+  struct in_addr a4;
+  struct in6_addr a6;
+  if(tgt->getTargetAddress()->getVersion()==AF_INET6){
+    a6=tgt->getTargetAddress()->getIPv6Address();
+    memcpy(addr, &a6, 16);
+  }else{
+    a4=tgt->getTargetAddress()->getIPv4Address();
+    memcpy(addr, &a4, 4);
+  }
+} /* End of target_address() */
+
+
+/* Stores a record for a packet sent to the supplied target. */
+int OutputWriter::sent(TargetHost *tgt, PacketElement *pkt, const struct timeval *when){
+  struct output_record rec;
+  assert(tgt!=NULL && pkt!=NULL && when!=NULL);
+  if(this->format==OUTPUT_FORMAT_NONE)
+    return OP_FAILURE;
+  memset(&rec, 0, sizeof(rec));
+  rec.time=*when;
+  rec.rtt=-1;
+  rec.event=OUTPUT_EVENT_SENT;
+  target_address(tgt, rec.target);
+  fill_record(&rec, pkt);
+  this->store(&rec);
+  return OP_SUCCESS;
+} /* End of sent() */
+
+
+/* Stores a record for a packet received in response to a probe sent to the
+ * supplied target. "rtt" is the round trip time in microseconds, or -1 if it
+ * is unknown. */
+int OutputWriter::rcvd(TargetHost *tgt, PacketElement *pkt, const struct timeval *when, int rtt){
+  struct output_record rec;
+  assert(tgt!=NULL && pkt!=NULL && when!=NULL);
+  if(this->format==OUTPUT_FORMAT_NONE)
+    return OP_FAILURE;
+  memset(&rec, 0, sizeof(rec));
+  rec.time=*when;
+  rec.rtt=rtt;
+  rec.event=OUTPUT_EVENT_RCVD;
+  target_address(tgt, rec.target);
+  fill_record(&rec, pkt);
+  this->store(&rec);
+  return OP_SUCCESS;
+} /* End of rcvd() */
+
+
+/* Stops the writer thread, writes any pending record and closes the output
+ * file. It's safe to call it more than once. */
+int OutputWriter::close(){
+  if(this->fp==NULL)
+    return OP_SUCCESS;
+#ifndef WIN32
+  if(this->running){
+    pthread_mutex_lock(&this->lock);
+    this->stop=true;
+    pthread_cond_signal(&this->ready);
+    pthread_mutex_unlock(&this->lock);
+    pthread_join(this->thread, NULL);
+    this->running=false;
+  }
+#endif
+  /* Without a writer thread, the last records are still here */
+  if(this->active_len>0)
+    this->write_records(this->active, this->active_len);
+  this->active_len=0;
+  if(this->close_fp)
+    fclose(this->fp);
+  else
+    fflush(this->fp);
+  this->fp=NULL;
+  this->format=OUTPUT_FORMAT_NONE;
+  free(this->active);
+  free(this->spare);
+  this->active=NULL;
+  this->spare=NULL;
+  return OP_SUCCESS;
+} /* End of close() */
+
+
+/* Appends a record to the active buffer. When the buffer is full, it is
+ * handed to the writer thread and the spare one takes its place. We only
+ * wait if the writer thread is still busy with the spare buffer. */
+void OutputWriter::store(struct output_record *rec){
+#ifndef WIN32
+  if(this->running){
+    pthread_mutex_lock(&this->lock);
+    if(this->active_len==OUTPUT_BUFFER_RECORDS){
+      while(this->spare_len>0)
+        pthread_cond_wait(&this->written, &this->lock);
+      struct output_record *aux=this->spare;
+      this->spare=this->active;
+      this->spare_len=this->active_len;
+      this->active=aux;
+      this->active_len=0;
+      pthread_cond_signal(&this->ready);
+    }
+    this->active[this->active_len++]=*rec;
+    pthread_mutex_unlock(&this->lock);
+    return;
+  }
+#endif
+  if(this->active_len==OUTPUT_BUFFER_RECORDS){
+    this->write_records(this->active, this->active_len);
+    this->active_len=0;
+  }
+  this->active[this->active_len++]=*rec;
+} /* End of store() */
+
+
+#ifndef WIN32
+/* Body of the writer thread. It writes the spare buffer every time the
+ * producer fills it. If that doesn't happen for OUTPUT_FLUSH_INTERVAL
+ * milliseconds, it takes the records stored in the active buffer so far, so
+ * the output doesn't lag behind when packets are few. */
+void OutputWriter::writer_loop(){
+  struct output_record *recs=NULL;
+  struct output_record *aux=NULL;
+  struct timeval now;
+  struct timespec deadline;
+  u32 count=0;
+
+  pthread_mutex_lock(&this->lock);
+  while(1){
+    if(this->spare_len==0){
+      if(this->stop && this->active_len==0)
+        break;
+      if(!this->stop){
+        gettimeofday(&now, NULL);
+        TIMEVAL_MSEC_ADD(now, now, OUTPUT_FLUSH_INTERVAL);
+        deadline.tv_sec=now.tv_sec;
+        deadline.tv_nsec=now.tv_usec*1000;
+        pthread_cond_timedwait(&this->ready, &this->lock, &deadline);
+      }
+      if(this->spare_len==0 && this->active_len>0){
+        aux=this->spare;
+        this->spare=this->active;
+        this->spare_len=this->active_len;
+        this->active=aux;
+        this->active_len=0;
+      }
+      if(this->spare_len==0)
+        continue;
+    }
+    /* The producer won't touch the spare buffer until we are done with it */
+    recs=this->spare;
+    count=this->spare_len;
+    pthread_mutex_unlock(&this->lock);
+    this->write_records(recs, count);
+    fflush(this->fp);
+    pthread_mutex_lock(&this->lock);
+    this->spare_len=0;
+    pthread_cond_signal(&this->written);
+  }
+  pthread_mutex_unlock(&this->lock);
+} /* End of writer_loop() */
+
+
+void *OutputWriter::writer_main(void *arg){
+  ((OutputWriter *)arg)->writer_loop();
+  return NULL;
+} /* End of writer_main() */
+#endif
+
+
+/* Formats and writes a set of records to the output file.
+ * @return OP_SUCCESS on success and OP_FAILURE in case of error. */
+int OutputWriter::write_records(const struct output_record *recs, u32 count){
+  char line[512];
+  u8 bin[OUTPUT_BINARY_RECLEN];
+  int len=0;
+  for(u32 i=0; i<count; i++){
+    if(this->format==OUTPUT_FORMAT_BINARY){
+      format_binary(&recs[i], bin);
+      if(fwrite(bin, 1, OUTPUT_BINARY_RECLEN, this->fp)!=OUTPUT_BINARY_RECLEN)
+        return OP_FAILURE;
+    }else{
+      if((len=format_jsonl(&recs[i], line, sizeof(line)))<=0)
+        continue;
+      if(fwrite(line, 1, len, this->fp)!=(size_t)len)
+        return OP_FAILURE;
+    }
+  }
+  return OP_SUCCESS;
+} /* End of write_records() */
+
+
+/* Copies the interesting fields of a packet into a record. Only the first
+ * network header and the first transport header are looked at, so the
+ * datagram quoted in ICMP error messages is ignored. */
+void OutputWriter::fill_record(struct output_record *rec, PacketElement *pkt){
+  PacketElement *p=NULL;
+  IPv4Header *ip4=NULL;
+  IPv6Header *ip6=NULL;
+  TCPHeader *tcp=NULL;
+  UDPHeader *udp=NULL;
+  ICMPv4Header *icmp4=NULL;
+  ICMPv6Header *icmp6=NULL;
+  ARPHeader *arp=NULL;
+  u32 aux32=0;
+
+  for(p=pkt; p!=NULL && rec->proto==0; p=p->getNextElement()){
+    switch(p->protocol_id()){
+      case HEADER_TYPE_IPv4:
+        if(rec->ipver!=0)
+          break;
+        ip4=(IPv4Header *)p;
+        rec->ipver=4;
+        rec->ttl=ip4->getTTL();
+        rec->len=p->getLen();
+        memcpy(rec->src, ip4->getSourceAddress(), 4);
+        memcpy(rec->dst, ip4->getDestinationAddress(), 4);
+      break;
+      case HEADER_TYPE_IPv6:
+        if(rec->ipver!=0)
+          break;
+        ip6=(IPv6Header *)p;
+        rec->ipver=6;
+        rec->ttl=ip6->getHopLimit();
+        rec->len=p->getLen();
+        memcpy(rec->src, ip6->getSourceAddress(), 16);
+        memcpy(rec->dst, ip6->getDestinationAddress(), 16);
+      break;
+      case HEADER_TYPE_ARP:
+        arp=(ARPHeader *)p;
+        rec->ipver=4;
+        rec->proto=OUTPUT_PROTO_ARP;
+        rec->len=p->getLen();
+        rec->type=arp->getOpCode();
+        aux32=arp->getSenderIP();
+        memcpy(rec->src, &aux32, 4);
+        aux32=arp->getTargetIP();
+        memcpy(rec->dst, &aux32, 4);
+      break;
+      case HEADER_TYPE_TCP:
+        tcp=(TCPHeader *)p;
+        rec->proto=HEADER_TYPE_TCP;
+        rec->sport=tcp->getSourcePort();
+        rec->dport=tcp->getDestinationPort();
+        rec->flags=tcp->getFlags();
+        rec->seq=tcp->getSeq();
+      break;
+      case HEADER_TYPE_UDP:
+        udp=(UDPHeader *)p;
+        rec->proto=HEADER_TYPE_UDP;
+        rec->sport=udp->getSourcePort();
+        rec->dport=udp->getDestinationPort();
+      break;
+      case HEADER_TYPE_ICMPv4:
+        icmp4=(ICMPv4Header *)p;
+        rec->proto=HEADER_TYPE_ICMPv4;
+        rec->type=icmp4->getType();
+        rec->code=icmp4->getCode();
+        rec->sport=icmp4->getIdentifier();
+        rec->seq=icmp4->getSequence();
+      break;
+      case HEADER_TYPE_ICMPv6:
+        icmp6=(ICMPv6Header *)p;
+        rec->proto=HEADER_TYPE_ICMPv6;
+        rec->type=icmp6->getType();
+        rec->code=icmp6->getCode();
+        rec->sport=icmp6->getIdentifier();
+        rec->seq=icmp6->getSequence();
+      break;
+      default:
+        /* Link layer, extension headers, etc. Keep looking. */
+      break;
+    }
+  }
+} /* End of fill_record() */
+
+
+/* Turns a record into a line of JSON, terminated by a newline. Returns the
+ * length of the line, or -1 if it does not fit in the buffer. */
+int OutputWriter::format_jsonl(const struct output_record *rec, char *buff, size_t len){
+  char target[INET6_ADDRSTRLEN];
+  char src[INET6_ADDRSTRLEN];
+  char dst[INET6_ADDRSTRLEN];
+  char proto[16];
+  int af=(rec->ipver==6) ? AF_INET6 : AF_INET;
+  int n=0, m=0;
+
+  inet_ntop(af, rec->target, target, sizeof(target));
+  inet_ntop(af, rec->src, src, sizeof(src));
+  inet_ntop(af, rec->dst, dst, sizeof(dst));
+  switch(rec->proto){
+    case HEADER_TYPE_TCP: Strncpy(proto, "\"tcp\"", sizeof(proto)); break;
+    case HEADER_TYPE_UDP: Strncpy(proto, "\"udp\"", sizeof(proto)); break;
+    case HEADER_TYPE_ICMPv4: Strncpy(proto, "\"icmp\"", sizeof(proto)); break;
+    case HEADER_TYPE_ICMPv6: Strncpy(proto, "\"icmpv6\"", sizeof(proto)); break;
+    case OUTPUT_PROTO_ARP: Strncpy(proto, "\"arp\"", sizeof(proto)); break;
+    default: Snprintf(proto, sizeof(proto), "%u", rec->proto); break;
+  }
+
+  n=Snprintf(buff, len, "{\"event\":\"%s\",\"time\":%lu.%06lu,\"target\":\"%s\",\"proto\":%s,\"src\":\"%s\",\"dst\":\"%s\",\"len\":%u",
+             rec->event==OUTPUT_EVENT_SENT ? "SENT" : "RCVD",
+             (unsigned long)rec->time.tv_sec, (unsigned long)rec->time.tv_usec,
+             target, proto, src, dst, rec->len);
+  if(n<0 || (size_t)n>=len)
+    return -1;
+
+  switch(rec->proto){
+    case HEADER_TYPE_TCP:
+      m=Snprintf(buff+n, len-n, ",\"ttl\":%u,\"sport\":%u,\"dport\":%u,\"flags\":\"%s%s%s%s%s%s%s%s\",\"seq\":%lu",
+                 rec->ttl, rec->sport, rec->dport,
+                 (rec->flags & TH_SYN) ? "S" : "", (rec->flags & TH_FIN) ? "F" : "",
+                 (rec->flags & TH_RST) ? "R" : "", (rec->flags & TH_PSH) ? "P" : "",
+                 (rec->flags & TH_ACK) ? "A" : "", (rec->flags & TH_URG) ? "U" : "",
+                 (rec->flags & TH_ECN) ? "E" : "", (rec->flags & TH_CWR) ? "C" : "",
+                 (unsigned long)rec->seq);
+    break;
+    case HEADER_TYPE_UDP:
+      m=Snprintf(buff+n, len-n, ",\"ttl\":%u,\"sport\":%u,\"dport\":%u",
+                 rec->ttl, rec->sport, rec->dport);
+    break;
+    case HEADER_TYPE_ICMPv4:
+    case HEADER_TYPE_ICMPv6:
+      m=Snprintf(buff+n, len-n, ",\"ttl\":%u,\"type\":%u,\"code\":%u,\"id\":%u,\"seq\":%lu",
+                 rec->ttl, rec->type, rec->code, rec->sport, (unsigned long)rec->seq);
+    break;
+    case OUTPUT_PROTO_ARP:
+      m=Snprintf(buff+n, len-n, ",\"op\":%u", rec->type);
+    break;
+    default:
+      m=Snprintf(buff+n, len-n, ",\"ttl\":%u", rec->ttl);
+    break;
+  }
+  if(m<0 || (size_t)(n+=m)>=len)
+    return -1;
+
+  if(rec->rtt>=0)
+    m=Snprintf(buff+n, len-n, ",\"rtt\":%.3f}\n", rec->rtt/1000.0);
+  else
+    m=Snprintf(buff+n, len-n, "}\n");
+  if(m<0 || (size_t)(n+=m)>=len)
+    return -1;
+  return n;
+} /* End of format_jsonl() */
+
+
+/* Serializes a record in the binary layout described in OutputWriter.h.
+ * The supplied buffer must hold OUTPUT_BINARY_RECLEN bytes. */
+void OutputWriter::format_binary(const struct output_record *rec, u8 *buff){
+  u32 aux32=0;
+  u16 aux16=0;
+  s32 rtt=rec->rtt;
+
+  memset(buff, 0, OUTPUT_BINARY_RECLEN);
+  aux32=htonl((u32)(((u64)rec->time.tv_sec*1000000+rec->time.tv_usec) >> 32));
+  memcpy(buff, &aux32, 4);
+  aux32=htonl((u32)(((u64)rec->time.tv_sec*1000000+rec->time.tv_usec) & 0xFFFFFFFF));
+  memcpy(buff+4, &aux32, 4);
+  aux32=htonl((u32)rtt);
+  memcpy(buff+8, &aux32, 4);
+  aux32=htonl(rec->seq);
+  memcpy(buff+12, &aux32, 4);
+  aux16=htons(rec->sport);
+  memcpy(buff+16, &aux16, 2);
+  aux16=htons(rec->dport);
+  memcpy(buff+18, &aux16, 2);
+  aux16=htons(rec->len);
+  memcpy(buff+20, &aux16, 2);
+  buff[22]=rec->event;
+  buff[23]=rec->ipver;
+  buff[24]=rec->proto;
+  buff[25]=rec->ttl;
+  buff[26]=rec->flags;
+  buff[27]=rec->type;
+  buff[28]=rec->code;
+  memcpy(buff+32, rec->target, 16);
+  memcpy(buff+48, rec->src, 16);
+  memcpy(buff+64, rec->dst, 16);
+} /* End of format_binary() */
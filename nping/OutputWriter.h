@@ -0,0 +1,258 @@
+/***************************************************************************
+ * OutputWriter.h -- The OutputWriter class writes one compact, machine-   *
+ * readable record per sent or received packet, in JSON Lines or in a      *
+ * fixed-width binary format, from a background thread.                    *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2014 Insecure.Com LLC. Nmap is    *
+ * also a registered trademark of Insecure.Com LLC.  This program is free  *
+ * software; you may redistribute and/or modify it under the terms of the  *
+ * GNU General Public License as published by the Free Software            *
+ * Foundation; Version 2 ("GPL"), BUT ONLY WITH ALL OF THE CLARIFICATIONS  *
+ * AND EXCEPTIONS DESCRIBED HEREIN.  This guarantees your right to use,    *
+ * modify, and redistribute this software under certain conditions.  If    *
+ * you wish to embed Nmap technology into proprietary software, we sell    *
+ * alternative licenses (contact sales@nmap.com).  Dozens of software      *
+ * vendors already license Nmap technology such as host discovery, port    *
+ * scanning, OS detection, version detection, and the Nmap Scripting       *
+ * Engine.                                                                 *
+ *                                                                         *
+ * Note that the GPL places important restrictions on "derivative works",  *
+ * yet it does not provide a detailed definition of that term.  To avoid   *
+ * misunderstandings, we interpret that term as broadly as copyright law   *
+ * allows.  For example, we consider an application to constitute a        *
+ * derivative work for the purpose of this license if it does any of the   *
+ * following with any software or content covered by this license          *
+ * ("Covered Software"):                                                   *
+ *                                                                         *
+ * o Integrates source code from Covered Software.                         *
+ *                                                                         *
+ * o Reads or includes copyrighted data files, such as Nmap's nmap-os-db   *
+ * or nmap-service-probes.                                                 *
+ *                                                                         *
+ * o Is designed specifically to execute Covered Software and parse the    *
+ * results (as opposed to typical shell or execution-menu apps, which will *
+ * execute anything you tell them to).                                     *
+ *                                                                         *
+ * o Includes Covered Software in a proprietary executable installer.  The *
+ * installers produced by InstallShield are an example of this.  Including *
+ * Nmap with other software in compressed or archival form does not        *
+ * trigger this provision, provided appropriate open source decompression  *
+ * or de-archiving software is widely available for no charge.  For the    *
+ * purposes of this license, an installer is considered to include Covered *
+ * Software even if it actually retrieves a copy of Covered Software from  *
+ * another source during runtime (such as by downloading it from the       *
+ * Internet).                                                              *
+ *                                                                         *
+ * o Links (statically or dynamically) to a library which does any of the  *
+ * above.                                                                  *
+ *                                                                         *
+ * o Executes a helper program, module, or script to do any of the above.  *
+ *                                                                         *
+ * This list is not exclusive, but is meant to clarify our interpretation  *
+ * of derived works with some common examples.  Other people may interpret *
+ * the plain GPL differently, so we consider this a special exception to   *
+ * the GPL that we apply to Covered Software.  Works which meet any of     *
+ * these conditions must conform to all of the terms of this license,      *
+ * particularly including the GPL Section 3 requirements of providing      *
+ * source code and allowing free redistribution of the work as a whole.    *
+ *                                                                         *
+ * As another special exception to the GPL terms, Insecure.Com LLC grants  *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two.                                  *
+ *                                                                         *
+ * Any redistribution of Covered Software, including any derived works,    *
+ * must obey and carry forward all of the terms of this license, including *
+ * obeying all GPL rules and restrictions.  For example, source code of    *
+ * the whole work must be provided and free redistribution must be         *
+ * allowed.  All GPL references to "this License", are to be treated as    *
+ * including the terms and conditions of this license text as well.        *
+ *                                                                         *
+ * Because this license imposes special exceptions to the GPL, Covered     *
+ * Work may not be combined (even as part of a larger work) with plain GPL *
+ * software.  The terms, conditions, and exceptions of this license must   *
+ * be included as well.  This license is incompatible with some other open *
+ * source licenses as well.  In some cases we can relicense portions of    *
+ * Nmap or grant special permissions to use it in other open source        *
+ * software.  Please contact fyodor@nmap.org with any such requests.       *
+ * Similarly, we don't incorporate incompatible open source software into  *
+ * Covered Software without special permission from the copyright holders. *
+ *                                                                         *
+ * If you have any questions about the licensing restrictions on using     *
+ * Nmap in other works, are happy to help.  As mentioned above, we also    *
+ * offer alternative license to integrate Nmap into proprietary            *
+ * applications and appliances.  These contracts have been sold to dozens  *
+ * of software vendors, and generally include a perpetual license as well  *
+ * as providing for priority support and updates.  They also fund the      *
+ * continued development of Nmap.  Please email sales@nmap.com for further *
+ * information.                                                            *
+ *                                                                         *
+ * If you have received a written license agreement or contract for        *
+ * Covered Software stating terms other than these, you may choose to use  *
+ * and redistribute Covered Software under those terms instead of these.   *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the Nmap      *
+ * license file for more details (it's in a COPYING file included with     *
+ * Nmap, and also available from https://svn.nmap.org/nmap/COPYING)        *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef __OUTPUTWRITER_H__
+#define __OUTPUTWRITER_H__ 1
+
+#include "nping.h"
+#ifndef WIN32
+#include <pthread.h>
+#endif
+
+class PacketElement;
+class TargetHost;
+
+/* Structured output formats */
+#define OUTPUT_FORMAT_NONE   0
+#define OUTPUT_FORMAT_JSONL  1  /* One JSON object per line               */
+#define OUTPUT_FORMAT_BINARY 2  /* Fixed-width records, see below         */
+
+/* Types of event */
+#define OUTPUT_EVENT_SENT 1
+#define OUTPUT_EVENT_RCVD 2
+
+/* Value of the protocol field for ARP packets. For the rest, the field holds
+ * the IP protocol number of the transport layer (0 if there is none). */
+#define OUTPUT_PROTO_ARP 255
+
+/* Number of records each of the two buffers holds. The producer fills one
+ * buffer while the writer thread writes the other. */
+#define OUTPUT_BUFFER_RECORDS 4096
+
+/* Max time a record waits in a partially filled buffer (milliseconds) */
+#define OUTPUT_FLUSH_INTERVAL 200
+
+/* The binary format is a 16 byte header followed by fixed-width records.
+ * All integers are in network byte order. The header is:
+ *
+ *   0  char magic[8]   "NPINGREC"
+ *   8  u16  version    OUTPUT_BINARY_VERSION
+ *  10  u16  reclen     OUTPUT_BINARY_RECLEN
+ *  12  u32  reserved   Zero
+ *
+ * And each record:
+ *
+ *   0  u64  time       Microseconds since the Epoch
+ *   8  s32  rtt        Round trip time in microseconds, -1 if unknown
+ *  12  u32  seq        TCP sequence number, or ICMP sequence number
+ *  16  u16  sport      TCP/UDP source port, or ICMP identifier
+ *  18  u16  dport      TCP/UDP destination port
+ *  20  u16  len        Packet length, from the network layer up
+ *  22  u8   event      OUTPUT_EVENT_SENT or OUTPUT_EVENT_RCVD
+ *  23  u8   ipver      4 or 6
+ *  24  u8   proto      IP protocol number or OUTPUT_PROTO_ARP
+ *  25  u8   ttl        TTL or hop limit (0 for ARP)
+ *  26  u8   flags      TCP flags
+ *  27  u8   type       ICMP type or ARP operation
+ *  28  u8   code       ICMP code
+ *  29  u8   pad[3]     Zero
+ *  32  u8   target[16] Target host the probe was sent to
+ *  48  u8   src[16]    Source address of the packet
+ *  64  u8   dst[16]    Destination address of the packet
+ *
+ * IPv4 addresses take the first four bytes of the address fields and the
+ * rest are zero. For ARP, src and dst are the sender and target protocol
+ * addresses. */
+#define OUTPUT_BINARY_MAGIC   "NPINGREC"
+#define OUTPUT_BINARY_VERSION 1
+#define OUTPUT_BINARY_HDRLEN  16
+#define OUTPUT_BINARY_RECLEN  80
+
+/* A record, as it is stored before it is written out. It only holds raw
+ * values: turning them into text or into the binary layout is left to the
+ * writer thread. */
+struct output_record {
+  struct timeval time;
+  s32 rtt;
+  u32 seq;
+  u16 sport;
+  u16 dport;
+  u16 len;
+  u8 event;
+  u8 ipver;
+  u8 proto;
+  u8 ttl;
+  u8 flags;
+  u8 type;
+  u8 code;
+  u8 target[16];
+  u8 src[16];
+  u8 dst[16];
+};
+
+/* Writes a structured record for every packet Nping sends or receives. The
+ * thread that handles the packet only copies a few header fields into a
+ * buffer. Records are formatted and written to the output file by a separate
+ * thread, once a buffer fills up or OUTPUT_FLUSH_INTERVAL milliseconds after
+ * the first record was stored, whatever happens first. On Windows there is
+ * no writer thread, so full buffers are written by the caller. */
+class OutputWriter{
+
+  private:
+    FILE *fp;                       /* Output file                      */
+    bool close_fp;                  /* Did we open it?                  */
+    int format;                     /* OUTPUT_FORMAT_*                  */
+    struct output_record *active;   /* Buffer being filled              */
+    u32 active_len;
+    struct output_record *spare;    /* Buffer being written             */
+    u32 spare_len;
+#ifndef WIN32
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;           /* There is a buffer to write       */
+    pthread_cond_t written;         /* The spare buffer is free again   */
+    bool running;                   /* Is the writer thread alive?      */
+    bool stop;                      /* Tells the writer thread to quit  */
+
+    void writer_loop();
+    static void *writer_main(void *arg);
+#endif
+
+    void store(struct output_record *rec);
+    int write_records(const struct output_record *recs, u32 count);
+    static int format_jsonl(const struct output_record *rec, char *buff, size_t len);
+    static void format_binary(const struct output_record *rec, u8 *buff);
+    static void fill_record(struct output_record *rec, PacketElement *pkt);
+
+  public:
+    OutputWriter();
+    ~OutputWriter();
+    int open(const char *filename, int format);
+    bool enabled();
+    int sent(TargetHost *tgt, PacketElement *pkt, const struct timeval *when);
+    int rcvd(TargetHost *tgt, PacketElement *pkt, const struct timeval *when, int rtt);
+    int close();
+
+}; /* End of class OutputWriter */
+
+#endif /* __OUTPUTWRITER_H__ */
@@ -95,6 +95,7 @@
 #include "nsock.h"
 #include "output.h"
 #include "NpingOps.h"
+#include "BPFGenerator.h"
 
 extern NpingOps o;
 extern ProbeEngine prob;
@@ -135,6 +136,20 @@ void ProbeEngine::reset() {
   this->fds=NULL;
   this->max_iods=0;
   this->packetno=0;
+  this->window_probe=0;
+  this->retired_probe=0;
+  this->txq=NULL;
+  this->txq_len=0;
+  this->txq_max=0;
+  this->txring_ifaces.clear();
+  this->txrings.clear();
+  this->eth_ifaces.clear();
+  this->eth_sds.clear();
+  this->txstats=&o.stats;
+  this->tx_output=true;
+#ifndef WIN32
+  this->pipeline=NULL;
+#endif
 } /* End of reset() */
 
 
@@ -165,6 +180,9 @@ int ProbeEngine::init_nsock(){
       nsp_setdevice(this->nsp, o.getDevice());
     }
 
+    /* Make room in the kernel for bursts of captured replies */
+    nsp_setpcapbufsize(this->nsp, PCAP_BUFFER_SIZE);
+
     /* Flag it as already initialized so we don't do it again */
     nsock_init=true;
   }
@@ -176,7 +194,32 @@ int ProbeEngine::init_nsock(){
  * needs to be taken care of before destroying the object. */
 int ProbeEngine::cleanup(){
   nping_print(DBG_4,"%s()", __func__);
-  nsp_delete(this->nsp);
+  if(this->nsock_init)
+    nsp_delete(this->nsp);
+  /* Release the transmission queue and the TX rings, if we used them */
+  if(this->txq!=NULL){
+    for(u32 i=0; i<this->txq_max; i++)
+      free(this->txq[i].buff);
+    free(this->txq);
+    this->txq=NULL;
+    this->txq_len=0;
+  }
+  for(size_t i=0; i<this->txrings.size(); i++)
+    eth_txring_close(this->txrings[i]);
+  this->txrings.clear();
+  this->txring_ifaces.clear();
+  for(size_t i=0; i<this->eth_sds.size(); i++)
+    eth_close(this->eth_sds[i]);
+  this->eth_sds.clear();
+  this->eth_ifaces.clear();
+  if(this->rawsd4>=0){
+    close(this->rawsd4);
+    this->rawsd4=-1;
+  }
+  if(this->rawsd6>=0){
+    close(this->rawsd6);
+    this->rawsd6=-1;
+  }
   return OP_SUCCESS;
 } /* End of cleanup() */
 
@@ -247,22 +290,27 @@ int ProbeEngine::setup_sniffer(vector<NetworkInterface *> &ifacelist, vector<con
  *
  * Note that although a complete list of targets and network interfaces is
  * passed, the ProbeEngine still needs to access some additional configuration
- * parameters through the global NpingOps object.  */
+ * parameters through the global NpingOps object. Also, when the target list
+ * is too big to be instanced at once, the supplied lists only hold its first
+ * window and they are refilled as we go (see next_window()).  */
 int ProbeEngine::start(vector<TargetHost *> &Targets, vector<NetworkInterface *> &Interfaces){
   nping_print(DBG_4,"%s()", __func__);
   const char *filter = NULL;
   vector<const char *>bpf_filters;
   vector<PacketElement *> Packets;
-  struct timeval now, now2, next_time;
-  int wait_time=0, time_deviation=0;
+  struct timeval now, now2, last_poll;
+  RateScheduler sched;
+  long wait_time=0;
+  bool last=false;
   u16 total_ports=0;
   u16 *pts=NULL;
   u16 spts_len=0;
   u16 spts_idx=0;
   u16 *spts=o.getSourcePorts(&spts_len);
   u16 curr_spt=0; /* Current source port for unpriv mode. Must be init to zero. */
-  u32 count=1;
   int max_rtt=0;
+  bool window_end=false;
+  bool first=true;
 
 
   nping_print(DBG_1, "Starting Nping Probe Engine...");
@@ -284,10 +332,15 @@ int ProbeEngine::start(vector<TargetHost *> &Targets, vector<NetworkInterface *>
     /* Set up the sniffer(s) */
     this->setup_sniffer(Interfaces, bpf_filters);
 
+    /* Now that we know the datalink of each device, replace the filters
+     * with programs that check the whole set of targets in the kernel. */
+    for(u32 i=0; i<Interfaces.size(); i++)
+      this->set_prefilter(Targets, Interfaces[i], this->pcap_iods[i]);
+
     /* Schedule the first pcap read event (one for each interface we use) */
     if(!o.disablePacketCapture()){
       for(size_t i=0; i<this->pcap_iods.size(); i++){
-        nsock_pcap_read_packet(this->nsp, this->pcap_iods[i], packet_capture_handler_wrapper, -1, NULL);
+        nsock_pcap_read_packets(this->nsp, this->pcap_iods[i], packet_capture_handler_wrapper, -1, PCAP_READ_BATCH, NULL);
       }
     }
   }
@@ -296,121 +349,196 @@ int ProbeEngine::start(vector<TargetHost *> &Targets, vector<NetworkInterface *>
   gettimeofday(&this->start_time, NULL);
   o.stats.start_clocks();
 
-  /* Do the Probe Mode rounds! */
-  for(unsigned int r=0; r<o.getRounds(); r++){
-
-    for(unsigned int p=0; p<total_ports; p++){
-
-      /* Use a custom source port if appropriate */
-      if(spts!=NULL){
-        curr_spt=spts[spts_idx];
-        if(spts_idx==(spts_len-1))
-          spts_idx=0;
-        else
-          spts_idx++;
+#ifndef WIN32
+  /* With --threads, probes are sent, captured and matched by different
+   * threads. See ProbePipeline.cc for details. */
+  if(o.getThreads()>0 && o.mode(MODE_IS_PRIVILEGED)){
+    while(1){
+      ProbePipeline pipe(this);
+      this->pipeline=&pipe;
+      pipe.run(Targets, o.getThreads(), !o.moreTargetHosts());
+      this->pipeline=NULL;
+      if(!o.moreTargetHosts())
+        break;
+      if(this->next_window(Targets, Interfaces)!=OP_SUCCESS){
+        o.stats.stop_tx_clock();
+        this->wait_replies(Targets);
+        break;
       }
-
-      for(unsigned int t = 0; t < Targets.size(); t++){
-
-        /* Get current timestamp so we can output time elapsed  */
-        if(r==0 && p==0 && t==0){
-          now=this->start_time;
-        }else{
-          gettimeofday(&now, NULL);
+    }
+    o.stats.stop_rx_clock();
+    nping_print(DBG_1, "Nping Probe Engine Finished.");
+    return OP_SUCCESS;
+  }
+#endif
+
+  /* Set up the transmission schedule. If the user supplied a rate, we use it
+   * directly, otherwise we send one packet every inter-probe delay. */
+  if(o.issetRate())
+    sched.setRate(o.getRate(), 1000000);
+  else
+    sched.setRate(1, (u64)o.getDelay()*1000);
+  sched.start(&this->start_time);
+  last_poll=this->start_time;
+
+  /* Do the Probe Mode rounds! Big target lists are processed in windows (see
+   * NpingOps::nextTargetHosts()): all the rounds are done for the hosts of a
+   * window before we move on to the next one. */
+  while(1){
+    for(unsigned int r=0; r<o.getRounds(); r++){
+
+      for(unsigned int p=0; p<total_ports; p++){
+
+        /* Use a custom source port if appropriate */
+        if(spts!=NULL){
+          curr_spt=spts[spts_idx];
+          if(spts_idx==(spts_len-1))
+            spts_idx=0;
+          else
+            spts_idx++;
         }
 
-        /* There are two possibilities.
-         *   1: we are in some unprivileged mode in which we have to issue TCP
-         *      connects or send UDP datagrams using regular system calls
-         *
-         *   2: We need to produce and send raw packets.
-         */
-        if(o.mode(DO_TCP_CONNECT) || o.mode(DO_UDP_UNPRIV)){
-          if(o.mode(DO_TCP_CONNECT)){ // TODO: @todo set the target port right!!
-            if(pts!=NULL){
-              do_tcp_connect(Targets[t], pts[p], curr_spt, &now);
-            }else{
-              do_tcp_connect(Targets[t], DEFAULT_TCP_TARGET_PORT, curr_spt, &now);
-            }
+        for(unsigned int t = 0; t < Targets.size(); t++){
+
+          /* Get current timestamp so we can output time elapsed  */
+          if(first){
+            now=this->start_time;
+            first=false;
+          }else{
+            gettimeofday(&now, NULL);
           }
-          if(o.mode(DO_UDP_UNPRIV)){
-            if(pts!=NULL){
-              do_udp_unpriv(Targets[t], pts[p], curr_spt, &now);
-            }else{
-              do_udp_unpriv(Targets[t], DEFAULT_UDP_TARGET_PORT, curr_spt, &now);
+          window_end=(r==(o.getRounds()-1) && p==(total_ports-1) && t==(Targets.size()-1));
+          last=(window_end && !o.moreTargetHosts());
+          sched.update(1);
+
+          /* There are two possibilities.
+           *   1: we are in some unprivileged mode in which we have to issue TCP
+           *      connects or send UDP datagrams using regular system calls
+           *
+           *   2: We need to produce and send raw packets.
+           */
+          if(o.mode(DO_TCP_CONNECT) || o.mode(DO_UDP_UNPRIV)){
+            if(o.mode(DO_TCP_CONNECT)){ // TODO: @todo set the target port right!!
+              if(pts!=NULL){
+                do_tcp_connect(Targets[t], pts[p], curr_spt, &now);
+              }else{
+                do_tcp_connect(Targets[t], DEFAULT_TCP_TARGET_PORT, curr_spt, &now);
+              }
+            }
+            if(o.mode(DO_UDP_UNPRIV)){
+              if(pts!=NULL){
+                do_udp_unpriv(Targets[t], pts[p], curr_spt, &now);
+              }else{
+                do_udp_unpriv(Targets[t], DEFAULT_UDP_TARGET_PORT, curr_spt, &now);
+              }
             }
           }
-        }
-        if(o.mode(DO_TCP) || o.mode(DO_UDP) || o.mode(DO_ICMP) || o.mode(DO_ARP)){
-          /* Obtain a list of packets to send (each TargetHost adds whatever
-           * packets it wants to send to the supplied vector) */
-          Targets[t]->getNextPacketBatch(Packets);
-
-          /* Here, schedule the immediate transmission of all the packets
-           * provided by the TargetHosts. */
-          nping_print(DBG_2, "Starting transmission of %d packets", (int)Packets.size());
-          while(Packets.size()>0){
-              this->send_packet(Targets[t], Packets[0], &now);
-             /* Delete the packet we've just sent from the list so we don't send
-              * it again the next time */
-             Packets.erase(Packets.begin(), Packets.begin()+1);
-          }
-        }
+          if(o.mode(DO_TCP) || o.mode(DO_UDP) || o.mode(DO_ICMP) || o.mode(DO_ARP)){
+            /* Obtain a list of packets to send (each TargetHost adds whatever
+             * packets it wants to send to the supplied vector) */
+            Targets[t]->getNextPacketBatch(Packets);
+
+            /* In batch mode, packets are just queued. They'll be transmitted
+             * all together when the queue fills up or when it's time to wait
+             * for the next inter-packet delay. */
+            if(o.getTxBatch()>1){
+              for(size_t i=0; i<Packets.size(); i++)
+                this->queue_packet(Targets[t], Packets[i], &now);
+              Packets.clear();
+            }
 
-        /* Check if we've just sent the last packet. In that case, stop the
-         * Tx clock.*/
-        if(r==(o.getRounds()-1) && p==(total_ports-1) && t==(Targets.size()-1))
-          o.stats.stop_tx_clock();
-
-        /* Determine how long do we have to wait until we send the next pkt.
-         * If we still have more packets to send, we wait until a whole
-         * inter-packet delay has elapsed since the last packet we sent. */
-        if(!(r==(o.getRounds()-1) && p==(total_ports-1) && t==(Targets.size()-1))){
-          TIMEVAL_MSEC_ADD(next_time, start_time, count*o.getDelay() );
-          gettimeofday(&now, NULL);
-          if((wait_time=TIMEVAL_MSEC_SUBTRACT(next_time, now)-time_deviation) < 0){
-            nping_print(DBG_1, "Wait time < 0 ! (wait_time=%d)", wait_time);
-            wait_time=0;
-          }
-        /* If we have sent the last packet already, it doesn't make sense to wait
-         * for the same amount of time as before (the inter-packet delay). Imagine
-         * we have an interpacket delay of 10s and a max RTT of 0.2s. Why wait 10s
-         * when we can reasonably stop capturing packets after 0.2s? So here what we
-         * do is to determine the higher RTT that we've observed in the past, and
-         * wait for t=4*Max_RTT (We multiply the max RTT observed by 4 so if
-         * we have multiple targets, we don't miss a first response sent by
-         * a slow target). If we don't have any RTT we wait for a fixed 1 second. */
-        }else{
-          for(u32 z=0; z<Targets.size(); z++){
-            if(Targets[z]->stats.get_max_rtt()>max_rtt)
-              max_rtt=Targets[z]->stats.get_max_rtt();
+            /* Here, schedule the immediate transmission of all the packets
+             * provided by the TargetHosts. */
+            nping_print(DBG_2, "Starting transmission of %d packets", (int)Packets.size());
+            while(Packets.size()>0){
+                this->send_packet(Targets[t], Packets[0], &now);
+               /* Delete the packet we've just sent from the list so we don't send
+                * it again the next time */
+               Packets.erase(Packets.begin(), Packets.begin()+1);
+            }
+
+            /* If the queue still has room and this is not the last packet, move
+             * on to the next target without waiting. The schedule is based on
+             * the total number of probes, so the wait we do after the flush
+             * accounts for all the iterations we skip here. */
+            if(this->txq_len>0){
+              if(this->txq_len<this->txq_max && !window_end)
+                continue;
+              this->flush_packets(&now);
+            }
           }
-          if(max_rtt==0){
-            wait_time=DEFAULT_TIME_WAIT_AFTER_LAST_PACKET;
+          o.stats.update_tx_lag(sched.getLag(&now));
+
+          /* Check if we've just sent the last packet. In that case, stop the
+           * Tx clock.*/
+          if(last)
+            o.stats.stop_tx_clock();
+
+          /* Determine how long do we have to wait until we send the next pkt.
+           * If we still have more packets to send, we wait until the next
+           * packet is due, according to the schedule. When that's less than
+           * the resolution of Nsock timers, we don't wait at all, so packets
+           * go out in bursts between wakeups. We still give Nsock a chance to
+           * process pending events (i.e. captured packets) every now and then. */
+          if(!last){
+            gettimeofday(&now, NULL);
+            if((wait_time=sched.getWaitTime(&now)) < SCHED_MIN_WAIT){
+              if(TIMEVAL_MSEC_SUBTRACT(now, last_poll) >= 1){
+                nsock_loop(this->nsp, 0);
+                gettimeofday(&last_poll, NULL);
+              }
+              continue;
+            }
+            wait_time/=1000;
+          /* If we have sent the last packet already, it doesn't make sense to wait
+           * for the same amount of time as before (the inter-packet delay). Imagine
+           * we have an interpacket delay of 10s and a max RTT of 0.2s. Why wait 10s
+           * when we can reasonably stop capturing packets after 0.2s? So here what we
+           * do is to determine the higher RTT that we've observed in the past, and
+           * wait for t=4*Max_RTT (We multiply the max RTT observed by 4 so if
+           * we have multiple targets, we don't miss a first response sent by
+           * a slow target). If we don't have any RTT we wait for a fixed 1 second. */
           }else{
-            wait_time=(4*max_rtt)/1000;
+            for(u32 z=0; z<Targets.size(); z++){
+              if(Targets[z]->stats.get_max_rtt()>max_rtt)
+                max_rtt=Targets[z]->stats.get_max_rtt();
+            }
+            if(max_rtt==0){
+              wait_time=DEFAULT_TIME_WAIT_AFTER_LAST_PACKET;
+            }else{
+              wait_time=(4*max_rtt)/1000;
+            }
+            nping_print(DBG_2, "Final wait time for responses: %ld msecs.", wait_time);
           }
-          nping_print(DBG_2, "Final wait time for responses: %d msecs.", wait_time);
-        }
 
-        /* Now schedule a dummy wait event so we don't send more packets
-         * until the inter-packet delay has passed */
-        nping_print(DBG_2, "Waiting for %d msecs.", wait_time);
-        nsock_timer_create(nsp, interpacket_delay_wait_handler, wait_time, NULL);
+          /* Now schedule a dummy wait event so we don't send more packets
+           * until the inter-packet delay has passed */
+          nping_print(DBG_2, "Waiting for %ld msecs.", wait_time);
+          nsock_timer_create(nsp, interpacket_delay_wait_handler, wait_time, NULL);
 
-        /* Now wait until all events have been dispatched */
-        nsock_loop(this->nsp, -1);
+          /* Now wait until all events have been dispatched */
+          nsock_loop(this->nsp, -1);
 
-        /* Let's see what time it is now so we can determine if we got the
-         * wait_time right. If we didn't, we compute the time deviation and
-         * apply it in the next iteration. */
-        gettimeofday(&now2, NULL);
-        if((time_deviation=TIMEVAL_MSEC_SUBTRACT(now2, now) - wait_time)<0){
-          time_deviation=0;
+          /* Let's see what time it is now so we can determine if we got the
+           * wait_time right. If we didn't, the scheduler computes the time
+           * deviation and applies it in the next iteration. */
+          gettimeofday(&now2, NULL);
+          last_poll=now2;
+          sched.adjust(wait_time*1000, TIMEVAL_SUBTRACT(now2, now));
         }
-        count++;
       }
     }
+
+    /* Move on to the next window of targets, if any. If it turns out that
+     * the rest of the targets can't be reached, we haven't waited for the
+     * replies to the last probes yet. */
+    if(!o.moreTargetHosts())
+      break;
+    if(this->next_window(Targets, Interfaces)!=OP_SUCCESS){
+      o.stats.stop_tx_clock();
+      this->wait_replies(Targets);
+      break;
+    }
   }
 
   /* Cleanup and return */
@@ -420,6 +548,87 @@ int ProbeEngine::start(vector<TargetHost *> &Targets, vector<NetworkInterface *>
 } /* End of start() */
 
 
+/* Replaces the targets we are done with by the next window of the target
+ * list (see NpingOps::nextTargetHosts()). "Targets" and "Interfaces" must be
+ * the lists held by NpingOps, which get the new hosts and any interface they
+ * need. Sniffers are opened for the new interfaces, and the kernel filters
+ * are regenerated so they accept replies from the new hosts and from the
+ * previous window, whose last probes may still get a reply. Returns
+ * OP_SUCCESS on success and OP_FAILURE if there are no targets left. */
+int ProbeEngine::next_window(vector<TargetHost *> &Targets, vector<NetworkInterface *> &Interfaces){
+  nping_print(DBG_4,"%s()", __func__);
+  vector<NetworkInterface *> newifaces;
+  vector<const char *> bpf_filters;
+  vector<TargetHost *> accepted;
+  size_t first_new=this->pcap_iods.size();
+
+  assert(&Targets==&o.target_hosts && &Interfaces==&o.interfaces);
+  if(o.nextTargetHosts()==0)
+    return OP_FAILURE;
+
+  /* The hosts of the window before the previous one are gone now. The
+   * events of their unprivileged probes hold a pointer to them, so get rid
+   * of the IODs that are still around. */
+  if(this->fds!=NULL){
+    for(u32 i=this->retired_probe; i<this->window_probe; i++){
+      if(i+(u32)max_iods>=this->packetno && this->fds[i%max_iods]!=NULL){
+        nsi_delete(this->fds[i%max_iods], NSOCK_PENDING_SILENT);
+        this->fds[i%max_iods]=NULL;
+      }
+    }
+  }
+  this->retired_probe=this->window_probe;
+  this->window_probe=this->packetno;
+
+  if(o.mode(MODE_IS_PRIVILEGED)){
+    /* Open a sniffer on the interfaces we haven't used before */
+    for(size_t i=first_new; i<Interfaces.size(); i++){
+      newifaces.push_back(Interfaces[i]);
+      bpf_filters.push_back(strdup(this->bpf_filter(Targets, Interfaces[i])));
+    }
+    if(newifaces.size()>0)
+      this->setup_sniffer(newifaces, bpf_filters);
+    for(size_t i=0; i<bpf_filters.size(); i++)
+      free((void *)bpf_filters[i]);
+
+    /* Update the filters of all of them */
+    accepted=Targets;
+    accepted.insert(accepted.end(), o.retired_hosts.begin(), o.retired_hosts.end());
+    for(size_t i=0; i<Interfaces.size(); i++)
+      this->set_prefilter(accepted, Interfaces[i], this->pcap_iods[i]);
+
+    if(!o.disablePacketCapture()){
+      for(size_t i=first_new; i<this->pcap_iods.size(); i++)
+        nsock_pcap_read_packets(this->nsp, this->pcap_iods[i], packet_capture_handler_wrapper, -1, PCAP_READ_BATCH, NULL);
+    }
+  }
+  return OP_SUCCESS;
+} /* End of next_window() */
+
+
+/* Keeps processing events (i.e. captured packets) for a while, so the last
+ * probes sent to the supplied targets get a chance to be answered. Like at
+ * the end of start(), we wait four times the highest RTT observed. */
+int ProbeEngine::wait_replies(vector<TargetHost *> &Targets){
+  nping_print(DBG_4,"%s()", __func__);
+  long wait_time=0;
+  int max_rtt=0;
+
+  for(u32 z=0; z<Targets.size(); z++){
+    if(Targets[z]->stats.get_max_rtt()>max_rtt)
+      max_rtt=Targets[z]->stats.get_max_rtt();
+  }
+  if(max_rtt==0)
+    wait_time=DEFAULT_TIME_WAIT_AFTER_LAST_PACKET;
+  else
+    wait_time=(4*max_rtt)/1000;
+  nping_print(DBG_2, "Final wait time for responses: %ld msecs.", wait_time);
+  nsock_timer_create(this->nsp, interpacket_delay_wait_handler, wait_time, NULL);
+  nsock_loop(this->nsp, -1);
+  return OP_SUCCESS;
+} /* End of wait_replies() */
+
+
 /* This function creates a BPF filter specification, suitable to be passed to
  * pcap_compile() or nsock_pcap_open(). Note that @param target_interface
  * determines which subset of @param Targets will be considered for the
@@ -547,6 +756,54 @@ char *ProbeEngine::bpf_filter(vector<TargetHost *> &Targets, NetworkInterface *t
 } /* End of bpf_filter() */
 
 
+/* The filter expressions built by bpf_filter() can only list a few hosts, so
+ * with many targets we end up capturing everything that is sent to us. This
+ * method generates a BPF program that checks the complete list of targets,
+ * plus the protocol and ports of the responses we expect, and installs it in
+ * the capture device of the supplied interface, so the kernel drops anything
+ * else before it even reaches us. If no program can be generated (custom
+ * filters, ARP, unsupported datalinks...), the expression is left in place.
+ * Returns OP_SUCCESS if the program was installed and OP_FAILURE otherwise. */
+int ProbeEngine::set_prefilter(vector<TargetHost *> &Targets, NetworkInterface *target_interface, nsock_iod pcap_iod){
+  nping_print(DBG_4,"%s()", __func__);
+  BPFGenerator gen;
+  struct bpf_program fp;
+  u16 *ports=NULL;
+  u16 total_ports=0;
+
+  if(o.issetBPFFilterSpec() || o.doMulticast() || o.getRole()==ROLE_CLIENT)
+    return OP_FAILURE;
+  if(o.mode(DO_TCP))
+    gen.setProtocol(IPPROTO_TCP);
+  else if(o.mode(DO_UDP))
+    gen.setProtocol(IPPROTO_UDP);
+  else if(!o.mode(DO_ICMP))
+    return OP_FAILURE;
+
+  for(u32 i=0; i<Targets.size(); i++){
+    if(!strcmp(Targets[i]->getInterface()->getName(), target_interface->getName()))
+      gen.addTarget(Targets[i]->getTargetAddress(), Targets[i]->getSourceAddress());
+  }
+  if(o.mode(DO_TCP) || o.mode(DO_UDP)){
+    if((ports=o.getTargetPorts(&total_ports))!=NULL)
+      gen.addTargetPorts(ports, total_ports);
+    if(o.issetSourcePorts() && (ports=o.getSourcePorts(&total_ports))!=NULL)
+      gen.addSourcePorts(ports, total_ports);
+  }
+
+  if(gen.compile(nsi_pcap_linktype(pcap_iod), &fp)!=OP_SUCCESS){
+    nping_print(DBG_2, "[ProbeEngine] Interface=%s: no BPF program generated. Using the filter expression.", target_interface->getName());
+    return OP_FAILURE;
+  }
+  if(nsi_pcap_setfilter(pcap_iod, &fp)!=0){
+    nping_warning(QT_2, "Failed to install the BPF program for %s. Using the filter expression.", target_interface->getName());
+    return OP_FAILURE;
+  }
+  nping_print(DBG_2, "[ProbeEngine] Interface=%s BPF: %u instructions generated for the target list", target_interface->getName(), fp.bf_len);
+  return OP_SUCCESS;
+} /* End of set_prefilter() */
+
+
 /* This method sends a packet to the supplied target host. The packet is not
  * supplied in a raw "binary form" but as a chain of PacketElements. If the
  * first element of the chain is an Ethernet header, then the packet will be
@@ -602,38 +859,275 @@ int ProbeEngine::send_packet(TargetHost *tgt, PacketElement *pkt, struct timeval
   /* Update statistics */
   this->ts_last_sent=*now;
   if((tlayer=PacketParser::find_transport_layer(pkt))!=NULL){
-    o.stats.update_sent(tgt->getTargetAddress()->getVersion(), tlayer->protocol_id(), pkt->getLen());
+    this->txstats->update_sent(tgt->getTargetAddress()->getVersion(), tlayer->protocol_id(), pkt->getLen());
     tgt->stats.update_sent(tgt->getTargetAddress()->getVersion(), tlayer->protocol_id(), pkt->getLen());
   }else{
     nping_warning(QT_2, "%s(): No transport layer found. Please report this bug.", __func__);
   }
 
   /* Finally, print the packet we've just sent */
-  if(o.showSentPackets()){
-    PacketElement *pkt2print=pkt;
-    nping_print(VB_0|NO_NEWLINE,"SENT (%.4fs) ", ((double)TIMEVAL_MSEC_SUBTRACT(*now, this->start_time)) / 1000);
+  if(o.showSentPackets())
+    this->print_sent_pkt(pkt, now);
+  if(o.output.enabled())
+    o.output.sent(tgt, pkt, now);
+  return OP_SUCCESS;
+} /* End of send_packet() */
+
+
+/* This method is the batched counterpart of send_packet(). Instead of sending
+ * the packet straight away, it serializes it into the next free slot of the
+ * transmission queue. Queued packets are sent by flush_packets(), which is
+ * called automatically when the queue is full. The SENT line is printed
+ * right away, so the output looks the same as in unbatched mode. */
+int ProbeEngine::queue_packet(TargetHost *tgt, PacketElement *pkt, struct timeval *now){
+  nping_print(DBG_4,"%s()", __func__);
+  struct tx_pkt *slot=NULL;
+  PacketElement *tlayer=NULL;
+  u32 pktlen=0;
+  assert(tgt!=NULL && pkt!=NULL && now!=NULL);
+
+  if(pkt->protocol_id()!=HEADER_TYPE_ETHERNET && pkt->protocol_id()!=HEADER_TYPE_IPv4 &&
+     pkt->protocol_id()!=HEADER_TYPE_IPv6){
+    nping_fatal(QT_3, "%s(): Unknown protocol", __func__);
+  }
+
+  /* First time this is called, allocate the queue */
+  if(this->txq==NULL){
+    this->txq_max=o.getTxBatch();
+    this->txq=(struct tx_pkt *)safe_zalloc(sizeof(struct tx_pkt)*this->txq_max);
+    this->txq_len=0;
+  }
+  if(this->txq_len>=this->txq_max)
+    this->flush_packets(now);
+
+  /* Serialize the packet into the slot, growing its buffer if needed */
+  slot=&this->txq[this->txq_len];
+  pktlen=pkt->getLen();
+  if(slot->bufflen<pktlen){
+    slot->buff=(u8 *)safe_realloc(slot->buff, pktlen);
+    slot->bufflen=pktlen;
+  }
+  pkt->dumpToBinaryBuffer(slot->buff, slot->bufflen);
+  slot->len=pktlen;
+  slot->tgt=tgt;
+  slot->link=pkt->protocol_id();
+  slot->sent=false;
+  if((tlayer=PacketParser::find_transport_layer(pkt))!=NULL){
+    slot->tproto=tlayer->protocol_id();
+  }else{
+    slot->tproto=-1;
+    nping_warning(QT_2, "%s(): No transport layer found. Please report this bug.", __func__);
+  }
+  this->txq_len++;
+
+  if(o.showSentPackets() && this->tx_output)
+    this->print_sent_pkt(pkt, now);
+  if(o.output.enabled() && this->tx_output)
+    o.output.sent(tgt, pkt, now);
+  return OP_SUCCESS;
+} /* End of queue_packet() */
 
-    /* Skip the Ethernet layer if necessary */
-    if(o.showEth()==false && pkt->protocol_id()==HEADER_TYPE_ETHERNET){
-      pkt2print=pkt->getNextElement();
+
+/* Transmits every packet in the transmission queue. Raw IP packets are
+ * handed to the kernel with send_ip_packets_sd()/send_ipv6_packets_sd(),
+ * which use sendmmsg() when available. Ethernet frames are placed in the TX
+ * ring of their interface (PACKET_MMAP), and the rings are kicked once at the
+ * end. When an interface has no ring, frames go through eth_send(). Sent
+ * statistics are updated once for the whole batch. */
+int ProbeEngine::flush_packets(struct timeval *now){
+  nping_print(DBG_4,"%s()", __func__);
+  u8 *pkts4[MAX_SENDMMSG_BATCH], *pkts6[MAX_SENDMMSG_BATCH];
+  unsigned int lens4[MAX_SENDMMSG_BATCH], lens6[MAX_SENDMMSG_BATCH];
+  u32 idx4[MAX_SENDMMSG_BATCH], idx6[MAX_SENDMMSG_BATCH];
+  bool ok[MAX_SENDMMSG_BATCH];
+  struct sockaddr_in dst4[MAX_SENDMMSG_BATCH];
+  struct sockaddr_in6 dst6[MAX_SENDMMSG_BATCH];
+  int n4=0, n6=0, res=0, failed=0;
+  struct eth_txring *ring=NULL;
+  eth_t *ethsd=NULL;
+  struct tx_pkt *slot=NULL;
+  NetworkInterface *dev=NULL;
+
+  if(this->txq_len==0)
+    return OP_SUCCESS;
+  nping_print(DBG_2, "Flushing a batch of %d packets", (int)this->txq_len);
+
+  /* Get raw sockets ready. IPv6 batching is optional: if we can't get the
+   * socket, send_ipv6_packets_sd() falls back to one packet at a time. */
+  if(this->rawsd4<0){
+    if((this->rawsd4=socket(AF_INET, SOCK_RAW, IPPROTO_RAW))<0)
+      nping_fatal(QT_3, "%s(): Unable to obtain raw socket.", __func__);
+  }
+  if(this->rawsd6<0)
+    this->rawsd6=socket(AF_INET6, SOCK_RAW, IPPROTO_RAW);
+
+  /* Raw IP packets are only marked as sent once the kernel has taken them */
+  for(u32 i=0; i<=this->txq_len; i++){
+    slot=(i<this->txq_len) ? &this->txq[i] : NULL;
+    if(n4>0 && (slot==NULL || n4==MAX_SENDMMSG_BATCH)){
+      res=send_ip_packets_sd(this->rawsd4, dst4, pkts4, lens4, n4, ok);
+      failed+=n4-res;
+      for(int k=0; k<n4; k++)
+        this->txq[idx4[k]].sent=ok[k];
+      n4=0;
     }
-    pkt2print->print(stdout, o.getDetailLevel());
-    if(o.getVerbosity()>=VB_3){
-      int mylen=0;
-      u8 *mybuff = pkt2print->getBinaryBuffer(&mylen);
-      if(mybuff!=NULL){
-        if(mylen>0){
-          nping_print(VB_3|NO_NEWLINE,"\n");
-          print_hexdump(VB_3 | NO_NEWLINE, mybuff,mylen);
-        }
-        free(mybuff);
+    if(n6>0 && (slot==NULL || n6==MAX_SENDMMSG_BATCH)){
+      res=send_ipv6_packets_sd(this->rawsd6, dst6, pkts6, lens6, n6, ok);
+      failed+=n6-res;
+      for(int k=0; k<n6; k++)
+        this->txq[idx6[k]].sent=ok[k];
+      n6=0;
+    }
+    if(slot==NULL)
+      break;
+    if(slot->link==HEADER_TYPE_ETHERNET){
+      dev=slot->tgt->getInterface();
+      assert(dev!=NULL);
+      if((ring=this->get_txring(dev))!=NULL && eth_txring_add(ring, slot->buff, slot->len)==0){
+        slot->sent=true;
+        continue;
+      }
+      /* No ring (or the frame doesn't fit in a slot). Use DNET. */
+      if((ethsd=this->get_ethsd(dev))==NULL)
+        nping_fatal(QT_3, "%s: Failed to open ethernet device (%s)", __func__, dev->getName());
+      if(eth_send(ethsd, slot->buff, slot->len) < (ssize_t)slot->len){
+        nping_warning(QT_2, "Failed to send Ethernet frame through %s", dev->getName());
+        continue;
       }
+      slot->sent=true;
+    }else if(slot->link==HEADER_TYPE_IPv4){
+      slot->tgt->getTargetAddress()->getIPv4Address(&dst4[n4]);
+      pkts4[n4]=slot->buff;
+      lens4[n4]=slot->len;
+      idx4[n4++]=i;
     }else{
-      nping_print(VB_0|NO_NEWLINE,"\n");
+      slot->tgt->getTargetAddress()->getIPv6Address(&dst6[n6]);
+      pkts6[n6]=slot->buff;
+      lens6[n6]=slot->len;
+      idx6[n6++]=i;
+    }
+  }
+  if(failed>0)
+    nping_warning(QT_2, "%d out of %d raw IP packets could not be sent.", failed, (int)this->txq_len);
+  for(size_t i=0; i<this->txrings.size(); i++){
+    if(eth_txring_flush(this->txrings[i])<0)
+      nping_warning(QT_2, "Failed to flush TX ring of %s", this->txring_ifaces[i]->getName());
+  }
+
+  /* Now update statistics. Packets for the same target and protocol are
+   * normally next to each other, so we update target stats once per run of
+   * packets and global stats once per protocol. */
+  struct { int af; int proto; u32 pkts; u32 bytes; } totals[8];
+  int ntotals=0;
+  u32 run_pkts=0, run_bytes=0;
+  for(u32 i=0; i<=this->txq_len; i++){
+    slot=(i<this->txq_len) ? &this->txq[i] : NULL;
+    if(slot!=NULL && (!slot->sent || slot->tproto<0))
+      continue;
+    /* Close the current run if the packet doesn't belong to it */
+    if(run_pkts>0 && (slot==NULL || slot->tgt!=this->txq[i-1].tgt || slot->tproto!=this->txq[i-1].tproto)){
+      TargetHost *tgt=this->txq[i-1].tgt;
+      int af=tgt->getTargetAddress()->getVersion();
+      int proto=this->txq[i-1].tproto;
+      int j=0;
+      tgt->stats.update_sent(af, proto, run_pkts, run_bytes);
+      while(j<ntotals && !(totals[j].af==af && totals[j].proto==proto))
+        j++;
+      if(j==ntotals){
+        if(ntotals==(int)(sizeof(totals)/sizeof(totals[0]))){
+          this->txstats->update_sent(af, proto, run_pkts, run_bytes);
+          run_pkts=run_bytes=0;
+        }else{
+          totals[j].af=af;
+          totals[j].proto=proto;
+          totals[j].pkts=totals[j].bytes=0;
+          ntotals++;
+        }
+      }
+      if(run_pkts>0){
+        totals[j].pkts+=run_pkts;
+        totals[j].bytes+=run_bytes;
+      }
+      run_pkts=run_bytes=0;
+    }
+    if(slot!=NULL){
+      run_pkts++;
+      run_bytes+=slot->len;
     }
   }
+  for(int j=0; j<ntotals; j++)
+    this->txstats->update_sent(totals[j].af, totals[j].proto, totals[j].pkts, totals[j].bytes);
+
+  this->ts_last_sent=*now;
+  this->txq_len=0;
   return OP_SUCCESS;
-} /* End of send_packet() */
+} /* End of flush_packets() */
+
+
+/* Returns the Ethernet TX ring associated with the supplied interface,
+ * setting one up the first time the interface is seen. Returns NULL if the
+ * interface can't have a TX ring; in that case, we don't try again. */
+struct eth_txring *ProbeEngine::get_txring(NetworkInterface *dev){
+  assert(dev!=NULL);
+  for(size_t i=0; i<this->txring_ifaces.size(); i++){
+    if(this->txring_ifaces[i]==dev)
+      return this->txrings[i];
+  }
+  struct eth_txring *ring=eth_txring_open(dev->getName(), this->txq_max);
+  if(ring==NULL)
+    nping_print(DBG_1, "No TX ring available for %s. Frames will be sent one by one.", dev->getName());
+  this->txring_ifaces.push_back(dev);
+  this->txrings.push_back(ring);
+  return ring;
+} /* End of get_txring() */
+
+
+/* Returns a DNET Ethernet handler for the supplied interface, opening it the
+ * first time the interface is seen. Unlike eth_open_cached(), handlers are
+ * private to the engine, so engines running on different threads don't
+ * step on each other. Returns NULL if the interface can't be opened. */
+eth_t *ProbeEngine::get_ethsd(NetworkInterface *dev){
+  eth_t *ethsd=NULL;
+  assert(dev!=NULL);
+  for(size_t i=0; i<this->eth_ifaces.size(); i++){
+    if(this->eth_ifaces[i]==dev)
+      return this->eth_sds[i];
+  }
+  if((ethsd=eth_open(dev->getName()))!=NULL){
+    this->eth_ifaces.push_back(dev);
+    this->eth_sds.push_back(ethsd);
+  }
+  return ethsd;
+} /* End of get_ethsd() */
+
+
+/* Prints a SENT line for the supplied packet. The result is a line like:
+ * SENT (1.0000s) IPv4[127.0.0.1 > 127.0.0.1 ver=4 ihl=5 tos=0x00 iplen=28...
+ * The "now" parameter holds the time to be displayed. */
+int ProbeEngine::print_sent_pkt(PacketElement *pkt, struct timeval *now){
+  PacketElement *pkt2print=pkt;
+  nping_print(VB_0|NO_NEWLINE,"SENT (%.4fs) ", ((double)TIMEVAL_MSEC_SUBTRACT(*now, this->start_time)) / 1000);
+
+  /* Skip the Ethernet layer if necessary */
+  if(o.showEth()==false && pkt->protocol_id()==HEADER_TYPE_ETHERNET){
+    pkt2print=pkt->getNextElement();
+  }
+  pkt2print->print(stdout, o.getDetailLevel());
+  if(o.getVerbosity()>=VB_3){
+    int mylen=0;
+    u8 *mybuff = pkt2print->getBinaryBuffer(&mylen);
+    if(mybuff!=NULL){
+      if(mylen>0){
+        nping_print(VB_3|NO_NEWLINE,"\n");
+        print_hexdump(VB_3 | NO_NEWLINE, mybuff,mylen);
+      }
+      free(mybuff);
+    }
+  }else{
+    nping_print(VB_0|NO_NEWLINE,"\n");
+  }
+  return OP_SUCCESS;
+} /* End of print_sent_pkt() */
 
 
 /* This function handles TCP and UDP connection attempts. Obviously UDP is
@@ -687,7 +1181,7 @@ int ProbeEngine::do_unprivileged(int proto, TargetHost *tgt, u16 tport, u16 spor
    * If we run out of them, we just start overwriting the oldest one.
    * If we don't have a response by that time we probably aren't gonna
    * get any, so it shouldn't be a big problem. */
-  if( packetno>(u32)max_iods ){
+  if( packetno>(u32)max_iods && fds[packetno%max_iods]!=NULL ){
     nsi_delete(fds[packetno%max_iods], NSOCK_PENDING_SILENT);
   }
   /* Create new IOD for connects */
@@ -752,9 +1246,13 @@ int ProbeEngine::packet_capture_handler(nsock_pool nsp, nsock_event nse, void *a
   const u8 *rcvd_pkt = NULL;                /* Points to the captured packet */
   size_t rcvd_pkt_len = 0;                  /* Length of the captured packet */
   struct timeval pcaptime;                  /* Time the packet was captured  */
-  struct timeval now;
-  gettimeofday(&now, NULL);
-  PacketElement *pkt=NULL, *tlayer=NULL;
+  size_t cursor=0;                          /* Position in the capture batch */
+  packet_view_t view;                       /* Parsed captured packet        */
+  PacketElement *pkt=NULL;
+  int tlayer=-1;
+  struct flow_probe *flow=NULL;             /* Probe the packet answers      */
+  TargetHost *target=NULL;                  /* Host the probe was sent to    */
+  int rtt=-1;                               /* Round trip time (usecs)       */
 
   if (status == NSE_STATUS_SUCCESS) {
     switch(type) {
@@ -762,27 +1260,40 @@ int ProbeEngine::packet_capture_handler(nsock_pool nsp, nsock_event nse, void *a
       case NSE_TYPE_PCAP_READ:
 
         /* Schedule a new pcap read operation */
-        nsock_pcap_read_packet(nsp, nsi, packet_capture_handler_wrapper, -1, NULL);
-
-        /* Get captured packet */
-        nse_readpcap(nse, NULL, NULL, &rcvd_pkt, &rcvd_pkt_len, NULL, &pcaptime);
-
-        /* Here, we convert the raw hex buffer into a nice chain of PacketElement
-         * objects. */
-        if((pkt=PacketParser::split(rcvd_pkt, rcvd_pkt_len, false))!=NULL){
-          /* Now let's lee if the captured packet is a response to a probe
-           * we've sent before. What we do is iterate over the list of
-           * target hosts and ask each of those hosts to check if that's the
-           * case. */
-          for(size_t i=0; i<o.target_hosts.size(); i++){
-            if(o.target_hosts[i]->is_response(pkt, &now)){
+        nsock_pcap_read_packets(nsp, nsi, packet_capture_handler_wrapper, -1, PCAP_READ_BATCH, NULL);
+
+        /* The event may carry several captured packets. Process them all.
+         * Each one has its own capture time, which is what RTTs and RCVD
+         * timestamps are based on: the packets may have been waiting for a
+         * while before we got to them. */
+        cursor=0;
+        while(nse_readpcap_next(nse, &cursor, NULL, NULL, &rcvd_pkt, &rcvd_pkt_len, NULL, &pcaptime)){
+
+#ifndef WIN32
+          /* In multi-threaded mode, the matcher thread takes it from here */
+          if(this->pipeline!=NULL){
+            this->pipeline->capture(rcvd_pkt, rcvd_pkt_len, &pcaptime);
+            continue;
+          }
+#endif
+
+          /* Here, we find where each header of the captured packet starts.
+           * Nothing is copied yet: the nice chain of PacketElement objects is
+           * only built if the packet turns out to be a response. */
+          if(PacketParser::parse_view(rcvd_pkt, rcvd_pkt_len, false, &view)==OP_SUCCESS){
+            /* Now let's see if the captured packet is a response to a probe
+             * we've sent before. The flow table gives us the probe it answers
+             * (and the target host it was sent to) directly. */
+            if((flow=o.flows.lookup(&view))!=NULL){
+              target=flow->host;
+              target->got_response(flow, &pcaptime, &rtt);
 
               /* It's a response! Let's update the stats and print its contents. */
               /* First, find which transport layer protocol we have received and
                * update stats accordingly. */
-              if((tlayer=PacketParser::find_transport_layer(pkt))!=NULL){
-                o.stats.update_rcvd(o.target_hosts[i]->getTargetAddress()->getVersion(), tlayer->protocol_id(), rcvd_pkt_len);
-                o.target_hosts[i]->stats.update_rcvd(o.target_hosts[i]->getTargetAddress()->getVersion(), tlayer->protocol_id(), rcvd_pkt_len);
+              if((tlayer=PacketParser::find_transport_layer(&view, 0))>=0){
+                o.stats.update_rcvd(target->getTargetAddress()->getVersion(), view.hdr[tlayer].type, rcvd_pkt_len);
+                target->stats.update_rcvd(target->getTargetAddress()->getVersion(), view.hdr[tlayer].type, rcvd_pkt_len);
               }else{
                 nping_warning(QT_2, "%s(): No transport layer found. Please report this bug.", __func__);
               }
@@ -793,9 +1304,24 @@ int ProbeEngine::packet_capture_handler(nsock_pool nsp, nsock_event nse, void *a
                * that would make comparisons a bit less straightforward. If we
                * are in normal mode, we just call print_rcvd_pkt() and print it
                * right away. */
-              double timestamp=(((double)TIMEVAL_MSEC_SUBTRACT(now, this->start_time)) / 1000.0);
-              if( o.getRole() == ROLE_CLIENT ){
+              double timestamp=(((double)TIMEVAL_MSEC_SUBTRACT(pcaptime, this->start_time)) / 1000.0);
+              if((pkt=PacketParser::view_chain(&view))!=NULL && o.output.enabled())
+                o.output.rcvd(target, pkt, &pcaptime, rtt);
+              if(pkt==NULL){
+                nping_warning(QT_2, "%s(): Unable to parse the captured packet.", __func__);
+              }else if( o.getRole() == ROLE_CLIENT ){
                 int delay=(int)MIN(o.getDelay()*0.33, 333);
+                /* Only one RCVD packet can be waiting at a time. If an earlier
+                 * packet of this batch (or of a previous one) is still there,
+                 * print it now, before it gets replaced, and cancel its timer. */
+                double old_ts=0;
+                nsock_event_id old_id;
+                PacketElement *old=o.getDelayedRcvd(&old_ts, &old_id);
+                if(old!=NULL){
+                  nsock_event_cancel(nsp, old_id, 0);
+                  ProbeEngine::print_rcvd_pkt(old, old_ts);
+                  PacketParser::freePacketChain(old);
+                }
                 /* Here, we schedule a timing event. When the timer goes off,
                  * the handler prints the packet. However, the packet may
                  * get printed earlier than that, as soon as we get a CAPT
@@ -803,14 +1329,14 @@ int ProbeEngine::packet_capture_handler(nsock_pool nsp, nsock_event nse, void *a
                  * event in that case, so it doesn't get printed twice. */
                 nsock_event_id ev_id=nsock_timer_create(nsp, delayed_output_handler_wrapper, delay, NULL);
                 o.setDelayedRcvd(pkt, timestamp, ev_id);
-                return OP_SUCCESS; /* Return now, so we don't run PacketParser::freePacketChain() */
+                view.chain=NULL; /* The chain belongs to NpingOps now */
               }else{
                 ProbeEngine::print_rcvd_pkt(pkt, timestamp);
               }
             }
+            /* Free the captured packet, if we had to split it */
+            PacketParser::free_view(&view);
           }
-          /* Free the captured packet */
-          PacketParser::freePacketChain(pkt);
         }
       break;
 
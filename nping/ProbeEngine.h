@@ -97,6 +97,7 @@
 #include "nsock.h"
 #include <vector>
 #include "TargetHost.h"
+#include "ProbePipeline.h"
 #include "utils_net.h"
 #include "utils.h"
 using namespace std;
@@ -124,9 +125,24 @@ using namespace std;
  * providing we have no measured RTT for any of the hosts. */
 #define DEFAULT_TIME_WAIT_AFTER_LAST_PACKET 1000
 
+/* A packet waiting in the transmission queue, when packets are sent in
+ * batches (--batch). Slots are reused from one batch to the next, so their
+ * buffers are only reallocated when a bigger packet shows up. */
+struct tx_pkt {
+  TargetHost *tgt;  /* Target host the packet is addressed to     */
+  u8 *buff;         /* Wire image of the packet                   */
+  u32 bufflen;      /* Allocated length of buff                   */
+  u32 len;          /* Actual length of the packet                */
+  int link;         /* HEADER_TYPE_ETHERNET, _IPv4 or _IPv6        */
+  int tproto;       /* Transport protocol (for stats) or -1        */
+  bool sent;        /* True if the packet was handed to the kernel */
+};
+
 
 class ProbeEngine  {
 
+  friend class ProbePipeline;
+
   public:
     struct timeval start_time;   /* Time at which the engine was started    */
     struct timeval ts_last_sent; /* Time at which the engine was started    */
@@ -141,6 +157,21 @@ class ProbeEngine  {
     nsock_iod *fds;              /* IODs for multiple parallel connections  */
     int max_iods;                /* Number of IODS in "fds"                 */
     u32 packetno;                /* Packets sent from this handler.         */
+    u32 window_probe;            /* packetno when the window was loaded     */
+    u32 retired_probe;           /* packetno when the previous one was      */
+
+    struct tx_pkt *txq;          /* Transmission queue for batched mode     */
+    u32 txq_len;                 /* Number of packets currently queued      */
+    u32 txq_max;                 /* Capacity of the queue (--batch)         */
+    vector<NetworkInterface *> txring_ifaces; /* Ifaces with a TX ring      */
+    vector<struct eth_txring *> txrings;      /* TX ring for each of them   */
+    vector<NetworkInterface *> eth_ifaces;    /* Ifaces with a DNET handler */
+    vector<eth_t *> eth_sds;                  /* DNET handler for each one  */
+    PacketStats *txstats;        /* Where Tx stats go (o.stats by default)  */
+    bool tx_output;              /* Print SENT lines for queued packets?    */
+#ifndef WIN32
+    ProbePipeline *pipeline;     /* Threads we run on, if any (--threads)   */
+#endif
 
   public:
 
@@ -149,12 +180,20 @@ class ProbeEngine  {
     void reset();
     int init_nsock();
     int start(vector<TargetHost *> &Targets, vector<NetworkInterface *> &Interfaces);
+    int next_window(vector<TargetHost *> &Targets, vector<NetworkInterface *> &Interfaces);
+    int wait_replies(vector<TargetHost *> &Targets);
     int cleanup();
     nsock_pool getNsockPool();
 
     static char *bpf_filter(vector<TargetHost *> &Targets, NetworkInterface *target_interface);
+    int set_prefilter(vector<TargetHost *> &Targets, NetworkInterface *target_interface, nsock_iod pcap_iod);
     int setup_sniffer(vector<NetworkInterface *> &ifacelist, vector<const char *>bpf_filters);
     int send_packet(TargetHost *tgt, PacketElement *pkt, struct timeval *now);
+    int queue_packet(TargetHost *tgt, PacketElement *pkt, struct timeval *now);
+    int flush_packets(struct timeval *now);
+    struct eth_txring *get_txring(NetworkInterface *dev);
+    eth_t *get_ethsd(NetworkInterface *dev);
+    int print_sent_pkt(PacketElement *pkt, struct timeval *now);
     int do_unprivileged(int proto, TargetHost *tgt, u16 tport, u16 sport, struct timeval *now);
     int do_tcp_connect(TargetHost *tgt, u16 tport, u16 sport, struct timeval *now);
     int do_udp_unpriv(TargetHost *tgt, u16 tport, u16 sport, struct timeval *now);
@@ -0,0 +1,492 @@
+/***************************************************************************
+ * ProbePipeline.cc -- Multi-threaded version of the probe engine. Sender  *
+ * threads, a capture thread and a matcher thread exchange probes and      *
+ * captured packets through lock-free queues.                              *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2014 Insecure.Com LLC. Nmap is    *
+ * also a registered trademark of Insecure.Com LLC.  This program is free  *
+ * software; you may redistribute and/or modify it under the terms of the  *
+ * GNU General Public License as published by the Free Software            *
+ * Foundation; Version 2 ("GPL"), BUT ONLY WITH ALL OF THE CLARIFICATIONS  *
+ * AND EXCEPTIONS DESCRIBED HEREIN.  This guarantees your right to use,    *
+ * modify, and redistribute this software under certain conditions.  If    *
+ * you wish to embed Nmap technology into proprietary software, we sell    *
+ * alternative licenses (contact sales@nmap.com).  Dozens of software      *
+ * vendors already license Nmap technology such as host discovery, port    *
+ * scanning, OS detection, version detection, and the Nmap Scripting       *
+ * Engine.                                                                 *
+ *                                                                         *
+ * Note that the GPL places important restrictions on "derivative works",  *
+ * yet it does not provide a detailed definition of that term.  To avoid   *
+ * misunderstandings, we interpret that term as broadly as copyright law   *
+ * allows.  For example, we consider an application to constitute a        *
+ * derivative work for the purpose of this license if it does any of the   *
+ * following with any software or content covered by this license          *
+ * ("Covered Software"):                                                   *
+ *                                                                         *
+ * o Integrates source code from Covered Software.                         *
+ *                                                                         *
+ * o Reads or includes copyrighted data files, such as Nmap's nmap-os-db   *
+ * or nmap-service-probes.                                                 *
+ *                                                                         *
+ * o Is designed specifically to execute Covered Software and parse the    *
+ * results (as opposed to typical shell or execution-menu apps, which will *
+ * execute anything you tell them to).                                     *
+ *                                                                         *
+ * o Includes Covered Software in a proprietary executable installer.  The *
+ * installers produced by InstallShield are an example of this.  Including *
+ * Nmap with other software in compressed or archival form does not        *
+ * trigger this provision, provided appropriate open source decompression  *
+ * or de-archiving software is widely available for no charge.  For the    *
+ * purposes of this license, an installer is considered to include Covered *
+ * Software even if it actually retrieves a copy of Covered Software from  *
+ * another source during runtime (such as by downloading it from the       *
+ * Internet).                                                              *
+ *                                                                         *
+ * o Links (statically or dynamically) to a library which does any of the  *
+ * above.                                                                  *
+ *                                                                         *
+ * o Executes a helper program, module, or script to do any of the above.  *
+ *                                                                         *
+ * This list is not exclusive, but is meant to clarify our interpretation  *
+ * of derived works with some common examples.  Other people may interpret *
+ * the plain GPL differently, so we consider this a special exception to   *
+ * the GPL that we apply to Covered Software.  Works which meet any of     *
+ * these conditions must conform to all of the terms of this license,      *
+ * particularly including the GPL Section 3 requirements of providing      *
+ * source code and allowing free redistribution of the work as a whole.    *
+ *                                                                         *
+ * As another special exception to the GPL terms, Insecure.Com LLC grants  *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two.                                  *
+ *                                                                         *
+ * Any redistribution of Covered Software, including any derived works,    *
+ * must obey and carry forward all of the terms of this license, including *
+ * obeying all GPL rules and restrictions.  For example, source code of    *
+ * the whole work must be provided and free redistribution must be         *
+ * allowed.  All GPL references to "this License", are to be treated as    *
+ * including the terms and conditions of this license text as well.        *
+ *                                                                         *
+ * Because this license imposes special exceptions to the GPL, Covered     *
+ * Work may not be combined (even as part of a larger work) with plain GPL *
+ * software.  The terms, conditions, and exceptions of this license must   *
+ * be included as well.  This license is incompatible with some other open *
+ * source licenses as well.  In some cases we can relicense portions of    *
+ * Nmap or grant special permissions to use it in other open source        *
+ * software.  Please contact fyodor@nmap.org with any such requests.       *
+ * Similarly, we don't incorporate incompatible open source software into  *
+ * Covered Software without special permission from the copyright holders. *
+ *                                                                         *
+ * If you have any questions about the licensing restrictions on using     *
+ * Nmap in other works, are happy to help.  As mentioned above, we also    *
+ * offer alternative license to integrate Nmap into proprietary            *
+ * applications and appliances.  These contracts have been sold to dozens  *
+ * of software vendors, and generally include a perpetual license as well  *
+ * as providing for priority support and updates.  They also fund the      *
+ * continued development of Nmap.  Please email sales@nmap.com for further *
+ * information.                                                            *
+ *                                                                         *
+ * If you have received a written license agreement or contract for        *
+ * Covered Software stating terms other than these, you may choose to use  *
+ * and redistribute Covered Software under those terms instead of these.   *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the Nmap      *
+ * license file for more details (it's in a COPYING file included with     *
+ * Nmap, and also available from https://svn.nmap.org/nmap/COPYING)        *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "nping.h"
+#include "ProbePipeline.h"
+
+#ifndef WIN32
+#include "ProbeEngine.h"
+#include "TargetHost.h"
+#include "NpingOps.h"
+#include "output.h"
+#include "stats.h"
+#include <sched.h>
+
+extern NpingOps o;
+
+
+/* The ProbePipeline runs the probe engine on several threads, so the cost of
+ * handling replies does not slow down transmission at high rates. It is used
+ * instead of the main loop of ProbeEngine::start() when --threads is set.
+ *
+ *  - Sender threads (as many as requested). Each one produces and transmits
+ *    the probes for its own subset of the targets, at its share of the
+ *    overall rate. Before a probe is transmitted, it is handed to the
+ *    matcher through a queue that belongs to the sender.
+ *
+ *  - Capture thread. It runs the Nsock loop of the ProbeEngine, which only
+ *    has the pcap read events, and copies every captured packet to the
+ *    capture queue.
+ *
+ *  - Matcher thread. It stores the probes that the senders hand over and
+ *    matches captured packets against them. It is the only thread that
+ *    touches the flow table, the probe rings of the targets and the Rx
+ *    statistics, and the only one that prints SENT and RCVD lines.
+ *
+ * Each queue has exactly one producer and one consumer, so no locks are
+ * needed. Senders keep their Tx statistics separately, and they are added to
+ * the global ones when all threads are done. */
+ProbePipeline::ProbePipeline(ProbeEngine *engine){
+  this->engine=engine;
+  this->captures=NULL;
+  this->capturing=false;
+  this->stop=false;
+  this->last=true;
+  memset(&this->started, 0, sizeof(struct timeval));
+} /* End of ProbePipeline constructor */
+
+
+ProbePipeline::~ProbePipeline(){
+  struct pipe_capture cap;
+  for(size_t i=0; i<this->senders.size(); i++){
+    this->senders[i]->engine->cleanup();
+    delete this->senders[i]->engine;
+    delete this->senders[i]->stats;
+    delete this->senders[i]->probes;
+    delete this->senders[i];
+  }
+  this->senders.clear();
+  if(this->captures!=NULL){
+    while(this->captures->pop(&cap))
+      free(cap.data);
+    delete this->captures;
+    this->captures=NULL;
+  }
+} /* End of ProbePipeline destructor */
+
+
+/* Sends probes to all the supplied targets, using "nthreads" sender threads,
+ * and matches the replies. It returns once the last probe has been sent and
+ * we have waited long enough for its reply. The ProbeEngine must have its
+ * sniffers set up and its clocks started already. When the target list is
+ * processed in windows, this is called once per window, and "last" is only
+ * set for the last one: the replies to the other ones are not waited for,
+ * because the next call can still match them (see
+ * NpingOps::nextTargetHosts()). */
+int ProbePipeline::run(vector<TargetHost *> &Targets, u32 nthreads, bool last){
+  nping_print(DBG_4,"%s()", __func__);
+  struct pipe_sender *s=NULL;
+  int err=0;
+
+  if(Targets.size()==0)
+    return OP_SUCCESS;
+  this->last=last;
+  gettimeofday(&this->started, NULL);
+  nthreads=MAX(1, MIN(nthreads, (u32)Targets.size()));
+  nping_print(DBG_1, "Starting %u sender threads.", nthreads);
+
+  /* Set up the senders. Targets are dealt among them one by one, so each one
+   * gets a similar number of hosts. */
+  for(u32 i=0; i<nthreads; i++){
+    s=new struct pipe_sender;
+    s->pipe=this;
+    s->index=i;
+    s->done=false;
+    s->stats=new PacketStats();
+    s->engine=new ProbeEngine();
+    s->engine->start_time=this->engine->start_time;
+    s->engine->txstats=s->stats;
+    s->engine->tx_output=false;
+    o.reporter.attach(s->stats);
+    s->probes=new SPSCQueue<struct pipe_probe>(PIPELINE_QUEUE_LEN);
+    this->senders.push_back(s);
+  }
+  for(size_t t=0; t<Targets.size(); t++){
+    Targets[t]->setDeferStore(true);
+    this->senders[t%nthreads]->targets.push_back(Targets[t]);
+  }
+
+  /* Start the threads. Senders go last, so nothing they send can be missed */
+  if(!o.disablePacketCapture() && this->engine->pcap_iods.size()>0){
+    this->captures=new SPSCQueue<struct pipe_capture>(PIPELINE_QUEUE_LEN);
+    this->capturing=true;
+    if((err=pthread_create(&this->capture_thread, NULL, capture_main, this))!=0)
+      nping_fatal(QT_3, "%s(): Unable to start capture thread: %s", __func__, strerror(err));
+  }
+  if((err=pthread_create(&this->matcher_thread, NULL, matcher_main, this))!=0)
+    nping_fatal(QT_3, "%s(): Unable to start matcher thread: %s", __func__, strerror(err));
+  for(u32 i=0; i<nthreads; i++){
+    if((err=pthread_create(&this->senders[i]->thread, NULL, sender_main, this->senders[i]))!=0)
+      nping_fatal(QT_3, "%s(): Unable to start sender thread: %s", __func__, strerror(err));
+  }
+
+  /* Wait for the senders to finish. The matcher notices, waits a bit more for
+   * the last replies and then stops the capture thread. */
+  for(u32 i=0; i<nthreads; i++)
+    pthread_join(this->senders[i]->thread, NULL);
+  if(last)
+    o.stats.stop_tx_clock();
+  pthread_join(this->matcher_thread, NULL);
+  if(this->capturing)
+    pthread_join(this->capture_thread, NULL);
+
+  /* Everybody is done. Collect the Tx stats of the senders. */
+  for(u32 i=0; i<nthreads; i++)
+    o.reporter.detach(this->senders[i]->stats, &o.stats);
+  for(size_t t=0; t<Targets.size(); t++)
+    Targets[t]->setDeferStore(false);
+  return OP_SUCCESS;
+} /* End of run() */
+
+
+/* Called by ProbeEngine::packet_capture_handler(), on the capture thread, for
+ * every captured packet. It hands a copy of the packet to the matcher. */
+int ProbePipeline::capture(const u8 *pkt, size_t pktlen, struct timeval *rcvd_time){
+  struct pipe_capture cap;
+  assert(this->captures!=NULL);
+  if(pkt==NULL || pktlen==0)
+    return OP_FAILURE;
+  cap.data=(u8 *)safe_malloc(pktlen);
+  memcpy(cap.data, pkt, pktlen);
+  cap.len=pktlen;
+  cap.rcvd_time=*rcvd_time;
+  while(!this->captures->push(cap))
+    sched_yield();
+  return OP_SUCCESS;
+} /* End of capture() */
+
+
+/* Main loop of a sender thread. It mirrors the transmission loop of
+ * ProbeEngine::start(), restricted to the sender's targets, and always uses
+ * the engine's transmission queue (see ProbeEngine::queue_packet()). */
+void ProbePipeline::send_probes(struct pipe_sender *s){
+  vector<PacketElement *> Packets;
+  struct pipe_probe probe;
+  struct timeval now, now2;
+  RateScheduler sched;
+  TargetHost *tgt=NULL;
+  ProbeEngine *tx=s->engine;
+  u64 total_targets=0;
+  u16 total_ports=0;
+  long wait_time=0;
+  bool last=false;
+
+  o.getTargetPorts(&total_ports);
+  total_ports = (total_ports==0) ? 1 : total_ports;
+  for(size_t i=0; i<this->senders.size(); i++)
+    total_targets+=this->senders[i]->targets.size();
+
+  /* Each sender gets a share of the overall rate that is proportional to
+   * its number of targets, so they all finish at the same time. */
+  if(o.issetRate())
+    sched.setRate((u64)o.getRate()*s->targets.size(), 1000000*total_targets);
+  else
+    sched.setRate(s->targets.size(), (u64)o.getDelay()*1000*total_targets);
+  sched.start(&this->started);
+
+  for(unsigned int r=0; r<o.getRounds(); r++){
+    for(u16 p=0; p<total_ports; p++){
+      for(size_t t=0; t<s->targets.size(); t++){
+        tgt=s->targets[t];
+        gettimeofday(&now, NULL);
+        last=(r==(o.getRounds()-1) && p==(total_ports-1) && t==(s->targets.size()-1));
+        sched.update(1);
+
+        /* Queue the probes, then tell the matcher about them. They don't go
+         * out until the queue is flushed, so the matcher always knows about
+         * a probe before its reply can be captured. */
+        tgt->getNextPacketBatch(Packets);
+        for(size_t i=0; i<Packets.size(); i++){
+          tx->queue_packet(tgt, Packets[i], &now);
+          probe.tgt=tgt;
+          probe.pkt=Packets[i];
+          probe.sent_time=now;
+          while(!s->probes->push(probe))
+            sched_yield();
+        }
+        Packets.clear();
+        s->stats->update_tx_lag(sched.getLag(&now));
+
+        /* Transmit when the queue is full, when it's time to wait for the
+         * next probe or when we are done. */
+        gettimeofday(&now, NULL);
+        wait_time=last ? 0 : sched.getWaitTime(&now);
+        if(tx->txq_len>=tx->txq_max || last || wait_time>=SCHED_MIN_WAIT)
+          tx->flush_packets(&now);
+        if(wait_time>=SCHED_MIN_WAIT){
+          usleep(wait_time);
+          gettimeofday(&now2, NULL);
+          sched.adjust(wait_time, TIMEVAL_SUBTRACT(now2, now));
+        }
+      }
+    }
+  }
+  __atomic_store_n(&s->done, true, __ATOMIC_RELEASE);
+} /* End of send_probes() */
+
+
+/* Main loop of the capture thread. Captured packets are delivered to
+ * ProbeEngine::packet_capture_handler(), which passes them to capture(). */
+void ProbePipeline::capture_packets(){
+  while(!__atomic_load_n(&this->stop, __ATOMIC_ACQUIRE)){
+    if(nsock_loop(this->engine->nsp, 100)==NSOCK_LOOP_ERROR){
+      nping_warning(QT_2, "%s(): Unexpected nsock_loop error.", __func__);
+      break;
+    }
+  }
+} /* End of capture_packets() */
+
+
+/* Stores every probe that the senders have handed over since the last call.
+ * Returns true if there was any. */
+bool ProbePipeline::drain_probes(){
+  struct pipe_probe probe;
+  bool any=false;
+  for(size_t i=0; i<this->senders.size(); i++){
+    while(this->senders[i]->probes->pop(&probe)){
+      if(o.showSentPackets())
+        this->engine->print_sent_pkt(probe.pkt, &probe.sent_time);
+      if(o.output.enabled())
+        o.output.sent(probe.tgt, probe.pkt, &probe.sent_time);
+      probe.tgt->store_probe(probe.pkt, &probe.sent_time);
+      any=true;
+    }
+  }
+  return any;
+} /* End of drain_probes() */
+
+
+/* Returns true if all the senders have sent their last probe */
+bool ProbePipeline::senders_done(){
+  for(size_t i=0; i<this->senders.size(); i++){
+    if(!__atomic_load_n(&this->senders[i]->done, __ATOMIC_ACQUIRE))
+      return false;
+  }
+  return true;
+} /* End of senders_done() */
+
+
+/* Returns how long we wait for replies after the last probe is sent, in
+ * milliseconds. This is four times the highest RTT we have observed, like in
+ * ProbeEngine::start(), or zero if more targets come after these. */
+int ProbePipeline::final_wait(){
+  int max_rtt=0;
+  if(!this->last)
+    return 0;
+  for(size_t i=0; i<this->senders.size(); i++){
+    for(size_t t=0; t<this->senders[i]->targets.size(); t++){
+      if(this->senders[i]->targets[t]->stats.get_max_rtt()>max_rtt)
+        max_rtt=this->senders[i]->targets[t]->stats.get_max_rtt();
+    }
+  }
+  if(max_rtt==0)
+    return DEFAULT_TIME_WAIT_AFTER_LAST_PACKET;
+  return (4*max_rtt)/1000;
+} /* End of final_wait() */
+
+
+/* Main loop of the matcher thread. */
+void ProbePipeline::match_packets(){
+  struct pipe_capture cap;
+  struct flow_probe *flow=NULL;
+  struct timeval now, deadline;
+  packet_view_t view;
+  PacketElement *pkt=NULL;
+  TargetHost *target=NULL;
+  int tlayer=-1;
+  int rtt=-1;
+  bool tx_over=false;
+  bool busy=false;
+  int wait_time=0;
+
+  memset(&deadline, 0, sizeof(struct timeval));
+  while(1){
+    busy=this->drain_probes();
+    while(this->capturing && this->captures->pop(&cap)){
+      busy=true;
+      if(PacketParser::parse_view(cap.data, cap.len, false, &view)==OP_SUCCESS){
+        /* If the packet doesn't match, the probe may have been handed over
+         * after we last checked. Check again. */
+        flow=o.flows.lookup(&view);
+        if(flow==NULL && this->drain_probes())
+          flow=o.flows.lookup(&view);
+        if(flow!=NULL){
+          target=flow->host;
+          target->got_response(flow, &cap.rcvd_time, &rtt);
+          if((tlayer=PacketParser::find_transport_layer(&view, 0))>=0){
+            o.stats.update_rcvd(target->getTargetAddress()->getVersion(), view.hdr[tlayer].type, cap.len);
+            target->stats.update_rcvd(target->getTargetAddress()->getVersion(), view.hdr[tlayer].type, cap.len);
+          }else{
+            nping_warning(QT_2, "%s(): No transport layer found. Please report this bug.", __func__);
+          }
+          if((pkt=PacketParser::view_chain(&view))!=NULL){
+            if(o.output.enabled())
+              o.output.rcvd(target, pkt, &cap.rcvd_time, rtt);
+            ProbeEngine::print_rcvd_pkt(pkt, ((double)TIMEVAL_MSEC_SUBTRACT(cap.rcvd_time, this->engine->start_time)) / 1000.0);
+          }
+        }
+        PacketParser::free_view(&view);
+      }
+      free(cap.data);
+    }
+
+    /* Once the last probe is out, keep going for a while so we get the
+     * last replies. The senders may have handed over a few more probes
+     * right before finishing, so get those first. */
+    gettimeofday(&now, NULL);
+    if(!tx_over && this->senders_done()){
+      this->drain_probes();
+      tx_over=true;
+      wait_time=this->final_wait();
+      nping_print(DBG_2, "Final wait time for responses: %d msecs.", wait_time);
+      TIMEVAL_MSEC_ADD(deadline, now, wait_time);
+    }
+    if(tx_over && TIMEVAL_SUBTRACT(now, deadline)>=0)
+      break;
+    if(!busy)
+      usleep(PIPELINE_IDLE_WAIT);
+  }
+  __atomic_store_n(&this->stop, true, __ATOMIC_RELEASE);
+} /* End of match_packets() */
+
+
+/* Thread entry points */
+void *ProbePipeline::sender_main(void *arg){
+  struct pipe_sender *s=(struct pipe_sender *)arg;
+  s->pipe->send_probes(s);
+  return NULL;
+} /* End of sender_main() */
+
+
+void *ProbePipeline::capture_main(void *arg){
+  ((ProbePipeline *)arg)->capture_packets();
+  return NULL;
+} /* End of capture_main() */
+
+
+void *ProbePipeline::matcher_main(void *arg){
+  ((ProbePipeline *)arg)->match_packets();
+  return NULL;
+} /* End of matcher_main() */
+
+#endif /* WIN32 */
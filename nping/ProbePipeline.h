@@ -0,0 +1,263 @@
+/***************************************************************************
+ * ProbePipeline.h -- Multi-threaded version of the probe engine. Sender   *
+ * threads, a capture thread and a matcher thread exchange probes and      *
+ * captured packets through lock-free queues.                              *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2014 Insecure.Com LLC. Nmap is    *
+ * also a registered trademark of Insecure.Com LLC.  This program is free  *
+ * software; you may redistribute and/or modify it under the terms of the  *
+ * GNU General Public License as published by the Free Software            *
+ * Foundation; Version 2 ("GPL"), BUT ONLY WITH ALL OF THE CLARIFICATIONS  *
+ * AND EXCEPTIONS DESCRIBED HEREIN.  This guarantees your right to use,    *
+ * modify, and redistribute this software under certain conditions.  If    *
+ * you wish to embed Nmap technology into proprietary software, we sell    *
+ * alternative licenses (contact sales@nmap.com).  Dozens of software      *
+ * vendors already license Nmap technology such as host discovery, port    *
+ * scanning, OS detection, version detection, and the Nmap Scripting       *
+ * Engine.                                                                 *
+ *                                                                         *
+ * Note that the GPL places important restrictions on "derivative works",  *
+ * yet it does not provide a detailed definition of that term.  To avoid   *
+ * misunderstandings, we interpret that term as broadly as copyright law   *
+ * allows.  For example, we consider an application to constitute a        *
+ * derivative work for the purpose of this license if it does any of the   *
+ * following with any software or content covered by this license          *
+ * ("Covered Software"):                                                   *
+ *                                                                         *
+ * o Integrates source code from Covered Software.                         *
+ *                                                                         *
+ * o Reads or includes copyrighted data files, such as Nmap's nmap-os-db   *
+ * or nmap-service-probes.                                                 *
+ *                                                                         *
+ * o Is designed specifically to execute Covered Software and parse the    *
+ * results (as opposed to typical shell or execution-menu apps, which will *
+ * execute anything you tell them to).                                     *
+ *                                                                         *
+ * o Includes Covered Software in a proprietary executable installer.  The *
+ * installers produced by InstallShield are an example of this.  Including *
+ * Nmap with other software in compressed or archival form does not        *
+ * trigger this provision, provided appropriate open source decompression  *
+ * or de-archiving software is widely available for no charge.  For the    *
+ * purposes of this license, an installer is considered to include Covered *
+ * Software even if it actually retrieves a copy of Covered Software from  *
+ * another source during runtime (such as by downloading it from the       *
+ * Internet).                                                              *
+ *                                                                         *
+ * o Links (statically or dynamically) to a library which does any of the  *
+ * above.                                                                  *
+ *                                                                         *
+ * o Executes a helper program, module, or script to do any of the above.  *
+ *                                                                         *
+ * This list is not exclusive, but is meant to clarify our interpretation  *
+ * of derived works with some common examples.  Other people may interpret *
+ * the plain GPL differently, so we consider this a special exception to   *
+ * the GPL that we apply to Covered Software.  Works which meet any of     *
+ * these conditions must conform to all of the terms of this license,      *
+ * particularly including the GPL Section 3 requirements of providing      *
+ * source code and allowing free redistribution of the work as a whole.    *
+ *                                                                         *
+ * As another special exception to the GPL terms, Insecure.Com LLC grants  *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two.                                  *
+ *                                                                         *
+ * Any redistribution of Covered Software, including any derived works,    *
+ * must obey and carry forward all of the terms of this license, including *
+ * obeying all GPL rules and restrictions.  For example, source code of    *
+ * the whole work must be provided and free redistribution must be         *
+ * allowed.  All GPL references to "this License", are to be treated as    *
+ * including the terms and conditions of this license text as well.        *
+ *                                                                         *
+ * Because this license imposes special exceptions to the GPL, Covered     *
+ * Work may not be combined (even as part of a larger work) with plain GPL *
+ * software.  The terms, conditions, and exceptions of this license must   *
+ * be included as well.  This license is incompatible with some other open *
+ * source licenses as well.  In some cases we can relicense portions of    *
+ * Nmap or grant special permissions to use it in other open source        *
+ * software.  Please contact fyodor@nmap.org with any such requests.       *
+ * Similarly, we don't incorporate incompatible open source software into  *
+ * Covered Software without special permission from the copyright holders. *
+ *                                                                         *
+ * If you have any questions about the licensing restrictions on using     *
+ * Nmap in other works, are happy to help.  As mentioned above, we also    *
+ * offer alternative license to integrate Nmap into proprietary            *
+ * applications and appliances.  These contracts have been sold to dozens  *
+ * of software vendors, and generally include a perpetual license as well  *
+ * as providing for priority support and updates.  They also fund the      *
+ * continued development of Nmap.  Please email sales@nmap.com for further *
+ * information.                                                            *
+ *                                                                         *
+ * If you have received a written license agreement or contract for        *
+ * Covered Software stating terms other than these, you may choose to use  *
+ * and redistribute Covered Software under those terms instead of these.   *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the Nmap      *
+ * license file for more details (it's in a COPYING file included with     *
+ * Nmap, and also available from https://svn.nmap.org/nmap/COPYING)        *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef __PROBE_PIPELINE_H__
+#define __PROBE_PIPELINE_H__ 1
+
+#include "nping.h"
+#include <vector>
+using namespace std;
+
+#ifndef WIN32
+#include <pthread.h>
+
+class TargetHost;
+class PacketElement;
+class PacketStats;
+class ProbeEngine;
+
+/* Capacity of the queues that link the threads of the pipeline. When a queue
+ * fills up, the thread that feeds it waits until there is room. */
+#define PIPELINE_QUEUE_LEN 65536
+
+/* Time the matcher thread sleeps when it has nothing to do (microseconds) */
+#define PIPELINE_IDLE_WAIT 100
+
+/* Bounded single-producer/single-consumer queue. One thread may push() while
+ * another one pop()s, without any locking: each index is written by one side
+ * only, and the other side reads it with acquire semantics, so it never sees
+ * an index before the element it covers. The indexes live in different cache
+ * lines so the producer and the consumer don't keep stealing them from each
+ * other. */
+template <class T> class SPSCQueue {
+
+  private:
+    T *slots;         /* Storage (capacity is a power of two)   */
+    u32 mask;         /* Capacity minus one                     */
+    char pad0[64];
+    u32 head;         /* Next slot to read. Written by consumer */
+    char pad1[64];
+    u32 tail;         /* Next slot to write. Written by producer */
+    char pad2[64];
+
+  public:
+    SPSCQueue(u32 capacity){
+      u32 size=1;
+      while(size<capacity)
+        size<<=1;
+      this->slots=new T[size];
+      this->mask=size-1;
+      this->head=0;
+      this->tail=0;
+    }
+
+    ~SPSCQueue(){
+      delete [] this->slots;
+    }
+
+    /* Adds an element. Returns false if the queue is full. */
+    bool push(const T &item){
+      u32 t=this->tail;
+      if(t - __atomic_load_n(&this->head, __ATOMIC_ACQUIRE) > this->mask)
+        return false;
+      this->slots[t & this->mask]=item;
+      __atomic_store_n(&this->tail, t+1, __ATOMIC_RELEASE);
+      return true;
+    }
+
+    /* Removes the oldest element. Returns false if the queue is empty. */
+    bool pop(T *item){
+      u32 h=this->head;
+      if(h == __atomic_load_n(&this->tail, __ATOMIC_ACQUIRE))
+        return false;
+      *item=this->slots[h & this->mask];
+      __atomic_store_n(&this->head, h+1, __ATOMIC_RELEASE);
+      return true;
+    }
+};
+
+/* A probe handed by a sender to the matcher, right before it's transmitted */
+struct pipe_probe {
+  TargetHost *tgt;          /* Host the probe is sent to  */
+  PacketElement *pkt;       /* The probe                  */
+  struct timeval sent_time; /* When it was sent           */
+};
+
+/* A packet handed by the capture thread to the matcher */
+struct pipe_capture {
+  u8 *data;                 /* Copy of the packet (IP layer and up) */
+  u32 len;                  /* Its length                           */
+  struct timeval rcvd_time; /* When it was captured                 */
+};
+
+class ProbePipeline;
+
+/* State of a sender thread. Each one transmits to its own subset of the
+ * targets through a private ProbeEngine, so it has its own raw sockets,
+ * transmission queue and TX rings, and keeps its own Tx statistics. */
+struct pipe_sender {
+  ProbePipeline *pipe;             /* Pipeline it belongs to      */
+  pthread_t thread;
+  vector<TargetHost *> targets;    /* Targets it sends probes to  */
+  ProbeEngine *engine;             /* Transmission engine         */
+  PacketStats *stats;              /* Tx statistics               */
+  SPSCQueue<struct pipe_probe> *probes; /* Probes to be matched   */
+  u32 index;                       /* Number of the thread        */
+  bool done;                       /* Has it sent every probe?    */
+};
+
+class ProbePipeline {
+
+  private:
+    ProbeEngine *engine;                /* Engine that owns the sniffers  */
+    vector<struct pipe_sender *> senders;
+    SPSCQueue<struct pipe_capture> *captures; /* Captured packets         */
+    pthread_t capture_thread;
+    pthread_t matcher_thread;
+    bool capturing;                     /* Is there a capture thread?     */
+    bool stop;                          /* Tells the capture thread to quit */
+    bool last;                          /* Are these the last targets?    */
+    struct timeval started;             /* When run() was called          */
+
+    void send_probes(struct pipe_sender *s);
+    void capture_packets();
+    void match_packets();
+    bool drain_probes();
+    bool senders_done();
+    int final_wait();
+
+    static void *sender_main(void *arg);
+    static void *capture_main(void *arg);
+    static void *matcher_main(void *arg);
+
+  public:
+    ProbePipeline(ProbeEngine *engine);
+    ~ProbePipeline();
+    int run(vector<TargetHost *> &Targets, u32 nthreads, bool last);
+    int capture(const u8 *pkt, size_t pktlen, struct timeval *rcvd_time);
+
+}; /* End of class ProbePipeline */
+
+#endif /* WIN32 */
+
+#endif /* __PROBE_PIPELINE_H__ */
@@ -0,0 +1,453 @@
+/***************************************************************************
+ * StatsReporter.cc -- The StatsReporter class prints live statistics at   *
+ * regular intervals and serves them through a local Unix domain socket.   *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2014 Insecure.Com LLC. Nmap is    *
+ * also a registered trademark of Insecure.Com LLC.  This program is free  *
+ * software; you may redistribute and/or modify it under the terms of the  *
+ * GNU General Public License as published by the Free Software            *
+ * Foundation; Version 2 ("GPL"), BUT ONLY WITH ALL OF THE CLARIFICATIONS  *
+ * AND EXCEPTIONS DESCRIBED HEREIN.  This guarantees your right to use,    *
+ * modify, and redistribute this software under certain conditions.  If    *
+ * you wish to embed Nmap technology into proprietary software, we sell    *
+ * alternative licenses (contact sales@nmap.com).  Dozens of software      *
+ * vendors already license Nmap technology such as host discovery, port    *
+ * scanning, OS detection, version detection, and the Nmap Scripting       *
+ * Engine.                                                                 *
+ *                                                                         *
+ * Note that the GPL places important restrictions on "derivative works",  *
+ * yet it does not provide a detailed definition of that term.  To avoid   *
+ * misunderstandings, we interpret that term as broadly as copyright law   *
+ * allows.  For example, we consider an application to constitute a        *
+ * derivative work for the purpose of this license if it does any of the   *
+ * following with any software or content covered by this license          *
+ * ("Covered Software"):                                                   *
+ *                                                                         *
+ * o Integrates source code from Covered Software.                         *
+ *                                                                         *
+ * o Reads or includes copyrighted data files, such as Nmap's nmap-os-db   *
+ * or nmap-service-probes.                                                 *
+ *                                                                         *
+ * o Is designed specifically to execute Covered Software and parse the    *
+ * results (as opposed to typical shell or execution-menu apps, which will *
+ * execute anything you tell them to).                                     *
+ *                                                                         *
+ * o Includes Covered Software in a proprietary executable installer.  The *
+ * installers produced by InstallShield are an example of this.  Including *
+ * Nmap with other software in compressed or archival form does not        *
+ * trigger this provision, provided appropriate open source decompression  *
+ * or de-archiving software is widely available for no charge.  For the    *
+ * purposes of this license, an installer is considered to include Covered *
+ * Software even if it actually retrieves a copy of Covered Software from  *
+ * another source during runtime (such as by downloading it from the       *
+ * Internet).                                                              *
+ *                                                                         *
+ * o Links (statically or dynamically) to a library which does any of the  *
+ * above.                                                                  *
+ *                                                                         *
+ * o Executes a helper program, module, or script to do any of the above.  *
+ *                                                                         *
+ * This list is not exclusive, but is meant to clarify our interpretation  *
+ * of derived works with some common examples.  Other people may interpret *
+ * the plain GPL differently, so we consider this a special exception to   *
+ * the GPL that we apply to Covered Software.  Works which meet any of     *
+ * these conditions must conform to all of the terms of this license,      *
+ * particularly including the GPL Section 3 requirements of providing      *
+ * source code and allowing free redistribution of the work as a whole.    *
+ *                                                                         *
+ * As another special exception to the GPL terms, Insecure.Com LLC grants  *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two.                                  *
+ *                                                                         *
+ * Any redistribution of Covered Software, including any derived works,    *
+ * must obey and carry forward all of the terms of this license, including *
+ * obeying all GPL rules and restrictions.  For example, source code of    *
+ * the whole work must be provided and free redistribution must be         *
+ * allowed.  All GPL references to "this License", are to be treated as    *
+ * including the terms and conditions of this license text as well.        *
+ *                                                                         *
+ * Because this license imposes special exceptions to the GPL, Covered     *
+ * Work may not be combined (even as part of a larger work) with plain GPL *
+ * software.  The terms, conditions, and exceptions of this license must   *
+ * be included as well.  This license is incompatible with some other open *
+ * source licenses as well.  In some cases we can relicense portions of    *
+ * Nmap or grant special permissions to use it in other open source        *
+ * software.  Please contact fyodor@nmap.org with any such requests.       *
+ * Similarly, we don't incorporate incompatible open source software into  *
+ * Covered Software without special permission from the copyright holders. *
+ *                                                                         *
+ * If you have any questions about the licensing restrictions on using     *
+ * Nmap in other works, are happy to help.  As mentioned above, we also    *
+ * offer alternative license to integrate Nmap into proprietary            *
+ * applications and appliances.  These contracts have been sold to dozens  *
+ * of software vendors, and generally include a perpetual license as well  *
+ * as providing for priority support and updates.  They also fund the      *
+ * continued development of Nmap.  Please email sales@nmap.com for further *
+ * information.                                                            *
+ *                                                                         *
+ * If you have received a written license agreement or contract for        *
+ * Covered Software stating terms other than these, you may choose to use  *
+ * and redistribute Covered Software under those terms instead of these.   *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the Nmap      *
+ * license file for more details (it's in a COPYING file included with     *
+ * Nmap, and also available from https://svn.nmap.org/nmap/COPYING)        *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "nping.h"
+#include "StatsReporter.h"
+#include "NpingOps.h"
+#include "output.h"
+
+#ifndef WIN32
+#include <poll.h>
+#include <sys/un.h>
+
+extern NpingOps o;
+
+
+StatsReporter::StatsReporter(){
+  this->interval=DEFAULT_STATS_INTERVAL;
+  this->print=false;
+  this->sockpath=NULL;
+  this->listensd=-1;
+  this->wakefd[0]=this->wakefd[1]=-1;
+  pthread_mutex_init(&this->lock, NULL);
+  this->running=false;
+  this->first=this->prev=this->cur=this->delta=NULL;
+  memset(this->report, 0, sizeof(this->report));
+  this->have_report=false;
+} /* End of StatsReporter constructor */
+
+
+StatsReporter::~StatsReporter(){
+  this->stop();
+  pthread_mutex_destroy(&this->lock);
+} /* End of StatsReporter destructor */
+
+
+/* Starts the reporter thread. A report is produced every "interval_ms"
+ * milliseconds. If "print" is true, reports are printed. If "sockpath" is
+ * not NULL, a Unix domain socket is created there and every client that
+ * connects to it gets the last report and is disconnected.
+ * @return OP_SUCCESS on success and OP_FAILURE in case of error. */
+int StatsReporter::start(long interval_ms, bool print, const char *sockpath){
+  int err=0;
+  if(this->running)
+    return OP_FAILURE;
+  this->interval=(interval_ms>0) ? interval_ms : DEFAULT_STATS_INTERVAL;
+  this->print=print;
+  if(pipe(this->wakefd)!=0)
+    return OP_FAILURE;
+  if(sockpath!=NULL && this->open_socket(sockpath)!=OP_SUCCESS){
+    ::close(this->wakefd[0]);
+    ::close(this->wakefd[1]);
+    return OP_FAILURE;
+  }
+
+  this->first=(struct stats_snapshot *)safe_malloc(sizeof(struct stats_snapshot));
+  this->prev=(struct stats_snapshot *)safe_malloc(sizeof(struct stats_snapshot));
+  this->cur=(struct stats_snapshot *)safe_malloc(sizeof(struct stats_snapshot));
+  this->delta=(struct stats_snapshot *)safe_malloc(sizeof(struct stats_snapshot));
+  this->take_snapshot(this->first);
+  memcpy(this->prev, this->first, sizeof(struct stats_snapshot));
+  this->have_report=false;
+
+  if((err=pthread_create(&this->thread, NULL, reporter_main, this))!=0){
+    nping_warning(QT_2, "%s(): Unable to start reporter thread: %s", __func__, strerror(err));
+    this->release();
+    return OP_FAILURE;
+  }
+  this->running=true;
+  return OP_SUCCESS;
+} /* End of start() */
+
+
+/* Stops the reporter thread and removes the socket. It's safe to call it
+ * more than once. */
+int StatsReporter::stop(){
+  char c='q';
+  if(!this->running)
+    return OP_SUCCESS;
+  if(write(this->wakefd[1], &c, 1)!=1)
+    nping_warning(QT_2, "%s(): Unable to wake up the reporter thread.", __func__);
+  pthread_join(this->thread, NULL);
+  this->running=false;
+  this->release();
+  return OP_SUCCESS;
+} /* End of stop() */
+
+
+/* Closes the pipe and the socket and frees the snapshots */
+void StatsReporter::release(){
+  ::close(this->wakefd[0]);
+  ::close(this->wakefd[1]);
+  this->wakefd[0]=this->wakefd[1]=-1;
+  if(this->listensd>=0){
+    ::close(this->listensd);
+    this->listensd=-1;
+  }
+  if(this->sockpath!=NULL){
+    unlink(this->sockpath);
+    free(this->sockpath);
+    this->sockpath=NULL;
+  }
+  free(this->first);
+  free(this->prev);
+  free(this->cur);
+  free(this->delta);
+  this->first=this->prev=this->cur=this->delta=NULL;
+} /* End of release() */
+
+
+/* Makes the reporter include the supplied stats in its snapshots, in
+ * addition to the global ones. This is how the stats kept by each sender
+ * thread of a ProbePipeline are taken into account. */
+void StatsReporter::attach(PacketStats *st){
+  assert(st!=NULL);
+  pthread_mutex_lock(&this->lock);
+  this->sources.push_back(st);
+  pthread_mutex_unlock(&this->lock);
+} /* End of attach() */
+
+
+/* Undoes attach(), merging the supplied stats into "into" at the same time,
+ * so no snapshot ever counts them twice or misses them. */
+void StatsReporter::detach(PacketStats *st, PacketStats *into){
+  assert(st!=NULL && into!=NULL);
+  pthread_mutex_lock(&this->lock);
+  for(size_t i=0; i<this->sources.size(); i++){
+    if(this->sources[i]==st){
+      this->sources.erase(this->sources.begin()+i);
+      break;
+    }
+  }
+  into->merge(st);
+  pthread_mutex_unlock(&this->lock);
+} /* End of detach() */
+
+
+/* Adds up the global stats and those of the attached sources. Only the list
+ * of sources is locked: the counters are read while they are updated. */
+void StatsReporter::take_snapshot(struct stats_snapshot *snap){
+  memset(snap, 0, sizeof(struct stats_snapshot));
+  gettimeofday(&snap->time, NULL);
+  pthread_mutex_lock(&this->lock);
+  o.stats.snapshot(snap);
+  for(size_t i=0; i<this->sources.size(); i++)
+    this->sources[i]->snapshot(snap);
+  pthread_mutex_unlock(&this->lock);
+} /* End of take_snapshot() */
+
+
+/* Returns a-b, or zero if b is larger */
+static inline u64 counter_diff(u64 a, u64 b){
+  return (a>b) ? a-b : 0;
+} /* End of counter_diff() */
+
+
+/* Computes what happened between two snapshots and stores it, as a line of
+ * JSON, in the "report" buffer. If "show" is true, it's also printed. */
+void StatsReporter::build_report(struct stats_snapshot *from, struct stats_snapshot *to, bool show){
+  char line[STATS_REPORT_LEN];
+  double secs=0, elapsed=0, lost=0;
+  double tx_pps=0, tx_bps=0, rx_pps=0, rx_bps=0, avg=0;
+  u32 p50=0, p90=0, p99=0, p999=0;
+  struct stats_snapshot *d=this->delta;
+  int n=0;
+
+  secs=TIMEVAL_SUBTRACT(to->time, from->time)/1000000.0;
+  elapsed=TIMEVAL_SUBTRACT(to->time, this->first->time)/1000000.0;
+  if(secs<=0)
+    secs=0.000001;
+  d->pkts_sent=counter_diff(to->pkts_sent, from->pkts_sent);
+  d->bytes_sent=counter_diff(to->bytes_sent, from->bytes_sent);
+  d->pkts_rcvd=counter_diff(to->pkts_rcvd, from->pkts_rcvd);
+  d->bytes_rcvd=counter_diff(to->bytes_rcvd, from->bytes_rcvd);
+  d->rtt_count=counter_diff(to->rtt_count, from->rtt_count);
+  d->rtt_sum=counter_diff(to->rtt_sum, from->rtt_sum);
+  for(u32 i=0; i<HISTOGRAM_BUCKETS; i++)
+    d->rtt[i]=counter_diff(to->rtt[i], from->rtt[i]);
+
+  tx_pps=d->pkts_sent/secs;
+  tx_bps=d->bytes_sent/secs;
+  rx_pps=d->pkts_rcvd/secs;
+  rx_bps=d->bytes_rcvd/secs;
+  /* Replies to probes sent near the end of the previous interval arrive in
+   * this one, so this is an approximation. */
+  if(d->pkts_sent>0 && d->pkts_rcvd<d->pkts_sent)
+    lost=100.0*(d->pkts_sent-d->pkts_rcvd)/d->pkts_sent;
+  if(d->rtt_count>0){
+    avg=(double)d->rtt_sum/d->rtt_count;
+    p50=LatencyHistogram::percentile(d->rtt, d->rtt_count, 50);
+    p90=LatencyHistogram::percentile(d->rtt, d->rtt_count, 90);
+    p99=LatencyHistogram::percentile(d->rtt, d->rtt_count, 99);
+    p999=LatencyHistogram::percentile(d->rtt, d->rtt_count, 99.9);
+  }
+
+  Snprintf(this->report, sizeof(this->report),
+    "{\"time\":%lu.%06lu,\"elapsed\":%.3f,\"interval\":%.3f,"
+    "\"pkts_sent\":%llu,\"bytes_sent\":%llu,\"pkts_rcvd\":%llu,\"bytes_rcvd\":%llu,"
+    "\"tx_pkt_rate\":%.2f,\"tx_byte_rate\":%.2f,\"rx_pkt_rate\":%.2f,\"rx_byte_rate\":%.2f,"
+    "\"lost\":%.2f,\"rtt_count\":%llu,\"rtt_avg\":%.3f,\"rtt_p50\":%.3f,\"rtt_p90\":%.3f,"
+    "\"rtt_p99\":%.3f,\"rtt_p999\":%.3f,\"total_sent\":%llu,\"total_rcvd\":%llu}\n",
+    (unsigned long)to->time.tv_sec, (unsigned long)to->time.tv_usec, elapsed, secs,
+    (unsigned long long)d->pkts_sent, (unsigned long long)d->bytes_sent,
+    (unsigned long long)d->pkts_rcvd, (unsigned long long)d->bytes_rcvd,
+    tx_pps, tx_bps, rx_pps, rx_bps, lost, (unsigned long long)d->rtt_count,
+    avg/1000.0, p50/1000.0, p90/1000.0, p99/1000.0, p999/1000.0,
+    (unsigned long long)to->pkts_sent, (unsigned long long)to->pkts_rcvd);
+  this->have_report=true;
+
+  if(show){
+    n=Snprintf(line, sizeof(line), "Stats (%.2fs) | Tx pkts/s: %.2f | Tx bytes/s: %.2f | Rx pkts/s: %.2f | Rx bytes/s: %.2f | Lost: %.2f%%",
+               elapsed, tx_pps, tx_bps, rx_pps, rx_bps, lost);
+    if(d->rtt_count>0 && n>0 && (size_t)n<sizeof(line))
+      Snprintf(line+n, sizeof(line)-n, " | Rtt p50: %.3fms | p90: %.3fms | p99: %.3fms",
+               p50/1000.0, p90/1000.0, p99/1000.0);
+    nping_print(QT_1, "%s", line);
+  }
+} /* End of build_report() */
+
+
+/* Creates the listening Unix domain socket. A stale socket left at the same
+ * path by a previous execution is removed, any other file is not.
+ * @return OP_SUCCESS on success and OP_FAILURE in case of error. */
+int StatsReporter::open_socket(const char *path){
+  struct sockaddr_un sun;
+  struct stat st;
+  int sd=-1;
+
+  if(strlen(path)>=sizeof(sun.sun_path)){
+    nping_warning(QT_2, "Socket path %s is too long.", path);
+    return OP_FAILURE;
+  }
+  if(lstat(path, &st)==0){
+    if(!S_ISSOCK(st.st_mode)){
+      nping_warning(QT_2, "%s already exists and is not a socket.", path);
+      return OP_FAILURE;
+    }
+    unlink(path);
+  }
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family=AF_UNIX;
+  Strncpy(sun.sun_path, path, sizeof(sun.sun_path));
+  if((sd=socket(AF_UNIX, SOCK_STREAM, 0))<0){
+    nping_warning(QT_2, "Unable to create stats socket: %s", strerror(errno));
+    return OP_FAILURE;
+  }
+  if(bind(sd, (struct sockaddr *)&sun, sizeof(sun))!=0 || listen(sd, 16)!=0){
+    nping_warning(QT_2, "Unable to listen on %s: %s", path, strerror(errno));
+    ::close(sd);
+    return OP_FAILURE;
+  }
+  unblock_socket(sd);
+  this->listensd=sd;
+  this->sockpath=strdup(path);
+  return OP_SUCCESS;
+} /* End of open_socket() */
+
+
+/* Accepts every pending connection, sends the last report and closes it.
+ * Clients that connect before the first interval is over get a report of
+ * what happened since we started. */
+void StatsReporter::serve_clients(){
+  int sd=-1;
+  int flags=0;
+#ifdef MSG_NOSIGNAL
+  flags=MSG_NOSIGNAL;
+#endif
+  while((sd=accept(this->listensd, NULL, NULL))>=0){
+    if(!this->have_report){
+      this->take_snapshot(this->cur);
+      this->build_report(this->first, this->cur, false);
+      this->have_report=false; /* Not an interval report */
+    }
+    unblock_socket(sd);
+    if(send(sd, this->report, strlen(this->report), flags)<0)
+      nping_print(DBG_2, "%s(): send() failed: %s", __func__, strerror(errno));
+    ::close(sd);
+  }
+} /* End of serve_clients() */
+
+
+/* Body of the reporter thread. It sleeps until the next report is due,
+ * a client connects, or stop() wakes it up. */
+void StatsReporter::reporter_loop(){
+  struct pollfd fds[2];
+  struct timeval now, next;
+  struct stats_snapshot *aux=NULL;
+  nfds_t nfds=1;
+  long wait_ms=0;
+
+  fds[0].fd=this->wakefd[0];
+  fds[0].events=POLLIN;
+  if(this->listensd>=0){
+    fds[1].fd=this->listensd;
+    fds[1].events=POLLIN;
+    nfds=2;
+  }
+  gettimeofday(&next, NULL);
+  TIMEVAL_MSEC_ADD(next, next, this->interval);
+
+  while(1){
+    gettimeofday(&now, NULL);
+    wait_ms=TIMEVAL_MSEC_SUBTRACT(next, now);
+    if(wait_ms<0)
+      wait_ms=0;
+    fds[0].revents=fds[1].revents=0;
+    if(poll(fds, nfds, wait_ms)<0 && errno!=EINTR)
+      break;
+    if(fds[0].revents)
+      break;
+    if(nfds==2 && fds[1].revents)
+      this->serve_clients();
+
+    gettimeofday(&now, NULL);
+    if(TIMEVAL_SUBTRACT(next, now)<=0){
+      this->take_snapshot(this->cur);
+      this->build_report(this->prev, this->cur, this->print);
+      aux=this->prev;
+      this->prev=this->cur;
+      this->cur=aux;
+      TIMEVAL_MSEC_ADD(next, next, this->interval);
+      /* Don't try to catch up if we were held up for too long */
+      if(TIMEVAL_SUBTRACT(next, now)<=0)
+        TIMEVAL_MSEC_ADD(next, now, this->interval);
+    }
+  }
+} /* End of reporter_loop() */
+
+
+void *StatsReporter::reporter_main(void *arg){
+  ((StatsReporter *)arg)->reporter_loop();
+  return NULL;
+} /* End of reporter_main() */
+
+#endif /* WIN32 */
@@ -96,12 +96,39 @@
 
 extern NpingOps o;
 
+/* Tells the patch_*() methods whether the supplied field changes from one
+ * probe to the next */
+#define VARIES(field) ((field).getBehavior()!=FIELD_TYPE_CONSTANT)
+
 TargetHost::TargetHost(){
   this->reset();
 } /* End of TargetHost constructor */
 
 
 TargetHost::~TargetHost(){
+  struct flow_probe *probe=NULL;
+
+  /* Probes that are still waiting for a response must leave the flow table */
+  while((probe=this->sent.pop())!=NULL){
+    if(probe->pkt!=NULL)
+      PacketParser::freePacketChain(o.flows.remove(probe));
+  }
+  for(int i=0; i<TMPL_COUNT; i++){
+    if(this->tmpl[i].image!=NULL)
+      free(this->tmpl[i].image);
+    if(this->tmpl[i].work!=NULL)
+      free(this->tmpl[i].work);
+    for(size_t j=0; j<this->tmpl[i].spare.size(); j++)
+      PacketParser::freePacketChain(this->tmpl[i].spare[j]);
+  }
+  delete this->eth;
+  delete this->arp;
+  delete this->ip4;
+  delete this->ip6;
+  delete this->tcp;
+  delete this->udp;
+  delete this->icmp4;
+  delete this->icmp6;
 } /* End of TargetHost destructor */
 
 
@@ -125,6 +152,21 @@ void TargetHost::reset(){
   this->icmp6=NULL;
   this->payload=NULL;
   this->payload_len=0;
+  this->defer_store=false;
+  for(int i=0; i<TMPL_COUNT; i++){
+    this->tmpl[i].image=NULL;
+    this->tmpl[i].work=NULL;
+    this->tmpl[i].len=0;
+    this->tmpl[i].l3off=0;
+    this->tmpl[i].l4off=0;
+    this->tmpl[i].l4hdrlen=0;
+    this->tmpl[i].l3sum=0;
+    this->tmpl[i].l4sum=0;
+    this->tmpl[i].eth=false;
+    this->tmpl[i].compiled=false;
+    this->tmpl[i].usable=false;
+    this->tmpl[i].spare.clear();
+  }
 } /* End of reset() */
 
 
@@ -326,14 +368,14 @@ int TargetHost::getNextPacketBatch(vector<PacketElement *> &Packets){
     nping_fatal(QT_3, "%s(): No IP version set.",__func__);
   }
 
-  /* If we need to send a payload, have it ready. */
-  if(this->payload!=NULL){
-    myraw=this->getPayloadHeader();
-  }
 
   /* Build a TCP packet */
-  if(this->tcp!=NULL){
+  if(this->tcp!=NULL && this->next_from_template(TMPL_TCP, Packets)!=OP_SUCCESS){
 
+    /* If we need to send a payload, have it ready. Note that we only
+     * do this when the packet is built from scratch. */
+    if(this->payload!=NULL && myraw==NULL)
+      myraw=this->getPayloadHeader();
     mytcp=this->getTCPHeader();
     mytcp->setNextElement(myraw);
 
@@ -381,11 +423,14 @@ int TargetHost::getNextPacketBatch(vector<PacketElement *> &Packets){
       Packets.push_back(myip);
       this->store_packet(myip);
     }
+    this->compile_template(TMPL_TCP, Packets.back());
   }
 
   /* Build an UDP packet */
-  if(this->udp!=NULL){
+  if(this->udp!=NULL && this->next_from_template(TMPL_UDP, Packets)!=OP_SUCCESS){
 
+    if(this->payload!=NULL && myraw==NULL)
+      myraw=this->getPayloadHeader();
     myudp=this->getUDPHeader();
     myudp->setNextElement(myraw);
 
@@ -434,10 +479,13 @@ int TargetHost::getNextPacketBatch(vector<PacketElement *> &Packets){
       Packets.push_back(myip);
       this->store_packet(myip);
     }
+    this->compile_template(TMPL_UDP, Packets.back());
   }
 
   /* Build an ICMPv4 packet */
-  if(this->icmp4!=NULL){
+  if(this->icmp4!=NULL && this->next_from_template(TMPL_ICMPv4, Packets)!=OP_SUCCESS){
+    if(this->payload!=NULL && myraw==NULL)
+      myraw=this->getPayloadHeader();
     assert(ip_version==AF_INET);
     myicmp4=this->getICMPv4Header();
     myicmp4->setNextElement(myraw);
@@ -479,10 +527,13 @@ int TargetHost::getNextPacketBatch(vector<PacketElement *> &Packets){
       Packets.push_back(myip4);
       this->store_packet(myip4);
     }
+    this->compile_template(TMPL_ICMPv4, Packets.back());
   }
 
   /* Build an ICMPv6 packet */
-  if(this->icmp6!=NULL){
+  if(this->icmp6!=NULL && this->next_from_template(TMPL_ICMPv6, Packets)!=OP_SUCCESS){
+    if(this->payload!=NULL && myraw==NULL)
+      myraw=this->getPayloadHeader();
     assert(ip_version==AF_INET6);
     myicmp6=this->getICMPv6Header();
 
@@ -520,19 +571,23 @@ int TargetHost::getNextPacketBatch(vector<PacketElement *> &Packets){
       Packets.push_back(myip6);
       this->store_packet(myip6);
     }
+    this->compile_template(TMPL_ICMPv6, Packets.back());
   }
 
   /* Build an ARP packet */
-  if(this->arp!=NULL){
+  if(this->arp!=NULL && this->next_from_template(TMPL_ARP, Packets)!=OP_SUCCESS){
     /* Only create ARP packets when the host is IPv4 and reachable
      * through Ethernet */
     if(ip_version==AF_INET && this->eth!=NULL){
+      if(this->payload!=NULL && myraw==NULL)
+        myraw=this->getPayloadHeader();
       myarp=this->getARPHeader();
       myarp->setNextElement(myraw);
       myeth=getEthernetHeader(ETHTYPE_ARP);
       myeth->setNextElement(myarp);
       Packets.push_back(myeth);
       this->store_packet(myeth);
+      this->compile_template(TMPL_ARP, myeth);
     }
   }
 
@@ -903,31 +958,641 @@ RawData *TargetHost::getPayloadHeader(){
 } /* End of getPayloadHeader() */
 
 
-/* This method stores a chain of PacketElements inside the object. In particular,
- * the supplied pointer is stored in the TargetHost::sent_pkts vector. Note that
- * then MAX_STORED_PACKETS_PER_HOST is exceeded, the oldest packet in the list
- * will be removed (and its elements will be freed). This method also store
- * the current time in TargetHost::sent_times. This allows hosts determine
- * their RTTs. */
+/* Stores a probe that getNextPacketBatch() has just produced, unless the
+ * caller has asked to do that itself (see setDeferStore()). */
 int TargetHost::store_packet(PacketElement *pkt){
+  if(this->defer_store)
+    return OP_SUCCESS;
+  return this->store_probe(pkt, NULL);
+} /* End of store_packet() */
+
+
+/* When enabled, getNextPacketBatch() does not store the probes it produces.
+ * The caller becomes responsible for passing them to store_probe(). This is
+ * used by the ProbePipeline, where probes are produced by a sender thread but
+ * matched by a different one, which is the only one that touches the ring
+ * and the flow table. In this mode, packets are freed instead of recycled,
+ * because the thread that disposes of them is not the one that builds them. */
+int TargetHost::setDeferStore(bool val){
+  this->defer_store=val;
+  return OP_SUCCESS;
+} /* End of setDeferStore() */
+
+
+/* This method stores a chain of PacketElements so responses can be matched
+ * against it. In particular, the supplied pointer is placed in the next slot
+ * of the TargetHost::sent ring and inserted in the global flow table
+ * (o.flows). Note that when the ring is full (see NpingOps::getInflight()),
+ * the oldest packet in it will be removed (and its elements will be freed).
+ * This method also stores the time the packet was sent along with it (the
+ * current time if sent_time is NULL). This allows hosts determine their
+ * RTTs. */
+int TargetHost::store_probe(PacketElement *pkt, const struct timeval *sent_time){
+  struct flow_probe *slot=NULL;
   struct timeval now;
+  u64 total=0;
+  u16 ports=0;
   assert(pkt!=NULL);
-  /* Check if we have reached the maximum number of packets we are allowed to
-   * store. In that case, delete the oldest one.*/
-  if(this->sent_pkts.size()>=MAX_STORED_PACKETS_PER_HOST){
-    PacketParser::freePacketChain(this->sent_pkts[0]);
-    this->sent_pkts.erase(this->sent_pkts.begin(), this->sent_pkts.begin()+1);
-    this->sent_times.erase(this->sent_times.begin(), this->sent_times.begin()+1);
-  }
-  gettimeofday(&now, NULL);
-  this->sent_pkts.push_back(pkt);
-  this->sent_times.push_back(now);
+
+  /* The ring never needs more slots than the probes the host will get. This
+   * keeps hosts cheap when there are lots of them and just a few rounds. */
+  if(this->sent.getDepth()==0){
+    if(o.getRounds() < o.getInflight()){
+      o.getTargetPorts(&ports);
+      total=o.getRounds() * MAX(ports, 1) * (o.mode(DO_TCP) + o.mode(DO_UDP) + o.mode(DO_ICMP) + o.mode(DO_ARP));
+    }
+    this->sent.setDepth((total>0 && total<o.getInflight()) ? (u32)total : o.getInflight());
+  }
+  /* If we have reached the maximum number of packets we are allowed to
+   * store, the slot we get is the one of the oldest packet. Delete it. */
+  slot=this->sent.push();
+  if(slot->pkt!=NULL)
+    this->recycle_packet(o.flows.remove(slot));
+  if(sent_time!=NULL)
+    now=*sent_time;
+  else
+    gettimeofday(&now, NULL);
+  slot->pkt=pkt;
+  slot->host=this;
+  slot->sent_time=now;
+  o.flows.insert(slot);
   return OP_SUCCESS;
-} /* End of store_packet() */
+} /* End of store_probe() */
+
+
+/* Disposes of a packet chain that is no longer needed. If the chain was
+ * produced from a precompiled template, it is kept so it can be reused for
+ * a future probe (except in deferred store mode, see setDeferStore()).
+ * Otherwise it is freed. */
+int TargetHost::recycle_packet(PacketElement *pkt){
+  int idx=this->template_index(pkt);
+  if(idx>=0 && this->tmpl[idx].usable && !this->defer_store)
+    this->tmpl[idx].spare.push_back(pkt);
+  else
+    PacketParser::freePacketChain(pkt);
+  return OP_SUCCESS;
+} /* End of recycle_packet() */
+
+
+/* Returns the index of the template that matches the type of the supplied
+ * packet, or -1 if there is none. */
+int TargetHost::template_index(PacketElement *pkt){
+  for(PacketElement *elem=pkt; elem!=NULL; elem=elem->getNextElement()){
+    switch(elem->protocol_id()){
+      case HEADER_TYPE_TCP:
+        return TMPL_TCP;
+      case HEADER_TYPE_UDP:
+        return TMPL_UDP;
+      case HEADER_TYPE_ICMPv4:
+        return TMPL_ICMPv4;
+      case HEADER_TYPE_ICMPv6:
+        return TMPL_ICMPv6;
+      case HEADER_TYPE_ARP:
+        return TMPL_ARP;
+    }
+  }
+  return -1;
+} /* End of template_index() */
+
+
+/* Returns the offset of the checksum field within the transport header of
+ * probes of type "idx". */
+static u32 template_sum_offset(int idx){
+  switch(idx){
+    case TMPL_TCP:
+      return 16;
+    case TMPL_UDP:
+      return 6;
+    default:
+      return 2; /* ICMPv4 and ICMPv6 */
+  }
+} /* End of template_sum_offset() */
+
+
+/* Stores a 16 or 32-bit value at the supplied position of a wire image, in
+ * network byte order. */
+static void put_u16(u8 *buf, u16 val){
+  val=htons(val);
+  memcpy(buf, &val, 2);
+} /* End of put_u16() */
+
+static void put_u32(u8 *buf, u32 val){
+  val=htonl(val);
+  memcpy(buf, &val, 4);
+} /* End of put_u32() */
+
+
+/* Loads the supplied header of a probe chain from its wire image. This is the
+ * counterpart of dumpToBinaryBuffer(), which PacketElement doesn't provide. */
+static void load_header(PacketElement *elem, const u8 *buf, size_t len){
+  switch(elem->protocol_id()){
+    case HEADER_TYPE_ETHERNET:
+      ((EthernetHeader *)elem)->storeRecvData(buf, len);
+    break;
+    case HEADER_TYPE_ARP:
+      ((ARPHeader *)elem)->storeRecvData(buf, len);
+    break;
+    case HEADER_TYPE_IPv4:
+      ((IPv4Header *)elem)->storeRecvData(buf, len);
+    break;
+    case HEADER_TYPE_IPv6:
+      ((IPv6Header *)elem)->storeRecvData(buf, len);
+    break;
+    case HEADER_TYPE_TCP:
+      ((TCPHeader *)elem)->storeRecvData(buf, len);
+    break;
+    case HEADER_TYPE_UDP:
+      ((UDPHeader *)elem)->storeRecvData(buf, len);
+    break;
+    case HEADER_TYPE_ICMPv4:
+      ((ICMPv4Header *)elem)->storeRecvData(buf, len);
+    break;
+    case HEADER_TYPE_ICMPv6:
+      ((ICMPv6Header *)elem)->storeRecvData(buf, len);
+    break;
+  }
+} /* End of load_header() */
+
+
+/* Turns the supplied packet into the template for probes of type "idx". This
+ * is only done when the user requested it, and only once. Templates are not
+ * usable when the structure of the probe may change from one probe to the
+ * next (e.g. random IP options or ICMP types), when it has fields that the
+ * patch_*() methods don't know about, or when the probe can't be parsed back
+ * into the same chain of headers. */
+int TargetHost::compile_template(int idx, PacketElement *pkt){
+  struct probe_template *t=&this->tmpl[idx];
+  PacketElement *copy=NULL, *a=NULL, *b=NULL;
+  struct in_addr i4src, i4dst;
+  struct in6_addr i6src, i6dst;
+  u8 *l4=NULL;
+  u16 zero=0;
+  assert(idx>=0 && idx<TMPL_COUNT && pkt!=NULL);
+
+  if(t->compiled || !o.precompileProbes())
+    return OP_FAILURE;
+  t->compiled=true;
+
+  if(this->ip4!=NULL && this->ip4->opts.getBehavior()!=FIELD_TYPE_CONSTANT)
+    return OP_FAILURE;
+  if(idx==TMPL_ICMPv4){
+    if(this->icmp4->type.getBehavior()!=FIELD_TYPE_CONSTANT ||
+       this->icmp4->code.getBehavior()!=FIELD_TYPE_CONSTANT ||
+       this->icmp4->type.getNextValue()==ICMP_ROUTERADVERT)
+      return OP_FAILURE;
+  }else if(idx==TMPL_ICMPv6){
+    if(this->icmp6->type.getBehavior()!=FIELD_TYPE_CONSTANT ||
+       this->icmp6->code.getBehavior()!=FIELD_TYPE_CONSTANT)
+      return OP_FAILURE;
+    switch(this->icmp6->type.getNextValue()){
+      case ICMPv6_ROUTERADVERT:
+      case ICMPv6_REDIRECT:
+      case ICMPv6_RTRRENUM:
+      case ICMPv6_NODEINFOQUERY:
+      case ICMPv6_NODEINFORESP:
+        return OP_FAILURE;
+    }
+  }
 
+  /* Produce the wire image */
+  t->len=pkt->getLen();
+  t->image=(u8 *)safe_malloc(t->len);
+  pkt->dumpToBinaryBuffer(t->image, t->len);
+  t->eth=(pkt->protocol_id()==HEADER_TYPE_ETHERNET);
+  if(t->eth && pkt->getNextElement()!=NULL)
+    t->l3off=t->len-pkt->getNextElement()->getLen();
+
+  /* Make sure the image parses back into the same chain of headers. The copy
+   * becomes the first spare chain. */
+  if((copy=PacketParser::split(t->image, t->len, t->eth))==NULL){
+    nping_print(DBG_2, "Probe template %d can't be parsed. Not using it.", idx);
+    return OP_FAILURE;
+  }
+  for(a=pkt, b=copy; a!=NULL && b!=NULL; a=a->getNextElement(), b=b->getNextElement()){
+    if(a->protocol_id()!=b->protocol_id() || a->getLen()!=b->getLen())
+      break;
+  }
+  if(a!=NULL || b!=NULL){
+    nping_print(DBG_2, "Probe template %d doesn't parse back the same. Not using it.", idx);
+    PacketParser::freePacketChain(copy);
+    return OP_FAILURE;
+  }
 
-int TargetHost::is_response(PacketElement *pkt_rcvd, struct timeval *rcvd_time){
-  assert(pkt_rcvd!=NULL);
+  /* Locate the header that follows the network one. Only that header and the
+   * ones before it are patched, so it must come right after the network
+   * header. ARP messages have no checksum and are handled as if they were
+   * the transport header. */
+  a=(t->eth) ? copy->getNextElement() : copy;
+  b=(a==NULL || idx==TMPL_ARP) ? a : a->getNextElement();
+  if(b==NULL || (idx!=TMPL_ARP && PacketParser::find_transport_layer(copy)!=b)){
+    nping_print(DBG_2, "Probe template %d has unexpected headers. Not using it.", idx);
+    PacketParser::freePacketChain(copy);
+    return OP_FAILURE;
+  }
+  t->l4off=t->len-b->getLen();
+  t->l4hdrlen=b->getLen();
+  if(b->getNextElement()!=NULL)
+    t->l4hdrlen-=b->getNextElement()->getLen();
+
+  /* Compute the checksums of the image. They are kept aside and the fields
+   * are cleared in the image, so they don't get in the way when the sums are
+   * updated from the differences between two probes. */
+  if(idx!=TMPL_ARP){
+    l4=t->image+t->l4off;
+    if(this->ip4!=NULL){
+      memcpy(t->image+t->l3off+10, &zero, 2);
+      t->l3sum=in_cksum((u16 *)(t->image+t->l3off), t->l4off-t->l3off);
+    }
+    memcpy(l4+template_sum_offset(idx), &zero, 2);
+    if(idx==TMPL_ICMPv4){
+      t->l4sum=in_cksum((u16 *)l4, t->len-t->l4off);
+    }else if(this->ip4!=NULL){
+      memcpy(&(i4src.s_addr), t->image+t->l3off+12, 4);
+      memcpy(&(i4dst.s_addr), t->image+t->l3off+16, 4);
+      t->l4sum=ipv4_pseudoheader_cksum(&i4src, &i4dst, b->protocol_id(), t->len-t->l4off, l4);
+    }else{
+      memcpy(i6src.s6_addr, t->image+t->l3off+8, 16);
+      memcpy(i6dst.s6_addr, t->image+t->l3off+24, 16);
+      t->l4sum=ipv6_pseudoheader_cksum(&i6src, &i6dst, b->protocol_id(), t->len-t->l4off, l4);
+    }
+  }
+  t->work=(u8 *)safe_malloc(t->len);
+  memcpy(t->work, t->image, t->len);
+  t->spare.push_back(copy);
+  t->usable=true;
+  nping_print(DBG_2, "Compiled probe template %d (%u bytes)", idx, t->len);
+  return OP_SUCCESS;
+} /* End of compile_template() */
+
+/* Produces the next probe of type "idx" from its precompiled template. The
+ * image of the previous probe is copied over and only the fields that change
+ * from one probe to the next are patched, straight on the wire bytes, by the
+ * patch_*() methods. Checksums are then updated incrementally (RFC 1624) from
+ * the ones of the previous probe, looking only at the headers, as the payload
+ * never changes. Finally, the headers of a spare chain (or of a copy of the
+ * template if there is none) are loaded from the image, as the rest of Nping
+ * deals with PacketElements. The probe is appended to the supplied vector.
+ * Returns OP_FAILURE if the template can't be used, in which case the caller
+ * must build the probe from scratch. */
+int TargetHost::next_from_template(int idx, vector<PacketElement *> &Packets){
+  struct probe_template *t=&this->tmpl[idx];
+  PacketElement *pkt=NULL, *elem=NULL;
+  u8 *net=NULL, *l4=NULL, *aux=NULL;
+  u32 hdrlen=0, sumoff=0;
+  u16 sum=0;
+
+  if(!t->usable)
+    return OP_FAILURE;
+  if(t->spare.size()>0){
+    pkt=t->spare.back();
+    t->spare.pop_back();
+  }else if((pkt=PacketParser::split(t->image, t->len, t->eth))==NULL){
+    return OP_FAILURE;
+  }
+
+  /* Patch the headers of the previous probe */
+  hdrlen=t->l4off+t->l4hdrlen;
+  memcpy(t->work, t->image, hdrlen);
+  net=t->work+t->l3off;
+  l4=t->work+t->l4off;
+  if(t->eth)
+    this->patch_ethernet(t->work);
+  switch(idx){
+    case TMPL_ARP:
+      this->patch_arp(net);
+    break;
+    case TMPL_TCP:
+      this->patch_tcp(l4);
+    break;
+    case TMPL_UDP:
+      this->patch_udp(l4);
+    break;
+    case TMPL_ICMPv4:
+      this->patch_icmpv4(l4);
+    break;
+    case TMPL_ICMPv6:
+      this->patch_icmpv6(l4);
+    break;
+  }
+  if(idx!=TMPL_ARP){
+    if(this->ip4!=NULL)
+      this->patch_ipv4(net);
+    else
+      this->patch_ipv6(net);
+
+    /* Now the checksums. Addresses and lengths never change, so for the
+     * transport checksum only its own header needs to be compared. */
+    sumoff=template_sum_offset(idx);
+    if(this->ip4!=NULL){
+      t->l3sum=in_cksum_update(t->l3sum, t->image+t->l3off, net, t->l4off-t->l3off);
+      sum=this->pick_sum(&this->ip4->csum, t->l3sum);
+      memcpy(net+10, &sum, 2);
+    }
+    t->l4sum=in_cksum_update(t->l4sum, t->image+t->l4off, l4, t->l4hdrlen);
+    sum=t->l4sum;
+    if(idx==TMPL_UDP && sum==0)
+      sum=0xFFFF;
+    if(idx==TMPL_TCP)
+      sum=this->pick_sum(&this->tcp->csum, sum);
+    else if(idx==TMPL_UDP)
+      sum=this->pick_sum(&this->udp->csum, sum);
+    else if(idx==TMPL_ICMPv4)
+      sum=this->pick_sum(&this->icmp4->csum, sum);
+    else
+      sum=this->pick_sum(&this->icmp6->csum, sum);
+    memcpy(l4+sumoff, &sum, 2);
+  }
+
+  /* Load the headers of the chain from the image. The payload, if any, is
+   * the same for every probe. */
+  elem=pkt;
+  if(t->eth){
+    load_header(elem, t->work, t->l3off);
+    elem=elem->getNextElement();
+  }
+  if(idx!=TMPL_ARP){
+    load_header(elem, net, t->l4off-t->l3off);
+    elem=elem->getNextElement();
+  }
+  load_header(elem, l4, t->l4hdrlen);
+
+  /* The image we just produced becomes the reference for the next probe. Its
+   * checksum fields are cleared, as they are in the template. */
+  if(idx!=TMPL_ARP){
+    sum=0;
+    if(this->ip4!=NULL)
+      memcpy(net+10, &sum, 2);
+    memcpy(l4+sumoff, &sum, 2);
+  }
+  aux=t->image;
+  t->image=t->work;
+  t->work=aux;
+  Packets.push_back(pkt);
+  this->store_packet(pkt);
+  return OP_SUCCESS;
+} /* End of next_from_template() */
+
+
+/* The patch_*() methods set the fields of the supplied header, in wire format,
+ * whose value changes from one probe to the next. They follow the get*Header()
+ * methods, which produced the rest of the fields when the template was built. */
+void TargetHost::patch_ethernet(u8 *eth){
+  MACAddress auxmac;
+  if(VARIES(this->eth->dst)){
+    auxmac=this->eth->dst.getNextValue();
+    memcpy(eth, auxmac.getAddress_bin(), 6);
+  }
+  if(VARIES(this->eth->src)){
+    auxmac=this->eth->src.getNextValue();
+    memcpy(eth+6, auxmac.getAddress_bin(), 6);
+  }
+  if(this->eth->type.is_set() && VARIES(this->eth->type))
+    put_u16(eth+12, this->eth->type.getNextValue());
+} /* End of patch_ethernet() */
+
+
+void TargetHost::patch_arp(u8 *arp){
+  MACAddress auxmac;
+  struct in_addr auxaddr;
+  if(VARIES(this->arp->htype))
+    put_u16(arp, this->arp->htype.getNextValue());
+  if(VARIES(this->arp->ptype))
+    put_u16(arp+2, this->arp->ptype.getNextValue());
+  if(VARIES(this->arp->haddrlen))
+    arp[4]=this->arp->haddrlen.getNextValue();
+  if(VARIES(this->arp->paddrlen))
+    arp[5]=this->arp->paddrlen.getNextValue();
+  if(VARIES(this->arp->op))
+    put_u16(arp+6, this->arp->op.getNextValue());
+  /* Sender MAC address */
+  if(this->arp->sha.is_set()){
+    if(VARIES(this->arp->sha))
+      memcpy(arp+8, this->arp->sha.getNextValue().getAddress_bin(), 6);
+  }else if(VARIES(this->eth->src)){
+    auxmac=this->eth->src.getNextValue();
+    memcpy(arp+8, auxmac.getAddress_bin(), 6);
+  }
+  /* Sender IP address */
+  if(this->arp->spa.is_set() && VARIES(this->arp->spa)){
+    auxaddr=this->arp->spa.getNextValue();
+    memcpy(arp+14, &auxaddr, 4);
+  }
+  /* Target MAC address */
+  if(this->arp->tha.is_set()){
+    if(VARIES(this->arp->tha))
+      memcpy(arp+18, this->arp->tha.getNextValue().getAddress_bin(), 6);
+  }else if(VARIES(this->eth->dst)){
+    auxmac=this->eth->dst.getNextValue();
+    memcpy(arp+18, auxmac.getAddress_bin(), 6);
+  }
+  /* Target IP Address */
+  if(this->arp->tpa.is_set() && VARIES(this->arp->tpa)){
+    auxaddr=this->arp->tpa.getNextValue();
+    memcpy(arp+24, &auxaddr, 4);
+  }
+} /* End of patch_arp() */
+
+
+void TargetHost::patch_ipv4(u8 *ip){
+  u16 off=0;
+  if(VARIES(this->ip4->tos))
+    ip[1]=this->ip4->tos.getNextValue();
+  if(VARIES(this->ip4->id))
+    put_u16(ip+4, this->ip4->id.getNextValue());
+  /* Fragment offset and flags share the same 16 bits */
+  off=(ip[6]<<8) | ip[7];
+  if(VARIES(this->ip4->off))
+    off=(off & (IP_RF|IP_DF|IP_MF)) | (this->ip4->off.getNextValue() & ~(IP_RF|IP_DF|IP_MF));
+  if(VARIES(this->ip4->rf))
+    off=this->ip4->rf.getNextValue() ? (off | IP_RF) : (off & ~IP_RF);
+  if(VARIES(this->ip4->mf))
+    off=this->ip4->mf.getNextValue() ? (off | IP_MF) : (off & ~IP_MF);
+  if(VARIES(this->ip4->df))
+    off=this->ip4->df.getNextValue() ? (off | IP_DF) : (off & ~IP_DF);
+  put_u16(ip+6, off);
+  if(VARIES(this->ip4->ttl))
+    ip[8]=this->ip4->ttl.getNextValue();
+  if(this->ip4->nh.is_set() && VARIES(this->ip4->nh))
+    ip[9]=this->ip4->nh.getNextValue();
+} /* End of patch_ipv4() */
+
+
+void TargetHost::patch_ipv6(u8 *ip){
+  u32 first=0;
+  /* Version, traffic class and flow label share the first 32 bits */
+  first=((u32)ip[0]<<24) | ((u32)ip[1]<<16) | ((u32)ip[2]<<8) | ip[3];
+  if(VARIES(this->ip6->flow))
+    first=(first & 0xFFF00000) | (this->ip6->flow.getNextValue() & 0x000FFFFF);
+  if(VARIES(this->ip6->tclass))
+    first=(first & 0xF00FFFFF) | ((u32)this->ip6->tclass.getNextValue()<<20);
+  put_u32(ip, first);
+  if(this->ip6->nh.is_set() && VARIES(this->ip6->nh))
+    ip[6]=this->ip6->nh.getNextValue();
+  if(VARIES(this->ip6->hlim))
+    ip[7]=this->ip6->hlim.getNextValue();
+} /* End of patch_ipv6() */
+
+
+void TargetHost::patch_tcp(u8 *tcp){
+  if(VARIES(this->tcp->sport))
+    put_u16(tcp, this->tcp->sport.getNextValue());
+  if(VARIES(this->tcp->dport))
+    put_u16(tcp+2, this->tcp->dport.getNextValue());
+  if(VARIES(this->tcp->seq))
+    put_u32(tcp+4, this->tcp->seq.getNextValue());
+  if(VARIES(this->tcp->ack))
+    put_u32(tcp+8, this->tcp->ack.getNextValue());
+  if(VARIES(this->tcp->off))
+    tcp[12]=(tcp[12] & 0x0F) | (this->tcp->off.getNextValue()<<4);
+  if(VARIES(this->tcp->flags))
+    tcp[13]=this->tcp->flags.getNextValue();
+  if(VARIES(this->tcp->win))
+    put_u16(tcp+14, this->tcp->win.getNextValue());
+  if(VARIES(this->tcp->urp))
+    put_u16(tcp+18, this->tcp->urp.getNextValue());
+} /* End of patch_tcp() */
+
+
+void TargetHost::patch_udp(u8 *udp){
+  if(VARIES(this->udp->sport))
+    put_u16(udp, this->udp->sport.getNextValue());
+  if(VARIES(this->udp->dport))
+    put_u16(udp+2, this->udp->dport.getNextValue());
+} /* End of patch_udp() */
+
+
+void TargetHost::patch_icmpv4(u8 *icmp){
+  struct in_addr auxaddr;
+  switch(icmp[0]){
+
+    case ICMP_REDIRECT:
+      if(VARIES(this->icmp4->redir_addr)){
+        auxaddr=this->icmp4->redir_addr.getNextValue();
+        memcpy(icmp+4, &auxaddr, 4);
+      }
+    break;
+
+    case ICMP_PARAMPROB:
+      if(VARIES(this->icmp4->pointer))
+        icmp[4]=this->icmp4->pointer.getNextValue();
+    break;
+
+    case ICMP_INFO:
+    case ICMP_INFOREPLY:
+    case ICMP_ECHO:
+    case ICMP_ECHOREPLY:
+    case ICMP_DOMAINNAME:
+    case ICMP_DOMAINNAMEREPLY:
+    case ICMP_TSTAMP:
+    case ICMP_TSTAMPREPLY:
+    case ICMP_MASK:
+    case ICMP_MASKREPLY:
+      if(VARIES(this->icmp4->id))
+        put_u16(icmp+4, this->icmp4->id.getNextValue());
+      if(VARIES(this->icmp4->seq))
+        put_u16(icmp+6, this->icmp4->seq.getNextValue());
+      if(icmp[0]==ICMP_TSTAMP || icmp[0]==ICMP_TSTAMPREPLY){
+        if(VARIES(this->icmp4->ts_orig))
+          put_u32(icmp+8, this->icmp4->ts_orig.getNextValue());
+        if(VARIES(this->icmp4->ts_rx))
+          put_u32(icmp+12, this->icmp4->ts_rx.getNextValue());
+        if(VARIES(this->icmp4->ts_tx))
+          put_u32(icmp+16, this->icmp4->ts_tx.getNextValue());
+      }else if((icmp[0]==ICMP_MASK || icmp[0]==ICMP_MASKREPLY) && VARIES(this->icmp4->mask)){
+        auxaddr=this->icmp4->mask.getNextValue();
+        memcpy(icmp+8, &auxaddr, 4);
+      }
+    break;
+
+    default:
+      /* The rest of the types have no fields of their own, or are never
+       * built from a template (router advertisements). */
+    break;
+  }
+} /* End of patch_icmpv4() */
+
+
+void TargetHost::patch_icmpv6(u8 *icmp){
+  struct in6_addr auxaddr;
+  switch(icmp[0]){
+
+    case ICMPv6_ECHO:
+    case ICMPv6_ECHOREPLY:
+      if(VARIES(this->icmp6->id))
+        put_u16(icmp+4, this->icmp6->id.getNextValue());
+      if(VARIES(this->icmp6->seq))
+        put_u16(icmp+6, this->icmp6->seq.getNextValue());
+    break;
+
+    case ICMPv6_PKTTOOBIG:
+      if(VARIES(this->icmp6->mtu))
+        put_u32(icmp+4, this->icmp6->mtu.getNextValue());
+    break;
+
+    case ICMPv6_PARAMPROB:
+      if(VARIES(this->icmp6->pointer))
+        put_u32(icmp+4, this->icmp6->pointer.getNextValue());
+    break;
+
+    case ICMPv6_NGHBRADVERT:
+      if(VARIES(this->icmp6->na_flags))
+        icmp[4]=this->icmp6->na_flags.getNextValue();
+      if(VARIES(this->icmp6->na_addr)){
+        auxaddr=this->icmp6->na_addr.getNextValue();
+        memcpy(icmp+8, auxaddr.s6_addr, 16);
+      }
+    break;
+
+    case ICMPv6_NGHBRSOLICIT:
+      if(VARIES(this->icmp6->ns_addr)){
+        auxaddr=this->icmp6->ns_addr.getNextValue();
+        memcpy(icmp+8, auxaddr.s6_addr, 16);
+      }
+    break;
+
+    case ICMPv6_GRPMEMBQUERY:
+    case ICMPv6_GRPMEMBREP:
+    case ICMPv6_GRPMEMBRED:
+    case ICMPv6_MLDV2:
+      if(icmp[0]!=ICMPv6_MLDV2 && VARIES(this->icmp6->mld_delay))
+        put_u16(icmp+4, this->icmp6->mld_delay.getNextValue());
+      if(VARIES(this->icmp6->mld_addr)){
+        auxaddr=this->icmp6->mld_addr.getNextValue();
+        memcpy(icmp+8, auxaddr.s6_addr, 16);
+      }
+    break;
+
+    default:
+      /* The rest of the types have no fields of their own, or are never
+       * built from a template (see compile_template()). */
+    break;
+  }
+} /* End of patch_icmpv6() */
+
+
+/* Returns the value that should be placed in a checksum field whose correct
+ * value is "correct". That is the correct value itself, unless the user asked
+ * for a bad checksum or supplied a specific value. */
+u16 TargetHost::pick_sum(ProtoField_u16 *csum, u16 correct){
+  u16 aux=0;
+  if(csum->getBehavior()==FIELD_TYPE_BADSUM){
+    /* Pick a value different from the correct one */
+    while( (aux=get_random_u16())==correct );
+    return aux;
+  }else if(csum->is_set()){
+    /* This means the user set a specific value, not --badsum */
+    return csum->getNextValue();
+  }
+  return correct;
+} /* End of pick_sum() */
+
+
+/* Processes a response to one of the probes sent to this host, as found by
+ * FlowTable::lookup(). It updates the RTT stats and forgets about the probe
+ * so it is not matched again. If "rtt_out" is not NULL, the round trip time
+ * (in microseconds) is stored there. */
+int TargetHost::got_response(struct flow_probe *probe, struct timeval *rcvd_time, int *rtt_out){
+  assert(probe!=NULL && probe->host==this);
   int rtt=0;
   struct timeval now;
   if(rcvd_time!=NULL){
@@ -936,29 +1601,22 @@ int TargetHost::is_response(PacketElement *pkt_rcvd, struct timeval *rcvd_time){
     gettimeofday(&now, NULL);
   }
 
-  for(size_t i=0; i<this->sent_pkts.size(); i++){
-    /* If we found the probe that matches the answer, then we remove the
-     * probe from our list so we don't process it again next time. */
-    if(PacketParser::is_response(this->sent_pkts[i], pkt_rcvd)){
-      /* Now that we know the packet is a response to one of our probes, let's
-       * determine the RTT and update our internal stats. */
-      rtt= TIMEVAL_SUBTRACT(now, this->sent_times[i]);
-      this->stats.update_rtt(rtt);
-      o.stats.update_rtt(rtt);
-      /* Do some cleanup */
-      if(o.doMulticast()==false){
-        /* We remove the packet in all cases except when we are targeting some
-         * multicast address. In that case, we need the packet to stay alive
-         * because we may have multiple answers to the same probe, and we
-         * need to be able to match it against more than one packet. If we
-         * delete the packet after the first match, we'll never detect the
-         * extra responses. */
-        PacketParser::freePacketChain(this->sent_pkts[i]);
-        this->sent_pkts.erase(this->sent_pkts.begin()+i, this->sent_pkts.begin()+i+1);
-        this->sent_times.erase(this->sent_times.begin()+i, this->sent_times.begin()+i+1);
-      }
-      return true;
-    }
+  /* Determine the RTT and update our internal stats. */
+  rtt= TIMEVAL_SUBTRACT(now, probe->sent_time);
+  if(rtt_out!=NULL)
+    *rtt_out=rtt;
+  this->stats.update_rtt(rtt);
+  o.stats.update_rtt(rtt);
+  /* Do some cleanup */
+  if(o.doMulticast()==false){
+    /* We remove the packet in all cases except when we are targeting some
+     * multicast address. In that case, we need the packet to stay alive
+     * because we may have multiple answers to the same probe, and we
+     * need to be able to match it against more than one packet. If we
+     * delete the packet after the first match, we'll never detect the
+     * extra responses. */
+    this->recycle_packet(o.flows.remove(probe));
+    this->sent.release(probe);
   }
-  return false;
-} /* End of is_response() */
+  return OP_SUCCESS;
+} /* End of got_response() */
@@ -97,6 +97,7 @@
 #include "NetworkInterface.h"
 #include "HeaderTemplates.h"
 #include "stats.h"
+#include "FlowTable.h"
 #include <vector>
 using namespace std;
 
@@ -105,13 +106,35 @@ using namespace std;
 #define DISTANCE_UNKNOWN -1   /* We don't know how far the host is. */
 #define DISTANCE_DIRECT   0   /* The host is directly connected.    */
 
-/* Maximum number of sent packets that a host stores internally. This value
- * directly affects the ability of a host to determine whether a received
- * packet is a response to a packet that it produced earlier. When the
- * inter-packet delay is something crazy like 1ms and the RTT is high, we may
- * not be able to correlate packets. Increasing the value for this define may
- * help. */
-#define MAX_STORED_PACKETS_PER_HOST 1024
+/* Indexes of the precompiled probe templates (one per probe type) */
+#define TMPL_TCP    0
+#define TMPL_UDP    1
+#define TMPL_ICMPv4 2
+#define TMPL_ICMPv6 3
+#define TMPL_ARP    4
+#define TMPL_COUNT  5
+
+/* A probe template holds the wire image of the first probe of a given type.
+ * The probes that follow are obtained by patching, on the image, the fields
+ * that change from probe to probe and the checksums. The checksums are
+ * updated incrementally (RFC 1624) from the ones of the previous probe,
+ * comparing only the headers, as the payload never changes. Packet chains
+ * that are no longer needed are kept in "spare" and reused instead of
+ * allocating new ones. */
+struct probe_template{
+  u8 *image;                     /* Wire-format image of the last probe    */
+  u8 *work;                      /* Image of the probe being built         */
+  u32 len;                       /* Length of the image                    */
+  u32 l3off;                     /* Offset of the network header           */
+  u32 l4off;                     /* Offset of the transport header         */
+  u32 l4hdrlen;                  /* Length of the transport header         */
+  u16 l3sum;                     /* IPv4 header checksum of the last probe */
+  u16 l4sum;                     /* Transport checksum of the last probe   */
+  bool eth;                      /* Image starts with an Ethernet header?  */
+  bool compiled;                 /* Have we tried to compile it already?   */
+  bool usable;                   /* Can probes be built from it?           */
+  vector<PacketElement *> spare; /* Chains that can be recycled            */
+};
 
 class TargetHost{
 
@@ -139,8 +162,9 @@ class TargetHost{
 
     int net_distance;        /* If >=0, indicates how many hops away the target is    */
     NetworkInterface *iface; /* Info about the proper interface to reach target       */
-    vector<PacketElement *> sent_pkts; /* List of transmitted packets                 */
-    vector<struct timeval> sent_times; /* List of timestamps for transmitted packets  */
+    ProbeRing sent;          /* Transmitted packets awaiting a response               */
+    bool defer_store;        /* Are probes stored by someone else? (store_probe())    */
+    struct probe_template tmpl[TMPL_COUNT]; /* Precompiled probes            */
 
     EthernetHeader *getEthernetHeader(u16 eth_type);
     ARPHeader *getARPHeader();
@@ -152,7 +176,22 @@ class TargetHost{
     ICMPv6Header *getICMPv6Header();
     RawData *getPayloadHeader();
 
+    void patch_ethernet(u8 *eth);
+    void patch_arp(u8 *arp);
+    void patch_ipv4(u8 *ip);
+    void patch_ipv6(u8 *ip);
+    void patch_tcp(u8 *tcp);
+    void patch_udp(u8 *udp);
+    void patch_icmpv4(u8 *icmp);
+    void patch_icmpv6(u8 *icmp);
+
+    int compile_template(int idx, PacketElement *pkt);
+    int next_from_template(int idx, vector<PacketElement *> &Packets);
+    int template_index(PacketElement *pkt);
+    u16 pick_sum(ProtoField_u16 *csum, u16 correct);
+
     int store_packet(PacketElement *pkt);
+    int recycle_packet(PacketElement *pkt);
 
   /* Public methods */
   public:
@@ -196,7 +235,9 @@ class TargetHost{
 
     void reset();
     int getNextPacketBatch(vector<PacketElement *> &Packets);
-    int is_response(PacketElement *pkt_rcvd, struct timeval *rcvd_time);
+    int setDeferStore(bool val);
+    int store_probe(PacketElement *pkt, const struct timeval *sent_time);
+    int got_response(struct flow_probe *probe, struct timeval *rcvd_time, int *rtt_out);
 
   /* Public attributes */
   public:
@@ -204,12 +204,27 @@ int main(int argc, char *argv[] ){
     /* Make sure we have at least one target host */
     if(o.totalTargetHosts()==0){
       nping_fatal(QT_3, "Execution aborted. Nping needs at least one valid target to operate.");
-    }else{
+    }else if(!o.moreTargetHosts()){
       nping_print(DBG_2,"%lu target IP address%s determined.",
                   (long unsigned int)o.totalTargetHosts(), (o.totalTargetHosts()==1)? "":"es");
+    }else{
+      nping_print(DBG_2,"%lu target IP addresses determined so far. The rest will be processed in windows of %d.",
+                  (long unsigned int)o.totalTargetHosts(), TARGET_WINDOW);
     }
   }
 
+  /* Open the file for structured output, if the user asked for it */
+  if(o.issetStructuredOutput()){
+    if(o.output.open(o.getStructuredOutputFile(), o.getStructuredOutputFormat())!=OP_SUCCESS)
+      nping_fatal(QT_3, "Unable to open output file %s: %s", o.getStructuredOutputFile(), strerror(errno));
+  }
+
+  /* Start reporting live statistics, if the user asked for it */
+  if(o.issetStatsInterval() || o.issetStatsSocket()){
+    if(o.reporter.start(o.getStatsInterval(), o.issetStatsInterval(), o.getStatsSocket())!=OP_SUCCESS)
+      nping_fatal(QT_3, "Unable to start the live statistics reporter.");
+  }
+
   switch( o.getRole() ){
 
         case ROLE_NORMAL:
@@ -236,6 +251,7 @@ int main(int argc, char *argv[] ){
 
   /* Display stats, clean up and quit */
   o.stats.stop_runtime();
+  o.reporter.stop();
   o.displayStatistics();
   o.displayNpingDoneMsg();
   o.cleanup();
@@ -287,6 +303,7 @@ void signal_handler(int signo){
         o.stats.stop_tx_clock();
         o.stats.stop_rx_clock();
         o.stats.stop_runtime();
+        o.reporter.stop();
         o.displayStatistics();
         o.displayNpingDoneMsg();
         o.cleanup();
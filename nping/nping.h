@@ -363,6 +363,28 @@
 
 #define DEFAULT_DELAY 1000              /**< Milliseconds between each probe */
 
+/* Number of packets the ProbeEngine queues before transmitting them all at
+ * once (--batch). 1 means packets are sent one by one as they are created. */
+#define DEFAULT_TX_BATCH 1
+#define MAX_TX_BATCH 4096
+
+/* Number of sent packets that a host stores internally (--inflight). This
+ * value directly affects the ability of a host to determine whether a
+ * received packet is a response to a packet that it produced earlier. When
+ * the inter-packet delay is something crazy like 1ms and the RTT is high, we
+ * may not be able to correlate packets. Increasing the value may help. */
+#define DEFAULT_INFLIGHT_PROBES 1024
+#define MAX_INFLIGHT_PROBES 1048576
+
+/* Maximum number of sender threads (--threads) */
+#define MAX_SENDER_THREADS 64
+
+/* Maximum number of captured packets delivered by a single pcap read event,
+ * and size of the kernel capture buffer. A large buffer lets us absorb bursts
+ * of replies, which we then consume in batches. */
+#define PCAP_READ_BATCH 256
+#define PCAP_BUFFER_SIZE (8*1024*1024)
+
  /** Milliseconds Nping waits for replies after all probes have been sent */
 #define DEFAULT_WAIT_AFTER_PROBES 1000
 
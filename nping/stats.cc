@@ -205,6 +205,336 @@ bool NpingTimer::timeval_set(const struct timeval *tv){
 } /* End of timeval_set() */
 
 
+/*****************************************************************************/
+/* Implementation of RateScheduler class.                                    */
+/*****************************************************************************/
+
+RateScheduler::RateScheduler(){
+  this->reset();
+}
+
+
+RateScheduler::~RateScheduler(){
+
+}
+
+
+void RateScheduler::reset(){
+  this->pkts=1;
+  this->period=0;
+  this->released=0;
+  this->deviation=0;
+  this->start_tv.tv_sec=0;
+  this->start_tv.tv_usec=0;
+} /* End of reset() */
+
+
+/** Sets the transmission rate: "pkts" packets every "period_usecs"
+  * microseconds. A period of zero means "as fast as possible". Expressing the
+  * rate as a fraction avoids rounding when the inter-packet delay is not a
+  * whole number of microseconds (e.g. 3 packets per second). */
+int RateScheduler::setRate(u64 pkts, u64 period_usecs){
+  if(pkts==0)
+    return OP_FAILURE;
+  this->pkts=pkts;
+  this->period=period_usecs;
+  return OP_SUCCESS;
+} /* End of setRate() */
+
+
+/** Starts the schedule. The first packet is due at "now". */
+int RateScheduler::start(const struct timeval *now){
+  assert(now!=NULL);
+  this->start_tv=*now;
+  this->released=0;
+  this->deviation=0;
+  return OP_SUCCESS;
+} /* End of start() */
+
+
+/** Tells the scheduler that "count" more packets have been released. */
+void RateScheduler::update(u32 count){
+  this->released+=count;
+} /* End of update() */
+
+
+/** Returns the number of microseconds to wait until the next packet is due,
+  * already corrected for the timer overshoot observed last time. Values
+  * lower than SCHED_MIN_WAIT mean the packet should be sent right away. The
+  * returned value may be negative if we are behind schedule. */
+long RateScheduler::getWaitTime(const struct timeval *now){
+  struct timeval next;
+  assert(now!=NULL);
+  this->get_deadline(this->released, &next);
+  return TIMEVAL_SUBTRACT(next, *now) - this->deviation;
+} /* End of getWaitTime() */
+
+
+/** Returns how many microseconds ago the last released packet was due, or
+  * zero if it was released on time. */
+long RateScheduler::getLag(const struct timeval *now){
+  struct timeval due;
+  long lag=0;
+  assert(now!=NULL);
+  if(this->released==0)
+    return 0;
+  this->get_deadline(this->released-1, &due);
+  lag=TIMEVAL_SUBTRACT(*now, due);
+  return (lag>0) ? lag : 0;
+} /* End of getLag() */
+
+
+/** Records how long a wait actually took, compared to what we asked for, so
+  * the difference can be applied to the next wait. */
+void RateScheduler::adjust(long expected_usecs, long actual_usecs){
+  if((this->deviation=actual_usecs-expected_usecs)<0)
+    this->deviation=0;
+} /* End of adjust() */
+
+
+/* Stores in "deadline" the time at which packet number "pktno" is due. */
+void RateScheduler::get_deadline(u64 pktno, struct timeval *deadline){
+  u64 offset=(pktno*this->period)/this->pkts;
+  TIMEVAL_ADD(*deadline, this->start_tv, offset);
+} /* End of get_deadline() */
+
+
+
+/*****************************************************************************/
+/* Implementation of LatencyHistogram class.                                 */
+/*****************************************************************************/
+
+LatencyHistogram::LatencyHistogram(){
+  this->counts=NULL;
+  this->reset();
+} /* End of LatencyHistogram constructor */
+
+
+LatencyHistogram::~LatencyHistogram(){
+  if(this->counts!=NULL)
+    free(this->counts);
+} /* End of LatencyHistogram destructor */
+
+
+/* Forgets all the samples */
+void LatencyHistogram::reset(){
+  if(this->counts!=NULL){
+    free(this->counts);
+    this->counts=NULL;
+  }
+  this->total=0;
+  this->sum=0;
+  this->min=0;
+  this->max=0;
+  this->last=0;
+  this->jitter_sum=0;
+  this->jitter_count=0;
+} /* End of reset() */
+
+
+/* Returns the position of the most significant bit set in "v" (v>0) */
+static inline u32 highest_bit(u32 v){
+#if defined(__GNUC__)
+  return 31 - __builtin_clz(v);
+#else
+  u32 b=0;
+  while(v>>=1)
+    b++;
+  return b;
+#endif
+} /* End of highest_bit() */
+
+
+/* Returns the bucket a value falls in */
+u32 LatencyHistogram::bucket_index(u32 usecs){
+  u32 shift=0;
+  if(usecs<HISTOGRAM_SUB_COUNT)
+    return usecs;
+  /* Shift the value so it keeps HISTOGRAM_SUB_BITS-1 significant bits */
+  shift=highest_bit(usecs)-(HISTOGRAM_SUB_BITS-1);
+  return HISTOGRAM_SUB_COUNT + (shift-1)*(HISTOGRAM_SUB_COUNT/2) + ((usecs>>shift) - HISTOGRAM_SUB_COUNT/2);
+} /* End of bucket_index() */
+
+
+/* Returns the lowest value that falls in the supplied bucket */
+u32 LatencyHistogram::bucket_low(u32 index){
+  u32 shift=0, sub=0;
+  if(index<HISTOGRAM_SUB_COUNT)
+    return index;
+  shift=(index-HISTOGRAM_SUB_COUNT)/(HISTOGRAM_SUB_COUNT/2) + 1;
+  sub=(index-HISTOGRAM_SUB_COUNT)%(HISTOGRAM_SUB_COUNT/2) + HISTOGRAM_SUB_COUNT/2;
+  return sub<<shift;
+} /* End of bucket_low() */
+
+
+/* Returns the highest value that falls in the supplied bucket */
+u32 LatencyHistogram::bucket_high(u32 index){
+  u32 shift=0;
+  if(index<HISTOGRAM_SUB_COUNT)
+    return index;
+  shift=(index-HISTOGRAM_SUB_COUNT)/(HISTOGRAM_SUB_COUNT/2) + 1;
+  return (u32)((u64)bucket_low(index) + ((u64)1<<shift) - 1);
+} /* End of bucket_high() */
+
+
+/* Records a sample */
+void LatencyHistogram::record(u32 usecs){
+  u64 *buckets=this->counts;
+  if(buckets==NULL){
+    buckets=(u64 *)safe_zalloc(HISTOGRAM_BUCKETS*sizeof(u64));
+#ifdef WIN32
+    this->counts=buckets;
+#else
+    __atomic_store_n(&this->counts, buckets, __ATOMIC_RELEASE);
+#endif
+  }
+  STAT_ADD(buckets[bucket_index(usecs)], 1);
+  if(this->total==0 || usecs<this->min)
+    this->min=usecs;
+  if(this->total==0 || usecs>this->max)
+    this->max=usecs;
+  /* Jitter is the mean difference between consecutive samples (the D of
+   * RFC 3550, without the smoothing, so histograms can be merged). */
+  if(this->total>0){
+    this->jitter_sum+=(usecs>this->last) ? usecs-this->last : this->last-usecs;
+    this->jitter_count++;
+  }
+  this->last=usecs;
+  STAT_ADD(this->sum, usecs);
+  STAT_ADD(this->total, 1);
+} /* End of record() */
+
+
+/* Adds the samples of the supplied histogram to ours */
+int LatencyHistogram::merge(LatencyHistogram *h){
+  assert(h!=NULL);
+  if(h->total==0)
+    return OP_SUCCESS;
+  if(this->counts==NULL)
+    this->counts=(u64 *)safe_zalloc(HISTOGRAM_BUCKETS*sizeof(u64));
+  for(u32 i=0; i<HISTOGRAM_BUCKETS; i++)
+    this->counts[i]+=h->counts[i];
+  if(this->total==0 || h->min<this->min)
+    this->min=h->min;
+  if(this->total==0 || h->max>this->max)
+    this->max=h->max;
+  this->sum+=h->sum;
+  this->total+=h->total;
+  this->jitter_sum+=h->jitter_sum;
+  this->jitter_count+=h->jitter_count;
+  return OP_SUCCESS;
+} /* End of merge() */
+
+
+/* Returns the number of samples recorded */
+u64 LatencyHistogram::getCount(){
+  return this->total;
+} /* End of getCount() */
+
+
+/* Returns the smallest sample, or zero if there are none */
+u32 LatencyHistogram::getMin(){
+  return this->min;
+} /* End of getMin() */
+
+
+/* Returns the largest sample, or zero if there are none */
+u32 LatencyHistogram::getMax(){
+  return this->max;
+} /* End of getMax() */
+
+
+/* Returns the mean of the samples, or zero if there are none */
+double LatencyHistogram::getMean(){
+  if(this->total==0)
+    return 0;
+  return (double)this->sum/this->total;
+} /* End of getMean() */
+
+
+/* Returns the mean difference between consecutive samples */
+double LatencyHistogram::getJitter(){
+  if(this->jitter_count==0)
+    return 0;
+  return (double)this->jitter_sum/this->jitter_count;
+} /* End of getJitter() */
+
+
+/* Returns the value below which the supplied percentage of the samples
+ * fall. The result is the upper end of the bucket, so it is never below the
+ * real value and off by one bucket width at most. Returns zero if there
+ * are no samples. */
+u32 LatencyHistogram::getPercentile(double percentile){
+  u32 value=0;
+  if(this->total==0)
+    return 0;
+  value=LatencyHistogram::percentile(this->counts, this->total, percentile);
+  /* Don't report values we haven't seen */
+  if(value>this->max)
+    value=this->max;
+  if(value<this->min)
+    value=this->min;
+  return value;
+} /* End of getPercentile() */
+
+
+/* Computes a percentile from a bare array of HISTOGRAM_BUCKETS counters
+ * holding "count" samples in total, like the ones snapshot() returns. The
+ * result is the upper end of the bucket the percentile falls in. */
+u32 LatencyHistogram::percentile(const u64 *buckets, u64 count, double percentile){
+  u64 wanted=0, seen=0;
+  if(buckets==NULL || count==0)
+    return 0;
+  if(percentile<0)
+    percentile=0;
+  if(percentile>100)
+    percentile=100;
+  wanted=(u64)ceil((percentile/100.0)*count);
+  if(wanted==0)
+    wanted=1;
+  for(u32 i=0; i<HISTOGRAM_BUCKETS; i++){
+    seen+=buckets[i];
+    if(seen>=wanted)
+      return bucket_high(i);
+  }
+  return bucket_high(HISTOGRAM_BUCKETS-1);
+} /* End of percentile() */
+
+
+/* Adds the current bucket counters, number of samples and sum of samples to
+ * the supplied ones. This may be called from a thread other than the one
+ * that records samples: no lock is taken, each counter is read atomically,
+ * so the result is accurate up to the samples recorded while it runs. */
+void LatencyHistogram::snapshot(u64 *buckets, u64 *count, u64 *sum){
+  u64 *mycounts=NULL;
+  assert(buckets!=NULL && count!=NULL && sum!=NULL);
+#ifdef WIN32
+  mycounts=this->counts;
+#else
+  mycounts=__atomic_load_n(&this->counts, __ATOMIC_ACQUIRE);
+#endif
+  if(mycounts==NULL)
+    return;
+  for(u32 i=0; i<HISTOGRAM_BUCKETS; i++)
+    buckets[i]+=STAT_GET(mycounts[i]);
+  *count+=STAT_GET(this->total);
+  *sum+=STAT_GET(this->sum);
+} /* End of snapshot() */
+
+
+/* Exports the histogram. Returns the number of samples in the bucket with
+ * the supplied index (0 to HISTOGRAM_BUCKETS-1) and stores the range of
+ * values that fall in it in "low" and "high". */
+u64 LatencyHistogram::getBucket(u32 index, u32 *low, u32 *high){
+  assert(index<HISTOGRAM_BUCKETS);
+  if(low!=NULL)
+    *low=bucket_low(index);
+  if(high!=NULL)
+    *high=bucket_high(index);
+  return (this->counts==NULL) ? 0 : this->counts[index];
+} /* End of getBucket() */
+
+
 /*****************************************************************************/
 /* Implementation of NpingStats class.                                       */
 /*****************************************************************************/
@@ -230,15 +560,55 @@ void PacketStats::reset(){
   memset(&this->ip4, 0, sizeof(this->ip4));
   memset(&this->ip6, 0, sizeof(this->ip6));
   this->echo_clients_served=0;
-  this->max_rtt=-1;
-  this->min_rtt=-1;
-  this->avg_rtt=-1;
+  this->rtt.reset();
+  this->max_tx_lag=0;
   this->tx_timer.reset();
   this->rx_timer.reset();
   this->run_timer.reset();
 } /* End of reset() */
 
 
+/* Adds the counters of the supplied object to ours. This is used to gather
+ * the statistics that several threads have kept separately. Clocks are not
+ * touched. */
+int PacketStats::merge(PacketStats *st){
+  assert(st!=NULL);
+  for(size_t i=0; i<sizeof(this->packets)/sizeof(u64); i++){
+    this->packets[i]+=st->packets[i];
+    this->tcp[i]+=st->tcp[i];
+    this->udp[i]+=st->udp[i];
+    this->ip4[i]+=st->ip4[i];
+    this->ip6[i]+=st->ip6[i];
+  }
+  for(size_t i=0; i<sizeof(this->bytes)/sizeof(u64); i++)
+    this->bytes[i]+=st->bytes[i];
+  for(size_t i=0; i<sizeof(this->icmp4)/sizeof(u64); i++){
+    this->icmp4[i]+=st->icmp4[i];
+    this->icmp6[i]+=st->icmp6[i];
+    this->arp[i]+=st->arp[i];
+  }
+  this->echo_clients_served+=st->echo_clients_served;
+
+  this->rtt.merge(&st->rtt);
+  if(st->max_tx_lag>this->max_tx_lag)
+    this->max_tx_lag=st->max_tx_lag;
+  return OP_SUCCESS;
+} /* End of merge() */
+
+
+/* Adds our packet, byte and RTT totals to the supplied snapshot. Like
+ * LatencyHistogram::snapshot(), this can be called while another thread
+ * is updating the counters. The snapshot's time is not touched. */
+void PacketStats::snapshot(struct stats_snapshot *snap){
+  assert(snap!=NULL);
+  snap->pkts_sent+=STAT_GET(this->packets[INDEX_SENT]);
+  snap->bytes_sent+=STAT_GET(this->bytes[INDEX_SENT]);
+  snap->pkts_rcvd+=STAT_GET(this->packets[INDEX_RCVD]);
+  snap->bytes_rcvd+=STAT_GET(this->bytes[INDEX_RCVD]);
+  this->rtt.snapshot(snap->rtt, &snap->rtt_count, &snap->rtt_sum);
+} /* End of snapshot() */
+
+
 /* Takes a protocol and returns the appropriate stats array. */
 u64 *PacketStats::proto2stats(int proto){
   switch(proto){
@@ -281,39 +651,41 @@ u64 *PacketStats::proto2stats(int proto){
 
 /** Updates packet and byte count for sent/received/echoed packets. This
   * method is meant to be used internally. Use the update_sent(), update_rcvd()
-  * and update_echoed() instead. */
-int PacketStats::update_count(int index, int ip_version, int proto, u32 pkt_len){
+  * and update_echoed() instead. The "pkts" parameter lets callers account
+  * for several packets at once, in which case "pkt_len" is the total number
+  * of bytes. */
+int PacketStats::update_count(int index, int ip_version, int proto, u64 pkt_len, u32 pkts){
   assert(index>=INDEX_SENT && index<=INDEX_ACCEPTS);
 
   /* General packet and byte count */
-  this->packets[index]++;
-  this->bytes[index]+=pkt_len;
+  STAT_ADD(this->packets[index], pkts);
+  STAT_ADD(this->bytes[index], pkt_len);
 
   /* IP stats */
   switch(ip_version){
     case AF_INET:
-      this->ip4[index]++;
+      this->ip4[index]+=pkts;
     break;
     case AF_INET6:
-      this->ip6[index]++;
+      this->ip6[index]+=pkts;
     break;
   }
   /* Stats for protocols above IP */
   switch(proto){
     case HEADER_TYPE_ICMPv4:
-      this->icmp4[index]++;
+      this->icmp4[index]+=pkts;
     break;
     case HEADER_TYPE_ICMPv6:
-      this->icmp6[index]++;
+      this->icmp6[index]+=pkts;
     break;
     case HEADER_TYPE_TCP:
-      this->tcp[index]++;
+      this->tcp[index]+=pkts;
     break;
     case HEADER_TYPE_UDP:
-      this->udp[index]++;
+      this->udp[index]+=pkts;
     break;
     case HEADER_TYPE_ARP:
-      this->arp[index]++;
+      this->arp[index]+=pkts;
     break;
   }
 
@@ -353,6 +725,13 @@ int PacketStats::update_sent(int ip_version, int proto, u32 pkt_len){
 } /* End of update_sent() */
 
 
+/* Update the stats for a batch of transmitted packets. "bytes" is the total
+ * length of the "pkts" packets. */
+int PacketStats::update_sent(int ip_version, int proto, u32 pkts, u64 bytes){
+  return this->update_count(INDEX_SENT, ip_version, proto, bytes, pkts);
+} /* End of update_sent() */
+
+
 /* Update the stats for received packets */
 int PacketStats::update_rcvd(int ip_version, int proto, u32 pkt_len){
   return this->update_count(INDEX_RCVD, ip_version, proto, pkt_len);
@@ -448,22 +827,12 @@ u64 PacketStats::get_accepts(int proto){
 } /* End of get_accepts() */
 
 
-/* @warning Assumes that the counter for received packets has NOT been incremented yet. */
+/* Records a round trip time, in microseconds */
 int PacketStats::update_rtt(int rtt){
-  /* Update Max RTT */
-  if(rtt > this->max_rtt || this->max_rtt<0){
-    this->max_rtt=rtt;
-  }
-  /* Update Min RTT */
-  if(rtt < this->min_rtt || this->min_rtt<0){
-    this->min_rtt=rtt;
-  }
-  /* Update average RTT */
-  if(this->packets[INDEX_RCVD]==0 || this->avg_rtt<0){
-    this->avg_rtt = rtt;
-  }else{
-    this->avg_rtt = ((this->avg_rtt*(this->packets[INDEX_RCVD]))+rtt) / (this->packets[INDEX_RCVD]+1);
-  }
+  /* The clock may have gone backwards */
+  if(rtt<0)
+    rtt=0;
+  this->rtt.record((u32)rtt);
   return OP_SUCCESS;
 } /* End of update_rtt() */
 
@@ -685,43 +1054,88 @@ double PacketStats::get_rx_byte_rate(){
 } /* End of get_rx_byte_rate() */
 
 
-/* Returns max RTT observed for this host */
+/* Records that a packet was sent "usecs" microseconds after it was due */
+int PacketStats::update_tx_lag(long usecs){
+  if(usecs > this->max_tx_lag)
+    this->max_tx_lag=usecs;
+  return OP_SUCCESS;
+} /* End of update_tx_lag() */
+
+
+/* Returns the maximum amount of time (in microseconds) that the transmission
+ * of a packet was delayed with respect to its schedule. */
+long PacketStats::get_max_tx_lag(){
+  return this->max_tx_lag;
+} /* End of get_max_tx_lag() */
+
+
+/* Returns max RTT observed for this host, or -1 if there are no RTTs */
 int PacketStats::get_max_rtt(){
-  return this->max_rtt;
+  return (this->rtt.getCount()>0) ? (int)this->rtt.getMax() : -1;
 } /* End of get_max_rtt() */
 
 
-/* Returns min RTT observed for this host */
+/* Returns min RTT observed for this host, or -1 if there are no RTTs */
 int PacketStats::get_min_rtt(){
-  return this->min_rtt;
+  return (this->rtt.getCount()>0) ? (int)this->rtt.getMin() : -1;
 } /* End of get_min_rtt() */
 
 
-/* Returns the average RTT observed for this host */
+/* Returns the average RTT observed for this host, or -1 if there are no RTTs */
 int PacketStats::get_avg_rtt(){
-  return this->avg_rtt;
+  return (this->rtt.getCount()>0) ? (int)this->rtt.getMean() : -1;
 } /* End of get_avg_rtt() */
 
 
+/* Returns the RTT below which the supplied percentage of the RTTs fall, or
+ * -1 if there are no RTTs */
+int PacketStats::get_rtt_percentile(double percentile){
+  return (this->rtt.getCount()>0) ? (int)this->rtt.getPercentile(percentile) : -1;
+} /* End of get_rtt_percentile() */
+
+
+/* Returns the mean difference between consecutive RTTs, or -1 if there
+ * are less than two RTTs */
+int PacketStats::get_rtt_jitter(){
+  return (this->rtt.getCount()>1) ? (int)this->rtt.getJitter() : -1;
+} /* End of get_rtt_jitter() */
+
+
+/* Returns the histogram of RTTs, so it can be exported */
+LatencyHistogram *PacketStats::get_rtt_histogram(){
+  return &this->rtt;
+} /* End of get_rtt_histogram() */
+
+
 /* Print round trip times */
 int PacketStats::print_RTTs(const char *leading_str){
   if(leading_str==NULL)
     leading_str="";
   /* Maximum RTT observed */
-  if(max_rtt>=0)
+  if(this->get_max_rtt()>=0)
     nping_print(VB_0|NO_NEWLINE,"%sMax rtt: %.3lfms ", leading_str, this->get_max_rtt()/1000.0 );
   else
     nping_print(VB_0|NO_NEWLINE,"%sMax rtt: N/A ", leading_str);
   /* Minimum RTT observed */
-  if(min_rtt>=0)
+  if(this->get_min_rtt()>=0)
     nping_print(VB_0|NO_NEWLINE,"| Min rtt: %.3lfms ", this->get_min_rtt()/1000.0 );
   else
     nping_print(VB_0|NO_NEWLINE,"| Min rtt: N/A " );
   /* Average RTT */
-  if(avg_rtt>=0)
+  if(this->get_avg_rtt()>=0)
     nping_print(VB_0,"| Avg rtt: %.3lfms", this->get_avg_rtt()/1000.0 );
   else
     nping_print(VB_0,"| Avg rtt: N/A" );
+  /* RTT distribution */
+  if(this->rtt.getCount()>0){
+    nping_print(VB_1|NO_NEWLINE,"%sRtt percentiles: p50: %.3lfms | p90: %.3lfms | p99: %.3lfms | p99.9: %.3lfms ",
+                leading_str, this->get_rtt_percentile(50)/1000.0, this->get_rtt_percentile(90)/1000.0,
+                this->get_rtt_percentile(99)/1000.0, this->get_rtt_percentile(99.9)/1000.0);
+    if(this->get_rtt_jitter()>=0)
+      nping_print(VB_1,"| Jitter: %.3lfms", this->rtt.getJitter()/1000.0 );
+    else
+      nping_print(VB_1,"| Jitter: N/A" );
+  }
   return OP_SUCCESS;
 } /* End of print_RTTs() */
 
@@ -198,6 +198,118 @@ class NpingTimer {
 
 };
 
+/* Minimum amount of time (in microseconds) that the rate scheduler will
+ * sleep for. Nsock timers have millisecond resolution, so any shorter wait is
+ * skipped and the packets that are due are sent in a single burst. */
+#define SCHED_MIN_WAIT 1000
+
+/* The RateScheduler class computes when the next packet is due so a given
+ * transmission rate can be honoured with microsecond resolution. The schedule
+ * is absolute (packet N is due at start+N*period/pkts), so rounding errors
+ * and late wakeups never accumulate. The scheduler also keeps track of how
+ * much the timers overshoot so the next wait can be shortened accordingly. */
+class RateScheduler {
+
+  private:
+    u64 pkts;                /* Packets to send...                      */
+    u64 period;              /* ...in this many microseconds            */
+    u64 released;            /* Packets released so far                 */
+    long deviation;          /* Last timer overshoot, in microseconds   */
+    struct timeval start_tv; /* Time the schedule was started           */
+
+  public:
+    RateScheduler();
+    ~RateScheduler();
+    void reset();
+    int setRate(u64 pkts, u64 period_usecs);
+    int start(const struct timeval *now);
+    void update(u32 count);
+    long getWaitTime(const struct timeval *now);
+    long getLag(const struct timeval *now);
+    void adjust(long expected_usecs, long actual_usecs);
+
+  private:
+    void get_deadline(u64 pktno, struct timeval *deadline);
+
+};
+
+/* Counters are written by a single thread at a time, but the live stats
+ * reporter reads them from a thread of its own (see StatsReporter.h). Relaxed
+ * atomic loads and stores make those reads well defined without any locking,
+ * and compile to the same instructions as plain ones. */
+#ifdef WIN32
+#define STAT_ADD(var, n) ((var)+=(n))
+#define STAT_GET(var)    (var)
+#else
+#define STAT_ADD(var, n) __atomic_store_n(&(var), __atomic_load_n(&(var), __ATOMIC_RELAXED)+(n), __ATOMIC_RELAXED)
+#define STAT_GET(var)    __atomic_load_n(&(var), __ATOMIC_RELAXED)
+#endif
+
+/* Each power of two of the latency range is split in this many linear
+ * sub-buckets (as a power of two), which bounds the relative error of the
+ * reported percentiles to 1/2^(HISTOGRAM_SUB_BITS-1), about 3%. */
+#define HISTOGRAM_SUB_BITS  6
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+/* Values are 32-bit microsecond counts: enough for RTTs of over an hour. */
+#define HISTOGRAM_BUCKETS   (HISTOGRAM_SUB_COUNT + (32 - HISTOGRAM_SUB_BITS) * (HISTOGRAM_SUB_COUNT / 2))
+
+/* The LatencyHistogram class records latency samples (in microseconds) in
+ * a fixed set of logarithmic buckets, as HdrHistogram does: values below
+ * HISTOGRAM_SUB_COUNT get a bucket of their own and every power of two
+ * above that is split in HISTOGRAM_SUB_COUNT/2 buckets. Recording a sample
+ * is O(1) and memory does not grow with the number of samples, so
+ * percentiles can be computed for runs of any length. Histograms can be
+ * merged. The bucket array is only allocated when the first sample is
+ * recorded, so hosts that never answer cost nothing. */
+class LatencyHistogram {
+
+  private:
+    u64 *counts;       /* HISTOGRAM_BUCKETS counters, or NULL        */
+    u64 total;         /* Number of samples                          */
+    u64 sum;           /* Sum of all samples, for the mean           */
+    u32 min;           /* Smallest sample                            */
+    u32 max;           /* Largest sample                             */
+    u32 last;          /* Previous sample, for the jitter            */
+    u64 jitter_sum;    /* Sum of differences between samples...      */
+    u64 jitter_count;  /* ...and number of differences               */
+
+    LatencyHistogram(const LatencyHistogram &);
+    LatencyHistogram &operator=(const LatencyHistogram &);
+
+  public:
+    LatencyHistogram();
+    ~LatencyHistogram();
+    void reset();
+    void record(u32 usecs);
+    int merge(LatencyHistogram *h);
+    u64 getCount();
+    u32 getMin();
+    u32 getMax();
+    double getMean();
+    double getJitter();
+    u32 getPercentile(double percentile);
+    u64 getBucket(u32 index, u32 *low, u32 *high);
+    void snapshot(u64 *buckets, u64 *count, u64 *sum);
+
+    static u32 percentile(const u64 *buckets, u64 count, double percentile);
+    static u32 bucket_index(u32 usecs);
+    static u32 bucket_low(u32 index);
+    static u32 bucket_high(u32 index);
+};
+
+/* Totals read by PacketStats::snapshot(). Snapshots taken at different
+ * times can be subtracted to get the activity in between. */
+struct stats_snapshot {
+  struct timeval time;          /* When it was taken                  */
+  u64 pkts_sent;
+  u64 bytes_sent;
+  u64 pkts_rcvd;
+  u64 bytes_rcvd;
+  u64 rtt_count;                /* Number of RTT samples...           */
+  u64 rtt_sum;                  /* ...their sum...                    */
+  u64 rtt[HISTOGRAM_BUCKETS];   /* ...and their LatencyHistogram      */
+};
+
 /* Stat identifiers for getters */
 #define STATS_TCP                (HEADER_TYPE_TCP)
 #define STATS_UDP                (HEADER_TYPE_UDP)
@@ -237,16 +349,15 @@ class PacketStats {
     u64 ip6[8];        /* IPv6 packets sent/received/echoed/captured/read()s/write()s/connect()s/accept()s */
 
     u64 echo_clients_served;
-    int max_rtt;
-    int min_rtt;
-    int avg_rtt;
+    LatencyHistogram rtt; /* Round trip times, in microseconds */
+    long max_tx_lag;      /* Max time we fell behind schedule (usecs) */
 
     NpingTimer tx_timer;  /* Timer for packet transmission.         */
     NpingTimer rx_timer;  /* Timer for packet reception.            */
     NpingTimer run_timer; /* Timer to measure Nping execution time. */
 
     u64 *proto2stats(int proto);
-    int update_count(int index, int ip_version, int proto, u32 pkt_len);
+    int update_count(int index, int ip_version, int proto, u64 pkt_len, u32 pkts=1);
     u64 get_stat(int proto, int index);
     u64 get_difference(int proto, int index_expected, int index_actual);
     double get_percentage(int proto, int index_expected, int index_actual);
@@ -255,9 +366,12 @@ class PacketStats {
     PacketStats();
     ~PacketStats();
     void reset();
+    int merge(PacketStats *st);
+    void snapshot(struct stats_snapshot *snap);
 
     /* Raw packets sent and received */
     int update_sent(int ip_version, int proto, u32 pkt_len);
+    int update_sent(int ip_version, int proto, u32 pkts, u64 bytes);
     int update_rcvd(int ip_version, int proto, u32 pkt_len);
     u64 get_sent(int proto);
     u64 get_rcvd(int proto);
@@ -296,6 +410,13 @@ class PacketStats {
     int get_max_rtt();
     int get_min_rtt();
     int get_avg_rtt();
+    int get_rtt_percentile(double percentile);
+    int get_rtt_jitter();
+    LatencyHistogram *get_rtt_histogram();
+
+    /* How far behind the transmission schedule we got */
+    int update_tx_lag(long usecs);
+    long get_max_tx_lag();
 
     /* Tx and Rx clocks */
     int start_clocks();
@@ -0,0 +1,119 @@
+/* Tests for the matching of captured packets against the probes stored in a
+ * FlowTable. Run it with "make check". */
+
+#include "nping.h"
+#include "NpingOps.h"
+#include "EchoClient.h"
+#include "EchoServer.h"
+#include "ProbeEngine.h"
+#include "FlowTable.h"
+#include "TargetHost.h"
+
+/* Globals that are normally defined in nping.cc */
+NpingOps o;
+EchoClient ec;
+EchoServer es;
+ProbeEngine prob;
+
+static long test_count = 0;
+static long success_count = 0;
+
+/* Returns a UDP datagram from "src" to "dst" with the supplied ports. */
+static IPv4Header *udp_packet(const char *src, const char *dst, u16 sport, u16 dport){
+  IPv4Header *ip=new IPv4Header();
+  UDPHeader *udp=new UDPHeader();
+  struct in_addr addr;
+
+  inet_pton(AF_INET, src, &addr);
+  ip->setSourceAddress(addr);
+  inet_pton(AF_INET, dst, &addr);
+  ip->setDestinationAddress(addr);
+  ip->setTTL(64);
+  ip->setNextProto("UDP");
+  udp->setSourcePort(sport);
+  udp->setDestinationPort(dport);
+  udp->setTotalLength();
+  ip->setNextElement(udp);
+  ip->setTotalLength();
+  ip->setSum();
+  return ip;
+}
+
+/* Returns an ICMP port unreachable sent by "from" to "to", quoting "pkt". */
+static IPv4Header *icmp_error(const char *from, const char *to, PacketElement *pkt){
+  IPv4Header *ip=new IPv4Header();
+  ICMPv4Header *icmp=new ICMPv4Header();
+  RawData *quote=new RawData();
+  u8 buff[256];
+  struct in_addr addr;
+  int len=pkt->dumpToBinaryBuffer(buff, sizeof(buff));
+
+  inet_pton(AF_INET, from, &addr);
+  ip->setSourceAddress(addr);
+  inet_pton(AF_INET, to, &addr);
+  ip->setDestinationAddress(addr);
+  ip->setTTL(64);
+  ip->setNextProto("ICMP");
+  icmp->setType(ICMP_UNREACH);
+  icmp->setCode(ICMP_UNREACH_PORT);
+  quote->store(buff, len);
+  icmp->setNextElement(quote);
+  icmp->setSum();
+  ip->setNextElement(icmp);
+  ip->setTotalLength();
+  ip->setSum();
+  return ip;
+}
+
+/* Stores "probe" in a fresh table and checks whether "rcvd" matches it. */
+static void test_match(const char *name, bool multicast, PacketElement *probe, PacketElement *rcvd, bool expected){
+  FlowTable table;
+  TargetHost host;
+  struct flow_probe p;
+  packet_view_t view;
+  u8 buff[512];
+  int len=rcvd->dumpToBinaryBuffer(buff, sizeof(buff));
+  bool matched=false;
+
+  o.doMulticast(multicast);
+  memset(&p, 0, sizeof(p));
+  p.pkt=probe;
+  p.host=&host;
+  table.insert(&p);
+  if(PacketParser::parse_view(buff, len, false, &view)==OP_SUCCESS){
+    matched=(table.lookup(&view)==&p);
+    PacketParser::free_view(&view);
+  }
+  table.remove(&p);
+
+  test_count++;
+  if(matched==expected){
+    success_count++;
+  }else{
+    printf("FAIL %s: expected %s, got %s\n", name,
+           expected ? "a match" : "no match", matched ? "a match" : "no match");
+  }
+  PacketParser::freePacketChain(rcvd);
+}
+
+int main(int argc, char *argv[]){
+  PacketElement *probe=NULL;
+
+  probe=udp_packet("192.0.2.1", "198.51.100.7", 40000, 53);
+  test_match("unicast reply", false, probe, udp_packet("198.51.100.7", "192.0.2.1", 53, 40000), true);
+  test_match("reply from another host", false, probe, udp_packet("198.51.100.8", "192.0.2.1", 53, 40000), false);
+  test_match("reply with other ports", false, probe, udp_packet("198.51.100.7", "192.0.2.1", 53, 40001), false);
+  test_match("ICMP error from the target", false, probe, icmp_error("198.51.100.7", "192.0.2.1", probe), true);
+  test_match("ICMP error from a router", false, probe, icmp_error("203.0.113.1", "192.0.2.1", probe), true);
+  PacketParser::freePacketChain(probe);
+
+  probe=udp_packet("192.0.2.1", "224.0.0.251", 40000, 5353);
+  test_match("multicast reply", true, probe, udp_packet("192.0.2.20", "192.0.2.1", 5353, 40000), true);
+  test_match("multicast reply to another host", true, probe, udp_packet("192.0.2.20", "192.0.2.2", 5353, 40000), false);
+  test_match("multicast ICMP error", true, probe, icmp_error("192.0.2.20", "192.0.2.1", probe), true);
+  PacketParser::freePacketChain(probe);
+
+  printf("%ld / %ld tests passed.\n", success_count, test_count);
+
+  return success_count == test_count ? 0 : 1;
+}
@@ -0,0 +1,169 @@
+/* Tests for the BPF programs generated by BPFGenerator, run against crafted
+ * Ethernet frames. Run it with "make check". */
+
+#include "nping.h"
+#include "NpingOps.h"
+#include "EchoClient.h"
+#include "EchoServer.h"
+#include "ProbeEngine.h"
+#include "BPFGenerator.h"
+
+/* Globals that are normally defined in nping.cc */
+NpingOps o;
+EchoClient ec;
+EchoServer es;
+ProbeEngine prob;
+
+static long test_count = 0;
+static long success_count = 0;
+
+/* Returns "next" inside an IPv4 datagram from "src" to "dst". */
+static IPv4Header *ipv4_packet(const char *src, const char *dst, const char *proto, PacketElement *next){
+  IPv4Header *ip=new IPv4Header();
+  struct in_addr addr;
+
+  inet_pton(AF_INET, src, &addr);
+  ip->setSourceAddress(addr);
+  inet_pton(AF_INET, dst, &addr);
+  ip->setDestinationAddress(addr);
+  ip->setTTL(64);
+  ip->setNextProto(proto);
+  ip->setNextElement(next);
+  ip->setTotalLength();
+  ip->setSum();
+  return ip;
+}
+
+/* Returns "next" inside an IPv6 datagram from "src" to "dst". */
+static IPv6Header *ipv6_packet(const char *src, const char *dst, const char *proto, PacketElement *next){
+  IPv6Header *ip=new IPv6Header();
+  struct in6_addr addr;
+
+  inet_pton(AF_INET6, src, &addr);
+  ip->setSourceAddress(addr);
+  inet_pton(AF_INET6, dst, &addr);
+  ip->setDestinationAddress(addr);
+  ip->setHopLimit(64);
+  ip->setNextHeader(proto);
+  ip->setNextElement(next);
+  ip->setPayloadLength();
+  return ip;
+}
+
+static UDPHeader *udp_header(u16 sport, u16 dport){
+  UDPHeader *udp=new UDPHeader();
+  udp->setSourcePort(sport);
+  udp->setDestinationPort(dport);
+  udp->setTotalLength();
+  return udp;
+}
+
+/* Returns an ICMP port unreachable quoting "quote". */
+static ICMPv4Header *icmp_error(PacketElement *quote){
+  ICMPv4Header *icmp=new ICMPv4Header();
+  RawData *raw=new RawData();
+  u8 buff[256];
+  int len=quote->dumpToBinaryBuffer(buff, sizeof(buff));
+
+  icmp->setType(ICMP_UNREACH);
+  icmp->setCode(ICMP_UNREACH_PORT);
+  raw->store(buff, len);
+  icmp->setNextElement(raw);
+  icmp->setSum();
+  PacketParser::freePacketChain(quote);
+  return icmp;
+}
+
+/* Returns an ICMPv6 port unreachable quoting "quote". */
+static ICMPv6Header *icmp6_error(PacketElement *quote){
+  ICMPv6Header *icmp=new ICMPv6Header();
+  RawData *raw=new RawData();
+  u8 buff[256];
+  int len=quote->dumpToBinaryBuffer(buff, sizeof(buff));
+
+  icmp->setType(ICMPv6_UNREACH);
+  icmp->setCode(ICMPv6_UNREACH_PORT_UNREACH);
+  raw->store(buff, len);
+  icmp->setNextElement(raw);
+  PacketParser::freePacketChain(quote);
+  return icmp;
+}
+
+/* Runs the program on "pkt", wrapped in an Ethernet frame. */
+static void test_filter(const char *name, struct bpf_program *fp, PacketElement *pkt, bool expected){
+  EthernetHeader *eth=new EthernetHeader();
+  u8 mac[6]={0x00, 0x11, 0x22, 0x33, 0x44, 0x55};
+  u8 buff[512];
+  int len=0;
+  bool accepted=false;
+
+  eth->setSrcMAC(mac);
+  eth->setDstMAC(mac);
+  eth->setEtherType(pkt->protocol_id()==HEADER_TYPE_IPv6 ? ETHTYPE_IPV6 : ETHTYPE_IPV4);
+  eth->setNextElement(pkt);
+  len=eth->dumpToBinaryBuffer(buff, sizeof(buff));
+  accepted=(bpf_filter(fp->bf_insns, buff, len, len)!=0);
+
+  test_count++;
+  if(accepted==expected){
+    success_count++;
+  }else{
+    printf("FAIL %s: expected %s, got %s\n", name,
+           expected ? "accept" : "reject", accepted ? "accept" : "reject");
+  }
+  PacketParser::freePacketChain(eth);
+}
+
+int main(int argc, char *argv[]){
+  BPFGenerator gen;
+  struct bpf_program fp;
+  IPAddress target, source;
+  u16 tport=53, sport=40000;
+
+  target.setAddress("198.51.100.7");
+  source.setAddress("192.0.2.1");
+  gen.addTarget(&target, &source);
+  target.setAddress("2001:db8::7");
+  source.setAddress("2001:db8:1::1");
+  gen.addTarget(&target, &source);
+  gen.setProtocol(IPPROTO_UDP);
+  gen.addTargetPorts(&tport, 1);
+  gen.addSourcePorts(&sport, 1);
+  if(gen.compile(DLT_EN10MB, &fp)!=OP_SUCCESS){
+    printf("FAIL no BPF program generated\n");
+    return 1;
+  }
+
+  test_filter("IPv4 reply", &fp,
+    ipv4_packet("198.51.100.7", "192.0.2.1", "UDP", udp_header(53, 40000)), true);
+  test_filter("IPv4 reply from another host", &fp,
+    ipv4_packet("198.51.100.8", "192.0.2.1", "UDP", udp_header(53, 40000)), false);
+  test_filter("IPv4 reply to another host", &fp,
+    ipv4_packet("198.51.100.7", "192.0.2.2", "UDP", udp_header(53, 40000)), false);
+  test_filter("IPv4 reply with other ports", &fp,
+    ipv4_packet("198.51.100.7", "192.0.2.1", "UDP", udp_header(54, 40000)), false);
+  test_filter("ICMP error from the target", &fp,
+    ipv4_packet("198.51.100.7", "192.0.2.1", "ICMP",
+      icmp_error(ipv4_packet("192.0.2.1", "198.51.100.7", "UDP", udp_header(40000, 53)))), true);
+  test_filter("ICMP error from a router", &fp,
+    ipv4_packet("203.0.113.1", "192.0.2.1", "ICMP",
+      icmp_error(ipv4_packet("192.0.2.1", "198.51.100.7", "UDP", udp_header(40000, 53)))), true);
+  test_filter("ICMP error to another host", &fp,
+    ipv4_packet("203.0.113.1", "192.0.2.2", "ICMP",
+      icmp_error(ipv4_packet("192.0.2.2", "198.51.100.7", "UDP", udp_header(40000, 53)))), false);
+
+  test_filter("IPv6 reply", &fp,
+    ipv6_packet("2001:db8::7", "2001:db8:1::1", "UDP", udp_header(53, 40000)), true);
+  test_filter("IPv6 reply from another host", &fp,
+    ipv6_packet("2001:db8::8", "2001:db8:1::1", "UDP", udp_header(53, 40000)), false);
+  test_filter("ICMPv6 error from a router", &fp,
+    ipv6_packet("2001:db8:ff::1", "2001:db8:1::1", "ICMPv6",
+      icmp6_error(ipv6_packet("2001:db8:1::1", "2001:db8::7", "UDP", udp_header(40000, 53)))), true);
+  test_filter("ICMPv6 error to another host", &fp,
+    ipv6_packet("2001:db8:ff::1", "2001:db8:1::2", "ICMPv6",
+      icmp6_error(ipv6_packet("2001:db8:1::2", "2001:db8::7", "UDP", udp_header(40000, 53)))), false);
+
+  printf("%ld / %ld tests passed.\n", success_count, test_count);
+
+  return success_count == test_count ? 0 : 1;
+}
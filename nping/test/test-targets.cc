@@ -0,0 +1,56 @@
+/* Tests for the processing of big target lists in windows. Run it with
+ * "make check". */
+
+#include "nping.h"
+#include "NpingOps.h"
+#include "EchoClient.h"
+#include "EchoServer.h"
+#include "ProbeEngine.h"
+#include "TargetHost.h"
+
+/* Globals that are normally defined in nping.cc */
+NpingOps o;
+EchoClient ec;
+EchoServer es;
+ProbeEngine prob;
+
+static long test_count = 0;
+static long success_count = 0;
+
+static void test_equal(const char *name, u32 got, u32 expected){
+  test_count++;
+  if(got==expected){
+    success_count++;
+  }else{
+    printf("FAIL %s: expected %u, got %u\n", name, expected, got);
+  }
+}
+
+int main(int argc, char *argv[]){
+  const char *addr=NULL;
+
+  /* In ARP mode, IPv4 targets are only loaded once their MAC address has
+   * been resolved, which never happens on the loopback interface, so the
+   * whole first window is skipped. The only host that can be reached is the
+   * IPv6 one, in the second window. */
+  o.setVerbosity(-2);
+  o.addMode(DO_ARP);
+  o.addTargetSpec("127.0.1.0/20");
+  o.addTargetSpec("::1");
+  o.setupTargetHosts();
+
+  test_equal("hosts in the first window", o.target_hosts.size(), 1);
+  addr=(o.target_hosts.size()>0) ? o.target_hosts[0]->getTargetAddress()->toString() : "";
+  test_count++;
+  if(strcmp(addr, "::1")==0)
+    success_count++;
+  else
+    printf("FAIL host of the first window: expected ::1, got %s\n", addr);
+  test_equal("targets loaded", o.totalTargetHosts(), 1);
+  test_equal("hosts in the next window", o.nextTargetHosts(), 0);
+  test_equal("hosts kept when the list is exhausted", o.target_hosts.size(), 1);
+
+  printf("%ld / %ld tests passed.\n", success_count, test_count);
+
+  return success_count == test_count ? 0 : 1;
+}
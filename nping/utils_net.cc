@@ -124,6 +124,7 @@
 #include "utils.h"
 #include "utils_net.h"
 #include "NpingOps.h"
+#include "NeighborResolver.h"
 #include "global_structures.h"
 #include "output.h"
 #include "nbase.h"
@@ -1747,24 +1748,21 @@ route6_t *route_dst_ipv6_linux(const struct sockaddr_storage *const dst){
 
 
 
-/* Turns the supplied target specification into an array of IPAddress objects.
- * Addresses generated from the spec will be added to the supplied addrlist
- * vector using the push_back() operation. Note that it is OK to pass
- * and address vector that already contains some elements. New elements will
- * be appended.
+/* Parses the supplied target specification and stores it in "ts". Address
+ * ranges and networks are not expanded: the spec just records their bounds
+ * and the addresses are computed one by one by target_spec_address(), so
+ * the cost of a spec does not depend on the number of addresses it covers.
  *
  * Returns NULL on success and a printable error message string in case of
  * failure. */
-const char *spec_to_addresses(const char *target_expr, int af, vector<IPAddress *> &addrlist, u8 max_netmask) {
+const char *parse_target_spec(const char *target_expr, int af, struct target_spec *ts, u8 max_netmask) {
   int start=0, end=0;
   char *r=NULL, *s=NULL, *target_net=NULL;
   char *addy[5]={NULL, NULL, NULL, NULL, NULL};
   char hostexp[512];
   IPAddress *base_address=NULL;
-  IPAddress *range_address=NULL;
   u32 netmask=0;
   struct in_addr startaddr;
-  struct in_addr currentaddr;
   struct in_addr endaddr;
   bool netmask_spec=false;
   bool range_spec=false;
@@ -1774,7 +1772,6 @@ const char *spec_to_addresses(const char *target_expr, int af, vector<IPAddress
   bool has_comma=false;
   u8 addresses[4][256];
   u16 total_octets[4];
-  u8 address[4];
 
   /* Safe initializations */
   strncpy(hostexp, target_expr, 512);
@@ -1782,8 +1779,11 @@ const char *spec_to_addresses(const char *target_expr, int af, vector<IPAddress
   memset(addresses[1], 0, 256);
   memset(addresses[2], 0, 256);
   memset(addresses[3], 0, 256);
-  memset(address, 0, 4);
   memset(total_octets, 0, 4);
+  ts->type=TSPEC_ADDRESS;
+  ts->addr=NULL;
+  ts->first=0;
+  ts->count=0;
 
   if (af == AF_INET) {
 
@@ -1862,8 +1862,9 @@ const char *spec_to_addresses(const char *target_expr, int af, vector<IPAddress
         delete base_address;
         return "Failed to resolve the supplied hostname.";
       }else if(netmask==32){
-        /* We got the host's address! Now we insert it into the address list */
-        addrlist.push_back(base_address);
+        /* We got the host's address! Now we store it in the spec */
+        ts->addr=base_address;
+        ts->count=1;
         return NULL;
       }
     /* If what we have is a range, we need to convert it into a list of addresses */
@@ -1926,38 +1927,18 @@ const char *spec_to_addresses(const char *target_expr, int af, vector<IPAddress
       if(total_addresses > pow((double)2, 32-max_netmask) )
         return "The supplied range contains too many addresses.";
 
-      /* Now form all possible combinations and turn them into an array of
-       * IP addresses. */
-      for(int octet1=0; octet1<256; octet1++){
-        if(addresses[0][octet1]==0)
-          continue;
-        for(int octet2=0; octet2<256; octet2++){
-          if(addresses[1][octet2]==0)
-            continue;
-          for(int octet3=0; octet3<256; octet3++){
-            if(addresses[2][octet3]==0)
-              continue;
-            for(int octet4=0; octet4<256; octet4++){
-              if(addresses[3][octet4]==0)
-                continue;
-
-              /* If we get here it means that the value of octet1, octet2,
-               * octet3 and octet4 form an actual address that belongs to
-               * the specified range. So here we just pack those octets into
-               * a proper IP address that we can insert to the IP address
-               * vector */
-              address[0]=(u8)octet1;
-              address[1]=(u8)octet2;
-              address[2]=(u8)octet3;
-              address[3]=(u8)octet4;
-              currentaddr.s_addr= *((u32 *)address); /* In big endian already */
-              range_address=new IPAddress();
-              range_address->setAddress(currentaddr);
-              addrlist.push_back(range_address);
-              //printf("[$] %d.%d.%d.%d\n", octet1, octet2, octet3, octet4);
-            }
-          }
+      /* Now store the values that each octet may take, in ascending order.
+       * Addresses are all the combinations of those, with the first octet
+       * varying the slowest. */
+      ts->type=TSPEC_OCTETS;
+      ts->count=1;
+      for(i=0; i<4; i++){
+        ts->noctets[i]=0;
+        for(int k=0; k<256; k++){
+          if(addresses[i][k])
+            ts->octets[i][ts->noctets[i]++]=(u8)k;
         }
+        ts->count*=ts->noctets[i];
       }
       return NULL;
 
@@ -1969,17 +1950,17 @@ const char *spec_to_addresses(const char *target_expr, int af, vector<IPAddress
         base_address=new IPAddress();
         base_address->setAddress(startaddr);
         if(netmask==32){
-          addrlist.push_back(base_address);
+          ts->addr=base_address;
+          ts->count=1;
           return NULL;
         }
       }
     }
 
     /* If we get here it means that we have the base address but we need to
-     * expand it because we got a netmask spec from the caller. At this
-     * point, no address has been inserted in the address list but base_address
-     * contains the right address needed to compute the whole range. First
-     * thing we do is determine the first and last address of the range.*/
+     * turn it into a network because we got a netmask spec from the caller.
+     * base_address contains the right address needed to compute the whole
+     * range, so determine the first and last address of the range.*/
     if(netmask!=0){
       startaddr=base_address->getIPv4Address();
       unsigned long longtmp = ntohl(startaddr.s_addr);
@@ -1991,16 +1972,11 @@ const char *spec_to_addresses(const char *target_expr, int af, vector<IPAddress
       startaddr.s_addr = 0;
       endaddr.s_addr = 0xffffffff;
     }
-    /* Do the actual expansion. We instantiate a new IPAddress object for
-     * every address in the range. */
-    for( currentaddr.s_addr=startaddr.s_addr;
-         ntohl(currentaddr.s_addr) <= ntohl(endaddr.s_addr);
-         currentaddr.s_addr = htonl( ntohl(currentaddr.s_addr)+1 )
-        ){
-          range_address=new IPAddress();
-          range_address->setAddress(currentaddr);
-          addrlist.push_back(range_address);
-    }
+    delete base_address;
+    ts->type=TSPEC_NETWORK;
+    ts->first=ntohl(startaddr.s_addr);
+    ts->count=(u64)ntohl(endaddr.s_addr) - ts->first + 1;
+    return NULL;
 
   /* IPv6 */
   }else if(af==AF_INET6) {
@@ -2010,18 +1986,19 @@ const char *spec_to_addresses(const char *target_expr, int af, vector<IPAddress
       delete base_address;
       return "Failed to resolve the supplied IPv6 address.";
     }else{
-      /* We got the host's IPv6 address! Now we insert it into the address list */
-      addrlist.push_back(base_address);
+      /* We got the host's IPv6 address! Now we store it in the spec */
+      ts->addr=base_address;
+      ts->count=1;
       return NULL;
     }
   /* No address family specified. */
   }else if(af==AF_UNSPEC){
     /* If the address is an IPv4 address in dot-decimal notations, treat it as such. */
     if(IPAddress::isIPv4Address(hostexp)){
-      return spec_to_addresses(target_expr, AF_INET, addrlist, 32);
+      return parse_target_spec(target_expr, AF_INET, ts, 32);
     /* Maybe it's an IPv6 address like 2600:1337::1 */
     }else if(IPAddress::isIPv6Address(hostexp)){
-      return spec_to_addresses(target_expr, AF_INET6, addrlist, 128);
+      return parse_target_spec(target_expr, AF_INET6, ts, 128);
     /* It looks like we have a hostname. In this case, we'll let the OS decide
      * which IP version to use. */
     }else{
@@ -2030,7 +2007,8 @@ const char *spec_to_addresses(const char *target_expr, int af, vector<IPAddress
       if(IPAddress::resolve(hostexp, &ss, &sslen, AF_UNSPEC)==OP_SUCCESS){
         base_address=new IPAddress();
         base_address->setAddress(ss);
-        addrlist.push_back(base_address);
+        ts->addr=base_address;
+        ts->count=1;
         return NULL;
       }else{
         return "Failed to resolve supplied AF_UNSPEC IP address.";
@@ -2038,7 +2016,45 @@ const char *spec_to_addresses(const char *target_expr, int af, vector<IPAddress
     }
   }
   return NULL;
-} /* End of spec_to_addresses() */
+} /* End of parse_target_spec() */
+
+
+/* Stores in "addr" the address number "index" (starting from zero) of the
+ * supplied target spec, which must have been filled by parse_target_spec().
+ * Addresses are numbered in the same order in which the spec lists them.
+ * Returns OP_SUCCESS on success and OP_FAILURE if the spec does not have
+ * that many addresses. */
+int target_spec_address(const struct target_spec *ts, u64 index, IPAddress *addr){
+  struct in_addr inaddr;
+  u8 address[4];
+
+  if(ts==NULL || addr==NULL || index>=ts->count)
+    return OP_FAILURE;
+  switch(ts->type){
+    case TSPEC_ADDRESS:
+      *addr=*ts->addr;
+    break;
+
+    case TSPEC_NETWORK:
+      inaddr.s_addr=htonl(ts->first+(u32)index);
+      addr->setAddress(inaddr);
+    break;
+
+    case TSPEC_OCTETS:
+      /* The index is a number whose digits select the value of each octet */
+      for(int i=3; i>=0; i--){
+        address[i]=ts->octets[i][index % ts->noctets[i]];
+        index/=ts->noctets[i];
+      }
+      memcpy(&inaddr.s_addr, address, 4); /* In big endian already */
+      addr->setAddress(inaddr);
+    break;
+
+    default:
+      return OP_FAILURE;
+  }
+  return OP_SUCCESS;
+} /* End of target_spec_address() */
 
 
 
@@ -2193,51 +2209,16 @@ const char *getpts_aux(const char *origexpr, int nested, u8 *porttbl) {
  * @return OP_SUCCESS if a MAC address for tgt_addr was found.
  * @return OP_FAILURE if the resolution was not successful. */
 int mac_resolve(IPAddress *tgt_addr, IPAddress *src_addr, NetworkInterface *iface, MACAddress *result){
-  struct sockaddr_storage tgt_ss, src_ss;
-  arp_t *a=NULL;
-  struct arp_entry ae;
-  u8 auxmac[6]={0,0,0,0,0,0};
+  NeighborResolver resolver;
   assert(tgt_addr!=NULL && src_addr!=NULL && iface!=NULL && result!=NULL);
-  tgt_addr->getAddress(&tgt_ss);
-  src_addr->getAddress(&src_ss);
 
   /* First of all, let's see if we already have an entry in libnetutil's MAC cache. */
-  if(mac_cache_get(&tgt_ss, auxmac)) {
-    result->setAddress_bin(auxmac);
+  if(resolver.get(tgt_addr, result)==OP_SUCCESS)
     return OP_SUCCESS;
-  }
-
-  /* Let's see if the address is in the system's cache (only for IPv4). */
-  if(tgt_addr->getVersion()==AF_INET){
-    a=arp_open();
-    addr_ston((sockaddr *)&tgt_ss, &ae.arp_pa);
-    if(arp_get(a, &ae)==0){
-      mac_cache_set(&tgt_ss, ae.arp_ha.addr_eth.data);
-      result->setAddress_bin(ae.arp_ha.addr_eth.data);
-      arp_close(a);
-      return OP_SUCCESS;
-    }
-    arp_close(a);
-  }else{
-    // TODO: Find a way to check the system's Neighbor Discovery cache.
-  }
-
-  /* It looks like we have to use ARP or ND to resolve the address. */
-  if(tgt_addr->getVersion()==AF_INET){
-    if(doArp(iface->getName(), iface->getAddress().getAddress_bin(),
-              &src_ss, &tgt_ss, auxmac, NULL)) {
-      mac_cache_set(&tgt_ss, auxmac);
-      result->setAddress_bin(auxmac);
-      return OP_SUCCESS;
-    }
-  }else if(tgt_addr->getVersion()==AF_INET6){
-    if (doND(iface->getName(), iface->getAddress().getAddress_bin(),
-              &src_ss, &tgt_ss, auxmac, NULL)) {
-      mac_cache_set(&tgt_ss, auxmac);
-      result->setAddress_bin(auxmac);
-      return OP_SUCCESS;
-    }
-  }
 
-  return OP_FAILURE;
+  /* Otherwise, check the system's neighbor table and, if it's not there,
+   * use ARP or ND to resolve the address. */
+  resolver.add(tgt_addr, src_addr, iface);
+  resolver.resolve();
+  return resolver.get(tgt_addr, result);
 } /* End of mac_resolve() */
@@ -208,7 +208,23 @@ typedef struct sys_route6 {
 int getroutes_inet6_linux(route6_t *rtbuf, int max_routes);
 route6_t *route_dst_ipv6_linux(const struct sockaddr_storage *const dst);
 
-const char *spec_to_addresses(const char *target_expr, int af, vector<IPAddress *> &addrlist, u8 max_netmask);
+/* Types of target specs */
+#define TSPEC_ADDRESS 0  /* A single address or hostname (e.g. 10.0.0.1)   */
+#define TSPEC_NETWORK 1  /* A block of IPv4 addresses (e.g. 10.0.0.0/8)     */
+#define TSPEC_OCTETS  2  /* An IPv4 octet range (e.g. 10.0-3.*.1,7)         */
+
+/* A parsed target specification (see parse_target_spec()) */
+struct target_spec{
+  int type;            /* TSPEC_ADDRESS, TSPEC_NETWORK or TSPEC_OCTETS     */
+  IPAddress *addr;     /* TSPEC_ADDRESS: the address                       */
+  u32 first;           /* TSPEC_NETWORK: first address, host byte order    */
+  u8 octets[4][256];   /* TSPEC_OCTETS: values each octet may take         */
+  u16 noctets[4];      /* TSPEC_OCTETS: number of values for each octet    */
+  u64 count;           /* Number of addresses covered by the spec          */
+};
+
+const char *parse_target_spec(const char *target_expr, int af, struct target_spec *ts, u8 max_netmask);
+int target_spec_address(const struct target_spec *ts, u64 index, IPAddress *addr);
 const char *spec_to_ports(const char *origexpr, u16 **list, int *count);
 const char *getpts_aux(const char *origexpr, int nested, u8 *porttbl);
 int mac_resolve(IPAddress *tgt_addr, IPAddress *src_addr, NetworkInterface *iface, MACAddress *result);
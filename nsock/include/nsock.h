@@ -245,12 +245,16 @@ nsock_ssl_ctx nsp_ssl_init_max_speed(nsock_pool ms_pool);
  * The engine parameter is a zero-terminated string that will be
  * strup()'ed by the library. No validity check is performed by this function,
  * beware nsp_new() will fatal() if an invalid/unavailable engine name was
- * supplied before.
+ * supplied before. If the engine is built in but can't be initialized on this
+ * system, nsp_new() falls back to the next available one.
  * Pass NULL to reset to default (use most efficient engine available).
  *
  * Function returns 0 on success and -1 on error. */
 int nsock_set_default_engine(char *engine);
 
+/* Returns the name of the IO engine used by the pool */
+const char *nsp_getengine(nsock_pool nsp);
+
 /* Get a comma-separated list of available engines. */
 const char *nsock_list_engines(void);
 
@@ -633,12 +637,26 @@ const struct timeval *nsock_gettimeofday();
 int nsock_pcap_open(nsock_pool nsp, nsock_iod nsiod, const char *pcap_device,
                     int snaplen, int promisc, const char *bpf_fmt, ...);
 
+/* Sets the kernel buffer size, in bytes, of the pcap devices opened from now
+ * on. Zero (the default) leaves the libpcap default. */
+void nsp_setpcapbufsize(nsock_pool nsp, int bytes);
+
 /* Requests exactly one packet to be captured.from pcap.
  * See nsock_read() for parameters description. */
 nsock_event_id nsock_pcap_read_packet(nsock_pool nsp, nsock_iod nsiod,
                                       nsock_ev_handler handler,
                                       int timeout_msecs, void *userdata);
 
+/* Requests a batch of up to max_packets packets to be captured from pcap. The
+ * event is delivered as soon as at least one packet is available, along with
+ * every other packet that was already waiting, so a single event (and a
+ * single call to the handler) takes care of a whole burst. Use
+ * nse_readpcap_next() to get them. */
+nsock_event_id nsock_pcap_read_packets(nsock_pool nsp, nsock_iod nsiod,
+                                       nsock_ev_handler handler,
+                                       int timeout_msecs, int max_packets,
+                                       void *userdata);
+
 /* Gets packet data. This should be called after successful receipt of packet
  * to get packet.  If you're not interested in some values, just pass NULL
  * instead of valid pointer.
@@ -653,12 +671,29 @@ void nse_readpcap(nsock_event nsee, const unsigned char **l2_data,
                   size_t *l2_len, const unsigned char **l3_data, size_t *l3_len,
                   size_t *packet_len, struct timeval *ts);
 
+/* Same as nse_readpcap(), for events that may carry several packets. Set
+ * *cursor to zero before the first call. Each call returns the next packet
+ * and advances the cursor. Returns 0 when there are no more packets. Works
+ * with single packet events too. */
+int nse_readpcap_next(nsock_event nsee, size_t *cursor,
+                      const unsigned char **l2_data, size_t *l2_len,
+                      const unsigned char **l3_data, size_t *l3_len,
+                      size_t *packet_len, struct timeval *ts);
+
 /* Well. Just pcap-style datalink. Like DLT_EN10MB or DLT_SLIP. Check in pcap(3) manpage. */
 int nsi_pcap_linktype(nsock_iod nsiod);
 
 /* Is this nsiod a pcap descriptor? */
 int nsi_is_pcap(nsock_iod nsiod);
 
+/* Replaces the filter of a pcap descriptor with an already compiled BPF
+ * program, for callers that generate their own code instead of using a pcap
+ * filter expression. Where supported, libpcap attaches it to the socket so the
+ * kernel drops the packets that don't pass the filter. Returns 0 on success or
+ * -1 on error. */
+struct bpf_program;
+int nsi_pcap_setfilter(nsock_iod nsiod, struct bpf_program *fp);
+
 #endif /* HAVE_PCAP */
 
 #ifdef __cplusplus
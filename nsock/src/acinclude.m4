@@ -118,6 +118,27 @@ $1],[AC_MSG_RESULT([no])
 $2])
 ])dnl
 
+dnl Checks for the io_uring(7) interface with multishot polls (Linux 5.13).
+dnl Only the kernel headers are needed: the engine uses the raw system calls.
+AC_DEFUN([AX_HAVE_IO_URING], [dnl
+  AC_MSG_CHECKING([for Linux io_uring(7) interface])
+  AC_CACHE_VAL([ax_cv_have_io_uring], [dnl
+    AC_COMPILE_IFELSE([dnl
+      AC_LANG_PROGRAM([dnl
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+], [dnl
+struct io_uring_getevents_arg arg;
+int op = IORING_OP_POLL_ADD, flags = IORING_POLL_ADD_MULTI;
+long nr = __NR_io_uring_setup + __NR_io_uring_enter;])],
+      [ax_cv_have_io_uring=yes],
+      [ax_cv_have_io_uring=no])])
+  AS_IF([test "${ax_cv_have_io_uring}" = "yes"],
+    [AC_MSG_RESULT([yes])
+$1],[AC_MSG_RESULT([no])
+$2])
+])dnl
+
 dnl Checks if PCAP_NETMASK_UNKNOWN is defined (has been since libpcap 1.1.1)
 dnl Sets it to 0 (no checking) if it's not defined.
 AC_DEFUN([PCAP_DEFINE_NETMASK_UNKNOWN],
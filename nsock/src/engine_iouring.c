@@ -0,0 +1,705 @@
+/***************************************************************************
+ * engine_iouring.c -- io_uring(7) based IO engine.                        *
+ *                                                                         *
+ ***********************IMPORTANT NSOCK LICENSE TERMS***********************
+ *                                                                         *
+ * The nsock parallel socket event library is (C) 1999-2013 Insecure.Com   *
+ * LLC This library is free software; you may redistribute and/or          *
+ * modify it under the terms of the GNU General Public License as          *
+ * published by the Free Software Foundation; Version 2.  This guarantees  *
+ * your right to use, modify, and redistribute this software under certain *
+ * conditions.  If this license is unacceptable to you, Insecure.Com LLC   *
+ * may be willing to sell alternative licenses (contact                    *
+ * sales@insecure.com ).                                                   *
+ *                                                                         *
+ * As a special exception to the GPL terms, Insecure.Com LLC grants        *
+ * permission to link the code of this program with any version of the     *
+ * OpenSSL library which is distributed under a license identical to that  *
+ * listed in the included docs/licenses/OpenSSL.txt file, and distribute   *
+ * linked combinations including the two. You must obey the GNU GPL in all *
+ * respects for all of the code used other than OpenSSL.  If you modify    *
+ * this file, you may extend this exception to your version of the file,   *
+ * but you are not obligated to do so.                                     *
+ *                                                                         *
+ * If you received these files with a written license agreement stating    *
+ * terms other than the (GPL) terms above, then that alternative license   *
+ * agreement takes precedence over this comment.                           *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to send your changes   *
+ * to the dev@nmap.org mailing list for possible incorporation into the    *
+ * main distribution.  By sending these changes to Fyodor or one of the    *
+ * Insecure.Org development mailing lists, or checking them into the Nmap  *
+ * source code repository, it is understood (unless you specify otherwise) *
+ * that you are offering the Nmap Project (Insecure.Com LLC) the           *
+ * unlimited, non-exclusive right to reuse, modify, and relicense the      *
+ * code.  Nmap will always be available Open Source, but this is important *
+ * because the inability to relicense code has caused devastating problems *
+ * for other Free Software projects (such as KDE and NASM).  We also       *
+ * occasionally relicense the code to third parties as discussed above.    *
+ * If you wish to specify special license conditions of your               *
+ * contributions, just say so when you send them.                          *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful, but     *
+ * WITHOUT ANY WARRANTY; without even the implied warranty of              *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU       *
+ * General Public License v2.0 for more details                            *
+ * (http://www.gnu.org/licenses/gpl-2.0.html).                             *
+ *                                                                         *
+ ***************************************************************************/
+
+/* $Id$ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "nsock_config.h"
+#endif
+
+#if HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <endian.h>
+#include <errno.h>
+
+#include "nsock_internal.h"
+#include "nsock_log.h"
+
+#if HAVE_PCAP
+#include "nsock_pcap.h"
+#endif
+
+/* Submission queue size. The completion queue is twice as large. */
+#define IOURING_SQ_ENTRIES  256
+#define INITIAL_POLL_COUNT  128
+
+#define IOURING_R_FLAGS (POLLIN | POLLPRI)
+#define IOURING_W_FLAGS POLLOUT
+#ifdef POLLRDHUP
+  #define IOURING_X_FLAGS (POLLERR | POLLRDHUP | POLLHUP)
+#else
+  #define IOURING_X_FLAGS (POLLERR | POLLHUP)
+#endif /* POLLRDHUP */
+
+
+/* --- ENGINE INTERFACE PROTOTYPES --- */
+static int iouring_init(struct npool *nsp);
+static void iouring_destroy(struct npool *nsp);
+static int iouring_iod_register(struct npool *nsp, struct niod *iod, int ev);
+static int iouring_iod_unregister(struct npool *nsp, struct niod *iod);
+static int iouring_iod_modify(struct npool *nsp, struct niod *iod, int ev_set, int ev_clr);
+static int iouring_loop(struct npool *nsp, int msec_timeout);
+
+
+/* ---- ENGINE DEFINITION ---- */
+struct io_engine engine_iouring = {
+  "io_uring",
+  iouring_init,
+  iouring_destroy,
+  iouring_iod_register,
+  iouring_iod_unregister,
+  iouring_iod_modify,
+  iouring_loop
+};
+
+
+/* --- INTERNAL PROTOTYPES --- */
+static void iterate_through_event_lists(struct npool *nsp);
+
+/* defined in nsock_core.c */
+void process_iod_events(struct npool *nsp, struct niod *nsi, int ev);
+void process_event(struct npool *nsp, gh_list_t *evlist, struct nevent *nse, int ev);
+void process_expired_events(struct npool *nsp);
+#if HAVE_PCAP
+#ifndef PCAP_CAN_DO_SELECT
+int pcap_read_on_nonselect(struct npool *nsp);
+#endif
+#endif
+
+/* defined in nsock_event.c */
+void update_first_events(struct nevent *nse);
+
+
+extern struct timeval nsock_tod;
+
+
+/*
+ * Engine specific data structures
+ */
+
+/* A multishot poll request watching the descriptor of an IOD. Its address is
+ * the user_data of the request, so that completions can be matched to it.
+ * When the IOD is unregistered or its events change, the request is removed
+ * and the structure is retired: completions that were already queued must not
+ * be delivered to the IOD (which might even have been reused). It is freed
+ * once the kernel has posted the request's last completion. */
+struct iouring_poll {
+  struct niod *iod;   /* NULL once retired */
+  unsigned int mask;  /* poll(2) events being watched */
+  int armed;          /* request still active in the kernel */
+  gh_lnode_t nodeq;   /* position in the retired list */
+};
+
+struct iouring_engine_info {
+  /* file descriptor of the io_uring instance */
+  int ringfd;
+
+  /* submission queue ring, mapped from the kernel */
+  void *sq_ring;
+  size_t sq_ring_len;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+  unsigned sq_entries;
+  /* number of SQEs queued since the last io_uring_enter() */
+  unsigned to_submit;
+
+  /* completion queue ring. It shares the mapping of the submission queue when
+   * the kernel supports it */
+  void *cq_ring;
+  size_t cq_ring_len;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  /* multishot polls are supported by the kernel (>= 5.13) */
+  int multishot;
+
+  /* active poll requests, indexed by descriptor */
+  struct iouring_poll **polls;
+  int polls_len;
+
+  /* retired poll requests still waiting for their last completion */
+  gh_list_t retired;
+};
+
+
+static inline int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                                     unsigned flags, void *arg, size_t argsz) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+
+int iouring_init(struct npool *nsp) {
+  struct iouring_engine_info *einfo;
+  struct io_uring_params params;
+  char *sq_ptr, *cq_ptr;
+
+  einfo = (struct iouring_engine_info *)safe_zalloc(sizeof(struct iouring_engine_info));
+  einfo->sq_ring = MAP_FAILED;
+  einfo->cq_ring = MAP_FAILED;
+  einfo->sqes = (struct io_uring_sqe *)MAP_FAILED;
+
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = IOURING_SQ_ENTRIES * 2;
+
+  /* io_uring may be missing, disabled by the administrator or blocked by a
+   * seccomp filter. Fail then, so that nsp_new() falls back to another
+   * engine. */
+  einfo->ringfd = sys_io_uring_setup(IOURING_SQ_ENTRIES, &params);
+  if (einfo->ringfd < 0) {
+    nsock_log_info(nsp, "Unable to create io_uring instance: %s", strerror(errno));
+    goto failure;
+  }
+
+  /* Timeouts are passed straight to io_uring_enter() (Linux >= 5.11) */
+  if (!(params.features & IORING_FEAT_EXT_ARG)) {
+    nsock_log_info(nsp, "The io_uring engine requires Linux 5.11 or later");
+    goto failure;
+  }
+
+  einfo->sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  einfo->cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    einfo->sq_ring_len = MAX(einfo->sq_ring_len, einfo->cq_ring_len);
+    einfo->cq_ring_len = 0;
+  }
+
+  einfo->sq_ring = mmap(NULL, einfo->sq_ring_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, einfo->ringfd, IORING_OFF_SQ_RING);
+  if (einfo->sq_ring == MAP_FAILED) {
+    nsock_log_info(nsp, "Unable to map io_uring submission queue: %s", strerror(errno));
+    goto failure;
+  }
+
+  if (einfo->cq_ring_len == 0) {
+    einfo->cq_ring = NULL;
+    cq_ptr = (char *)einfo->sq_ring;
+  } else {
+    einfo->cq_ring = mmap(NULL, einfo->cq_ring_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, einfo->ringfd, IORING_OFF_CQ_RING);
+    if (einfo->cq_ring == MAP_FAILED) {
+      nsock_log_info(nsp, "Unable to map io_uring completion queue: %s", strerror(errno));
+      goto failure;
+    }
+    cq_ptr = (char *)einfo->cq_ring;
+  }
+
+  einfo->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  einfo->sqes = (struct io_uring_sqe *)mmap(NULL, einfo->sqes_len, PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_POPULATE, einfo->ringfd, IORING_OFF_SQES);
+  if (einfo->sqes == MAP_FAILED) {
+    nsock_log_info(nsp, "Unable to map io_uring submission entries: %s", strerror(errno));
+    goto failure;
+  }
+
+  sq_ptr = (char *)einfo->sq_ring;
+  einfo->sq_head = (unsigned *)(sq_ptr + params.sq_off.head);
+  einfo->sq_tail = (unsigned *)(sq_ptr + params.sq_off.tail);
+  einfo->sq_mask = (unsigned *)(sq_ptr + params.sq_off.ring_mask);
+  einfo->sq_array = (unsigned *)(sq_ptr + params.sq_off.array);
+  einfo->sq_entries = params.sq_entries;
+
+  einfo->cq_head = (unsigned *)(cq_ptr + params.cq_off.head);
+  einfo->cq_tail = (unsigned *)(cq_ptr + params.cq_off.tail);
+  einfo->cq_mask = (unsigned *)(cq_ptr + params.cq_off.ring_mask);
+  einfo->cqes = (struct io_uring_cqe *)(cq_ptr + params.cq_off.cqes);
+
+  einfo->multishot = 1;
+  einfo->polls_len = INITIAL_POLL_COUNT;
+  einfo->polls = (struct iouring_poll **)safe_zalloc(einfo->polls_len * sizeof(struct iouring_poll *));
+  gh_list_init(&einfo->retired);
+
+  nsp->engine_data = (void *)einfo;
+
+  return 1;
+
+failure:
+  if (einfo->sqes != MAP_FAILED)
+    munmap(einfo->sqes, einfo->sqes_len);
+  if (einfo->cq_ring != MAP_FAILED && einfo->cq_ring != NULL)
+    munmap(einfo->cq_ring, einfo->cq_ring_len);
+  if (einfo->sq_ring != MAP_FAILED)
+    munmap(einfo->sq_ring, einfo->sq_ring_len);
+  if (einfo->ringfd >= 0)
+    close(einfo->ringfd);
+  free(einfo);
+  return 0;
+}
+
+void iouring_destroy(struct npool *nsp) {
+  struct iouring_engine_info *einfo = (struct iouring_engine_info *)nsp->engine_data;
+  gh_lnode_t *lnode;
+  int i;
+
+  assert(einfo != NULL);
+
+  /* Closing the ring cancels every pending request */
+  close(einfo->ringfd);
+  munmap(einfo->sqes, einfo->sqes_len);
+  if (einfo->cq_ring != NULL)
+    munmap(einfo->cq_ring, einfo->cq_ring_len);
+  munmap(einfo->sq_ring, einfo->sq_ring_len);
+
+  for (i = 0; i < einfo->polls_len; i++)
+    free(einfo->polls[i]);
+  free(einfo->polls);
+  while ((lnode = gh_list_pop(&einfo->retired)) != NULL)
+    free(container_of(lnode, struct iouring_poll, nodeq));
+  gh_list_free(&einfo->retired);
+  free(einfo);
+}
+
+
+/* ---- SUBMISSION QUEUE ---- */
+
+/* Hands every queued SQE over to the kernel, without waiting for anything. */
+static void iouring_submit(struct iouring_engine_info *einfo) {
+  int rc;
+
+  while (einfo->to_submit > 0) {
+    rc = sys_io_uring_enter(einfo->ringfd, einfo->to_submit, 0, 0, NULL, 0);
+    if (rc < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+        continue;
+      fatal("Unable to submit io_uring requests: %s", strerror(errno));
+    }
+    einfo->to_submit -= rc;
+  }
+}
+
+/* Returns a blank SQE. SQEs are only handed over to the kernel when the loop
+ * waits for events, so that all the changes made while processing events go
+ * in a single system call. */
+static struct io_uring_sqe *iouring_get_sqe(struct iouring_engine_info *einfo) {
+  struct io_uring_sqe *sqe;
+  unsigned tail, idx;
+
+  tail = *einfo->sq_tail;
+  if (tail - __atomic_load_n(einfo->sq_head, __ATOMIC_ACQUIRE) >= einfo->sq_entries)
+    iouring_submit(einfo);
+
+  idx = tail & *einfo->sq_mask;
+  sqe = &einfo->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  einfo->sq_array[idx] = idx;
+  __atomic_store_n(einfo->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  einfo->to_submit++;
+  return sqe;
+}
+
+static inline __u32 poll32_events(unsigned int mask) {
+#if __BYTE_ORDER == __BIG_ENDIAN
+  /* poll32_events is stored with its 16-bit halves swapped */
+  mask = (mask << 16) | (mask >> 16);
+#endif
+  return mask;
+}
+
+static void iouring_arm_poll(struct iouring_engine_info *einfo, struct niod *iod,
+                             struct iouring_poll *ipoll) {
+  struct io_uring_sqe *sqe;
+
+  sqe = iouring_get_sqe(einfo);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = nsi_getsd(iod);
+  sqe->poll32_events = poll32_events(ipoll->mask);
+  if (einfo->multishot)
+    sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = (__u64)(uintptr_t)ipoll;
+  ipoll->armed = 1;
+}
+
+/* Changes the events watched by an active multishot poll request in place.
+ * If the request has terminated in the meantime, the update fails and the
+ * request is re-armed with the new events when its last completion is
+ * processed. */
+static void iouring_update_poll(struct iouring_engine_info *einfo, struct iouring_poll *ipoll) {
+  struct io_uring_sqe *sqe;
+
+  sqe = iouring_get_sqe(einfo);
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->fd = -1;
+  sqe->addr = (__u64)(uintptr_t)ipoll;
+  sqe->poll32_events = poll32_events(ipoll->mask);
+  sqe->len = IORING_POLL_UPDATE_EVENTS | IORING_POLL_ADD_MULTI;
+  sqe->user_data = 0;
+}
+
+/* Detaches a poll request from its IOD. If the request is still active, it is
+ * removed and the structure stays around until its last completion shows up.
+ * Otherwise it is freed straight away. */
+static void iouring_retire_poll(struct iouring_engine_info *einfo, struct iouring_poll *ipoll) {
+  struct io_uring_sqe *sqe;
+
+  ipoll->iod = NULL;
+  if (!ipoll->armed) {
+    free(ipoll);
+    return;
+  }
+
+  sqe = iouring_get_sqe(einfo);
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->fd = -1;
+  sqe->addr = (__u64)(uintptr_t)ipoll;
+  sqe->user_data = 0;
+  gh_list_append(&einfo->retired, &ipoll->nodeq);
+}
+
+static unsigned int iouring_mask(int ev) {
+  unsigned int mask = 0;
+
+  if (ev & EV_READ)
+    mask |= IOURING_R_FLAGS;
+  if (ev & EV_WRITE)
+    mask |= IOURING_W_FLAGS;
+  if (ev & EV_EXCEPT)
+    mask |= IOURING_X_FLAGS;
+
+  return mask;
+}
+
+static void iouring_watch(struct iouring_engine_info *einfo, struct niod *iod, int ev) {
+  struct iouring_poll *ipoll;
+  int sd = nsi_getsd(iod);
+
+  assert(sd >= 0);
+  if (sd >= einfo->polls_len) {
+    int newlen = MAX(sd + 1, einfo->polls_len * 2);
+
+    einfo->polls = (struct iouring_poll **)safe_realloc(einfo->polls, newlen * sizeof(struct iouring_poll *));
+    memset(einfo->polls + einfo->polls_len, 0, (newlen - einfo->polls_len) * sizeof(struct iouring_poll *));
+    einfo->polls_len = newlen;
+  }
+  assert(einfo->polls[sd] == NULL);
+
+  ipoll = (struct iouring_poll *)safe_zalloc(sizeof(struct iouring_poll));
+  ipoll->iod = iod;
+  ipoll->mask = iouring_mask(ev);
+  einfo->polls[sd] = ipoll;
+  iouring_arm_poll(einfo, iod, ipoll);
+}
+
+static void iouring_unwatch(struct iouring_engine_info *einfo, struct niod *iod) {
+  int sd = nsi_getsd(iod);
+
+  if (sd < 0 || sd >= einfo->polls_len || einfo->polls[sd] == NULL)
+    return;
+
+  iouring_retire_poll(einfo, einfo->polls[sd]);
+  einfo->polls[sd] = NULL;
+}
+
+
+int iouring_iod_register(struct npool *nsp, struct niod *iod, int ev) {
+  struct iouring_engine_info *einfo = (struct iouring_engine_info *)nsp->engine_data;
+
+  assert(!IOD_PROPGET(iod, IOD_REGISTERED));
+
+  iod->watched_events = ev;
+  iouring_watch(einfo, iod, ev);
+
+  IOD_PROPSET(iod, IOD_REGISTERED);
+  return 1;
+}
+
+int iouring_iod_unregister(struct npool *nsp, struct niod *iod) {
+  iod->watched_events = EV_NONE;
+
+  /* some IODs can be unregistered here if they're associated to an event that was
+   * immediately completed */
+  if (IOD_PROPGET(iod, IOD_REGISTERED)) {
+    struct iouring_engine_info *einfo = (struct iouring_engine_info *)nsp->engine_data;
+
+    iouring_unwatch(einfo, iod);
+
+    IOD_PROPCLR(iod, IOD_REGISTERED);
+  }
+  return 1;
+}
+
+int iouring_iod_modify(struct npool *nsp, struct niod *iod, int ev_set, int ev_clr) {
+  int new_events;
+  struct iouring_engine_info *einfo = (struct iouring_engine_info *)nsp->engine_data;
+
+  assert((ev_set & ev_clr) == 0);
+  assert(IOD_PROPGET(iod, IOD_REGISTERED));
+
+  new_events = iod->watched_events;
+  new_events |= ev_set;
+  new_events &= ~ev_clr;
+
+  if (new_events == iod->watched_events)
+    return 1; /* nothing to do */
+
+  iod->watched_events = new_events;
+
+  /* The change is submitted together with the next wait. Either way, the
+   * request reports the descriptor's current state, just like EPOLL_CTL_MOD
+   * does. */
+  if (einfo->multishot) {
+    struct iouring_poll *ipoll = einfo->polls[nsi_getsd(iod)];
+
+    ipoll->mask = iouring_mask(new_events);
+    if (ipoll->armed)
+      iouring_update_poll(einfo, ipoll);
+    else
+      iouring_arm_poll(einfo, iod, ipoll);
+  } else {
+    /* One-shot polls cannot be updated, replace the request */
+    iouring_unwatch(einfo, iod);
+    iouring_watch(einfo, iod, new_events);
+  }
+
+  return 1;
+}
+
+/* Submits the queued SQEs and waits up to msec_timeout milliseconds (-1 means
+ * forever) for at least one completion, in a single system call. Returns the
+ * number of completions available or -1 on error. */
+static int iouring_wait(struct iouring_engine_info *einfo, int msec_timeout) {
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned wait_nr;
+  int rc;
+
+  if (__atomic_load_n(einfo->cq_tail, __ATOMIC_ACQUIRE) != *einfo->cq_head)
+    msec_timeout = 0;
+
+  /* Nothing to submit and nothing to wait for */
+  if (msec_timeout == 0 && einfo->to_submit == 0)
+    return __atomic_load_n(einfo->cq_tail, __ATOMIC_ACQUIRE) - *einfo->cq_head;
+
+  memset(&arg, 0, sizeof(arg));
+  if (msec_timeout >= 0) {
+    ts.tv_sec = msec_timeout / 1000;
+    ts.tv_nsec = (long long)(msec_timeout % 1000) * 1000000;
+    arg.ts = (__u64)(uintptr_t)&ts;
+  }
+  wait_nr = (msec_timeout == 0) ? 0 : 1;
+
+  rc = sys_io_uring_enter(einfo->ringfd, einfo->to_submit, wait_nr,
+                          IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+  if (rc >= 0)
+    einfo->to_submit -= rc;
+  else if (errno != ETIME && errno != EBUSY)
+    return -1;
+
+  return __atomic_load_n(einfo->cq_tail, __ATOMIC_ACQUIRE) - *einfo->cq_head;
+}
+
+int iouring_loop(struct npool *nsp, int msec_timeout) {
+  int results_left = 0;
+  int event_msecs; /* msecs before an event goes off */
+  int combined_msecs;
+  int sock_err = 0;
+  struct iouring_engine_info *einfo = (struct iouring_engine_info *)nsp->engine_data;
+
+  assert(msec_timeout >= -1);
+
+  if (nsp->events_pending == 0)
+    return 0; /* No need to wait on 0 events ... */
+
+  do {
+    struct nevent *nse;
+
+    nsock_log_debug_all(nsp, "wait for events");
+
+    nse = next_expirable_event(nsp);
+    if (!nse)
+      event_msecs = -1; /* None of the events specified a timeout */
+    else
+      event_msecs = MAX(0, TIMEVAL_MSEC_SUBTRACT(nse->timeout, nsock_tod));
+
+#if HAVE_PCAP
+#ifndef PCAP_CAN_DO_SELECT
+    /* Force a low timeout when capturing packets on systems where
+     * the pcap descriptor is not select()able. */
+    if (gh_list_count(&nsp->pcap_read_events) > 0)
+      if (event_msecs > PCAP_POLL_INTERVAL)
+        event_msecs = PCAP_POLL_INTERVAL;
+#endif
+#endif
+
+    /* We cast to unsigned because we want -1 to be very high (since it means no
+     * timeout) */
+    combined_msecs = MIN((unsigned)event_msecs, (unsigned)msec_timeout);
+
+#if HAVE_PCAP
+#ifndef PCAP_CAN_DO_SELECT
+    /* do non-blocking read on pcap devices that doesn't support select()
+     * If there is anything read, just leave this loop. */
+    if (pcap_read_on_nonselect(nsp)) {
+      /* okay, something was read. */
+    } else
+#endif
+#endif
+    {
+      results_left = iouring_wait(einfo, combined_msecs);
+      if (results_left == -1)
+        sock_err = socket_errno();
+    }
+
+    gettimeofday(&nsock_tod, NULL); /* Due to io_uring delay */
+  } while (results_left == -1 && sock_err == EINTR); /* repeat only if signal occurred */
+
+  if (results_left == -1 && sock_err != EINTR) {
+    nsock_log_error(nsp, "nsock_loop error %d: %s", sock_err, socket_strerror(sock_err));
+    nsp->errnum = sock_err;
+    return -1;
+  }
+
+  iterate_through_event_lists(nsp);
+
+  return 1;
+}
+
+
+/* ---- INTERNAL FUNCTIONS ---- */
+static inline int get_evmask(int res) {
+  int evmask = EV_NONE;
+
+  /* Failed poll requests are reported as errors on the descriptor */
+  if (res < 0)
+    return (EV_READ | EV_WRITE | EV_EXCEPT);
+
+  if (res & IOURING_R_FLAGS)
+    evmask |= EV_READ;
+  if (res & IOURING_W_FLAGS)
+    evmask |= EV_WRITE;
+  if (res & IOURING_X_FLAGS)
+    evmask |= (EV_READ | EV_WRITE | EV_EXCEPT);
+
+  return evmask;
+}
+
+/* Iterate through all the event lists (such as connect_events, read_events,
+ * timer_events, etc) and take action for those that have completed (due to
+ * timeout, i/o, etc) */
+void iterate_through_event_lists(struct npool *nsp) {
+  struct iouring_engine_info *einfo = (struct iouring_engine_info *)nsp->engine_data;
+  unsigned head, tail;
+
+  head = *einfo->cq_head;
+  tail = __atomic_load_n(einfo->cq_tail, __ATOMIC_ACQUIRE);
+
+  for (; head != tail; head++) {
+    struct io_uring_cqe *cqe = &einfo->cqes[head & *einfo->cq_mask];
+    struct iouring_poll *ipoll = (struct iouring_poll *)(uintptr_t)cqe->user_data;
+    int res = cqe->res;
+    int more = cqe->flags & IORING_CQE_F_MORE;
+    struct niod *nsi;
+
+    /* The CQE has been copied, give the slot back to the kernel */
+    __atomic_store_n(einfo->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    /* Completion of a POLL_REMOVE request */
+    if (ipoll == NULL)
+      continue;
+
+    if (!more)
+      ipoll->armed = 0;
+
+    /* Leftovers of a retired request */
+    if (ipoll->iod == NULL) {
+      if (!ipoll->armed) {
+        gh_list_remove(&einfo->retired, &ipoll->nodeq);
+        free(ipoll);
+      }
+      continue;
+    }
+
+    nsi = ipoll->iod;
+
+    /* Multishot polls were introduced in Linux 5.13. Fall back to re-arming
+     * one-shot polls after every completion on older kernels. */
+    if (res == -EINVAL && einfo->multishot) {
+      einfo->multishot = 0;
+      iouring_arm_poll(einfo, nsi, ipoll);
+      continue;
+    }
+
+    /* The kernel may terminate a multishot poll at any time. Re-arm it before
+     * processing the IOD: its handlers may retire the request. */
+    if (!ipoll->armed && res >= 0)
+      iouring_arm_poll(einfo, nsi, ipoll);
+
+    /* process all the pending events for this IOD */
+    process_iod_events(nsp, nsi, get_evmask(res));
+
+    if (nsi->state == NSIOD_STATE_DELETED) {
+      gh_list_remove(&nsp->active_iods, &nsi->nodeq);
+      gh_list_prepend(&nsp->free_iods, &nsi->nodeq);
+    }
+  }
+
+  /* iterate through timers and expired events */
+  process_expired_events(nsp);
+}
+
+#endif /* HAVE_IO_URING */
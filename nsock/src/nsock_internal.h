@@ -203,6 +203,10 @@ struct npool {
   /* Interface to bind to; only supported on Linux with SO_BINDTODEVICE sockopt. */
   const char *device;
 
+  /* Kernel buffer size for new pcap descriptors, in bytes. Zero means the
+   * libpcap default. */
+  int pcap_bufsize;
+
   /* If true, exit the next iteration of nsock_loop with a status of
    * NSOCK_LOOP_QUIT. */
   int quit;
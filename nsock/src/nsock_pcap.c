@@ -60,6 +60,9 @@
 #include "nsock_log.h"
 
 #include <limits.h>
+#if HAVE_POLL && !defined(WIN32)
+#include <poll.h>
+#endif
 #if HAVE_SYS_IOCTL_H
 #include <sys/ioctl.h>
 #endif
@@ -200,6 +203,7 @@ static int nsock_pcap_get_l3_offset(pcap_t *pt, int *dl) {
 static int nsock_pcap_try_open(struct npool *nsp, mspcap *mp, const char *dev,
                                int snaplen, int promisc, int timeout_ms,
                                char *errbuf) {
+#ifdef WIN32
     mp->pt = pcap_open_live(dev, snaplen, promisc, timeout_ms, errbuf);
     if (!mp->pt) {
       nsock_log_error(nsp, "pcap_open_live(%s, %d, %d, %d) failed with error: %s",
@@ -207,6 +211,41 @@ static int nsock_pcap_try_open(struct npool *nsp, mspcap *mp, const char *dev,
       return -1;
     }
     return 0;
+#else
+    int rc;
+
+    /* Unlike pcap_open_live(), this lets us tune the descriptor before it is
+     * activated. */
+    mp->pt = pcap_create(dev, errbuf);
+    if (!mp->pt) {
+      nsock_log_error(nsp, "pcap_create(%s) failed with error: %s", dev, errbuf);
+      return -1;
+    }
+    pcap_set_snaplen(mp->pt, snaplen);
+    pcap_set_promisc(mp->pt, promisc);
+    pcap_set_timeout(mp->pt, timeout_ms);
+#ifdef PCAP_TSTAMP_PRECISION_NANO
+    /* libpcap >= 1.5.0. Hand packets over as soon as they arrive instead of
+     * waiting for the kernel to fill up or time out a whole buffer block (like
+     * a TPACKET_V3 block on Linux). Batched reads still get every packet that
+     * is waiting in the ring at once. */
+    pcap_set_immediate_mode(mp->pt, 1);
+#endif
+    if (nsp->pcap_bufsize > 0)
+      pcap_set_buffer_size(mp->pt, nsp->pcap_bufsize);
+
+    rc = pcap_activate(mp->pt);
+    if (rc < 0) {
+      nsock_log_error(nsp, "pcap_activate(%s, %d, %d, %d) failed with error: %s",
+                      dev, snaplen, promisc, timeout_ms, pcap_geterr(mp->pt));
+      pcap_close(mp->pt);
+      mp->pt = NULL;
+      return -1;
+    } else if (rc > 0) {
+      nsock_log_info(nsp, "pcap_activate(%s) warning: %s", dev, pcap_geterr(mp->pt));
+    }
+    return 0;
+#endif
 }
 
 /* Convert new nsiod to pcap descriptor. Other parameters have
@@ -357,6 +396,13 @@ int nsock_pcap_open(nsock_pool nsp, nsock_iod nsiod, const char *pcap_device,
   return 0;
 }
 
+/* Sets the kernel buffer size of the pcap descriptors opened from now on. A
+ * larger buffer lets batched reads keep up with bursts of packets. */
+void nsp_setpcapbufsize(nsock_pool nsp, int bytes) {
+  struct npool *ms = (struct npool *)nsp;
+  ms->pcap_bufsize = bytes;
+}
+
 /* Requests exactly one packet to be captured. */
 nsock_event_id nsock_pcap_read_packet(nsock_pool nsp, nsock_iod nsiod,
                                       nsock_ev_handler handler,
@@ -375,6 +421,105 @@ nsock_event_id nsock_pcap_read_packet(nsock_pool nsp, nsock_iod nsiod,
   return nse->id;
 }
 
+/* Requests up to max_packets packets to be captured. The event completes as
+ * soon as there is at least one. */
+nsock_event_id nsock_pcap_read_packets(nsock_pool nsp, nsock_iod nsiod,
+                                       nsock_ev_handler handler,
+                                       int timeout_msecs, int max_packets,
+                                       void *userdata) {
+  struct niod *nsi = (struct niod *)nsiod;
+  struct npool *ms = (struct npool *)nsp;
+  struct nevent *nse;
+
+  nse = event_new(ms, NSE_TYPE_PCAP_READ, nsi, timeout_msecs, handler, userdata);
+  assert(nse);
+  nse->readinfo.num = MAX(max_packets, 1);
+
+  nsock_log_info(ms, "Pcap read request (up to %d packets) from IOD #%li  EID %li",
+                 nse->readinfo.num, nsi->id, nse->id);
+
+  nsp_add_event(ms, nse);
+
+  return nse->id;
+}
+
+/* pcap_dispatch() callback for batched reads. Appends a record to the event
+ * buffer. */
+static void nsock_pcap_batch_cb(u_char *user, const struct pcap_pkthdr *h,
+                                const u_char *bytes) {
+  struct nevent *nse = (struct nevent *)user;
+  static const char pad[PCAP_RECORD_ALIGN];
+  nsock_pcap npp;
+  size_t padlen;
+
+  memset(&npp, 0, sizeof(nsock_pcap));
+#ifdef PCAP_RECV_TIMEVAL_VALID
+  npp.ts     = h->ts;
+#else
+  memcpy(&npp.ts, nsock_gettimeofday(), sizeof(struct timeval));
+#endif
+  npp.len    = h->len;
+  npp.caplen = h->caplen;
+
+  fs_cat(&(nse->iobuf), (char *)&npp, sizeof(npp));
+  fs_cat(&(nse->iobuf), (char *)bytes, npp.caplen);
+  padlen = PCAP_RECORD_SIZE(npp.caplen) - sizeof(npp) - npp.caplen;
+  if (padlen > 0)
+    fs_cat(&(nse->iobuf), pad, padlen);
+}
+
+/* Returns whether the pcap descriptor still has something to read. */
+static int nsock_pcap_readable(mspcap *mp) {
+#if HAVE_POLL && !defined(WIN32)
+  struct pollfd pfd;
+
+  if (mp->pcap_desc < 0)
+    return 0;
+  pfd.fd = mp->pcap_desc;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+#else
+  return 0;
+#endif
+}
+
+/* Reads all the packets that are waiting, up to the limit set for the event.
+ * Where libpcap reads one packet per pcap_dispatch() call, or returns 0 for a
+ * packet it skipped (like the outgoing copy of a loopback packet), we keep
+ * going while the descriptor is readable. Otherwise edge-triggered engines
+ * would not report the packets left behind until a new one arrived. */
+static int do_actual_pcap_read_batch(struct nevent *nse) {
+  mspcap *mp = (mspcap *)nse->iod->pcap;
+  nsock_pcap *n;
+  size_t off;
+  int rc, count = 0;
+
+  while (count < nse->readinfo.num) {
+    rc = pcap_dispatch(mp->pt, nse->readinfo.num - count, nsock_pcap_batch_cb, (u_char *)nse);
+    if (rc == -1)
+      fatal("pcap_dispatch() fatal error while reading from pcap: %s\n",
+            pcap_geterr(mp->pt));
+    if (rc > 0)
+      count += rc;
+    else if (rc < 0 || !nsock_pcap_readable(mp))
+      break;
+  }
+  if (count == 0)
+    return 0;
+
+  /* The buffer may have moved while it grew, so the packet pointers can only
+   * be set now. */
+  for (off = 0; off < (size_t)fs_length(&(nse->iobuf)); off += PCAP_RECORD_SIZE(n->caplen)) {
+    n = (nsock_pcap *)(fs_str(&(nse->iobuf)) + off);
+    n->packet = (unsigned char *)n + sizeof(nsock_pcap);
+  }
+
+  nsock_log_debug_all(nse->iod->nsp, "PCAP %s READ (IOD #%li) (EID #%li) packets=%i",
+                      __func__, nse->iod->id, nse->id, count);
+  return 1;
+}
+
 /* Remember that pcap descriptor is in nonblocking state. */
 int do_actual_pcap_read(struct nevent *nse) {
   mspcap *mp = (mspcap *)nse->iod->pcap;
@@ -391,6 +536,9 @@ int do_actual_pcap_read(struct nevent *nse) {
 
   assert(fs_length(&(nse->iobuf)) == 0);
 
+  if (nse->readinfo.num > 1)
+    return do_actual_pcap_read_batch(nse);
+
   rc = pcap_next_ex(mp->pt, &pkt_header, &pkt_data);
   switch (rc) {
     case 1: /* read good packet  */
@@ -433,6 +581,30 @@ int do_actual_pcap_read(struct nevent *nse) {
   return rc;
 }
 
+static void nsock_pcap_get_packet(mspcap *mp, nsock_pcap *n,
+                                  const unsigned char **l2_data, size_t *l2_len,
+                                  const unsigned char **l3_data, size_t *l3_len,
+                                  size_t *packet_len, struct timeval *ts) {
+  size_t l2l;
+  size_t l3l;
+
+  l2l = MIN(mp->l3_offset, n->caplen);
+  l3l = MAX(0, n->caplen-mp->l3_offset);
+
+  if (l2_data)
+    *l2_data = n->packet;
+  if (l2_len)
+    *l2_len = l2l;
+  if (l3_data)
+    *l3_data = (l3l > 0) ? n->packet+l2l : NULL;
+  if (l3_len)
+    *l3_len = l3l;
+  if (packet_len)
+    *packet_len = n->len;
+  if (ts)
+    *ts = n->ts;
+}
+
 void nse_readpcap(nsock_event nsev, const unsigned char **l2_data, size_t *l2_len,
                   const unsigned char **l3_data, size_t *l3_len,
                   size_t *packet_len, struct timeval *ts) {
@@ -440,8 +612,6 @@ void nse_readpcap(nsock_event nsev, const unsigned char **l2_data, size_t *l2_le
   struct niod  *iod = nse->iod;
   mspcap *mp = (mspcap *)iod->pcap;
   nsock_pcap *n;
-  size_t l2l;
-  size_t l3l;
 
   n = (nsock_pcap *)fs_str(&(nse->iobuf));
   if (fs_length(&(nse->iobuf)) < sizeof(nsock_pcap)) {
@@ -458,24 +628,29 @@ void nse_readpcap(nsock_event nsev, const unsigned char **l2_data, size_t *l2_le
     return;
   }
 
-  l2l = MIN(mp->l3_offset, n->caplen);
-  l3l = MAX(0, n->caplen-mp->l3_offset);
-
-  if (l2_data)
-    *l2_data = n->packet;
-  if (l2_len)
-    *l2_len = l2l;
-  if (l3_data)
-    *l3_data = (l3l > 0) ? n->packet+l2l : NULL;
-  if (l3_len)
-    *l3_len = l3l;
-  if (packet_len)
-    *packet_len = n->len;
-  if (ts)
-    *ts = n->ts;
+  nsock_pcap_get_packet(mp, n, l2_data, l2_len, l3_data, l3_len, packet_len, ts);
   return;
 }
 
+int nse_readpcap_next(nsock_event nsev, size_t *cursor,
+                      const unsigned char **l2_data, size_t *l2_len,
+                      const unsigned char **l3_data, size_t *l3_len,
+                      size_t *packet_len, struct timeval *ts) {
+  struct nevent *nse = (struct nevent *)nsev;
+  struct niod  *iod = nse->iod;
+  mspcap *mp = (mspcap *)iod->pcap;
+  nsock_pcap *n;
+
+  assert(cursor);
+  if (*cursor + sizeof(nsock_pcap) > (size_t)fs_length(&(nse->iobuf)))
+    return 0;
+
+  n = (nsock_pcap *)(fs_str(&(nse->iobuf)) + *cursor);
+  nsock_pcap_get_packet(mp, n, l2_data, l2_len, l3_data, l3_len, packet_len, ts);
+  *cursor += PCAP_RECORD_SIZE(n->caplen);
+  return 1;
+}
+
 int nsi_pcap_linktype(nsock_iod nsiod) {
   struct niod *nsi = (struct niod *)nsiod;
   mspcap *mp = (mspcap *)nsi->pcap;
@@ -484,6 +659,18 @@ int nsi_pcap_linktype(nsock_iod nsiod) {
   return (mp->datalink);
 }
 
+int nsi_pcap_setfilter(nsock_iod nsiod, struct bpf_program *fp) {
+  struct niod *nsi = (struct niod *)nsiod;
+  mspcap *mp = (mspcap *)nsi->pcap;
+
+  assert(mp);
+  if (pcap_setfilter(mp->pt, fp) != 0) {
+    nsock_log_error(nsi->nsp, "Failed to set the pcap filter: %s", pcap_geterr(mp->pt));
+    return -1;
+  }
+  return 0;
+}
+
 int nsi_is_pcap(nsock_iod nsiod) {
   struct niod *nsi = (struct niod *)nsiod;
   mspcap *mp = (mspcap *)nsi->pcap;
@@ -150,6 +150,14 @@ typedef struct{
   const unsigned char *packet;  /* caplen bytes */
 } nsock_pcap;
 
+/* Events that capture several packets at once store them in their iobuf one
+ * after another, each of them being an nsock_pcap structure followed by the
+ * packet data. Records are padded to this size so the structures are
+ * properly aligned. */
+#define PCAP_RECORD_ALIGN 8
+#define PCAP_RECORD_SIZE(caplen) \
+  ((sizeof(nsock_pcap) + (caplen) + PCAP_RECORD_ALIGN - 1) & ~(PCAP_RECORD_ALIGN - 1))
+
 int do_actual_pcap_read(struct nevent *nse);
 
 #endif /* HAVE_PCAP */
@@ -83,6 +83,7 @@ static int nsocklib_initialized = 0;
 
 /* defined in nsock_engines.h */
 struct io_engine *get_io_engine(void);
+struct io_engine *get_next_io_engine(struct io_engine *engine);
 
 /* ---- INTERNAL FUNCTIONS PROTOTYPES ---- */
 static void nsock_library_initialize(void);
@@ -95,6 +96,12 @@ unsigned long nsp_getid(nsock_pool nsp) {
   return mt->id;
 }
 
+/* Name of the IO engine the pool actually uses */
+const char *nsp_getengine(nsock_pool nsp) {
+  struct npool *mt = (struct npool *)nsp;
+  return mt->engine->name;
+}
+
 /* This next function returns the errno style error code -- which is only
  * valid if the status NSOCK_LOOP_ERROR was returned by nsock_loop() */
 
@@ -167,7 +174,17 @@ nsock_pool nsp_new(void *userdata) {
   nsp->userdata = userdata;
 
   nsp->engine = get_io_engine();
-  nsock_engine_init(nsp);
+  while (!nsock_engine_init(nsp)) {
+    struct io_engine *failed = nsp->engine;
+
+    /* The engine is built in but can't be used on this system. Try the next
+     * one in order of preference. */
+    nsp->engine = get_next_io_engine(failed);
+    if (nsp->engine == NULL)
+      fatal("Unable to initialize the %s IO engine", failed->name);
+    nsock_log_error(nsp, "Unable to initialize the %s IO engine, using %s instead",
+                    failed->name, nsp->engine->name);
+  }
 
   /* initialize IO events lists */
   gh_list_init(&nsp->connect_events);
@@ -190,6 +207,7 @@ nsock_pool nsp_new(void *userdata) {
   nsp->next_event_serial = 1;
 
   nsp->device = NULL;
+  nsp->pcap_bufsize = 0;
 
 #if HAVE_OPENSSL
   nsp->sslctx = NULL;
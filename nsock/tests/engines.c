@@ -0,0 +1,213 @@
+/*
+ * Nsock regression test suite
+ * Same license as nmap -- see http://nmap.org/book/man-legal.html
+ */
+
+#include "test-common.h"
+#include <sys/time.h>
+#ifndef WIN32
+#include <sys/socket.h>
+#endif
+
+/* Ping-pong benchmark of the IO engines over local stream sockets. Each pair
+ * keeps one message in flight, so every round trip costs the engine two
+ * readiness notifications and two re-arms. */
+#define ENGINE_PAIRS    32
+#define ENGINE_ROUNDS   2000
+#define ENGINE_MSGLEN   64
+
+
+struct engine_test_data;
+
+struct engine_pair {
+  struct engine_test_data *etd;
+  nsock_iod ping;
+  nsock_iod pong;
+  int rounds;
+  int pending; /* bytes of the current message not echoed back yet */
+};
+
+struct engine_test_data {
+  nsock_pool nsp;
+  const char *engine;
+  int skip; /* engine not available on this system */
+  struct engine_pair pairs[ENGINE_PAIRS];
+  int active;
+  int error;
+  char msg[ENGINE_MSGLEN];
+};
+
+
+static void ping_handler(nsock_pool nsp, nsock_event nse, void *udata);
+
+static int engine_check(struct engine_test_data *etd, nsock_event nse) {
+  if (nse_status(nse) == NSE_STATUS_SUCCESS)
+    return 0;
+
+  if (!etd->error)
+    etd->error = nse_errorcode(nse) ? -nse_errorcode(nse) : -EIO;
+  nsock_loop_quit(etd->nsp);
+  return -1;
+}
+
+static void pong_handler(nsock_pool nsp, nsock_event nse, void *udata) {
+  struct engine_pair *pair = (struct engine_pair *)udata;
+  char *buf;
+  int len;
+
+  if (engine_check(pair->etd, nse))
+    return;
+
+  if (nse_type(nse) == NSE_TYPE_READ) {
+    buf = nse_readbuf(nse, &len);
+    nsock_write(nsp, pair->pong, pong_handler, -1, pair, buf, len);
+    nsock_read(nsp, pair->pong, pong_handler, -1, pair);
+  }
+}
+
+static void ping_send(nsock_pool nsp, struct engine_pair *pair) {
+  pair->pending = ENGINE_MSGLEN;
+  nsock_write(nsp, pair->ping, ping_handler, -1, pair, pair->etd->msg, ENGINE_MSGLEN);
+  nsock_readbytes(nsp, pair->ping, ping_handler, -1, pair, ENGINE_MSGLEN);
+}
+
+static void ping_handler(nsock_pool nsp, nsock_event nse, void *udata) {
+  struct engine_pair *pair = (struct engine_pair *)udata;
+  struct engine_test_data *etd = pair->etd;
+  int len;
+
+  if (engine_check(etd, nse))
+    return;
+
+  if (nse_type(nse) != NSE_TYPE_READ)
+    return;
+
+  nse_readbuf(nse, &len);
+  pair->pending -= len;
+  if (pair->pending > 0) {
+    nsock_readbytes(nsp, pair->ping, ping_handler, -1, pair, pair->pending);
+    return;
+  }
+
+  if (++pair->rounds < ENGINE_ROUNDS)
+    ping_send(nsp, pair);
+  else if (--etd->active == 0)
+    nsock_loop_quit(nsp);
+}
+
+static int engine_setup(struct engine_test_data **petd, const char *engine) {
+  struct engine_test_data *etd;
+#ifndef WIN32
+  int i, sv[2];
+#endif
+
+  etd = calloc(1, sizeof(struct engine_test_data));
+  if (etd == NULL)
+    return -ENOMEM;
+  *petd = etd;
+
+  etd->engine = engine;
+#ifndef WIN32
+  if (nsock_set_default_engine((char *)engine) < 0) {
+    etd->skip = 1;
+    return 0;
+  }
+
+  etd->nsp = nsp_new(etd);
+  AssertNonNull(etd->nsp);
+
+  /* Built in, but nsock had to fall back to another engine */
+  if (strcmp(nsp_getengine(etd->nsp), engine) != 0) {
+    etd->skip = 1;
+    return 0;
+  }
+
+  memset(etd->msg, 'A', ENGINE_MSGLEN);
+  for (i = 0; i < ENGINE_PAIRS; i++) {
+    struct engine_pair *pair = &etd->pairs[i];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+      return -errno;
+
+    pair->etd = etd;
+    pair->ping = nsi_new2(etd->nsp, sv[0], pair);
+    pair->pong = nsi_new2(etd->nsp, sv[1], pair);
+    close(sv[0]);
+    close(sv[1]);
+    AssertNonNull(pair->ping);
+    AssertNonNull(pair->pong);
+  }
+#else
+  etd->skip = 1;
+#endif
+  return 0;
+}
+
+static int engine_setup_epoll(void **tdata) {
+  return engine_setup((struct engine_test_data **)tdata, "epoll");
+}
+
+static int engine_setup_iouring(void **tdata) {
+  return engine_setup((struct engine_test_data **)tdata, "io_uring");
+}
+
+static int engine_teardown(void *tdata) {
+  struct engine_test_data *etd = (struct engine_test_data *)tdata;
+
+  if (etd) {
+    if (etd->nsp)
+      nsp_delete(etd->nsp); /* also deletes the IODs */
+    free(etd);
+  }
+  nsock_set_default_engine(NULL);
+  return 0;
+}
+
+static int engine_pingpong(void *tdata) {
+  struct engine_test_data *etd = (struct engine_test_data *)tdata;
+  struct timeval start, end;
+  double elapsed;
+  int i;
+
+  if (etd->skip) {
+    printf("(%s unavailable) ", etd->engine);
+    return 0;
+  }
+
+  gettimeofday(&start, NULL);
+  for (i = 0; i < ENGINE_PAIRS; i++) {
+    nsock_read(etd->nsp, etd->pairs[i].pong, pong_handler, -1, &etd->pairs[i]);
+    ping_send(etd->nsp, &etd->pairs[i]);
+  }
+  etd->active = ENGINE_PAIRS;
+
+  nsock_loop(etd->nsp, 60000);
+  gettimeofday(&end, NULL);
+
+  if (etd->error)
+    return etd->error;
+  AssertEqual(etd->active, 0);
+
+  for (i = 0; i < ENGINE_PAIRS; i++)
+    AssertEqual(etd->pairs[i].rounds, ENGINE_ROUNDS);
+
+  elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+  if (elapsed > 0)
+    printf("(%.0f msg/s) ", ENGINE_PAIRS * ENGINE_ROUNDS / elapsed);
+  return 0;
+}
+
+
+const struct test_case TestEngineEpoll = {
+  .t_name     = "epoll engine ping-pong",
+  .t_setup    = engine_setup_epoll,
+  .t_run      = engine_pingpong,
+  .t_teardown = engine_teardown
+};
+
+const struct test_case TestEngineIOUring = {
+  .t_name     = "io_uring engine ping-pong",
+  .t_setup    = engine_setup_iouring,
+  .t_run      = engine_pingpong,
+  .t_teardown = engine_teardown
+};
@@ -37,6 +37,8 @@ extern const struct test_case TestGHHeaps;
 extern const struct test_case TestHeapOrdering;
 extern const struct test_case TestCancelTCP;
 extern const struct test_case TestCancelUDP;
+extern const struct test_case TestEngineEpoll;
+extern const struct test_case TestEngineIOUring;
 #ifdef HAVE_OPENSSL
 extern const struct test_case TestCancelSSL;
 #endif
@@ -64,6 +66,9 @@ static const struct test_case *TestCases[] = {
 #ifdef HAVE_OPENSSL
   &TestCancelSSL,
 #endif
+  /* ---- engines.c */
+  &TestEngineEpoll,
+  &TestEngineIOUring,
   NULL
 };
 
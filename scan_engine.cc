@@ -494,6 +494,7 @@ HostScanStats::HostScanStats(Target *t, UltraScanInfo *UltraSI) {
   retry_capped_warned = false;
   num_probes_active = 0;
   num_probes_waiting_retransmit = 0;
+  first_active_probe = probes_outstanding.end();
   lastping_sent = lastprobe_sent = lastrcvd = USI->now;
   lastping_sent_numprobes = 0;
   nxtpseq = 1;
@@ -577,7 +578,6 @@ unsigned long HostScanStats::probeExpireTime(const UltraProbe *probe) {
    true. */
 bool HostScanStats::sendOK(struct timeval *when) {
   struct ultra_timing_vals tmng;
-  std::list<UltraProbe *>::iterator probeI;
   struct timeval probe_to, earliest_to, sendTime;
   long tdiff;
 
@@ -631,14 +631,11 @@ bool HostScanStats::sendOK(struct timeval *when) {
 
   TIMEVAL_MSEC_ADD(earliest_to, USI->now, 10000);
 
-  // Any timeouts coming up?
-  for (probeI = probes_outstanding.begin(); probeI != probes_outstanding.end();
-       probeI++) {
-    if (!(*probeI)->timedout) {
-      TIMEVAL_MSEC_ADD(probe_to, (*probeI)->sent, probeTimeout() / 1000);
-      if (TIMEVAL_SUBTRACT(probe_to, earliest_to) < 0) {
-        earliest_to = probe_to;
-      }
+  // Any timeouts coming up?  The first active probe times out first.
+  if (first_active_probe != probes_outstanding.end()) {
+    TIMEVAL_MSEC_ADD(probe_to, (*first_active_probe)->sent, probeTimeout() / 1000);
+    if (TIMEVAL_SUBTRACT(probe_to, earliest_to) < 0) {
+      earliest_to = probe_to;
     }
   }
 
@@ -670,27 +667,16 @@ bool HostScanStats::sendOK(struct timeval *when) {
    the earliest one and returns true.  Otherwise returns false and
    puts now in when. */
 bool HostScanStats::nextTimeout(struct timeval *when) {
-  struct timeval probe_to, earliest_to;
-  std::list<UltraProbe *>::iterator probeI;
-  bool firstgood = true;
-
   assert(when);
-  memset(&probe_to, 0, sizeof(probe_to));
-  memset(&earliest_to, 0, sizeof(earliest_to));
 
-  for (probeI = probes_outstanding.begin(); probeI != probes_outstanding.end();
-       probeI++) {
-    if (!(*probeI)->timedout) {
-      TIMEVAL_ADD(probe_to, (*probeI)->sent, probeTimeout());
-      if (firstgood || TIMEVAL_SUBTRACT(probe_to, earliest_to) < 0) {
-        earliest_to = probe_to;
-        firstgood = false;
-      }
-    }
+  /* Active probes time out in the order they were sent. */
+  if (first_active_probe == probes_outstanding.end()) {
+    *when = USI->now;
+    return false;
   }
 
-  *when = (firstgood) ? USI->now : earliest_to;
-  return !firstgood;
+  TIMEVAL_ADD(*when, (*first_active_probe)->sent, probeTimeout());
+  return true;
 }
 
 /* gives the maximum try number (try numbers start at zero and
@@ -757,6 +743,11 @@ UltraScanInfo::~UltraScanInfo() {
   }
   delete gstats;
   delete SPM;
+  close_ip_send_queue(&sendQueue);
+  if (sendQueue.ring) {
+    eth_txring_close(sendQueue.ring);
+    sendQueue.ring = NULL;
+  }
   if (rawsd >= 0) {
     close(rawsd);
     rawsd = -1;
@@ -947,6 +938,8 @@ void UltraScanInfo::Init(std::vector<Target *> &Targets, struct scan_lists *pts,
   completedHostLifetime = 120000;
   memset(&lastCompletedHostRemoval, 0, sizeof(lastCompletedHostRemoval));
 
+  hostsByAddr.clear();
+  duplicateHostAddrs = false;
   for (targetno = 0; targetno < Targets.size(); targetno++) {
     if (Targets[targetno]->timedOut(&now)) {
       num_timedout++;
@@ -955,6 +948,8 @@ void UltraScanInfo::Init(std::vector<Target *> &Targets, struct scan_lists *pts,
 
     hss = new HostScanStats(Targets[targetno], this);
     incompleteHosts.push_back(hss);
+    if (!hostsByAddr.insert(std::make_pair(*Targets[targetno]->TargetSockAddr(), hss)).second)
+      duplicateHostAddrs = true;
   }
   numInitialTargets = Targets.size();
   nextI = incompleteHosts.begin();
@@ -976,6 +971,10 @@ void UltraScanInfo::Init(std::vector<Target *> &Targets, struct scan_lists *pts,
       ethsd = eth_open_cached(Targets[0]->deviceName());
       if (ethsd == NULL)
         fatal("dnet: Failed to open device %s", Targets[0]->deviceName());
+      /* Send IP probes through a TX ring if we can. ARP and ND probes still
+         go through ethsd. */
+      if (!ping_scan_arp && !ping_scan_nd)
+        sendQueue.ring = eth_txring_open(Targets[0]->deviceName(), IP_SEND_QUEUE_MAX);
       rawsd = -1;
     } else {
 #ifdef WIN32
@@ -1112,6 +1111,23 @@ bool UltraScanInfo::sendOK(struct timeval *when) {
 /* Find a HostScanStats by its IP address in the incomplete and completed lists.
    Returns NULL if none are found. */
 HostScanStats *UltraScanInfo::findHost(struct sockaddr_storage *ss) {
+  std::map<struct sockaddr_storage, HostScanStats *, lt_sockaddr_storage>::iterator it;
+
+  /* With duplicate targets, the incomplete one must win. Only the lists know
+     which one that is. */
+  if (duplicateHostAddrs)
+    return findHostInLists(ss);
+
+  it = hostsByAddr.find(*ss);
+  if (it == hostsByAddr.end())
+    return NULL;
+  if (o.debugging > 2)
+    log_write(LOG_STDOUT, "Found %s in %s hosts list.\n", it->second->target->targetipstr(),
+              it->second->completiontime.tv_sec == 0 ? "incomplete" : "completed");
+  return it->second;
+}
+
+HostScanStats *UltraScanInfo::findHostInLists(struct sockaddr_storage *ss) {
   std::list<HostScanStats *>::iterator hss;
   struct sockaddr_storage target_addr;
   size_t target_addr_len;
@@ -1182,6 +1198,8 @@ int UltraScanInfo::removeCompletedHosts() {
 
       TIMEVAL_MSEC_ADD(compare, hss->completiontime, completedHostLifetime);
       if (TIMEVAL_AFTER(now, compare) ) {
+        if (!duplicateHostAddrs)
+          hostsByAddr.erase(*hss->target->TargetSockAddr());
         completedHosts.erase(hostI);
         hostsRemoved++;
       }
@@ -1571,10 +1589,53 @@ void HostScanStats::destroyOutstandingProbe(std::list<UltraProbe *>::iterator pr
   if (probe->type == UltraProbe::UP_CONNECT && probe->CP()->sd > 0)
     USI->gstats->CSI->clearSD(probe->CP()->sd);
 
-  probes_outstanding.erase(probeI);
+  removeOutstandingProbe(probeI);
   delete probe;
 }
 
+/* Returns the key of a probe in HostScanStats::probes_by_key. */
+u32 probe_key(const UltraProbe *probe) {
+  switch (probe->protocol()) {
+  case IPPROTO_TCP:
+  case IPPROTO_UDP:
+  case IPPROTO_SCTP:
+    return probe_key(probe->protocol(), probe->dport());
+  case IPPROTO_ICMP:
+  case IPPROTO_ICMPV6:
+    if (probe->type == UltraProbe::UP_IP)
+      return probe_key(probe->protocol(), probe->icmpid());
+    break;
+  }
+  return probe_key(probe->protocol(), 0);
+}
+
+std::list<UltraProbe *>::iterator HostScanStats::addOutstandingProbe(UltraProbe *probe) {
+  std::list<UltraProbe *>::iterator probeI;
+
+  probeI = probes_outstanding.insert(probes_outstanding.end(), probe);
+  if (first_active_probe == probes_outstanding.end())
+    first_active_probe = probeI;
+  probes_by_key.insert(std::make_pair(probe_key(probe), probeI));
+
+  return probeI;
+}
+
+void HostScanStats::removeOutstandingProbe(std::list<UltraProbe *>::iterator probeI) {
+  std::pair<probe_index::iterator, probe_index::iterator> range;
+  probe_index::iterator keyI;
+
+  range = probesByKey(probe_key(*probeI));
+  for (keyI = range.first; keyI != range.second; keyI++) {
+    if (keyI->second == probeI) {
+      probes_by_key.erase(keyI);
+      break;
+    }
+  }
+  if (probeI == first_active_probe)
+    first_active_probe++;
+  probes_outstanding.erase(probeI);
+}
+
 /* Removes all probes from probes_outstanding using
    destroyOutstandingProbe. This is used in ping scan to quit waiting
    for responses once a host is known to be up. Invalidates iterators
@@ -1677,6 +1738,11 @@ void HostScanStats::markProbeTimedout(std::list<UltraProbe *>::iterator probeI)
   assert(!probe->timedout);
   assert(!probe->retransmitted);
   probe->timedout = true;
+  /* Move it with the other timed out probes */
+  if (probeI == first_active_probe)
+    first_active_probe++;
+  else
+    probes_outstanding.splice(first_active_probe, probes_outstanding, probeI);
   assert(num_probes_active > 0);
   num_probes_active--;
   assert(USI->gstats->num_probes_active > 0);
@@ -1951,7 +2017,7 @@ void HostScanStats::moveProbeToBench(std::list<UltraProbe *>::iterator probeI) {
     probe_bench.reserve(128);
   }
   probe_bench.push_back(*probe->pspec());
-  probes_outstanding.erase(probeI);
+  removeOutstandingProbe(probeI);
   num_probes_waiting_retransmit--;
   delete probe;
 }
@@ -2372,17 +2438,17 @@ static void doAnyOutstandingRetransmits(UltraScanInfo *USI) {
          hostI != USI->incompleteHosts.end() && USI->gstats->sendOK(NULL);
          hostI++) {
       host = *hostI;
-      /* Skip this host if it has nothing to send. */
-      if ((host->num_probes_active == 0
-           && host->num_probes_waiting_retransmit == 0))
+      /* Skip this host if it has nothing to retransmit. */
+      if (host->num_probes_waiting_retransmit == 0)
         continue;
       if (!host->sendOK(NULL))
         continue;
-      assert(!host->probes_outstanding.empty());
+      assert(host->probes_outstanding.begin() != host->first_active_probe);
 
-      /* Initialize the probe cache if necessary. */
+      /* Initialize the probe cache if necessary. Only the probes before
+         first_active_probe have timed out. */
       if (probe_cache.find(host) == probe_cache.end())
-        probe_cache[host] = host->probes_outstanding.end();
+        probe_cache[host] = host->first_active_probe;
       /* Restore the probe iterator from the cache. */
       probeI = probe_cache[host];
 
@@ -2410,7 +2476,7 @@ static void doAnyOutstandingRetransmits(UltraScanInfo *USI) {
 
       /* Wrap the probe iterator around. */
       if (probeI == host->probes_outstanding.begin())
-        probeI = host->probes_outstanding.end();
+        probeI = host->first_active_probe;
       /* Cache the probe iterator. */
       probe_cache[host] = probeI;
     }
@@ -2468,13 +2534,17 @@ static void printAnyStats(UltraScanInfo *USI) {
 static void waitForResponses(UltraScanInfo *USI) {
   struct timeval stime;
   bool gotone;
+  bool batch_pending = false;
   gettimeofday(&USI->now, NULL);
   USI->gstats->last_wait = USI->now;
   USI->gstats->probes_sent_at_last_wait = USI->gstats->probes_sent;
 
   do {
     gotone = false;
-    USI->sendOK(&stime);
+    /* The rest of a batch of packets read in the previous iteration is
+       handled without recomputing the sending time for each packet. */
+    if (!batch_pending)
+      USI->sendOK(&stime);
     if (USI->ping_scan_arp) {
       gotone = get_arp_result(USI, &stime);
     } else if (USI->ping_scan_nd) {
@@ -2489,6 +2559,7 @@ static void waitForResponses(UltraScanInfo *USI) {
     } else if (USI->scantype == CONNECT_SCAN) {
       gotone = do_one_select_round(USI, &stime);
     } else assert(0);
+    batch_pending = USI->pd && pcap_batch_pending(&USI->pcapBatch);
   } while (gotone && USI->gstats->num_probes_active > 0);
 
   gettimeofday(&USI->now, NULL);
@@ -2543,8 +2614,10 @@ static void processData(UltraScanInfo *USI) {
       }
     }
 
+    /* Only the probes that have already timed out, which are kept before
+       the active ones, need to be looked at. */
     for (probeI = host->probes_outstanding.begin();
-         probeI != host->probes_outstanding.end(); probeI = nextProbeI) {
+         probeI != host->first_active_probe; probeI = nextProbeI) {
       nextProbeI = probeI;
       nextProbeI++;
       probe = *probeI;
@@ -2552,17 +2625,6 @@ static void processData(UltraScanInfo *USI) {
       // give up completely after this long
       expire_us = host->probeExpireTime(probe);
 
-      if (!probe->timedout && TIMEVAL_SUBTRACT(USI->now, probe->sent) >
-          (long) host->probeTimeout()) {
-        host->markProbeTimedout(probeI);
-        /* Once we've timed out a probe, skip it for this round of processData.
-           We don't want it to move to the bench or anything until the other
-           functions have had a chance to see that it's timed out. In
-           particular, timing out a probe may mean that the tryno can no longer
-           increase, which would make the logic below incorrect. */
-        continue;
-      }
-
       if (!probe->isPing() && probe->timedout && !probe->retransmitted) {
         if (!tryno_mayincrease && probe->tryno >= maxtries) {
           if (tryno_capped && !host->retry_capped_warned) {
@@ -2598,6 +2660,18 @@ static void processData(UltraScanInfo *USI) {
         continue;
       }
     }
+
+    /* Active probes time out in the order they were sent, so stop at the
+       first one that hasn't. Once we've timed out a probe, it is skipped for
+       this round of processData. We don't want it to move to the bench or
+       anything until the other functions have had a chance to see that it's
+       timed out. In particular, timing out a probe may mean that the tryno can
+       no longer increase, which would make the logic above incorrect. */
+    while (host->first_active_probe != host->probes_outstanding.end()
+           && TIMEVAL_SUBTRACT(USI->now, (*host->first_active_probe)->sent) >
+           (long) host->probeTimeout()) {
+      host->markProbeTimedout(host->first_active_probe);
+    }
   }
 
   /* In case any hosts were completed during this run */
@@ -2700,6 +2774,8 @@ void ultra_scan(std::vector<Target *> &Targets, struct scan_lists *ports,
        memory consumption reasons */
     doAnyRetryStackRetransmits(&USI);
     doAnyNewProbes(&USI);
+    /* Everything built in this round goes out together. */
+    flush_ip_packets(&USI.sendQueue);
     gettimeofday(&USI.now, NULL);
     // printf("TRACE: Finished doAnyNewProbes() at %.4fs\n", o.TimeSinceStartMS(&USI.now) / 1000.0);
     printAnyStats(&USI);
@@ -132,8 +132,13 @@
 #include "timing.h"
 #include "tcpip.h"
 #include <list>
+#include <map>
 #include <vector>
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
 struct probespec_tcpdata {
   u16 dport;
   u8 flags;
@@ -351,31 +356,50 @@ private:
   } probes;
 };
 
+class HostScanStats;
+
+/* The connect probe waiting on a socket descriptor */
+struct ConnectWatch {
+  HostScanStats *hss;
+  std::list<UltraProbe *>::iterator probeI;
+};
+
 /* Global info for the connect scan */
 class ConnectScanInfo {
 public:
   ConnectScanInfo();
   ~ConnectScanInfo();
 
-  /* Watch a socket descriptor (add to fd_sets and maxValidSD).  Returns
-     true if the SD was absent from the list, false if you tried to
+  /* Watch a socket descriptor for the connect probe at probeI of hss.
+     Returns true if the SD was absent from the list, false if you tried to
      watch an SD that was already being watched. */
-  bool watchSD(int sd);
+  bool watchSD(int sd, HostScanStats *hss,
+               std::list<UltraProbe *>::iterator probeI);
 
-  /* Clear SD from the fd_sets and maxValidSD.  Returns true if the SD
-   was in the list, false if you tried to clear an sd that wasn't
-   there in the first place. */
+  /* Stop watching SD.  Returns true if the SD was in the list, false if you
+   tried to clear an sd that wasn't there in the first place. */
   bool clearSD(int sd);
+
+  /* Waits up to timeout milliseconds for watched SDs to become ready and
+     fills readySDs with them.  Returns the number of ready SDs, or -1 on
+     error. */
+  int waitSDs(int timeout, std::vector<int> &readySDs);
+
+  /* The probe waiting on each watched SD */
+  std::map<int, ConnectWatch> watches;
+#ifdef HAVE_SYS_EPOLL_H
+  int epfd;
+  std::vector<struct epoll_event> events;
+#else
   int maxValidSD; /* The maximum socket descriptor in any of the fd_sets */
   fd_set fds_read;
   fd_set fds_write;
   fd_set fds_except;
+#endif
   int numSDs; /* Number of socket descriptors being watched */
   int maxSocketsAllowed; /* No more than this many sockets may be created @once */
 };
 
-class HostScanStats;
-
 /* These are ultra_scan() statistics for the whole group of Targets */
 class GroupScanStats {
 public:
@@ -524,14 +548,33 @@ public:
      accordingly.  For connect scans, this closes the socket. */
   void markProbeTimedout(std::list<UltraProbe *>::iterator probeI);
 
+  /* Appends a probe that was just sent to probes_outstanding and indexes it.
+     Returns its position in probes_outstanding. */
+  std::list<UltraProbe *>::iterator addOutstandingProbe(UltraProbe *probe);
+
   /* New (active) probes are appended to the end of this list.  When a
      host times out, it will be marked as such, but may hang around on
      the list for a while just in case a response comes in.  So use
      num_probes_active to learn how many active (not timed out) probes
      are outstanding.  Probes on the bench (reached the current
      maximum tryno and expired) are not counted in
-     probes_outstanding.  */
+     probes_outstanding.  Always add probes with addOutstandingProbe().  */
   std::list<UltraProbe *> probes_outstanding;
+  /* The first active probe of probes_outstanding.  Timed out probes are
+     kept before it and active ones from it on, so active probes are in the
+     order they were sent, which is also the order in which they will time
+     out.  probes_outstanding.end() if there are no active probes. */
+  std::list<UltraProbe *>::iterator first_active_probe;
+  /* probes_outstanding indexed by protocol and the field a response is
+     matched on (see probe_key()), for finding the probe that provoked a
+     response without walking the whole list.  Probes with the same key are
+     in the order they were sent. */
+  typedef std::multimap<u32, std::list<UltraProbe *>::iterator> probe_index;
+  probe_index probes_by_key;
+  /* Returns the probes with the given key, oldest first. */
+  std::pair<probe_index::iterator, probe_index::iterator> probesByKey(u32 key) {
+    return probes_by_key.equal_range(key);
+  }
   /* The number of probes in probes_outstanding, minus the inactive (timed out) ones */
   unsigned int num_probes_active;
   /* Probes timed out but not yet retransmitted because of congestion
@@ -631,6 +674,9 @@ public:
 
 private:
   u8 nxtpseq; /* the next scanping sequence number to use */
+  /* Removes a probe from probes_outstanding and probes_by_key, without
+     deleting it. */
+  void removeOutstandingProbe(std::list<UltraProbe *>::iterator probeI);
 };
 
 /* A few extra performance tuning parameters specific to ultra_scan. */
@@ -743,13 +789,28 @@ public:
   struct scan_lists *ports;
   int rawsd; /* raw socket descriptor */
   pcap_t *pd;
+  /* Packets read from pd but not processed yet */
+  struct pcap_batch pcapBatch;
   eth_t *ethsd;
+  /* Raw probes built but not sent yet. Flushed once per round of
+     ultra_scan(), after all the probes of the round are built. */
+  struct ip_send_queue sendQueue;
   u32 seqmask; /* This mask value is used to encode values in sequence
                   numbers.  It is set randomly in UltraScanInfo::Init() */
 private:
 
   unsigned int numInitialTargets;
   std::list<HostScanStats *>::iterator nextI;
+  /* Every host of incompleteHosts and completedHosts, indexed by address so
+     that findHost() doesn't have to walk both lists for each received
+     packet. */
+  std::map<struct sockaddr_storage, HostScanStats *, lt_sockaddr_storage> hostsByAddr;
+  /* Set if two targets have the same address. hostsByAddr can't tell them
+     apart, so findHost() falls back to searching the lists. */
+  bool duplicateHostAddrs;
+  /* Linear version of findHost(), used when several targets share an
+     address. */
+  HostScanStats *findHostInLists(struct sockaddr_storage *ss);
 
 };
 
@@ -757,6 +818,13 @@ private:
    individual host */
 enum ultra_timing_type { TIMING_HOST, TIMING_GROUP };
 
+/* The key of a probe in HostScanStats::probes_by_key: the protocol and the
+   destination port or ICMP identifier, as echoed back in responses. */
+static inline u32 probe_key(u8 proto, u16 id) {
+  return ((u32) proto << 16) | id;
+}
+u32 probe_key(const UltraProbe *probe);
+
 const char *pspectype2ascii(int type);
 
 void ultrascan_port_probe_update(UltraScanInfo *USI, HostScanStats *hss,
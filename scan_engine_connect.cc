@@ -143,7 +143,6 @@ void UltraProbe::setConnect(u16 portno) {
 }
 
 ConnectScanInfo::ConnectScanInfo() {
-  maxValidSD = -1;
   numSDs = 0;
   if (o.max_parallelism > 0) {
     maxSocketsAllowed = o.max_parallelism;
@@ -163,50 +162,125 @@ ConnectScanInfo::ConnectScanInfo() {
     if (maxSocketsAllowed < 5)
       maxSocketsAllowed = 5;
   }
+#ifdef HAVE_SYS_EPOLL_H
+  /* epoll has no limit on the descriptor numbers, only the descriptor
+     limit applies. */
+  epfd = epoll_create(maxSocketsAllowed);
+  if (epfd == -1)
+    pfatal("epoll_create failed in %s", __func__);
+  events.resize(MIN(maxSocketsAllowed, 4096));
+#else
   maxSocketsAllowed = MIN(maxSocketsAllowed, FD_SETSIZE - 10);
+  maxValidSD = -1;
   FD_ZERO(&fds_read);
   FD_ZERO(&fds_write);
   FD_ZERO(&fds_except);
+#endif
 }
 
-/* Nothing really to do here. */
-ConnectScanInfo::~ConnectScanInfo() {}
+ConnectScanInfo::~ConnectScanInfo() {
+#ifdef HAVE_SYS_EPOLL_H
+  close(epfd);
+#endif
+}
 
-/* Watch a socket descriptor (add to fd_sets and maxValidSD).  Returns
-   true if the SD was absent from the list, false if you tried to
+/* Watch a socket descriptor for the connect probe at probeI of hss.
+   Returns true if the SD was absent from the list, false if you tried to
    watch an SD that was already being watched. */
-bool ConnectScanInfo::watchSD(int sd) {
+bool ConnectScanInfo::watchSD(int sd, HostScanStats *hss,
+                              std::list<UltraProbe *>::iterator probeI) {
+  ConnectWatch watch;
+
   assert(sd >= 0);
-  if (!checked_fd_isset(sd, &fds_read)) {
-    checked_fd_set(sd, &fds_read);
-    checked_fd_set(sd, &fds_write);
-    checked_fd_set(sd, &fds_except);
-    numSDs++;
-    if (sd > maxValidSD)
-      maxValidSD = sd;
-    return true;
-  } else {
+  if (watches.find(sd) != watches.end())
     return false;
-  }
+
+#ifdef HAVE_SYS_EPOLL_H
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLPRI;
+  ev.data.fd = sd;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, sd, &ev) == -1)
+    pfatal("epoll_ctl failed in %s", __func__);
+#else
+  checked_fd_set(sd, &fds_read);
+  checked_fd_set(sd, &fds_write);
+  checked_fd_set(sd, &fds_except);
+  if (sd > maxValidSD)
+    maxValidSD = sd;
+#endif
+  watch.hss = hss;
+  watch.probeI = probeI;
+  watches[sd] = watch;
+  numSDs++;
+  return true;
 }
 
-/* Clear SD from the fd_sets and maxValidSD.  Returns true if the SD
-   was in the list, false if you tried to clear an sd that wasn't
-   there in the first place. */
+/* Stop watching SD.  Returns true if the SD was in the list, false if you
+   tried to clear an sd that wasn't there in the first place. */
 bool ConnectScanInfo::clearSD(int sd) {
+  std::map<int, ConnectWatch>::iterator watchI;
+
   assert(sd >= 0);
-  if (checked_fd_isset(sd, &fds_read)) {
-    checked_fd_clr(sd, &fds_read);
-    checked_fd_clr(sd, &fds_write);
-    checked_fd_clr(sd, &fds_except);
-    assert(numSDs > 0);
-    numSDs--;
-    if (sd == maxValidSD)
-      maxValidSD--;
-    return true;
-  } else {
+  watchI = watches.find(sd);
+  if (watchI == watches.end())
     return false;
+
+#ifdef HAVE_SYS_EPOLL_H
+  struct epoll_event ev;
+
+  /* A non-NULL event is needed by kernels before 2.6.9. */
+  if (epoll_ctl(epfd, EPOLL_CTL_DEL, sd, &ev) == -1)
+    pfatal("epoll_ctl failed in %s", __func__);
+#else
+  checked_fd_clr(sd, &fds_read);
+  checked_fd_clr(sd, &fds_write);
+  checked_fd_clr(sd, &fds_except);
+  if (sd == maxValidSD)
+    maxValidSD--;
+#endif
+  watches.erase(watchI);
+  assert(numSDs > 0);
+  numSDs--;
+  return true;
+}
+
+/* Waits up to timeout milliseconds for watched SDs to become ready and fills
+   readySDs with them.  Returns the number of ready SDs, or -1 on error. */
+int ConnectScanInfo::waitSDs(int timeout, std::vector<int> &readySDs) {
+  int res, i;
+
+  readySDs.clear();
+  if (numSDs == 0) {
+    /* Apparently Windows returns an WSAEINVAL if you select without watching any SDs.  Lame.  We'll usleep instead in that case */
+    usleep(timeout * 1000);
+    return 0;
+  }
+
+#ifdef HAVE_SYS_EPOLL_H
+  res = epoll_wait(epfd, &events[0], events.size(), timeout);
+  for (i = 0; i < res; i++)
+    readySDs.push_back(events[i].data.fd);
+#else
+  fd_set fds_rtmp, fds_wtmp, fds_xtmp;
+  std::map<int, ConnectWatch>::iterator watchI;
+  struct timeval tv;
+
+  fds_rtmp = fds_read;
+  fds_wtmp = fds_write;
+  fds_xtmp = fds_except;
+  tv.tv_sec = timeout / 1000;
+  tv.tv_usec = (timeout % 1000) * 1000;
+  res = select(maxValidSD + 1, &fds_rtmp, &fds_wtmp, &fds_xtmp, &tv);
+  for (watchI = watches.begin(); watchI != watches.end() && (int) readySDs.size() < res; watchI++) {
+    i = watchI->first;
+    if (checked_fd_isset(i, &fds_rtmp) || checked_fd_isset(i, &fds_wtmp)
+        || checked_fd_isset(i, &fds_xtmp))
+      readySDs.push_back(i);
   }
+#endif
+  return res;
 }
 
 ConnectProbe::ConnectProbe() {
@@ -444,9 +518,7 @@ UltraProbe *sendConnectScanProbe(UltraScanInfo *USI, HostScanStats *hss,
   if (rc == -1)
     connect_errno = socket_errno();
   /* This counts as probe being sent, so update structures */
-  hss->probes_outstanding.push_back(probe);
-  probeI = hss->probes_outstanding.end();
-  probeI--;
+  probeI = hss->addOutstandingProbe(probe);
   USI->gstats->num_probes_active++;
   hss->num_probes_active++;
 
@@ -457,7 +529,7 @@ UltraProbe *sendConnectScanProbe(UltraScanInfo *USI, HostScanStats *hss,
   if (rc == -1 && (connect_errno == EINPROGRESS || connect_errno == EAGAIN)) {
     PacketTrace::traceConnect(IPPROTO_TCP, (sockaddr *) &sock, socklen, rc,
         connect_errno, &USI->now);
-    USI->gstats->CSI->watchSD(CP->sd);
+    USI->gstats->CSI->watchSD(CP->sd, hss, probeI);
   } else {
     handleConnectResult(USI, hss, probeI, connect_errno, true);
     probe = NULL;
@@ -466,19 +538,22 @@ UltraProbe *sendConnectScanProbe(UltraScanInfo *USI, HostScanStats *hss,
   return probe;
 }
 
-/* Does a select() call and handles all of the results. This handles both host
-   discovery (ping) scans and port scans.  Even if stime is now, it tries a very
-   quick select() just in case.  Returns true if at least one good result
-   (generally a port state change) is found, false if it times out instead */
+/* Waits for connect results and handles all of them, using epoll where it is
+   available and select() otherwise. This handles both host discovery (ping)
+   scans and port scans.  Even if stime is now, it tries a very quick wait just
+   in case.  Returns true if at least one good result (generally a port state
+   change) is found, false if it times out instead */
 bool do_one_select_round(UltraScanInfo *USI, struct timeval *stime) {
-  fd_set fds_rtmp, fds_wtmp, fds_xtmp;
   int selectres;
-  struct timeval timeout;
   int timeleft;
   ConnectScanInfo *CSI = USI->gstats->CSI;
+  /* Static to avoid reallocating it every round. */
+  static std::vector<int> readySDs;
+  std::vector<int>::iterator sdI;
+  std::map<int, ConnectWatch>::iterator watchI;
   int sd;
-  std::list<HostScanStats *>::iterator hostI;
   HostScanStats *host;
+  std::list<UltraProbe *>::iterator probeI;
   UltraProbe *probe = NULL;
   int optval;
   recvfrom6_t optlen = sizeof(int);
@@ -489,21 +564,8 @@ bool do_one_select_round(UltraScanInfo *USI, struct timeval *stime) {
     timeleft = TIMEVAL_MSEC_SUBTRACT(*stime, USI->now);
     if (timeleft < 0)
       timeleft = 0;
-    fds_rtmp = USI->gstats->CSI->fds_read;
-    fds_wtmp = USI->gstats->CSI->fds_write;
-    fds_xtmp = USI->gstats->CSI->fds_except;
-    timeout.tv_sec = timeleft / 1000;
-    timeout.tv_usec = (timeleft % 1000) * 1000;
-
-    if (CSI->numSDs) {
-      selectres = select(CSI->maxValidSD + 1, &fds_rtmp, &fds_wtmp,
-                         &fds_xtmp, &timeout);
-      err = socket_errno();
-    } else {
-      /* Apparently Windows returns an WSAEINVAL if you select without watching any SDs.  Lame.  We'll usleep instead in that case */
-      usleep(timeleft * 1000);
-      selectres = 0;
-    }
+    selectres = CSI->waitSDs(timeleft, readySDs);
+    err = socket_errno();
   } while (selectres == -1 && err == EINTR);
 
   gettimeofday(&USI->now, NULL);
@@ -514,48 +576,28 @@ bool do_one_select_round(UltraScanInfo *USI, struct timeval *stime) {
   if (!selectres)
     return false;
 
-  /* Yay!  Got at least one response back -- loop through outstanding probes
-     and find the relevant ones. Note the peculiar structure of the loop--we
-     iterate through both incompleteHosts and completedHosts, because global
-     timing pings are sent to hosts in completedHosts. */
-  std::list<HostScanStats *>::iterator incompleteHostI, completedHostI;
-  incompleteHostI = USI->incompleteHosts.begin();
-  completedHostI = USI->completedHosts.begin();
-  while ((incompleteHostI != USI->incompleteHosts.end()
-          || completedHostI != USI->completedHosts.end())
-         && numGoodSD < selectres) {
-    if (incompleteHostI != USI->incompleteHosts.end())
-      hostI = incompleteHostI++;
-    else
-      hostI = completedHostI++;
-
-    host = *hostI;
-    if (host->num_probes_active == 0)
+  /* Yay!  Got at least one response back -- look up the probe waiting on each
+     ready SD.  The probes of both incompleteHosts and completedHosts are
+     watched, because global timing pings are sent to hosts in
+     completedHosts. */
+  for (sdI = readySDs.begin(); sdI != readySDs.end(); sdI++) {
+    sd = *sdI;
+    /* handleConnectResult may have removed the probe for this SD already, for
+       example when a host found up has all of its other probes destroyed. */
+    watchI = CSI->watches.find(sd);
+    if (watchI == CSI->watches.end())
       continue;
+    host = watchI->second.hss;
+    probeI = watchI->second.probeI;
+    probe = *probeI;
+    assert(probe->type == UltraProbe::UP_CONNECT);
+    assert(probe->CP()->sd == sd);
+    numGoodSD++;
+    if (getsockopt(sd, SOL_SOCKET, SO_ERROR, (char *) &optval,
+                   &optlen) != 0)
+      optval = socket_errno(); /* Stupid Solaris ... */
 
-    std::list<UltraProbe *>::iterator nextProbeI;
-    for (std::list<UltraProbe *>::iterator probeI = host->probes_outstanding.begin(), end = host->probes_outstanding.end();
-        probeI != end && numGoodSD < selectres && host->num_probes_outstanding() > 0; probeI = nextProbeI) {
-      /* handleConnectResult may remove the probe at probeI, which invalidates
-       * the iterator. We copy and increment it here instead of in the for-loop
-       * statement to avoid incrementing an invalid iterator */
-      nextProbeI = probeI;
-      nextProbeI++;
-      probe = *probeI;
-      assert(probe->type == UltraProbe::UP_CONNECT);
-      sd = probe->CP()->sd;
-      /* Let see if anything has happened! */
-      if (sd >= 0 && (checked_fd_isset(sd, &fds_rtmp) ||
-                      checked_fd_isset(sd, &fds_wtmp) ||
-                      checked_fd_isset(sd, &fds_xtmp))) {
-        numGoodSD++;
-        if (getsockopt(sd, SOL_SOCKET, SO_ERROR, (char *) &optval,
-                       &optlen) != 0)
-          optval = socket_errno(); /* Stupid Solaris ... */
-
-        handleConnectResult(USI, host, probeI, optval);
-      }
-    }
+    handleConnectResult(USI, host, probeI, optval);
   }
   return numGoodSD;
 }
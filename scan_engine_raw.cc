@@ -473,6 +473,32 @@ static bool tcp_probe_match(const UltraScanInfo *USI, const UltraProbe *probe,
   return true;
 }
 
+/* Finds the probes_by_key key of the probe that an ICMP error quoting the
+   packet with header encaps_hdr and data encaps_data would be a response to.
+   Returns false if the quoted protocol is not one whose probes are looked up by
+   port. */
+static bool encaps_probe_key(const struct abstract_ip_hdr *encaps_hdr,
+                             const void *encaps_data, u32 *key) {
+  u16 dport;
+
+  switch (encaps_hdr->proto) {
+  case IPPROTO_TCP:
+    dport = ntohs(((const struct tcp_hdr *) encaps_data)->th_dport);
+    break;
+  case IPPROTO_UDP:
+    dport = ntohs(((const struct udp_hdr *) encaps_data)->uh_dport);
+    break;
+  case IPPROTO_SCTP:
+    dport = ntohs(((const struct sctp_hdr *) encaps_data)->sh_dport);
+    break;
+  default:
+    return false;
+  }
+
+  *key = probe_key(encaps_hdr->proto, dport);
+  return true;
+}
+
 /* Tries to get one *good* (finishes a probe) pcap response to a host discovery
    (ping) probe by the (absolute) time given in stime.  Even if stime is now,
    try an ultra-quick pcap read just in case.  Returns true if a "good" result
@@ -494,6 +520,10 @@ int get_ping_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
   int newstate = HOST_UNKNOWN;
   unsigned int probenum;
   unsigned int listsz;
+  std::pair<HostScanStats::probe_index::iterator, HostScanStats::probe_index::iterator> range;
+  HostScanStats::probe_index::iterator keyI;
+  u32 key;
+  bool indexed;
   reason_t current_reason = ER_NORESPONSE;
 
   struct sockaddr_storage target_src, target_dst;
@@ -507,8 +537,8 @@ int get_ping_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
     to_usec = TIMEVAL_SUBTRACT(*stime, USI->now);
     if (to_usec < 2000)
       to_usec = 2000;
-    ip_tmp = (struct ip *) readip_pcap(USI->pd, &bytes, to_usec, &rcvdtime,
-                                       &linkhdr, true);
+    ip_tmp = (struct ip *) readip_pcap_batched(USI->pd, &USI->pcapBatch, &bytes,
+                                               to_usec, &rcvdtime, &linkhdr, true);
     gettimeofday(&USI->now, NULL);
     if (!ip_tmp) {
       if (TIMEVAL_SUBTRACT(*stime, USI->now) < 0) {
@@ -555,8 +585,7 @@ int get_ping_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
         if (!hss)
           continue; // Not from a host that interests us
         setTargetMACIfAvailable(hss->target, &linkhdr, &hdr.src, 0);
-        probeI = hss->probes_outstanding.end();
-        listsz = hss->num_probes_outstanding();
+        range = hss->probesByKey(probe_key(hdr.proto, ntohs(ping->id)));
 
         ss_len = sizeof(target_src);
         hss->target->SourceSockAddr(&target_src, &ss_len);
@@ -576,8 +605,9 @@ int get_ping_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
         goodone = false;
 
         /* Find the probe that provoked this response. */
-        for (probenum = 0; probenum < listsz && !goodone; probenum++) {
-          probeI--;
+        for (keyI = range.second; keyI != range.first && !goodone; ) {
+          keyI--;
+          probeI = keyI->second;
           probe = *probeI;
 
           if (!icmp_probe_match(USI, probe, ping, &target_src, &hdr.src, &hdr.dst, hdr.proto, hdr.ipid))
@@ -635,8 +665,19 @@ int get_ping_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
         if (!hss)
           continue; // Not referring to a host that interests us
         setTargetMACIfAvailable(hss->target, &linkhdr, &encaps_hdr.dst, 0);
-        probeI = hss->probes_outstanding.end();
-        listsz = hss->num_probes_outstanding();
+        /* Probes that are matched on their ports can be looked up by them. */
+        indexed = encaps_probe_key(&encaps_hdr, encaps_data, &key)
+                  && ((encaps_hdr.proto == IPPROTO_TCP && USI->ptech.rawtcpscan)
+                      || (encaps_hdr.proto == IPPROTO_UDP && USI->ptech.rawudpscan)
+                      || (encaps_hdr.proto == IPPROTO_SCTP && USI->ptech.rawsctpscan));
+        if (indexed) {
+          range = hss->probesByKey(key);
+          keyI = range.second;
+          listsz = std::distance(range.first, range.second);
+        } else {
+          probeI = hss->probes_outstanding.end();
+          listsz = hss->num_probes_outstanding();
+        }
 
         ss_len = sizeof(target_src);
         hss->target->SourceSockAddr(&target_src, &ss_len);
@@ -645,7 +686,12 @@ int get_ping_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
 
         /* Find the probe that provoked this response. */
         for (probenum = 0; probenum < listsz; probenum++) {
-          probeI--;
+          if (indexed) {
+            keyI--;
+            probeI = keyI->second;
+          } else {
+            probeI--;
+          }
           probe = *probeI;
 
           if (probe->protocol() != encaps_hdr.proto ||
@@ -743,14 +789,14 @@ int get_ping_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       if (!hss)
         continue; // Not from a host that interests us
       setTargetMACIfAvailable(hss->target, &linkhdr, &hdr.src, 0);
-      probeI = hss->probes_outstanding.end();
-      listsz = hss->num_probes_outstanding();
+      range = hss->probesByKey(probe_key(IPPROTO_TCP, ntohs(tcp->th_sport)));
 
       goodone = false;
 
       /* Find the probe that provoked this response. */
-      for (probenum = 0; probenum < listsz && !goodone; probenum++) {
-        probeI--;
+      for (keyI = range.second; keyI != range.first && !goodone; ) {
+        keyI--;
+        probeI = keyI->second;
         probe = *probeI;
 
         if (!tcp_probe_match(USI, probe, hss, tcp, &hdr.src, &hdr.dst, hdr.ipid))
@@ -780,15 +826,15 @@ int get_ping_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       hss = USI->findHost(&hdr.src);
       if (!hss)
         continue; // Not from a host that interests us
-      probeI = hss->probes_outstanding.end();
-      listsz = hss->num_probes_outstanding();
+      range = hss->probesByKey(probe_key(IPPROTO_UDP, ntohs(udp->uh_sport)));
       goodone = false;
 
       ss_len = sizeof(target_src);
       hss->target->SourceSockAddr(&target_src, &ss_len);
 
-      for (probenum = 0; probenum < listsz && !goodone; probenum++) {
-        probeI--;
+      for (keyI = range.second; keyI != range.first && !goodone; ) {
+        keyI--;
+        probeI = keyI->second;
         probe = *probeI;
 
         if (o.af() != AF_INET || probe->protocol() != IPPROTO_UDP)
@@ -830,15 +876,15 @@ int get_ping_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       hss = USI->findHost(&hdr.src);
       if (!hss)
         continue; // Not from a host that interests us
-      probeI = hss->probes_outstanding.end();
-      listsz = hss->num_probes_outstanding();
+      range = hss->probesByKey(probe_key(IPPROTO_SCTP, ntohs(sctp->sh_sport)));
       goodone = false;
 
       ss_len = sizeof(target_dst);
       hss->target->SourceSockAddr(&target_src, &ss_len);
 
-      for (probenum = 0; probenum < listsz && !goodone; probenum++) {
-        probeI--;
+      for (keyI = range.second; keyI != range.first && !goodone; ) {
+        keyI--;
+        probeI = keyI->second;
         probe = *probeI;
 
         if (o.af() != AF_INET || probe->protocol() != IPPROTO_SCTP)
@@ -1059,7 +1105,7 @@ UltraProbe *sendArpScanProbe(UltraScanInfo *USI, HostScanStats *hss,
   probe->setARP(frame, sizeof(frame));
 
   /* Now that the probe has been sent, add it to the Queue for this host */
-  hss->probes_outstanding.push_back(probe);
+  hss->addOutstandingProbe(probe);
   USI->gstats->num_probes_active++;
   hss->num_probes_active++;
 
@@ -1128,7 +1174,7 @@ UltraProbe *sendNDScanProbe(UltraScanInfo *USI, HostScanStats *hss,
   free(packet);
 
   /* Now that the probe has been sent, add it to the Queue for this host */
-  hss->probes_outstanding.push_back(probe);
+  hss->addOutstandingProbe(probe);
   USI->gstats->num_probes_active++;
   hss->num_probes_active++;
 
@@ -1249,7 +1295,9 @@ static u8 *build_protoscan_packet(const struct sockaddr_storage *src,
 }
 
 /* If this is NOT a ping probe, set pingseq to 0.  Otherwise it will be the
-   ping sequence number (they start at 1).  The probe sent is returned.
+   ping sequence number (they start at 1).  The probe sent is returned. The
+   packets are put in USI->sendQueue and only go out when ultra_scan()
+   flushes it at the end of the round.
 
    This function also handles the sending of decoys. There is no fine-grained
    control of this; all decoys are sent at once on one call of this function.
@@ -1323,7 +1371,8 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
           probe->sent = USI->now;
         }
         hss->probeSent(packetlen);
-        send_ip_packet(USI->rawsd, ethptr, hss->target->TargetSockAddr(), packet, packetlen);
+        queue_ip_packet(&USI->sendQueue, USI->rawsd, ethptr,
+                        hss->target->TargetSockAddr(), packet, packetlen);
         free(packet);
       }
     } else if (hss->target->af() == AF_INET6) {
@@ -1343,7 +1392,8 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
       probe->setIP(packet, packetlen, pspec);
       probe->sent = USI->now;
       hss->probeSent(packetlen);
-      send_ip_packet(USI->rawsd, ethptr, hss->target->TargetSockAddr(), packet, packetlen);
+      queue_ip_packet(&USI->sendQueue, USI->rawsd, ethptr,
+                      hss->target->TargetSockAddr(), packet, packetlen);
       free(packet);
     }
   } else if (pspec->type == PS_UDP) {
@@ -1365,7 +1415,8 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
           probe->sent = USI->now;
         }
         hss->probeSent(packetlen);
-        send_ip_packet(USI->rawsd, ethptr, hss->target->TargetSockAddr(), packet, packetlen);
+        queue_ip_packet(&USI->sendQueue, USI->rawsd, ethptr,
+                        hss->target->TargetSockAddr(), packet, packetlen);
         free(packet);
       }
     } else if (hss->target->af() == AF_INET6) {
@@ -1383,7 +1434,8 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
       probe->setIP(packet, packetlen, pspec);
       probe->sent = USI->now;
       hss->probeSent(packetlen);
-      send_ip_packet(USI->rawsd, ethptr, hss->target->TargetSockAddr(), packet, packetlen);
+      queue_ip_packet(&USI->sendQueue, USI->rawsd, ethptr,
+                      hss->target->TargetSockAddr(), packet, packetlen);
       free(packet);
     }
   } else if (pspec->type == PS_SCTP) {
@@ -1422,7 +1474,8 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
           probe->sent = USI->now;
         }
         hss->probeSent(packetlen);
-        send_ip_packet(USI->rawsd, ethptr, hss->target->TargetSockAddr(), packet, packetlen);
+        queue_ip_packet(&USI->sendQueue, USI->rawsd, ethptr,
+                        hss->target->TargetSockAddr(), packet, packetlen);
         free(packet);
       }
     } else if (hss->target->af() == AF_INET6) {
@@ -1441,7 +1494,8 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
       probe->setIP(packet, packetlen, pspec);
       probe->sent = USI->now;
       hss->probeSent(packetlen);
-      send_ip_packet(USI->rawsd, ethptr, hss->target->TargetSockAddr(), packet, packetlen);
+      queue_ip_packet(&USI->sendQueue, USI->rawsd, ethptr,
+                      hss->target->TargetSockAddr(), packet, packetlen);
       free(packet);
     }
     free(chunk);
@@ -1463,7 +1517,8 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
           probe->sent = USI->now;
         }
         hss->probeSent(packetlen);
-        send_ip_packet(USI->rawsd, ethptr, hss->target->TargetSockAddr(), packet, packetlen);
+        queue_ip_packet(&USI->sendQueue, USI->rawsd, ethptr,
+                        hss->target->TargetSockAddr(), packet, packetlen);
         free(packet);
       }
     } else if (hss->target->af() == AF_INET6) {
@@ -1473,7 +1528,8 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
       probe->setIP(packet, packetlen, pspec);
       probe->sent = USI->now;
       hss->probeSent(packetlen);
-      send_ip_packet(USI->rawsd, ethptr, hss->target->TargetSockAddr(), packet, packetlen);
+      queue_ip_packet(&USI->sendQueue, USI->rawsd, ethptr,
+                      hss->target->TargetSockAddr(), packet, packetlen);
       free(packet);
     }
   } else if (pspec->type == PS_ICMP) {
@@ -1489,7 +1545,8 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
         probe->sent = USI->now;
       }
       hss->probeSent(packetlen);
-      send_ip_packet(USI->rawsd, ethptr, hss->target->TargetSockAddr(), packet, packetlen);
+      queue_ip_packet(&USI->sendQueue, USI->rawsd, ethptr,
+                      hss->target->TargetSockAddr(), packet, packetlen);
       free(packet);
     }
   } else if (pspec->type == PS_ICMPV6) {
@@ -1508,12 +1565,13 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
     probe->setIP(packet, packetlen, pspec);
     probe->sent = USI->now;
     hss->probeSent(packetlen);
-    send_ip_packet(USI->rawsd, ethptr, hss->target->TargetSockAddr(), packet, packetlen);
+    queue_ip_packet(&USI->sendQueue, USI->rawsd, ethptr,
+                    hss->target->TargetSockAddr(), packet, packetlen);
     free(packet);
   } else assert(0);
 
   /* Now that the probe has been sent, add it to the Queue for this host */
-  hss->probes_outstanding.push_back(probe);
+  hss->addOutstandingProbe(probe);
   USI->gstats->num_probes_active++;
   hss->num_probes_active++;
 
@@ -1686,6 +1744,10 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
   int newstate = PORT_UNKNOWN;
   unsigned int probenum;
   unsigned int listsz;
+  std::pair<HostScanStats::probe_index::iterator, HostScanStats::probe_index::iterator> range;
+  HostScanStats::probe_index::iterator keyI;
+  u32 key;
+  bool indexed;
   /* Static so that we can detect an ICMP response now, then add it later when
      the icmp probe is made */
   static bool protoscanicmphack = false;
@@ -1705,7 +1767,8 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
     to_usec = TIMEVAL_SUBTRACT(*stime, USI->now);
     if (to_usec < 2000)
       to_usec = 2000;
-    ip_tmp = (struct ip *) readip_pcap(USI->pd, &bytes, to_usec, &rcvdtime, &linkhdr, true);
+    ip_tmp = (struct ip *) readip_pcap_batched(USI->pd, &USI->pcapBatch, &bytes,
+                                               to_usec, &rcvdtime, &linkhdr, true);
     gettimeofday(&USI->now, NULL);
     if (!ip_tmp && TIMEVAL_SUBTRACT(*stime, USI->now) < 0) {
       timedout = true;
@@ -1766,14 +1829,14 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       if (!hss)
         continue; // Not from a host that interests us
       setTargetMACIfAvailable(hss->target, &linkhdr, &hdr.src, 0);
-      probeI = hss->probes_outstanding.end();
-      listsz = hss->num_probes_outstanding();
+      range = hss->probesByKey(probe_key(IPPROTO_TCP, ntohs(tcp->th_sport)));
 
       goodone = false;
 
       /* Find the probe that provoked this response. */
-      for (probenum = 0; probenum < listsz && !goodone; probenum++) {
-        probeI--;
+      for (keyI = range.second; keyI != range.first && !goodone; ) {
+        keyI--;
+        probeI = keyI->second;
         probe = *probeI;
 
         if (!tcp_probe_match(USI, probe, hss, tcp, &hdr.src, &hdr.dst, hdr.ipid))
@@ -1814,8 +1877,7 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       if (!hss)
         continue; // Not from a host that interests us
       setTargetMACIfAvailable(hss->target, &linkhdr, &hdr.src, 0);
-      probeI = hss->probes_outstanding.end();
-      listsz = hss->num_probes_outstanding();
+      range = hss->probesByKey(probe_key(IPPROTO_SCTP, ntohs(sctp->sh_sport)));
 
       goodone = false;
 
@@ -1823,8 +1885,9 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       hss->target->SourceSockAddr(&target_src, &ss_len);
 
       /* Find the probe that provoked this response. */
-      for (probenum = 0; probenum < listsz && !goodone; probenum++) {
-        probeI--;
+      for (keyI = range.second; keyI != range.first && !goodone; ) {
+        keyI--;
+        probeI = keyI->second;
         probe = *probeI;
 
         if (probe->protocol() != IPPROTO_SCTP)
@@ -1914,8 +1977,16 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       hss = USI->findHost(&encaps_hdr.dst);
       if (!hss)
         continue; // Not from a host that interests us
-      probeI = hss->probes_outstanding.end();
-      listsz = hss->num_probes_outstanding();
+      /* Probes that are matched on their ports can be looked up by them. */
+      indexed = !USI->prot_scan && encaps_probe_key(&encaps_hdr, encaps_data, &key);
+      if (indexed) {
+        range = hss->probesByKey(key);
+        keyI = range.second;
+        listsz = std::distance(range.first, range.second);
+      } else {
+        probeI = hss->probes_outstanding.end();
+        listsz = hss->num_probes_outstanding();
+      }
 
       ss_len = sizeof(target_src);
       hss->target->SourceSockAddr(&target_src, &ss_len);
@@ -1925,7 +1996,12 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       goodone = false;
       /* Find the matching probe */
       for (probenum = 0; probenum < listsz && !goodone; probenum++) {
-        probeI--;
+        if (indexed) {
+          keyI--;
+          probeI = keyI->second;
+        } else {
+          probeI--;
+        }
         probe = *probeI;
         if (probe->protocol() != encaps_hdr.proto ||
             sockaddr_storage_cmp(&target_src, &encaps_hdr.src) != 0 ||
@@ -2043,8 +2119,16 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       hss = USI->findHost(&encaps_hdr.dst);
       if (!hss)
         continue; // Not from a host that interests us
-      probeI = hss->probes_outstanding.end();
-      listsz = hss->num_probes_outstanding();
+      /* Probes that are matched on their ports can be looked up by them. */
+      indexed = !USI->prot_scan && encaps_probe_key(&encaps_hdr, encaps_data, &key);
+      if (indexed) {
+        range = hss->probesByKey(key);
+        keyI = range.second;
+        listsz = std::distance(range.first, range.second);
+      } else {
+        probeI = hss->probes_outstanding.end();
+        listsz = hss->num_probes_outstanding();
+      }
 
       ss_len = sizeof(target_src);
       hss->target->SourceSockAddr(&target_src, &ss_len);
@@ -2054,7 +2138,12 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       goodone = false;
       /* Find the matching probe */
       for (probenum = 0; probenum < listsz && !goodone; probenum++) {
-        probeI--;
+        if (indexed) {
+          keyI--;
+          probeI = keyI->second;
+        } else {
+          probeI--;
+        }
         probe = *probeI;
         if (probe->protocol() != encaps_hdr.proto ||
             sockaddr_storage_cmp(&target_src, &encaps_hdr.src) != 0 ||
@@ -2165,15 +2254,15 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       hss = USI->findHost(&hdr.src);
       if (!hss)
         continue; // Not from a host that interests us
-      probeI = hss->probes_outstanding.end();
-      listsz = hss->num_probes_outstanding();
+      range = hss->probesByKey(probe_key(IPPROTO_UDP, ntohs(udp->uh_sport)));
       ss_len = sizeof(target_src);
       hss->target->SourceSockAddr(&target_src, &ss_len);
 
       goodone = false;
 
-      for (probenum = 0; probenum < listsz && !goodone; probenum++) {
-        probeI--;
+      for (keyI = range.second; keyI != range.first && !goodone; ) {
+        keyI--;
+        probeI = keyI->second;
         probe = *probeI;
         newstate = PORT_UNKNOWN;
 
@@ -560,6 +560,147 @@ int send_ip_packet(int sd, const struct eth_nfo *eth,
   fatal("%s only understands IP versions 4 and 6 (got %u)", __func__, ip->ip_v);
 }
 
+/* Queue a pre-built IPv4 or IPv6 packet for flush_ip_packets(). See tcpip.h. */
+int queue_ip_packet(struct ip_send_queue *queue, int sd,
+                    const struct eth_nfo *eth,
+                    const struct sockaddr_storage *dst,
+                    const u8 *packet, unsigned int packetlen) {
+  const struct ip *ip = (const struct ip *) packet;
+  struct ip_send_queue::packet p;
+
+  if (packetlen < 1)
+    return -1;
+
+  /* Leave the unusual cases to send_ip_packet(). */
+  if ((ip->ip_v != 4 && ip->ip_v != 6) || (eth != NULL && eth->ethsd == NULL)
+      || (ip->ip_v == 4 && (o.fragscan || (eth == NULL && sd == -1)))) {
+    flush_ip_packets(queue);
+    return send_ip_packet(sd, eth, dst, packet, packetlen);
+  }
+  if (ip->ip_v == 4 && eth == NULL && sd != queue->sd) {
+    flush_ip_packets(queue);
+    queue->sd = sd;
+  }
+
+  p.dst = *dst;
+  p.ethsd = eth ? eth->ethsd : NULL;
+  p.len = packetlen;
+  /* Keep IP headers 8-byte aligned, with room for the Ethernet header before
+     them if needed. */
+  p.pos = (queue->buf.size() + (eth ? ETH_HDR_LEN : 0) + 7) & ~(size_t) 7;
+  queue->buf.resize(p.pos + packetlen);
+  if (eth != NULL) {
+    eth_pack_hdr(&queue->buf[p.pos - ETH_HDR_LEN], eth->dstmac, eth->srcmac,
+                 ip->ip_v == 4 ? ETH_TYPE_IP : ETH_TYPE_IPV6);
+  }
+  memcpy(&queue->buf[p.pos], packet, packetlen);
+  queue->pkts.push_back(p);
+
+  if (queue->pkts.size() >= IP_SEND_QUEUE_MAX)
+    flush_ip_packets(queue);
+
+  return packetlen;
+}
+
+/* Sends the "count" raw socket packets of queue starting at index "first"
+   with one call to send_ip_packets_sd() or send_ipv6_packets_sd(). They must
+   all have the same address family and count may not exceed
+   MAX_SENDMMSG_BATCH. */
+static int send_queued_run(struct ip_send_queue *queue, size_t first, int count) {
+  struct sockaddr_in dsts[MAX_SENDMMSG_BATCH];
+  struct sockaddr_in6 dsts6[MAX_SENDMMSG_BATCH];
+  u8 *packets[MAX_SENDMMSG_BATCH];
+  unsigned int packetlens[MAX_SENDMMSG_BATCH];
+  const struct ip_send_queue::packet *p;
+  bool ipv6;
+  int i;
+
+  assert(count <= MAX_SENDMMSG_BATCH);
+  ipv6 = (queue->pkts[first].dst.ss_family == AF_INET6);
+  for (i = 0; i < count; i++) {
+    p = &queue->pkts[first + i];
+    if (ipv6)
+      dsts6[i] = *(const struct sockaddr_in6 *) &p->dst;
+    else
+      dsts[i] = *(const struct sockaddr_in *) &p->dst;
+    packets[i] = &queue->buf[p->pos];
+    packetlens[i] = p->len;
+  }
+
+  if (!ipv6)
+    return send_ip_packets_sd(queue->sd, dsts, packets, packetlens, count, NULL);
+
+#if HAVE_IPV6_IPPROTO_RAW
+  if (!queue->sd6_tried) {
+    /* Without it, send_ipv6_packets_sd() sends the packets one by one. */
+    queue->sd6 = socket(AF_INET6, SOCK_RAW, IPPROTO_RAW);
+    queue->sd6_tried = true;
+  }
+#endif
+  return send_ipv6_packets_sd(queue->sd6, dsts6, packets, packetlens, count, NULL);
+}
+
+/* Send all the packets held in an ip_send_queue. See tcpip.h. */
+int flush_ip_packets(struct ip_send_queue *queue) {
+  const struct ip_send_queue::packet *p;
+  size_t i, total;
+  unsigned int framelen;
+  int n, sent = 0;
+
+  total = queue->pkts.size();
+  for (i = 0; i < total; i += n) {
+    p = &queue->pkts[i];
+    if (p->ethsd != NULL) {
+      n = 1;
+      framelen = ETH_HDR_LEN + p->len;
+      if (queue->ring != NULL
+          && eth_txring_add(queue->ring, &queue->buf[p->pos - ETH_HDR_LEN], framelen) == 0) {
+        sent++;
+        continue;
+      }
+      /* Frames still waiting in the ring must go out before this one. */
+      if (queue->ring != NULL)
+        eth_txring_flush(queue->ring);
+      if (eth_send(p->ethsd, &queue->buf[p->pos - ETH_HDR_LEN], framelen) != -1)
+        sent++;
+      continue;
+    }
+    /* Send as long a run of raw packets of the same family as possible,
+       after any frames queued in the ring before them. */
+    for (n = 1; i + n < total && n < MAX_SENDMMSG_BATCH; n++) {
+      if (queue->pkts[i + n].ethsd != NULL
+          || queue->pkts[i + n].dst.ss_family != p->dst.ss_family)
+        break;
+    }
+    if (queue->ring != NULL)
+      eth_txring_flush(queue->ring);
+    sent += send_queued_run(queue, i, n);
+  }
+  if (queue->ring != NULL)
+    eth_txring_flush(queue->ring);
+
+  /* Packets that could not be sent have already been reported, so every
+     packet is traced as if it had been sent. */
+  for (i = 0; i < total; i++) {
+    p = &queue->pkts[i];
+    PacketTrace::trace(PacketTrace::SENT, &queue->buf[p->pos], p->len);
+  }
+
+  queue->pkts.clear();
+  queue->buf.clear();
+
+  return sent;
+}
+
+void close_ip_send_queue(struct ip_send_queue *queue) {
+  flush_ip_packets(queue);
+  if (queue->sd6 != -1) {
+    close(queue->sd6);
+    queue->sd6 = -1;
+  }
+  queue->sd6_tried = false;
+}
+
 
 /* Return an IPv4 pseudoheader checksum for the given protocol and data. Unlike
    ipv4_pseudoheader_cksum, this knows about STUPID_SOLARIS_CHECKSUM_BUG and
@@ -1525,67 +1666,12 @@ static bool validatepkt(u8 *ipc, unsigned *len) {
   return true;
 }
 
-/* Read an IP packet using libpcap .  We return the packet and take
-   a pcap descriptor and a pointer to the packet length (which we set
-   in the function. If you want a maximum length returned, you
-   should specify that in pcap_open_live() */
-/* to_usec is the timeout period in microseconds -- use 0 to skip the
-   test and -1 to block forever.  Note that we don't interrupt pcap, so
-   low values (and 0) degenerate to the timeout specified
-   in pcap_open_live() */
-/* If rcvdtime is non-null and a packet is returned, rcvd will be
-   filled with the time that packet was captured from the wire by
-   pcap.  If linknfo is not NULL, linknfo->headerlen and
-   linknfo->header will be filled with the appropriate values. */
-/* Specifying true for validate will enable validity checks against the
-   received IP packet.  See validatepkt() for a list of checks. */
-char *readipv4_pcap(pcap_t *pd, unsigned int *len, long to_usec,
-                    struct timeval *rcvdtime, struct link_header *linknfo,
-                    bool validate) {
-  char *buf;
-
-  buf = readip_pcap(pd, len, to_usec, rcvdtime, linknfo, validate);
-  if (buf != NULL) {
-    struct ip *ip;
-
-    ip = (struct ip *) buf;
-    if (*len < 1 || ip->ip_v != 4)
-      return NULL;
-  }
-
-  return buf;
-}
-
-char *readip_pcap(pcap_t *pd, unsigned int *len, long to_usec,
-                  struct timeval *rcvdtime, struct link_header *linknfo, bool validate) {
+/* Returns the length of the link layer header of the packets captured from pd,
+   whose pcap_datalink() is datalink.  Exits on unknown datalink types. */
+static unsigned int datalink_offset(pcap_t *pd, int datalink) {
   unsigned int offset = 0;
   struct pcap_pkthdr head;
   char *p;
-  int datalink;
-  int timedout = 0;
-  struct timeval tv_start, tv_end;
-  static char *alignedbuf = NULL;
-  static unsigned int alignedbufsz = 0;
-  static int warning = 0;
-
-  if (linknfo) {
-    memset(linknfo, 0, sizeof(*linknfo));
-  }
-
-  if (!pd)
-    fatal("NULL packet device passed to %s", __func__);
-
-  if (to_usec < 0) {
-    if (!warning) {
-      warning = 1;
-      error("WARNING: Negative timeout value (%lu) passed to %s() -- using 0", to_usec, __func__);
-    }
-    to_usec = 0;
-  }
-
-  /* New packet capture device, need to recompute offset */
-  if ((datalink = pcap_datalink(pd)) < 0)
-    fatal("Cannot obtain datalink information: %s", pcap_geterr(pd));
 
   /* NOTE: IF A NEW OFFSET EVER EXCEEDS THE CURRENT MAX (24), ADJUST
      MAX_LINK_HEADERSZ in libnetutil/netutil.h */
@@ -1674,6 +1760,72 @@ char *readip_pcap(pcap_t *pd, unsigned int *len, long to_usec,
     exit(1);
   }
 
+  return offset;
+}
+
+/* Read an IP packet using libpcap .  We return the packet and take
+   a pcap descriptor and a pointer to the packet length (which we set
+   in the function. If you want a maximum length returned, you
+   should specify that in pcap_open_live() */
+/* to_usec is the timeout period in microseconds -- use 0 to skip the
+   test and -1 to block forever.  Note that we don't interrupt pcap, so
+   low values (and 0) degenerate to the timeout specified
+   in pcap_open_live() */
+/* If rcvdtime is non-null and a packet is returned, rcvd will be
+   filled with the time that packet was captured from the wire by
+   pcap.  If linknfo is not NULL, linknfo->headerlen and
+   linknfo->header will be filled with the appropriate values. */
+/* Specifying true for validate will enable validity checks against the
+   received IP packet.  See validatepkt() for a list of checks. */
+char *readipv4_pcap(pcap_t *pd, unsigned int *len, long to_usec,
+                    struct timeval *rcvdtime, struct link_header *linknfo,
+                    bool validate) {
+  char *buf;
+
+  buf = readip_pcap(pd, len, to_usec, rcvdtime, linknfo, validate);
+  if (buf != NULL) {
+    struct ip *ip;
+
+    ip = (struct ip *) buf;
+    if (*len < 1 || ip->ip_v != 4)
+      return NULL;
+  }
+
+  return buf;
+}
+
+char *readip_pcap(pcap_t *pd, unsigned int *len, long to_usec,
+                  struct timeval *rcvdtime, struct link_header *linknfo, bool validate) {
+  unsigned int offset = 0;
+  struct pcap_pkthdr head;
+  char *p;
+  int datalink;
+  int timedout = 0;
+  struct timeval tv_start, tv_end;
+  static char *alignedbuf = NULL;
+  static unsigned int alignedbufsz = 0;
+  static int warning = 0;
+
+  if (linknfo) {
+    memset(linknfo, 0, sizeof(*linknfo));
+  }
+
+  if (!pd)
+    fatal("NULL packet device passed to %s", __func__);
+
+  if (to_usec < 0) {
+    if (!warning) {
+      warning = 1;
+      error("WARNING: Negative timeout value (%lu) passed to %s() -- using 0", to_usec, __func__);
+    }
+    to_usec = 0;
+  }
+
+  /* New packet capture device, need to recompute offset */
+  if ((datalink = pcap_datalink(pd)) < 0)
+    fatal("Cannot obtain datalink information: %s", pcap_geterr(pd));
+  offset = datalink_offset(pd, datalink);
+
   if (to_usec > 0) {
     gettimeofday(&tv_start, NULL);
   }
@@ -1787,6 +1939,198 @@ char *readip_pcap(pcap_t *pd, unsigned int *len, long to_usec,
   return alignedbuf;
 }
 
+/* Callback for pcap_dispatch() in pcap_batch_fill(). Appends a packet to the
+   batch, placing it so that the IP header after the link header is aligned. */
+static void pcap_batch_add(u_char *user, const struct pcap_pkthdr *h,
+                           const u_char *bytes) {
+  struct pcap_batch *batch = (struct pcap_batch *) user;
+  struct pcap_batch::packet pkt;
+  size_t pos;
+
+  pos = batch->buf.size() + batch->offset;
+  pos = (pos + 7) & ~(size_t) 7;
+  pos -= batch->offset;
+
+  pkt.ts = h->ts;
+  pkt.caplen = h->caplen;
+  pkt.pos = pos;
+  batch->buf.resize(pos + h->caplen);
+  if (h->caplen > 0)
+    memcpy(&batch->buf[pos], bytes, h->caplen);
+  batch->pkts.push_back(pkt);
+}
+
+/* Reads packets from pd into batch until there are no more waiting or the
+   batch is full.  pd must be in nonblocking mode: pcap_dispatch() may return a
+   single packet per call, depending on the platform and capture mechanism. */
+static void pcap_batch_drain(pcap_t *pd, struct pcap_batch *batch) {
+  while (batch->pkts.size() < PCAP_BATCH_MAX
+         && pcap_dispatch(pd, PCAP_BATCH_MAX - batch->pkts.size(),
+                          pcap_batch_add, (u_char *) batch) > 0)
+    ;
+}
+
+/* Replaces the contents of batch with all the packets that are already
+   waiting on pd, up to PCAP_BATCH_MAX.  If there are none, waits up to
+   to_usec microseconds for some to arrive, like readip_pcap().  Returns the
+   number of packets read. */
+static int pcap_batch_fill(pcap_t *pd, struct pcap_batch *batch, long to_usec) {
+  int datalink;
+  int timedout = 0;
+  struct timeval tv_start, tv_end;
+
+  batch->pkts.clear();
+  batch->buf.clear();
+  batch->next = 0;
+
+  /* New packet capture device */
+  if (pd != batch->pd) {
+    if ((datalink = pcap_datalink(pd)) < 0)
+      fatal("Cannot obtain datalink information: %s", pcap_geterr(pd));
+    batch->pd = pd;
+    batch->datalink = datalink;
+    batch->offset = datalink_offset(pd, datalink);
+    batch->pkts.reserve(PCAP_BATCH_MAX);
+    /* Where we can select() on pd, it is left in nonblocking mode so that
+       the packets that are waiting can be drained without a select() call
+       for each of them. */
+    batch->nonblock = pcap_selectable_fd_valid() && pcap_setnonblock(pd, 1, NULL) == 0;
+  }
+
+  if (to_usec > 0) {
+    gettimeofday(&tv_start, NULL);
+  }
+
+  do {
+#ifdef WIN32
+    long to_left;
+
+    if (to_usec > 0) {
+      gettimeofday(&tv_end, NULL);
+      to_left = MAX(1, (to_usec - TIMEVAL_SUBTRACT(tv_end, tv_start)) / 1000);
+    } else {
+      to_left = 1;
+    }
+    // Set the timeout (BUGBUG: this is cheating)
+    PacketSetReadTimeout(pd->adapter, to_left);
+#endif
+
+    if (batch->nonblock) {
+      pcap_batch_drain(pd, batch);
+    } else if (!pcap_selectable_fd_one_to_one()) {
+      /* See readip_pcap() about this nonblocking read. */
+      int rc, nonblock;
+
+      nonblock = pcap_getnonblock(pd, NULL);
+      assert(nonblock == 0);
+      rc = pcap_setnonblock(pd, 1, NULL);
+      assert(rc == 0);
+      pcap_dispatch(pd, PCAP_BATCH_MAX, pcap_batch_add, (u_char *) batch);
+      rc = pcap_setnonblock(pd, nonblock, NULL);
+      assert(rc == 0);
+    }
+
+    if (batch->pkts.empty()) {
+      /* Nonblocking read didn't get anything. */
+      if (pcap_select(pd, to_usec) == 0)
+        timedout = 1;
+      else if (batch->nonblock)
+        pcap_batch_drain(pd, batch);
+      else
+        pcap_dispatch(pd, PCAP_BATCH_MAX, pcap_batch_add, (u_char *) batch);
+    }
+
+    if (batch->pkts.empty()) {
+      /* Should we timeout? */
+      if (to_usec == 0) {
+        timedout = 1;
+      } else if (to_usec > 0) {
+        gettimeofday(&tv_end, NULL);
+        if (TIMEVAL_SUBTRACT(tv_end, tv_start) >= to_usec) {
+          timedout = 1;
+        }
+      }
+    }
+  } while (!timedout && batch->pkts.empty());
+
+  return batch->pkts.size();
+}
+
+/* Same as readip_pcap(), except that packets are read from pd in batches:
+   when batch has no more packets, every packet already waiting on pd is read
+   into it at once and the following calls return them without going back to
+   libpcap.  A batch must only be used with one pcap descriptor, which may be
+   left in nonblocking mode.  The returned packet is valid until the batch is
+   refilled. */
+char *readip_pcap_batched(pcap_t *pd, struct pcap_batch *batch,
+                          unsigned int *len, long to_usec,
+                          struct timeval *rcvdtime, struct link_header *linknfo,
+                          bool validate) {
+  const struct pcap_batch::packet *pkt;
+  char *p;
+  static int warning = 0;
+
+  if (linknfo) {
+    memset(linknfo, 0, sizeof(*linknfo));
+  }
+
+  if (!pd)
+    fatal("NULL packet device passed to %s", __func__);
+
+  if (to_usec < 0) {
+    if (!warning) {
+      warning = 1;
+      error("WARNING: Negative timeout value (%lu) passed to %s() -- using 0", to_usec, __func__);
+    }
+    to_usec = 0;
+  }
+
+  if (!pcap_batch_pending(batch) && pcap_batch_fill(pd, batch, to_usec) == 0) {
+    *len = 0;
+    return NULL;
+  }
+
+  pkt = &batch->pkts[batch->next++];
+  if (pkt->caplen <= batch->offset) {
+    *len = 0;
+    return NULL;
+  }
+  p = &batch->buf[pkt->pos];
+  if (batch->offset && linknfo) {
+    linknfo->datalinktype = batch->datalink;
+    linknfo->headerlen = batch->offset;
+    assert(batch->offset <= MAX_LINK_HEADERSZ);
+    memcpy(linknfo->header, p, MIN(sizeof(linknfo->header), batch->offset));
+  }
+  p += batch->offset;
+  *len = pkt->caplen - batch->offset;
+
+  if (validate) {
+    /* Let's see if this packet passes inspection.. */
+    if (!validatepkt((u8 *) p, len)) {
+      *len = 0;
+      return NULL;
+    }
+  }
+
+  if (rcvdtime) {
+    /* See readip_pcap() about Windows. */
+#if defined(WIN32) || defined(__amigaos__)
+    gettimeofday(rcvdtime, NULL);
+#else
+    *rcvdtime = pkt->ts;
+    assert(pkt->ts.tv_sec);
+#endif
+  }
+
+  if (rcvdtime)
+    PacketTrace::trace(PacketTrace::RCVD, (u8 *) p, *len, rcvdtime);
+  else
+    PacketTrace::trace(PacketTrace::RCVD, (u8 *) p, *len);
+
+  return p;
+}
+
 /* Attempts to read one IPv6 Neighbor Solicitation reply packet from the pcap
    descriptor pd.  If it receives one, fills in sendermac (must pass
    in 6 bytes), senderIP, and rcvdtime (can be NULL if you don't care)
@@ -226,6 +226,8 @@ extern "C" {
 #include "nmap.h"
 #include "global_structures.h"
 
+#include <vector>
+
 #ifndef INET_ADDRSTRLEN
 #define INET_ADDRSTRLEN 16
 #endif
@@ -291,6 +293,13 @@ class PacketCounter {
 */
 const char *inet_socktop(struct sockaddr_storage *ss);
 
+/* Dummy class to use sockaddr_storage as a map key. */
+struct lt_sockaddr_storage {
+  bool operator()(const struct sockaddr_storage& a, const struct sockaddr_storage& b) const {
+    return sockaddr_storage_cmp(&a, &b) < 0;
+  }
+};
+
 /* Tries to resolve the given name (or literal IP) into a sockaddr
    structure. This function calls getaddrinfo and returns the same
    addrinfo linked list that getaddrinfo produces. Returns NULL for any
@@ -313,6 +322,48 @@ int send_ip_packet(int sd, const struct eth_nfo *eth,
   const struct sockaddr_storage *dst,
   const u8 *packet, unsigned int packetlen);
 
+/* The most packets held in an ip_send_queue before it is flushed */
+#define IP_SEND_QUEUE_MAX 512
+
+/* Pre-built IP packets waiting to be sent together by flush_ip_packets().
+   Packets are copied into buf, which is reused from one batch to the next,
+   so the caller may free them right after queueing. */
+struct ip_send_queue {
+  struct packet {
+    struct sockaddr_storage dst;
+    eth_t *ethsd; /* NULL if the packet goes through the raw socket */
+    size_t pos; /* Where the packet (or Ethernet frame) starts in buf */
+    unsigned int len;
+  };
+  std::vector<struct packet> pkts;
+  std::vector<u8> buf;
+  int sd; /* Raw socket of the queued IPv4 packets */
+  int sd6; /* IPPROTO_RAW IPv6 socket, opened on first use */
+  bool sd6_tried;
+  struct eth_txring *ring; /* Optional, set up by the owner of the queue */
+
+  ip_send_queue() : sd(-1), sd6(-1), sd6_tried(false), ring(NULL) {}
+};
+
+/* Same as send_ip_packet(), except that the packet may be held in queue and
+   only sent on the next flush_ip_packets(). Packets that can't be batched
+   (fragmented ones, or Ethernet frames without a dnet handle) are sent right
+   away, after whatever is already queued so the order is kept. Returns -1 if
+   the packet could not be sent. */
+int queue_ip_packet(struct ip_send_queue *queue, int sd,
+                    const struct eth_nfo *eth,
+                    const struct sockaddr_storage *dst,
+                    const u8 *packet, unsigned int packetlen);
+
+/* Sends every packet held in queue, using as few system calls as the
+   platform allows (sendmmsg() for raw sockets and the queue's TX ring, if
+   any, for Ethernet frames). Returns the number of packets sent. */
+int flush_ip_packets(struct ip_send_queue *queue);
+
+/* Flushes queue and releases its IPv6 socket. The TX ring is left to its
+   owner. */
+void close_ip_send_queue(struct ip_send_queue *queue);
+
 /* Builds an IP packet (including an IP header) by packing the fields
    with the given information.  It allocates a new buffer to store the
    packet contents, and then returns that buffer.  The packet is not
@@ -527,6 +578,44 @@ char *readipv4_pcap(pcap_t *pd, unsigned int *len, long to_usec,
 char *readip_pcap(pcap_t *pd, unsigned int *len, long to_usec,
                   struct timeval *rcvdtime, struct link_header *linknfo, bool validate);
 
+/* The most packets read from libpcap at once into a pcap_batch */
+#define PCAP_BATCH_MAX 512
+
+/* Packets read all at once from a pcap descriptor by readip_pcap_batched().
+   The storage is reused from one batch to the next. */
+struct pcap_batch {
+  struct packet {
+    struct timeval ts;
+    unsigned int caplen;
+    size_t pos; /* Where the packet starts in buf */
+  };
+  std::vector<struct packet> pkts;
+  std::vector<char> buf;
+  size_t next; /* Index in pkts of the next packet to return */
+  pcap_t *pd; /* The descriptor the packets are read from */
+  int datalink;
+  unsigned int offset; /* Length of the link layer header */
+  bool nonblock; /* Whether pd was put in nonblocking mode */
+
+  pcap_batch() : next(0), pd(NULL), datalink(-1), offset(0), nonblock(false) {}
+};
+
+/* Same as readip_pcap(), except that packets are read from pd in batches:
+   when batch has no more packets, every packet already waiting on pd is read
+   into it at once and the following calls return them without going back to
+   libpcap.  A batch must only be used with one pcap descriptor, which may be
+   left in nonblocking mode. */
+char *readip_pcap_batched(pcap_t *pd, struct pcap_batch *batch,
+                          unsigned int *len, long to_usec,
+                          struct timeval *rcvdtime, struct link_header *linknfo,
+                          bool validate);
+
+/* Returns true if batch has packets that readip_pcap_batched() has not
+   returned yet. */
+static inline bool pcap_batch_pending(const struct pcap_batch *batch) {
+  return batch->next < batch->pkts.size();
+}
+
 int read_na_pcap(pcap_t *pd, u8 *sendermac, struct sockaddr_in6 *senderIP, long to_usec,
                   struct timeval *rcvdtime, bool *has_mac);
 